@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+namespace hnswlib {
+
+/*
+* Sorted array with the subset of the std::priority_queue interface used by the search.
+* Elements are kept in ascending order of the key, so top() is the largest element as for
+* a max-heap and bottom() the smallest. An insert is a binary search plus a move of the
+* elements above it, so the search keeps these short: the results are bounded by ef, and
+* popBottom drops the candidates farther than the ef-th result, which the search would never
+* expand. clear() keeps the capacity, so a reused pool stops allocating after a few queries.
+*/
+template<typename key_t, typename id_t>
+class FlatMaxQueue {
+    std::vector<std::pair<key_t, id_t>> data_;
+    size_t first_{0};  // the elements are data_[first_ ...], those before were dropped by popBottom
+
+    static bool keyLess(const key_t &key, const std::pair<key_t, id_t> &p) {
+        return key < p.first;
+    }
+
+ public:
+    typedef typename std::vector<std::pair<key_t, id_t>>::const_iterator const_iterator;
+
+    void reserve(size_t n) {
+        data_.reserve(n);
+    }
+
+    void clear() {
+        data_.clear();
+        first_ = 0;
+    }
+
+    bool empty() const {
+        return first_ == data_.size();
+    }
+
+    size_t size() const {
+        return data_.size() - first_;
+    }
+
+    const std::pair<key_t, id_t> &top() const {
+        return data_.back();
+    }
+
+    void pop() {
+        data_.pop_back();
+        if (empty())
+            clear();
+    }
+
+    const std::pair<key_t, id_t> &bottom() const {
+        return data_[first_];
+    }
+
+    // Drops the smallest element, the dropped slots are reclaimed once they are half of the array
+    void popBottom() {
+        first_++;
+        if (empty()) {
+            clear();
+        } else if (first_ >= 16 && 2 * first_ >= data_.size()) {
+            data_.erase(data_.begin(), data_.begin() + first_);
+            first_ = 0;
+        }
+    }
+
+    void emplace(key_t key, id_t id) {
+        auto it = std::upper_bound(data_.begin() + first_, data_.end(), key, keyLess);
+        data_.insert(it, std::pair<key_t, id_t>(key, id));
+    }
+
+    void push(const std::pair<key_t, id_t> &p) {
+        emplace(p.first, p.second);
+    }
+
+    // ascending order, i.e. from the smallest key to top()
+    const_iterator begin() const {
+        return data_.begin() + first_;
+    }
+
+    const_iterator end() const {
+        return data_.end();
+    }
+};
+
+}  // namespace hnswlib
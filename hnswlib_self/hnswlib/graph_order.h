@@ -0,0 +1,261 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+namespace hnswlib {
+typedef unsigned int tableint;
+
+// Orders of HierarchicalNSW::reorderGraph
+static const int GRAPH_ORDER_BFS = 0;
+static const int GRAPH_ORDER_RCM = 1;
+static const int GRAPH_ORDER_GORDER = 2;
+
+// Number of elements placed before Gorder stops scoring against an element
+static const size_t GORDER_WINDOW = 5;
+static const tableint GORDER_NONE = (tableint) -1;
+
+/*
+* Directed graph in compressed sparse row form: the neighbours of node i are
+* links[offsets[i]] .. links[offsets[i + 1]] - 1.
+*/
+struct GraphAdjacency {
+    std::vector<size_t> offsets;
+    std::vector<tableint> links;
+
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    size_t degree(tableint i) const {
+        return offsets[i + 1] - offsets[i];
+    }
+
+    const tableint *begin(tableint i) const {
+        return links.data() + offsets[i];
+    }
+
+    const tableint *end(tableint i) const {
+        return links.data() + offsets[i + 1];
+    }
+
+    // The graph with every link turned around
+    GraphAdjacency reversed() const {
+        GraphAdjacency result;
+        size_t n = size();
+        result.offsets.assign(n + 1, 0);
+        for (tableint link : links) result.offsets[link + 1]++;
+        for (size_t i = 0; i < n; i++) result.offsets[i + 1] += result.offsets[i];
+        result.links.resize(links.size());
+        std::vector<size_t> fill(result.offsets.begin(), result.offsets.end() - 1);
+        for (tableint i = 0; i < n; i++) {
+            for (const tableint *l = begin(i); l != end(i); l++) {
+                result.links[fill[*l]++] = i;
+            }
+        }
+        return result;
+    }
+};
+
+/*
+* Breadth first order from start over the links; nodes it does not reach follow, each further
+* unreached node in id order starting another search. Returns the nodes in their new order.
+*/
+static std::vector<tableint> bfsOrder(const GraphAdjacency &graph, tableint start) {
+    size_t n = graph.size();
+    std::vector<tableint> order;
+    order.reserve(n);
+    std::vector<bool> placed(n, false);
+    tableint next = 0;
+    while (order.size() < n) {
+        tableint root = start;
+        if (!order.empty() || start >= n) {
+            while (placed[next]) next++;
+            root = next;
+        }
+        size_t head = order.size();
+        order.push_back(root);
+        placed[root] = true;
+        for (; head < order.size(); head++) {
+            tableint node = order[head];
+            for (const tableint *l = graph.begin(node); l != graph.end(node); l++) {
+                if (!placed[*l]) {
+                    placed[*l] = true;
+                    order.push_back(*l);
+                }
+            }
+        }
+    }
+    return order;
+}
+
+/*
+* Reverse Cuthill-McKee order of the graph made undirected: every component is searched breadth
+* first from a node of least degree, neighbours by increasing degree, and the whole order reversed.
+*/
+static std::vector<tableint> rcmOrder(const GraphAdjacency &graph) {
+    size_t n = graph.size();
+    const GraphAdjacency reverse = graph.reversed();
+    std::vector<size_t> degree(n);
+    for (tableint i = 0; i < n; i++) degree[i] = graph.degree(i) + reverse.degree(i);
+    std::vector<tableint> by_degree(n);
+    for (tableint i = 0; i < n; i++) by_degree[i] = i;
+    std::stable_sort(by_degree.begin(), by_degree.end(), [&](tableint a, tableint b) {
+        return degree[a] < degree[b];
+    });
+
+    std::vector<tableint> order;
+    order.reserve(n);
+    std::vector<bool> placed(n, false);
+    std::vector<tableint> neighbours;
+    size_t next = 0;
+    while (order.size() < n) {
+        while (placed[by_degree[next]]) next++;
+        size_t head = order.size();
+        order.push_back(by_degree[next]);
+        placed[by_degree[next]] = true;
+        for (; head < order.size(); head++) {
+            tableint node = order[head];
+            neighbours.clear();
+            for (const GraphAdjacency *g : {&graph, &reverse}) {
+                for (const tableint *l = g->begin(node); l != g->end(node); l++) {
+                    if (!placed[*l]) {
+                        placed[*l] = true;
+                        neighbours.push_back(*l);
+                    }
+                }
+            }
+            std::stable_sort(neighbours.begin(), neighbours.end(), [&](tableint a, tableint b) {
+                return degree[a] < degree[b];
+            });
+            order.insert(order.end(), neighbours.begin(), neighbours.end());
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+/*
+* Nodes bucketed by an integer score with O(1) increments and decrements, for Gorder. Scores only
+* change by one, so the highest non-empty bucket is found by stepping down from the last one.
+*/
+class GorderQueue {
+    std::vector<tableint> prev_;
+    std::vector<tableint> next_;
+    std::vector<tableint> head_;  // first node of every score
+    std::vector<size_t> score_;
+    std::vector<bool> removed_;
+    size_t top_{0};
+
+    void unlink(tableint node) {
+        size_t s = score_[node];
+        if (prev_[node] != GORDER_NONE) {
+            next_[prev_[node]] = next_[node];
+        } else {
+            head_[s] = next_[node];
+        }
+        if (next_[node] != GORDER_NONE)
+            prev_[next_[node]] = prev_[node];
+    }
+
+    void link(tableint node) {
+        size_t s = score_[node];
+        if (s >= head_.size())
+            head_.resize(s + 1, GORDER_NONE);
+        prev_[node] = GORDER_NONE;
+        next_[node] = head_[s];
+        if (head_[s] != GORDER_NONE)
+            prev_[head_[s]] = node;
+        head_[s] = node;
+    }
+
+ public:
+    explicit GorderQueue(size_t n) : prev_(n, GORDER_NONE), next_(n, GORDER_NONE), head_(1, GORDER_NONE), score_(n, 0), removed_(n, false) {
+        // node 0 first in its bucket
+        for (size_t i = n; i-- > 0;) link((tableint) i);
+    }
+
+    void increment(tableint node) {
+        if (removed_[node]) return;
+        unlink(node);
+        score_[node]++;
+        link(node);
+        top_ = std::max(top_, score_[node]);
+    }
+
+    void decrement(tableint node) {
+        if (removed_[node]) return;
+        unlink(node);
+        score_[node]--;
+        link(node);
+    }
+
+    void remove(tableint node) {
+        if (removed_[node]) return;
+        unlink(node);
+        removed_[node] = true;
+    }
+
+    // Removes and returns a node of the highest score, GORDER_NONE when empty
+    tableint pop() {
+        while (top_ > 0 && head_[top_] == GORDER_NONE) top_--;
+        tableint node = head_[top_];
+        if (node != GORDER_NONE)
+            remove(node);
+        return node;
+    }
+};
+
+/*
+* Gorder (Wei et al., "Speedup Graph Processing by Graph Ordering"): nodes are placed one by one,
+* each time the node with the most links to and common in-neighbours with the last window placed
+* ones, starting from the node of highest in-degree.
+*/
+static std::vector<tableint> gorderOrder(const GraphAdjacency &graph, size_t window = GORDER_WINDOW) {
+    size_t n = graph.size();
+    std::vector<tableint> order;
+    if (n == 0)
+        return order;
+    order.reserve(n);
+    GraphAdjacency reverse = graph.reversed();
+    GorderQueue queue(n);
+
+    // the score of a node against v: links between them and in-neighbours they share
+    auto update = [&](tableint v, bool add) {
+        auto change = [&](tableint u) {
+            if (add) {
+                queue.increment(u);
+            } else {
+                queue.decrement(u);
+            }
+        };
+        for (const tableint *l = graph.begin(v); l != graph.end(v); l++) change(*l);
+        for (const tableint *w = reverse.begin(v); w != reverse.end(v); w++) {
+            change(*w);
+            for (const tableint *l = graph.begin(*w); l != graph.end(*w); l++) {
+                if (*l != v)
+                    change(*l);
+            }
+        }
+    };
+
+    tableint start = 0;
+    for (tableint i = 1; i < n; i++) {
+        if (reverse.degree(i) > reverse.degree(start))
+            start = i;
+    }
+    queue.remove(start);
+    order.push_back(start);
+    update(start, true);
+    while (order.size() < n) {
+        if (order.size() > window)
+            update(order[order.size() - window - 1], false);
+        tableint node = queue.pop();
+        order.push_back(node);
+        update(node, true);
+    }
+    return order;
+}
+
+}  // namespace hnswlib
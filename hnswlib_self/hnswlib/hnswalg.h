@@ -1,20 +1,49 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "candidate_pool.h"
+#include "vector_store.h"
 #include "hnswlib.h"
 #include <atomic>
+#include <exception>
 #include <random>
 #include <stdlib.h>
 #include <assert.h>
 #include <unordered_set>
 #include <list>
 #include <memory>
+#include <fstream>
+#include <sstream>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "./space_pq.h"
+#include "./space_sq.h"
+#include "./space_int8.h"
+#include "./index_format.h"
+#include "./graph_order.h"
+#include "./memory_policy.h"
+#include "./link_arena.h"
+#include "./level0_layout.h"
+#include "./link_codec.h"
 
 namespace hnswlib {
 typedef unsigned int tableint;
 typedef unsigned int linklistsizeint;
 
+// Entry of the sorted label index of a mapped index, see loadIndexMapped
+struct LabelIndexEntry {
+    labeltype label;
+    uint64_t internal_id;
+
+    bool operator<(const LabelIndexEntry &other) const {
+        return label < other.label;
+    }
+};
+
 template<typename dist_t>
 class HierarchicalNSW : public AlgorithmInterface<dist_t> {
  public:
@@ -50,13 +79,30 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     size_t data_level0_memory_size_{0};
     char *data_level0_memory_{nullptr};
+    size_t level0_mapped_size_{0};  // non zero if level 0 was mapped by allocateMemory, see setMemoryPolicy
+    int memory_policy_{MEMORY_DEFAULT};
+    int layout_{LAYOUT_INTERLEAVED};  // layout of the level 0 the index owns, see setLayout
+    Level0Layout level0_layout_;  // where the fields of the elements are in data_level0_memory_
+    // Copies of level 0 per NUMA node for the threads bound by bindSearchThread, see replicateLevel0
+    std::vector<std::pair<char *, size_t>> level0_replicas_;
+    uint64_t replicas_generation_{0};
     char **linkLists_{nullptr};
+    LinkArena link_arena_;  // memory of the upper level links the index owns
+    // Level 0 lists of compressLevel0, those of element i from links0_codes_[links0_offsets_[i]]
+    int links0_codec_{LINKS0_PLAIN};
+    std::vector<uint8_t> links0_codes_;
+    std::vector<uint64_t> links0_offsets_;
     std::vector<int> element_levels_;  // keeps level of each element
 
     size_t data_size_{0};
 
     DISTFUNC<dist_t> fstdistfunc_;
     void *dist_func_param_{nullptr};
+    // Distance between two stored elements, used to build the graph; differs from fstdistfunc_ for
+    // PQ and SQ spaces, whose search distance takes a prepared query, see SpaceInterface::get_code_dist_func
+    DISTFUNC<dist_t> code_fstdistfunc_;
+    void *code_dist_func_param_{nullptr};
+    SpaceInterface<dist_t> *space_{nullptr};  // prepares the queries, see SpaceInterface::prepare_query
 
     mutable std::mutex label_lookup_lock;  // lock for label_lookup_
     std::unordered_map<labeltype, tableint> label_lookup_;
@@ -68,22 +114,36 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     mutable std::atomic<long> metric_hops{0};
 
     bool allow_replace_deleted_ = false;  // flag to replace deleted elements (marked as deleted) during insertions
+    bool use_flat_candidate_pool_ = false;  // searchKnn uses reusable FlatSearchQueues instead of heaps
+    bool thread_local_visited_lists_ = false;  // visited lists are cached per thread, see VisitedListPool
 
     std::mutex deleted_elements_lock;  // lock for deleted_elements
     std::unordered_set<tableint> deleted_elements;  // contains internal ids of deleted elements
 
-    int pq_M_ = 0;
-    int pq_nbits_ = 0;
-    int pq_dsub = 0;
-    int pq_ks_ = 0;
     float scale_ = 1.0;
     float scale2_ = 1.0;
 
-    std::vector<std::vector<float>> pq_centroids_;
     std::vector<float> pq_residuals_;
 
-
-    HierarchicalNSW(SpaceInterface<dist_t> *s) {
+    // Full precision copies of the vectors of a quantized index, see keepRerankVectors
+    std::unique_ptr<VectorStore> rerank_vectors_{nullptr};
+    DISTFUNC<dist_t> rerank_fstdistfunc_{nullptr};
+    void *rerank_dist_func_param_{nullptr};
+
+    // Index file mapped by loadIndexMapped, level 0 and the upper level links point into it
+    char *mapped_index_{nullptr};
+    size_t mapped_index_size_{0};
+    // Labels of the mapped elements sorted, in the mapped lookup file or in label_index_storage_
+    const LabelIndexEntry *label_index_{nullptr};
+    size_t label_index_size_{0};
+    std::vector<LabelIndexEntry> label_index_storage_;
+    char *mapped_lookup_{nullptr};
+    size_t mapped_lookup_size_{0};
+    // Keeps the buffers level 0 and the upper level links point into alive, see useBorrowedMemory
+    std::shared_ptr<void> borrowed_memory_;
+
+
+    HierarchicalNSW(SpaceInterface<dist_t> *s) : space_(s) {
     }
 
 
@@ -111,9 +171,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             allow_replace_deleted_(allow_replace_deleted) {
         max_elements_ = max_elements;
         num_deleted_ = 0;
+        space_ = s;
         data_size_ = s->get_data_size();
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
+        code_fstdistfunc_ = s->get_code_dist_func();
+        code_dist_func_param_ = s->get_code_dist_func_param();
+        useInt8Scale();
         if ( M <= 10000 ) {
             M_ = M;
         } else {
@@ -134,9 +198,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         offsetData_ = size_links_level0_;
         label_offset_ = size_links_level0_ + data_size_;
         offsetLevel0_ = 0;
+        level0_layout_ = level0Layout(LAYOUT_INTERLEAVED, max_elements_);
 
         data_level0_memory_size_ = max_elements_ * size_data_per_element_;
-        data_level0_memory_ = (char *) malloc(data_level0_memory_size_);
+        data_level0_memory_ = allocateMemory(data_level0_memory_size_, memory_policy_, level0_mapped_size_);
         if (data_level0_memory_ == nullptr)
             throw std::runtime_error("Not enough memory");
 
@@ -163,16 +228,19 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     void clear() {
-        free(data_level0_memory_);
-        data_level0_memory_ = nullptr;
-        for (tableint i = 0; i < cur_element_count; i++) {
-            if (element_levels_[i] > 0)
-                free(linkLists_[i]);
+        dropReplicas();
+        if (ownsMemory()) {
+            freeMemory(data_level0_memory_, level0_mapped_size_);
+            link_arena_.clear();
         }
+        data_level0_memory_ = nullptr;
+        level0_mapped_size_ = 0;
+        dropCompressedLinks();
         free(linkLists_);
         linkLists_ = nullptr;
         cur_element_count = 0;
         visited_list_pool_.reset(nullptr);
+        unmapIndex();
     }
 
 
@@ -184,11 +252,65 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     };
 
 
+    // Candidate queues of the level-0 search, selected as the search_queues_t policy of searchBaseLayerST.
+    // top_candidates is a max-queue on distance, candidate_set a max-queue on negated distance.
+    struct HeapSearchQueues {
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+    };
+
+    // Preallocated sorted arrays, reused by the thread between queries (see setFlatCandidatePool)
+    struct FlatSearchQueues {
+        FlatMaxQueue<dist_t, tableint> top_candidates;
+        FlatMaxQueue<dist_t, tableint> candidate_set;
+
+        void reset(size_t ef) {
+            top_candidates.clear();
+            candidate_set.clear();
+            top_candidates.reserve(ef + 1);
+            candidate_set.reserve(ef + 1);
+        }
+    };
+
+    typedef std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_heap_t;
+
+    /*
+    * Drops the candidates farther than bound, the distance of the ef-th result: the search stops
+    * at the first of them, so they are never expanded. Only the sorted arrays can drop their bottom.
+    */
+    static void dropFartherCandidates(FlatMaxQueue<dist_t, tableint> &candidate_set, dist_t bound) {
+        while (!candidate_set.empty() && -candidate_set.bottom().first > bound)
+            candidate_set.popBottom();
+    }
+
+    static void dropFartherCandidates(candidate_heap_t &, dist_t) {
+    }
+
+
     void setEf(size_t ef) {
         ef_ = ef;
     }
 
 
+    /*
+    * Switches searchKnn and searchKnnBatch between std::priority_queue candidate queues (default)
+    * and thread-local preallocated sorted arrays, which avoid the heap allocations of every query.
+    */
+    void setFlatCandidatePool(bool use_flat_candidate_pool) {
+        use_flat_candidate_pool_ = use_flat_candidate_pool;
+    }
+
+
+    /*
+    * Gives every search thread its own visited list so queries take no lock on the pool.
+    * Recreates the pool, must not be called while other threads use the index.
+    */
+    void setThreadLocalVisitedLists(bool thread_local_visited_lists) {
+        thread_local_visited_lists_ = thread_local_visited_lists;
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements_, thread_local_visited_lists_));
+    }
+
+
     inline std::mutex& getLabelOpMutex(labeltype label) const {
         // calculate hash
         size_t lock_id = label & (MAX_LABEL_OPERATION_LOCKS - 1);
@@ -198,18 +320,41 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     inline labeltype getExternalLabel(tableint internal_id) const {
         labeltype return_label;
-        memcpy(&return_label, (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+        memcpy(&return_label, (data_level0_memory_ + level0_layout_.labels_region + internal_id * level0_layout_.labels_stride), sizeof(labeltype));
         return return_label;
     }
 
 
+    /*
+    * Internal id of the element with the label, from label_lookup_ or, for the elements of a mapped
+    * index, from its label index. Call it with label_lookup_lock held.
+    */
+    bool lookupInternalId(labeltype label, tableint &internal_id) const {
+        auto search = label_lookup_.find(label);
+        if (search != label_lookup_.end()) {
+            internal_id = search->second;
+            return true;
+        }
+        if (label_index_size_ == 0)
+            return false;
+        LabelIndexEntry key = {label, 0};
+        const LabelIndexEntry *end = label_index_ + label_index_size_;
+        const LabelIndexEntry *it = std::lower_bound(label_index_, end, key);
+        // the element may have got another label since, by a replacement
+        if (it == end || it->label != label || getExternalLabel(it->internal_id) != label)
+            return false;
+        internal_id = it->internal_id;
+        return true;
+    }
+
+
     inline void setExternalLabel(tableint internal_id, labeltype label) const {
-        memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+        memcpy((data_level0_memory_ + level0_layout_.labels_region + internal_id * level0_layout_.labels_stride), &label, sizeof(labeltype));
     }
 
 
     inline labeltype *getExternalLabeLp(tableint internal_id) const {
-        return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+        return (labeltype *) (data_level0_memory_ + level0_layout_.labels_region + internal_id * level0_layout_.labels_stride);
     }
 
 
@@ -223,7 +368,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     inline char *getDataByInternalId(tableint internal_id) const {
-        return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+        return (data_level0_memory_ + level0_layout_.data_region + internal_id * level0_layout_.data_stride);
+    }
+
+    inline char *getDataByInternalId(tableint internal_id, char *data_level0_memory_) const {
+        return (data_level0_memory_ + level0_layout_.data_region + internal_id * level0_layout_.data_stride);
     }
 
 
@@ -246,29 +395,58 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
-    searchBaseLayer(tableint ep_id, const void *data_point, int layer) {
+    searchBaseLayer(tableint ep_id, const void *data_point, int layer, size_t ef = 0) {
+        return searchBaseLayer(&ep_id, 1, data_point, layer, ef);
+    }
+
+
+    // Same search starting from several entry points of the layer
+    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
+    searchBaseLayer(const tableint *ep_ids, size_t num_eps, const void *data_point, int layer, size_t ef = 0) {
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+        if (use_flat_candidate_pool_) {
+            // the results go to the callers as a heap, the candidates stay in a reused array
+            static thread_local FlatMaxQueue<dist_t, tableint> candidate_set;
+            candidate_set.clear();
+            searchBaseLayer(top_candidates, candidate_set, ep_ids, num_eps, data_point, layer, ef);
+        } else {
+            candidate_heap_t candidate_set;
+            searchBaseLayer(top_candidates, candidate_set, ep_ids, num_eps, data_point, layer, ef);
+        }
+        return top_candidates;
+    }
+
+
+    template <typename candidate_set_t>
+    void searchBaseLayer(
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> &top_candidates,
+        candidate_set_t &candidateSet,
+        const tableint *ep_ids, size_t num_eps, const void *data_point, int layer, size_t ef) {
+        // ef of the search, ef_construction_ unless given
+        size_t ef_limit = ef ? ef : ef_construction_;
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
         vl_type *visited_array = vl->mass;
         vl_type visited_array_tag = vl->curV;
 
-        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidateSet;
-
-        dist_t lowerBound;
-        if (!isMarkedDeleted(ep_id)) {
-            dist_t dist = fstdistfunc_(data_point, getDataByInternalId(ep_id), dist_func_param_, scale2_);
-            top_candidates.emplace(dist, ep_id);
-            lowerBound = dist;
-            candidateSet.emplace(-dist, ep_id);
-        } else {
-            lowerBound = std::numeric_limits<dist_t>::max();
-            candidateSet.emplace(-lowerBound, ep_id);
+        for (size_t i = 0; i < num_eps; i++) {
+            tableint ep_id = ep_ids[i];
+            if (visited_array[ep_id] == visited_array_tag) continue;
+            visited_array[ep_id] = visited_array_tag;
+            if (!isMarkedDeleted(ep_id)) {
+                dist_t dist = code_fstdistfunc_(data_point, getDataByInternalId(ep_id), code_dist_func_param_, scale2_);
+                top_candidates.emplace(dist, ep_id);
+                if (top_candidates.size() > ef_limit)
+                    top_candidates.pop();
+                candidateSet.emplace(-dist, ep_id);
+            } else {
+                candidateSet.emplace(-std::numeric_limits<dist_t>::max(), ep_id);
+            }
         }
-        visited_array[ep_id] = visited_array_tag;
+        dist_t lowerBound = top_candidates.empty() ? std::numeric_limits<dist_t>::max() : top_candidates.top().first;
 
         while (!candidateSet.empty()) {
             std::pair<dist_t, tableint> curr_el_pair = candidateSet.top();
-            if ((-curr_el_pair.first) > lowerBound && top_candidates.size() == ef_construction_) {
+            if ((-curr_el_pair.first) > lowerBound && top_candidates.size() == ef_limit) {
                 break;
             }
             candidateSet.pop();
@@ -304,8 +482,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 visited_array[candidate_id] = visited_array_tag;
                 char *currObj1 = (getDataByInternalId(candidate_id));
 
-                dist_t dist1 = fstdistfunc_(data_point, currObj1, dist_func_param_, scale2_);
-                if (top_candidates.size() < ef_construction_ || lowerBound > dist1) {
+                dist_t dist1 = code_fstdistfunc_(data_point, currObj1, code_dist_func_param_, scale2_);
+                if (top_candidates.size() < ef_limit || lowerBound > dist1) {
                     candidateSet.emplace(-dist1, candidate_id);
 #ifdef USE_SSE
                     _mm_prefetch(getDataByInternalId(candidateSet.top().second), _MM_HINT_T0);
@@ -314,17 +492,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (!isMarkedDeleted(candidate_id))
                         top_candidates.emplace(dist1, candidate_id);
 
-                    if (top_candidates.size() > ef_construction_)
+                    if (top_candidates.size() > ef_limit)
                         top_candidates.pop();
 
                     if (!top_candidates.empty())
                         lowerBound = top_candidates.top().first;
+                    if (top_candidates.size() == ef_limit)
+                        dropFartherCandidates(candidateSet, lowerBound);
                 }
             }
         }
         visited_list_pool_->releaseVisitedList(vl);
-
-        return top_candidates;
     }
 
 
@@ -332,6 +510,23 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     template <bool bare_bone_search = true, bool collect_metrics = false>
     std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
     searchBaseLayerST(
+        tableint ep_id,
+        const void *data_point,
+        size_t ef,
+        float q_residual,
+        BaseFilterFunctor* isIdAllowed = nullptr,
+        BaseSearchStopCondition<dist_t>* stop_condition = nullptr) const {
+        HeapSearchQueues queues;
+        searchBaseLayerST<bare_bone_search, collect_metrics>(
+            queues, ep_id, data_point, ef, q_residual, isIdAllowed, stop_condition);
+        return std::move(queues.top_candidates);
+    }
+
+
+    // Same search writing into the caller's queues, search_queues_t is HeapSearchQueues or FlatSearchQueues
+    template <bool bare_bone_search = true, bool collect_metrics = false, typename search_queues_t = HeapSearchQueues>
+    void searchBaseLayerST(
+        search_queues_t &queues,
         tableint ep_id,
         const void *data_point,
         size_t ef,
@@ -341,14 +536,22 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
         vl_type *visited_array = vl->mass;
         vl_type visited_array_tag = vl->curV;
+        char *level0 = searchLevel0();
+        // compressed lists are decoded into a buffer of the thread, kept across searches
+        static thread_local std::vector<linklistsizeint> links0_buffer;
+        linklistsizeint *links0 = nullptr;
+        if (links0_codec_ != LINKS0_PLAIN) {
+            if (links0_buffer.size() < maxM0_ + 2) links0_buffer.resize(maxM0_ + 2);
+            links0 = links0_buffer.data();
+        }
 
-        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+        auto &top_candidates = queues.top_candidates;
+        auto &candidate_set = queues.candidate_set;
 
         dist_t lowerBound;
         if (bare_bone_search || 
             (!isMarkedDeleted(ep_id) && ((!isIdAllowed) || (*isIdAllowed)(getExternalLabel(ep_id))))) {
-            char* ep_data = getDataByInternalId(ep_id);
+            char* ep_data = getDataByInternalId(ep_id, level0);
             dist_t dist = fstdistfunc_(data_point, ep_data, dist_func_param_, scale2_);
                     // add residuals
                     // dist += q_residual;
@@ -386,7 +589,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             candidate_set.pop();
 
             tableint current_node_id = current_node_pair.second;
-            int *data = (int *) get_linklist0(current_node_id);
+            int *data = (int *) (links0 == nullptr ? get_linklist0(current_node_id, level0)
+                                                   : decodeLinkList0(current_node_id, level0, links0));
             size_t size = getListCount((linklistsizeint*)data);
 //                bool cur_node_deleted = isMarkedDeleted(current_node_id);
             if (collect_metrics) {
@@ -397,7 +601,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 #ifdef USE_SSE
             _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*(data + 1), level0), _MM_HINT_T0);
             _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
 #endif
 
@@ -406,13 +610,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                 _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
+                _mm_prefetch(getDataByInternalId(*(data + j + 1), level0),
                                 _MM_HINT_T0);  ////////////
 #endif
                 if (!(visited_array[candidate_id] == visited_array_tag)) {
                     visited_array[candidate_id] = visited_array_tag;
 
-                    char *currObj1 = (getDataByInternalId(candidate_id));
+                    char *currObj1 = (getDataByInternalId(candidate_id, level0));
                     dist_t dist = fstdistfunc_(data_point, currObj1, dist_func_param_, scale2_);
                     // add residuals
                     // dist += q_residual;
@@ -428,8 +632,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (flag_consider_candidate) {
                         candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                        _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
-                                        offsetLevel0_,  ///////////
+                        _mm_prefetch((char *) get_linklist0(candidate_set.top().second, level0),  ///////////
                                         _MM_HINT_T0);  ////////////////////////
 #endif
 
@@ -451,7 +654,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                             tableint id = top_candidates.top().second;
                             top_candidates.pop();
                             if (!bare_bone_search && stop_condition) {
-                                stop_condition->remove_point_from_result(getExternalLabel(id), getDataByInternalId(id), dist);
+                                stop_condition->remove_point_from_result(getExternalLabel(id), getDataByInternalId(id, level0), dist);
                                 flag_remove_extra = stop_condition->should_remove_extra();
                             } else {
                                 flag_remove_extra = top_candidates.size() > ef;
@@ -460,13 +663,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
                         if (!top_candidates.empty())
                             lowerBound = top_candidates.top().first;
+                        if ((bare_bone_search || !stop_condition) && top_candidates.size() >= ef)
+                            dropFartherCandidates(candidate_set, lowerBound);
                     }
                 }
             }
         }
 
         visited_list_pool_->releaseVisitedList(vl);
-        return top_candidates;
     }
 
 
@@ -495,9 +699,9 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             for (std::pair<dist_t, tableint> second_pair : return_list) {
                 dist_t curdist =
-                        fstdistfunc_(getDataByInternalId(second_pair.second),
-                                        getDataByInternalId(curent_pair.second),
-                                        dist_func_param_, scale2_);
+                        code_fstdistfunc_(getDataByInternalId(second_pair.second),
+                                             getDataByInternalId(curent_pair.second),
+                                             code_dist_func_param_, scale2_);
                 if (curdist < dist_to_query) {
                     good = false;
                     break;
@@ -515,12 +719,12 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     linklistsizeint *get_linklist0(tableint internal_id) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (data_level0_memory_ + level0_layout_.links0_region + internal_id * level0_layout_.links0_stride);
     }
 
 
     linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (data_level0_memory_ + level0_layout_.links0_region + internal_id * level0_layout_.links0_stride);
     }
 
 
@@ -541,7 +745,6 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         int level,
         bool isUpdate,
         bool use_heuristic2 = true) {
-        size_t Mcurmax = level ? maxM_ : maxM0_;
         if (use_heuristic2) getNeighborsByHeuristic2(top_candidates, M_);  // 启发式算法找到 M 个邻居
         if (use_heuristic2 && top_candidates.size() > M_)
             throw std::runtime_error("Should be not be more than M_ candidates returned by the heuristic");
@@ -586,112 +789,119 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-            std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
-
-            linklistsizeint *ll_other;
-            if (level == 0)
-                ll_other = get_linklist0(selectedNeighbors[idx]);
-            else
-                ll_other = get_linklist(selectedNeighbors[idx], level); // 获取已经连接的邻居的数据 
-
-            size_t sz_link_list_other = getListCount(ll_other);
+            addReverseLink(cur_c, selectedNeighbors[idx], level, isUpdate, use_heuristic2);
+        }
 
-            if (sz_link_list_other > Mcurmax)
-                throw std::runtime_error("Bad value of sz_link_list_other");
-            if (selectedNeighbors[idx] == cur_c)
-                throw std::runtime_error("Trying to connect an element to itself");
-            if (level > element_levels_[selectedNeighbors[idx]])  // 当前层是否超过了邻居所在的层，是的话邻居就不需要在当前点反向连接了
-                                                                  // 只会在小于邻居的层进行互联，即使这个邻居没有在该层
-                throw std::runtime_error("Trying to make a link on a non-existent level");
+        return next_closest_entry_point;
+    }
 
-            tableint *data = (tableint *) (ll_other + 1); // 获取已经连接的邻居的邻居信息 
 
-            bool is_cur_c_present = false;
-            if (isUpdate) {
-                for (size_t j = 0; j < sz_link_list_other; j++) {
-                    if (data[j] == cur_c) {
-                        is_cur_c_present = true;
-                        break;
-                    }
+    // Links neighbour back to cur_c at level, pruning the links of neighbour with the heuristic when they are full
+    void addReverseLink(tableint cur_c, tableint neighbour, int level, bool isUpdate, bool use_heuristic2 = true) {
+        size_t Mcurmax = level ? maxM_ : maxM0_;
+        std::unique_lock <std::mutex> lock(link_list_locks_[neighbour]);
+
+        linklistsizeint *ll_other;
+        if (level == 0)
+            ll_other = get_linklist0(neighbour);
+        else
+            ll_other = get_linklist(neighbour, level); // 获取已经连接的邻居的数据 
+
+        size_t sz_link_list_other = getListCount(ll_other);
+
+        if (sz_link_list_other > Mcurmax)
+            throw std::runtime_error("Bad value of sz_link_list_other");
+        if (neighbour == cur_c)
+            throw std::runtime_error("Trying to connect an element to itself");
+        if (level > element_levels_[neighbour])  // 当前层是否超过了邻居所在的层，是的话邻居就不需要在当前点反向连接了
+                                                 // 只会在小于邻居的层进行互联，即使这个邻居没有在该层
+            throw std::runtime_error("Trying to make a link on a non-existent level");
+
+        tableint *data = (tableint *) (ll_other + 1); // 获取已经连接的邻居的邻居信息 
+
+        bool is_cur_c_present = false;
+        if (isUpdate) {
+            for (size_t j = 0; j < sz_link_list_other; j++) {
+                if (data[j] == cur_c) {
+                    is_cur_c_present = true;
+                    break;
                 }
             }
+        }
 
-            if (use_heuristic2) {
-            // If cur_c is already present in the neighboring connections of `selectedNeighbors[idx]` then no need to modify any connections or run the heuristics.
-            if (!is_cur_c_present) {
-                if (sz_link_list_other < Mcurmax) { // 如果邻居的邻居数量少于 M 个，那么直接将当前点插入到邻居的邻居列表中，构成双向图
-                    data[sz_link_list_other] = cur_c;
-                    setListCount(ll_other, sz_link_list_other + 1);
-                } else {  
-                    // 如果邻居的邻居数量已经超过了 M 个，那么使用启发式算法，重新从 M+1 个邻居中选择 M 个邻居，
-                    // 存在当前点不是邻居最合适的点的请，所以也就导致了hnsw 图不一定是一个完全的双向图
-                    // finding the "weakest" element to replace it with the new one
-                    dist_t d_max = fstdistfunc_(getDataByInternalId(cur_c), getDataByInternalId(selectedNeighbors[idx]),
-                                                dist_func_param_, scale2_);
-                    // Heuristic:
-                    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
-                    candidates.emplace(d_max, cur_c);
+        if (use_heuristic2) {
+        // If cur_c is already present in the neighboring connections of `neighbour` then no need to modify any connections or run the heuristics.
+        if (!is_cur_c_present) {
+            if (sz_link_list_other < Mcurmax) { // 如果邻居的邻居数量少于 M 个，那么直接将当前点插入到邻居的邻居列表中，构成双向图
+                data[sz_link_list_other] = cur_c;
+                setListCount(ll_other, sz_link_list_other + 1);
+            } else {  
+                // 如果邻居的邻居数量已经超过了 M 个，那么使用启发式算法，重新从 M+1 个邻居中选择 M 个邻居，
+                // 存在当前点不是邻居最合适的点的请，所以也就导致了hnsw 图不一定是一个完全的双向图
+                // finding the "weakest" element to replace it with the new one
+                dist_t d_max = code_fstdistfunc_(getDataByInternalId(cur_c), getDataByInternalId(neighbour),
+                                                 code_dist_func_param_, scale2_);
+                // Heuristic:
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+                candidates.emplace(d_max, cur_c);
 
-                    for (size_t j = 0; j < sz_link_list_other; j++) {
-                        candidates.emplace(
-                                fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(selectedNeighbors[idx]),
-                                                dist_func_param_, scale2_), data[j]);
-                    }
+                for (size_t j = 0; j < sz_link_list_other; j++) {
+                    candidates.emplace(
+                            code_fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(neighbour),
+                                                 code_dist_func_param_, scale2_), data[j]);
+                }
 
-                    getNeighborsByHeuristic2(candidates, Mcurmax);
+                getNeighborsByHeuristic2(candidates, Mcurmax);
 
-                    int indx = 0;
-                    while (candidates.size() > 0) {
-                        data[indx] = candidates.top().second;
-                        candidates.pop();
-                        indx++;
-                    }
+                int indx = 0;
+                while (candidates.size() > 0) {
+                    data[indx] = candidates.top().second;
+                    candidates.pop();
+                    indx++;
+                }
 
-                    setListCount(ll_other, indx);
-                    // Nearest K:
-                    /*int indx = -1;
-                    for (int j = 0; j < sz_link_list_other; j++) {
-                        dist_t d = fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(rez[idx]), dist_func_param_);
-                        if (d > d_max) {
-                            indx = j;
-                            d_max = d;
-                        }
+                setListCount(ll_other, indx);
+                // Nearest K:
+                /*int indx = -1;
+                for (int j = 0; j < sz_link_list_other; j++) {
+                    dist_t d = fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(rez[idx]), dist_func_param_);
+                    if (d > d_max) {
+                        indx = j;
+                        d_max = d;
                     }
-                    if (indx >= 0) {
-                        data[indx] = cur_c;
-                    } */
                 }
+                if (indx >= 0) {
+                    data[indx] = cur_c;
+                } */
             }
+        }
 
-            } else {
-                if (sz_link_list_other < Mcurmax) { // 如果邻居的邻居数量少于 M 个，那么直接将当前点插入到邻居的邻居列表中，构成双向图
-                    data[sz_link_list_other] = cur_c;
-                    setListCount(ll_other, sz_link_list_other + 1);
-                }
-
+        } else {
+            if (sz_link_list_other < Mcurmax) { // 如果邻居的邻居数量少于 M 个，那么直接将当前点插入到邻居的邻居列表中，构成双向图
+                data[sz_link_list_other] = cur_c;
+                setListCount(ll_other, sz_link_list_other + 1);
             }
 
         }
-
-        return next_closest_entry_point;
     }
 
 
     void resizeIndex(size_t new_max_elements) {
         if (new_max_elements < cur_element_count)
             throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
+        checkNoReplicas();
+        checkLinksNotCompressed();
+        copyMappedIndex();
 
-        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
+        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements, thread_local_visited_lists_));
 
         element_levels_.resize(new_max_elements);
 
         std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
 
         // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
-        if (data_level0_memory_new == nullptr)
+        if (!resizeLevel0(new_max_elements, level0_layout_.type))
             throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-        data_level0_memory_ = data_level0_memory_new;
 
         // Reallocate all other layers
         char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
@@ -699,6 +909,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             throw std::runtime_error("Not enough memory: resizeIndex failed to allocate other layers");
         linkLists_ = linkLists_new;
 
+        // the re-ranking vectors grow with the index, a file mapped read-only is copied into memory
+        if (rerank_vectors_) {
+            if (rerank_vectors_->writable()) {
+                rerank_vectors_->resize(new_max_elements);
+            } else {
+                std::unique_ptr<VectorStore> vectors(new VectorStore(new_max_elements, rerank_vectors_->elementSize()));
+                for (size_t i = 0; i < cur_element_count; i++) vectors->set(i, rerank_vectors_->get(i));
+                rerank_vectors_.swap(vectors);
+            }
+        }
+
         max_elements_ = new_max_elements;
     }
 
@@ -729,35 +950,211 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         return size;
     }
 
+    /*
+    * Saves the index, the file is written in large blocks on all threads with pwrite, see
+    * ParallelFileWriter.
+    */
     void saveIndex(const std::string &location) {
-        std::cout << "max level: " << maxlevel_ << std::endl;
-        std::ofstream output(location, std::ios::binary);
-        std::streampos position;
+        std::ostringstream header;
+        writeIndexHeader(header);
+        std::string header_data = header.str();
+        size_t level0_size = cur_element_count * size_data_per_element_;
 
-        writeBinaryPOD(output, offsetLevel0_);
-        writeBinaryPOD(output, max_elements_);
-        writeBinaryPOD(output, cur_element_count);
-        writeBinaryPOD(output, size_data_per_element_);
-        writeBinaryPOD(output, label_offset_);
-        writeBinaryPOD(output, offsetData_);
-        writeBinaryPOD(output, maxlevel_);
-        writeBinaryPOD(output, enterpoint_node_);
-        writeBinaryPOD(output, maxM_);
+        // the upper level links of every element after their size
+        std::vector<size_t> link_starts(cur_element_count + 1, 0);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            link_starts[i + 1] = link_starts[i] + sizeof(unsigned int) + size_links_per_element_ * element_levels_[i];
+        }
+        auto copy_links = [this](size_t i, size_t pos, size_t n, char *out) {
+            unsigned int link_list_size = size_links_per_element_ * element_levels_[i];
+            if (pos < sizeof(link_list_size)) {
+                size_t m = std::min(n, sizeof(link_list_size) - pos);
+                memcpy(out, (const char *) &link_list_size + pos, m);
+                out += m;
+                pos += m;
+                n -= m;
+            }
+            if (n > 0)
+                memcpy(out, linkLists_[i] + pos - sizeof(link_list_size), n);
+        };
 
-        writeBinaryPOD(output, maxM0_);
-        writeBinaryPOD(output, M_);
-        writeBinaryPOD(output, mult_);
-        writeBinaryPOD(output, ef_construction_);
+        ParallelFileWriter writer(location);
+        writer.addBuffer(0, header_data.data(), header_data.size());
+        writer.addPart(header_data.size(), level0_size, [this](size_t offset, size_t size, char *out) {
+            fillLevel0Records(offset, size, out);
+        });
+        writer.addPart(header_data.size() + level0_size, link_starts.back(), [&](size_t offset, size_t size, char *out) {
+            fillIndexPieces(link_starts, copy_links, offset, size, out);
+        });
+        writer.write(header_data.size() + level0_size + link_starts.back());
+    }
 
-        output.write(data_level0_memory_, cur_element_count * size_data_per_element_);
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
-            writeBinaryPOD(output, linkListSize);
-            if (linkListSize)
-                output.write(linkLists_[i], linkListSize);
+    /*
+    * Saves the index in the file format version 1, as saveIndex(location), or 2. Version 2 keeps the
+    * state the first one leaves out, so quantized indexes load without files next to them: the kind
+    * and the state of the space (PQ codebooks, SQ ranges, int8 scale), scale_, the PQ residuals, the
+    * levels, the labels and the deleted ids, each in a section with a checksum, see index_format.h.
+    *
+    * With pack_links the neighbour ids of all levels are written sorted and delta coded as varints
+    * instead of in their slots, see packIndexLinks. Such a file is smaller but loadIndexMapped can not
+    * use it in place.
+    */
+    void saveIndex(const std::string &location, int version, bool pack_links = false) {
+        if (version == 1) {
+            saveIndex(location);
+            return;
         }
-        output.close();
+        if (version != 2)
+            throw std::runtime_error("Unsupported index file version " + std::to_string(version));
+
+        std::ostringstream params;
+        writeIndexParams(params);
+        std::string params_data = params.str();
+        std::ostringstream space_state;
+        saveSpaceState(space_state);
+        std::string space_data = space_state.str();
+
+        std::vector<LabelIndexEntry> labels;
+        std::vector<tableint> deleted;
+        labels.reserve(cur_element_count);
+        for (tableint i = 0; i < cur_element_count; i++) {
+            labeltype label = getExternalLabel(i);
+            tableint id;
+            if (lookupInternalId(label, id) && id == i)
+                labels.push_back({label, i});
+            if (isMarkedDeleted(i))
+                deleted.push_back(i);
+        }
+        std::sort(labels.begin(), labels.end());
+
+        // sections filled by a function, the others from one buffer
+        std::vector<uint32_t> section_ids;
+        std::vector<size_t> section_sizes;
+        std::vector<ParallelFileWriter::Fill> section_fills;
+        auto add_section = [&](uint32_t id, size_t size, ParallelFileWriter::Fill fill) {
+            section_ids.push_back(id);
+            section_sizes.push_back(size);
+            section_fills.push_back(fill);
+        };
+        auto add_buffer = [&](uint32_t id, const void *data, size_t size) {
+            const char *bytes = (const char *) data;
+            add_section(id, size, [bytes](size_t offset, size_t n, char *out) {
+                memcpy(out, bytes + offset, n);
+            });
+        };
+        add_buffer(INDEX_SECTION_PARAMS, params_data.data(), params_data.size());
+        add_buffer(INDEX_SECTION_LEVELS, element_levels_.data(), cur_element_count * sizeof(int));
+
+        std::vector<size_t> link_starts;
+        std::vector<std::vector<uint8_t>> packed_chunks;
+        std::vector<uint64_t> packed_directory;
+        std::vector<size_t> packed_starts;
+        if (!pack_links) {
+            add_section(INDEX_SECTION_LEVEL0, cur_element_count * size_data_per_element_, [this](size_t offset, size_t size, char *out) {
+                fillLevel0Records(offset, size, out);
+            });
+            link_starts.assign(cur_element_count + 1, 0);
+            for (size_t i = 0; i < cur_element_count; i++) {
+                link_starts[i + 1] = link_starts[i] + size_links_per_element_ * element_levels_[i];
+            }
+            add_section(INDEX_SECTION_LINKS, link_starts.back(), [&](size_t offset, size_t size, char *out) {
+                fillIndexPieces(link_starts, [this](size_t i, size_t pos, size_t n, char *out) {
+                    memcpy(out, linkLists_[i] + pos, n);
+                }, offset, size, out);
+            });
+        } else {
+            // the records without the slots of the neighbour ids
+            size_t id_slots_size = maxM0_ * sizeof(tableint);
+            size_t stride = size_data_per_element_ - id_slots_size;
+            add_section(INDEX_SECTION_LEVEL0_DATA, cur_element_count * stride, [this, stride, id_slots_size](size_t offset, size_t size, char *out) {
+                while (size > 0) {
+                    size_t pos = offset % stride;
+                    size_t n = pos < sizeof(linklistsizeint) ? std::min(size, sizeof(linklistsizeint) - pos) : std::min(size, stride - pos);
+                    copyRecordBytes(offset / stride, pos < sizeof(linklistsizeint) ? pos : pos + id_slots_size, n, out);
+                    offset += n;
+                    out += n;
+                    size -= n;
+                }
+            });
+
+            packed_chunks.resize((cur_element_count + INDEX_PACKED_CHUNK - 1) / INDEX_PACKED_CHUNK);
+#pragma omp parallel for schedule(dynamic)
+            for (long long c = 0; c < (long long) packed_chunks.size(); c++) {
+                std::vector<uint32_t> sorted;
+                std::vector<uint8_t> &chunk = packed_chunks[c];
+                size_t end = std::min(cur_element_count.load(), (size_t) (c + 1) * INDEX_PACKED_CHUNK);
+                std::vector<linklistsizeint> links0;
+                for (size_t i = c * INDEX_PACKED_CHUNK; i < end; i++) {
+                    linklistsizeint *ll = level0List(i, links0);
+                    packIndexLinks((const uint32_t *) (ll + 1), getListCount(ll), sorted, chunk);
+                    for (int level = 1; level <= element_levels_[i]; level++) {
+                        ll = get_linklist(i, level);
+                        writeVarint(chunk, getListCount(ll));
+                        packIndexLinks((const uint32_t *) (ll + 1), getListCount(ll), sorted, chunk);
+                    }
+                }
+            }
+            // the directory, then the chunks
+            packed_directory.assign(packed_chunks.size() + 1, packed_chunks.size());
+            packed_starts.assign(packed_chunks.size() + 2, 0);
+            packed_starts[1] = packed_directory.size() * sizeof(uint64_t);
+            for (size_t c = 0; c < packed_chunks.size(); c++) {
+                packed_starts[c + 2] = packed_starts[c + 1] + packed_chunks[c].size();
+                packed_directory[c + 1] = packed_starts[c + 2] - packed_starts[1];
+            }
+            add_section(INDEX_SECTION_LINKS_PACKED, packed_starts.back(), [&](size_t offset, size_t size, char *out) {
+                fillIndexPieces(packed_starts, [&](size_t i, size_t pos, size_t n, char *out) {
+                    const char *piece = i == 0 ? (const char *) packed_directory.data() : (const char *) packed_chunks[i - 1].data();
+                    memcpy(out, piece + pos, n);
+                }, offset, size, out);
+            });
+        }
+
+        add_buffer(INDEX_SECTION_LABELS, labels.data(), labels.size() * sizeof(LabelIndexEntry));
+        add_buffer(INDEX_SECTION_DELETED, deleted.data(), deleted.size() * sizeof(tableint));
+        if (!space_data.empty())
+            add_buffer(INDEX_SECTION_SPACE, space_data.data(), space_data.size());
+        if (!pq_residuals_.empty())
+            add_buffer(INDEX_SECTION_RESIDUALS, pq_residuals_.data(), pq_residuals_.size() * sizeof(float));
+
+        IndexFileHeader2 header = {INDEX_FILE_MAGIC, INDEX_FILE_VERSION, (uint32_t) section_ids.size()};
+        std::vector<IndexFileSection> sections(section_ids.size());
+        size_t offset = sizeof(header) + sections.size() * sizeof(IndexFileSection);
+        ParallelFileWriter writer(location);
+        for (size_t s = 0; s < sections.size(); s++) {
+            sections[s] = {section_ids[s], 0, indexSectionAlign(offset), section_sizes[s], 0};
+            writer.addPart(sections[s].offset, sections[s].size, section_fills[s]);
+            offset = sections[s].offset + sections[s].size;
+        }
+        writer.write(offset);
+
+        // the checksums are known once the sections are written
+        std::string table((const char *) &header, sizeof(header));
+        for (size_t s = 0; s < sections.size(); s++) {
+            sections[s].checksum = writer.checksum(s);
+        }
+        table.append((const char *) sections.data(), sections.size() * sizeof(IndexFileSection));
+        writer.writeAt(0, table.data(), table.size());
+    }
+
+
+    // Reads the header written by saveIndex
+    void readIndexHeader(std::istream &input) {
+        readBinaryPOD(input, offsetLevel0_);
+        readBinaryPOD(input, max_elements_);
+        readBinaryPOD(input, cur_element_count);
+        readBinaryPOD(input, size_data_per_element_);
+        readBinaryPOD(input, label_offset_);
+        readBinaryPOD(input, offsetData_);
+        readBinaryPOD(input, maxlevel_);
+        readBinaryPOD(input, enterpoint_node_);
+        readBinaryPOD(input, maxM_);
+        readBinaryPOD(input, maxM0_);
+        readBinaryPOD(input, M_);
+        readBinaryPOD(input, mult_);
+        readBinaryPOD(input, ef_construction_);
+        level0_layout_ = level0Layout(LAYOUT_INTERLEAVED, max_elements_);
     }
 
 
@@ -773,31 +1170,28 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::streampos total_filesize = input.tellg();
         input.seekg(0, input.beg);
 
-        readBinaryPOD(input, offsetLevel0_);
-        readBinaryPOD(input, max_elements_);
-        readBinaryPOD(input, cur_element_count);
+        std::vector<IndexFileSection> sections;
+        if (readIndexSections(input, sections)) {
+            loadIndexSections(input, total_filesize, sections, s, max_elements_i);
+            applyLayout();
+            return;
+        }
+        input.clear();
+        input.seekg(0, input.beg);
 
+        readIndexHeader(input);
         size_t max_elements = max_elements_i;
         if (max_elements < cur_element_count)
             max_elements = max_elements_;
         max_elements_ = max_elements;
-        readBinaryPOD(input, size_data_per_element_);
-        readBinaryPOD(input, label_offset_);
-        readBinaryPOD(input, offsetData_);
-        readBinaryPOD(input, maxlevel_);
-        readBinaryPOD(input, enterpoint_node_);
-        std::cout << "++++++++++++++++++++++++++++++++" << std::endl;
-        std::cout << "load index max level: " << maxlevel_ << std::endl;
-
-        readBinaryPOD(input, maxM_);
-        readBinaryPOD(input, maxM0_);
-        readBinaryPOD(input, M_);
-        readBinaryPOD(input, mult_);
-        readBinaryPOD(input, ef_construction_);
 
+        space_ = s;
         data_size_ = s->get_data_size();
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
+        code_fstdistfunc_ = s->get_code_dist_func();
+        code_dist_func_param_ = s->get_code_dist_func_param();
+        useInt8Scale();
 
         auto pos = input.tellg();
 
@@ -824,7 +1218,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
         input.seekg(pos, input.beg);
 
-        data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
+        data_level0_memory_ = allocateMemory(max_elements * size_data_per_element_, memory_policy_, level0_mapped_size_);
         if (data_level0_memory_ == nullptr)
             throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
         input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
@@ -835,7 +1229,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::vector<std::mutex>(max_elements).swap(link_list_locks_);
         std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
 
-        visited_list_pool_.reset(new VisitedListPool(1, max_elements));
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements, thread_local_visited_lists_));
 
         linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
         if (linkLists_ == nullptr)
@@ -843,6 +1237,9 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         element_levels_ = std::vector<int>(max_elements);
         revSize_ = 1.0 / mult_;
         ef_ = 10;
+        // the rest of the file is the links and their sizes, loaded into one block
+        if (!link_arena_.reserve((size_t) (total_filesize - input.tellg()) - cur_element_count * sizeof(unsigned int)))
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
         for (size_t i = 0; i < cur_element_count; i++) {
             label_lookup_[getExternalLabel(i)] = i;
             unsigned int linkListSize;
@@ -852,7 +1249,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 linkLists_[i] = nullptr;
             } else {
                 element_levels_[i] = linkListSize / size_links_per_element_;
-                linkLists_[i] = (char *) malloc(linkListSize);
+                linkLists_[i] = link_arena_.allocate(linkListSize);
                 if (linkLists_[i] == nullptr)
                     throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
                 input.read(linkLists_[i], linkListSize);
@@ -867,441 +1264,1612 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
 
         input.close();
+        applyLayout();
 
         return;
     }
 
-    int getElementLevel(tableint internal_id) {
-        return element_levels_[internal_id];
-    }
-
-    void getExternalNeighbours(tableint internal_id, std::vector<labeltype>& external_neighbours) const {
-        linklistsizeint *ll_cur = get_linklist0(internal_id);
-        tableint *data = (tableint *) (ll_cur + 1);
-
-        for (int i = 0; i < *ll_cur; i++) {
-            tableint internal_id_neighbour = *(data+i);
 
-            labeltype external_id = getExternalLabel(internal_id_neighbour);
-            external_neighbours.push_back(external_id);
+    // Loads a version 2 file, every section read is checked against its checksum
+    void loadIndexSections(std::istream &input, size_t file_size, const std::vector<IndexFileSection> &sections,
+                           SpaceInterface<dist_t> *s, size_t max_elements_i) {
+        label_lookup_.clear();
+        deleted_elements.clear();
+        num_deleted_ = 0;
+        checkIndexSections(sections, file_size);
+        std::vector<char> params = readIndexSection(input, requireIndexSection(sections, INDEX_SECTION_PARAMS));
+        readIndexParams(params.data(), params.size(), s);
+        const IndexFileSection &levels = requireIndexSection(sections, INDEX_SECTION_LEVELS);
+        const IndexFileSection *packed = findIndexSection(sections, INDEX_SECTION_LINKS_PACKED);
+        const IndexFileSection &level0 = requireIndexSection(sections, packed ? INDEX_SECTION_LEVEL0_DATA : INDEX_SECTION_LEVEL0);
+        size_t record_size = packed ? size_data_per_element_ - maxM0_ * sizeof(tableint) : size_data_per_element_;
+        if (level0.size != cur_element_count * record_size || levels.size != cur_element_count * sizeof(int)) {
+            cur_element_count = 0;
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
         }
-    }
+        size_t max_elements = max_elements_i;
+        if (max_elements < cur_element_count)
+            max_elements = max_elements_;
+        max_elements_ = max_elements;
 
-    void countOutDegrees(std::vector<std::vector<linklistsizeint>>& out_degrees) {
-        out_degrees.resize(max_elements_);
-        for (int i = 0; i < max_elements_; i++) {
-            out_degrees[i].resize(element_levels_[i]+1);
+        data_level0_memory_ = allocateMemory(max_elements * size_data_per_element_, memory_policy_, level0_mapped_size_);
+        linkLists_ = (char **) calloc(std::max(max_elements, (size_t) 1), sizeof(void *));
+        element_levels_ = std::vector<int>(max_elements);
+        if (data_level0_memory_ == nullptr || linkLists_ == nullptr) {
+            clear();
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
         }
+        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+        std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements, thread_local_visited_lists_));
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
 
-        for (int i = 0; i < max_elements_; i++) {
-            for (int level = 0; level <= element_levels_[i]; level++) {
-                linklistsizeint* ll_cur;
-                if (level == 0) {
-                    ll_cur = get_linklist0(i);
-                } else {
-                    ll_cur = get_linklist(i, level);
-                }
-                out_degrees[i][level] = *ll_cur;
+        try {
+            readIndexSection(input, levels, (char *) element_levels_.data());
+            for (size_t i = 0; i < cur_element_count; i++) {
+                if (element_levels_[i] < 0 || element_levels_[i] > maxlevel_)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+            }
+            if (packed != nullptr) {
+                readLevel0Data(input, level0);
+                readPackedLinks(input, *packed);
+            } else {
+                readIndexSection(input, level0, data_level0_memory_);
+                readLinks(input, requireIndexSection(sections, INDEX_SECTION_LINKS));
             }
-        }
-    }
-
-    void countInDegrees(std::vector<std::vector<linklistsizeint>>& in_degrees) {
-        in_degrees.resize(max_elements_);
-        for (int i = 0; i < max_elements_; i++) {
-            in_degrees[i].resize(element_levels_[i]+1);
-        }
-
-        for (int i = 0; i < max_elements_; i++) {
-            for (int level = 0; level <= element_levels_[i]; level++) {
-                linklistsizeint* ll_cur;
-                if (level == 0) {
-                    ll_cur = get_linklist0(i);
-                } else {
-                    ll_cur = get_linklist(i, level);
-                }
 
-                tableint *data = (tableint *) (ll_cur + 1);
-                for (int j = 0; j < *ll_cur; j++) {
-                    tableint internal_id_neighbour = *(data+j);
-                    in_degrees[internal_id_neighbour][level]++;
-                }
+            std::vector<char> labels = readIndexSection(input, requireIndexSection(sections, INDEX_SECTION_LABELS));
+            std::vector<char> deleted = readIndexSection(input, requireIndexSection(sections, INDEX_SECTION_DELETED));
+            size_t num_labels = checkLabelSection(labels.data(), labels.size());
+            const LabelIndexEntry *entries = (const LabelIndexEntry *) labels.data();
+            label_lookup_.reserve(num_labels);
+            for (size_t i = 0; i < num_labels; i++) {
+                label_lookup_[entries[i].label] = entries[i].internal_id;
             }
+            useDeletedSection(deleted.data(), deleted.size());
+
+            const IndexFileSection *space = findIndexSection(sections, INDEX_SECTION_SPACE);
+            const IndexFileSection *residuals = findIndexSection(sections, INDEX_SECTION_RESIDUALS);
+            std::vector<char> space_state, residual_data;
+            if (space != nullptr)
+                space_state = readIndexSection(input, *space);
+            if (residuals != nullptr)
+                residual_data = readIndexSection(input, *residuals);
+            useAuxiliarySections(space_state.data(), space_state.size(), residual_data.data(), residual_data.size());
+        } catch (...) {
+            clear();
+            label_lookup_.clear();
+            deleted_elements.clear();
+            num_deleted_ = 0;
+            throw;
         }
     }
 
-    // 索引合并测试
-    // 仅测试召回功能，不涉及内存优化
-    void mergeIndex(const std::vector<HierarchicalNSW*>& shard_indexes) {
-        if (shard_indexes.size() <= 1) {
+
+    /*
+    * Loads the index file at location by mapping it instead of reading it. Level 0 and the upper level
+    * links are used in place from the page cache, so processes that map the same file share one copy;
+    * pages are copied on write, so deletions and updates stay private and the file is never changed.
+    *
+    * The levels, deletions and sorted labels of the elements are kept in the lookup file location.lookup,
+    * written at the first mapped load of the file and mapped at the next ones, so a restart reads
+    * neither level 0 nor the upper levels. A version 2 file holds them itself and needs no lookup file.
+    * resizeIndex copies the index into memory before it grows.
+    */
+    void loadIndexMapped(const std::string &location, SpaceInterface<dist_t> *s) {
+#if defined(_WIN32)
+        throw std::runtime_error("Memory-mapped indexes are not supported on this platform");
+#else
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        clear();
+        label_lookup_.clear();
+        deleted_elements.clear();
+        num_deleted_ = 0;
+        std::vector<IndexFileSection> sections;
+        if (readIndexSections(input, sections)) {
+            input.close();
+            mapIndexSections(location, sections, s);
             return;
         }
+        input.clear();
+        input.seekg(0, input.beg);
+        readIndexHeader(input);
+        if (!input)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        size_t header_size = input.tellg();
+        input.close();
+        max_elements_ = cur_element_count;
 
-        struct node {
-            labeltype external_label_;
-            tableint internal_label_;
-            uint32_t shard_id_;
-            int max_level_;
-            std::vector<std::vector<labeltype>> external_neighbours_; // 记录每个 level 的邻居
-            std::vector<std::vector<tableint>> internal_neighbours_;
-        };
+        struct stat index_stat;
+        if (!mapFile(location, mapped_index_, mapped_index_size_, index_stat, true)) {
+            cur_element_count = 0;
+            throw std::runtime_error("Cannot map the index file");
+        }
+        size_t upper_offset = header_size + cur_element_count * size_data_per_element_;
+        if (upper_offset + cur_element_count * sizeof(unsigned int) > mapped_index_size_) {
+            clear();
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        data_level0_memory_ = mapped_index_ + header_size;
+
+        space_ = s;
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        code_fstdistfunc_ = s->get_code_dist_func();
+        code_dist_func_param_ = s->get_code_dist_func_param();
+        useInt8Scale();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        std::vector<std::mutex>(max_elements_).swap(link_list_locks_);
+        std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements_, thread_local_visited_lists_));
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
+
+        element_levels_ = std::vector<int>(max_elements_);
+        linkLists_ = (char **) malloc(sizeof(void *) * std::max(max_elements_, (size_t) 1));
+        if (linkLists_ == nullptr) {
+            clear();
+            throw std::runtime_error("Not enough memory: loadIndexMapped failed to allocate linklists");
+        }
+        std::vector<tableint> deleted;
+        std::string lookup_location = location + ".lookup";
+        if (!mapLookup(lookup_location, index_stat, deleted)) {
+            buildLookup(upper_offset, deleted);
+            writeLookup(lookup_location, index_stat, deleted);
+            mapLookup(lookup_location, index_stat, deleted);
+        }
+
+        // the upper level links of the elements follow each other, each after its size
+        size_t offset = upper_offset;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            offset += sizeof(unsigned int);
+            linkLists_[i] = element_levels_[i] > 0 ? mapped_index_ + offset : nullptr;
+            offset += size_links_per_element_ * element_levels_[i];
+        }
+        if (offset != mapped_index_size_) {
+            clear();
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+
+        num_deleted_ = deleted.size();
+        if (allow_replace_deleted_)
+            deleted_elements.insert(deleted.begin(), deleted.end());
+#endif
+    }
+
+    // false while level 0 and the upper level links are in a mapped file or in borrowed buffers
+    bool ownsMemory() const {
+        return mapped_index_ == nullptr && !borrowed_memory_;
+    }
+
+    /*
+    * Uses level 0 records and upper level links in buffers the index does not own, e.g. those of an
+    * unpickled index, instead of copying them. level0 holds the cur_element_count records, links the
+    * upper level links of the elements in id order as element_levels_ gives them; both must stay
+    * writable. owner keeps them alive until the index is cleared or copies them, which it does
+    * before it grows: max_elements_ becomes cur_element_count.
+    */
+    void useBorrowedMemory(char *level0, char *links, std::shared_ptr<void> owner) {
+        checkNoReplicas();
+        if (ownsMemory()) {
+            freeMemory(data_level0_memory_, level0_mapped_size_);
+            level0_mapped_size_ = 0;
+            link_arena_.clear();
+        } else {
+            unmapIndex();
+        }
+        data_level0_memory_ = level0;
+        level0_layout_ = level0Layout(LAYOUT_INTERLEAVED, cur_element_count);
+        dropCompressedLinks();
+        size_t offset = 0;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            linkLists_[i] = element_levels_[i] > 0 ? links + offset : nullptr;
+            offset += size_links_per_element_ * element_levels_[i];
+        }
+        max_elements_ = cur_element_count;
+        borrowed_memory_ = owner;
+    }
+
+    /*
+    * Copies a mapped index or one on borrowed memory into memory owned by the index, with room for
+    * max_elements_ elements, and drops the mapping. The labels of the label index move to label_lookup_.
+    */
+    void copyMappedIndex() {
+        if (ownsMemory())
+            return;
+        size_t mapped_size;
+        char *data_level0_memory = allocateMemory(max_elements_ * size_data_per_element_, memory_policy_, mapped_size);
+        if (data_level0_memory == nullptr)
+            throw std::runtime_error("Not enough memory: copyMappedIndex failed to allocate level0");
+        memcpy(data_level0_memory, data_level0_memory_, cur_element_count * size_data_per_element_);
+        std::vector<char *> link_lists(cur_element_count, nullptr);
+        if (!link_arena_.reserve(upperLinksSize(cur_element_count))) {
+            freeMemory(data_level0_memory, mapped_size);
+            throw std::runtime_error("Not enough memory: copyMappedIndex failed to allocate linklists");
+        }
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (element_levels_[i] == 0)
+                continue;
+            size_t size = size_links_per_element_ * element_levels_[i];
+            link_lists[i] = link_arena_.allocate(size);
+            memcpy(link_lists[i], linkLists_[i], size);
+        }
+        label_lookup_.reserve(cur_element_count);
+        for (size_t i = 0; i < label_index_size_; i++) {
+            tableint id = label_index_[i].internal_id;
+            if (getExternalLabel(id) == label_index_[i].label)
+                label_lookup_.emplace(label_index_[i].label, id);
+        }
+        data_level0_memory_ = data_level0_memory;
+        level0_mapped_size_ = mapped_size;
+        memcpy(linkLists_, link_lists.data(), cur_element_count * sizeof(char *));
+        unmapIndex();
+        applyLayout();
+    }
+
+    /*
+    * Renumbers the elements so that elements linked in level 0 get close internal ids, and a search
+    * touches fewer cache lines and pages of level 0. strategy is GRAPH_ORDER_BFS (breadth first from
+    * the entry point), GRAPH_ORDER_RCM (reverse Cuthill-McKee) or GRAPH_ORDER_GORDER (slowest to
+    * compute, usually the best locality). An offline operation, not thread safe with any other;
+    * saveIndex keeps the order.
+    */
+    void reorderGraph(int strategy = GRAPH_ORDER_BFS) {
+        checkLinksNotCompressed();
+        GraphAdjacency graph;
+        graph.offsets.assign(cur_element_count + 1, 0);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            graph.offsets[i + 1] = graph.offsets[i] + getListCount(get_linklist0(i));
+        }
+        graph.links.resize(graph.offsets[cur_element_count]);
+#pragma omp parallel for schedule(static)
+        for (long long i = 0; i < (long long) cur_element_count; i++) {
+            linklistsizeint *ll = get_linklist0(i);
+            memcpy(graph.links.data() + graph.offsets[i], ll + 1, getListCount(ll) * sizeof(tableint));
+        }
+
+        std::vector<tableint> order;
+        if (strategy == GRAPH_ORDER_BFS) {
+            order = bfsOrder(graph, enterpoint_node_);
+        } else if (strategy == GRAPH_ORDER_RCM) {
+            order = rcmOrder(graph);
+        } else if (strategy == GRAPH_ORDER_GORDER) {
+            order = gorderOrder(graph);
+        } else {
+            throw std::runtime_error("Unknown graph order");
+        }
+        permuteElements(order);
+    }
+
+    /*
+    * Gives element order[i] the internal id i. The records, links, levels, labels, deletions and rerank
+    * vectors all move; order must be a permutation of the internal ids.
+    */
+    void permuteElements(const std::vector<tableint> &order) {
+        checkLinksNotCompressed();
+        if (order.size() != cur_element_count)
+            throw std::runtime_error("The order does not have an entry for every element");
+        std::vector<tableint> new_id(cur_element_count, (tableint) -1);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (order[i] >= cur_element_count || new_id[order[i]] != (tableint) -1)
+                throw std::runtime_error("The order is not a permutation of the elements");
+            new_id[order[i]] = i;
+        }
+        checkNoReplicas();
+        copyMappedIndex();
+
+        size_t mapped_size;
+        char *data_level0_memory = allocateMemory(level0Size(level0_layout_.type, max_elements_), memory_policy_, mapped_size, -1, LEVEL0_ALIGNMENT);
+        if (data_level0_memory == nullptr)
+            throw std::runtime_error("Not enough memory: permuteElements failed to allocate level0");
+        std::vector<char *> link_lists(cur_element_count);
+        // every element is moved and its links renamed by one thread, the upper level lists keep their memory
+#pragma omp parallel for schedule(static)
+        for (long long i = 0; i < (long long) cur_element_count; i++) {
+            tableint old_id = order[i];
+            copyElement(data_level0_memory, level0_layout_, i, data_level0_memory_, level0_layout_, old_id);
+            renameLinks(get_linklist0(i, data_level0_memory), new_id);
+            for (int level = 1; level <= element_levels_[old_id]; level++) {
+                renameLinks(get_linklist(old_id, level), new_id);
+            }
+            link_lists[i] = linkLists_[old_id];
+        }
+        freeMemory(data_level0_memory_, level0_mapped_size_);
+        data_level0_memory_ = data_level0_memory;
+        level0_mapped_size_ = mapped_size;
+        memcpy(linkLists_, link_lists.data(), cur_element_count * sizeof(char *));
+
+        std::vector<int> element_levels(element_levels_.begin(), element_levels_.begin() + cur_element_count);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            element_levels_[i] = element_levels[order[i]];
+        }
+        compactLinks();
+        for (auto &entry : label_lookup_) {
+            entry.second = new_id[entry.second];
+        }
+        std::unordered_set<tableint> deleted;
+        for (tableint id : deleted_elements) {
+            deleted.insert(new_id[id]);
+        }
+        deleted_elements.swap(deleted);
+        if (cur_element_count > 0)
+            enterpoint_node_ = new_id[enterpoint_node_];
+
+        // a vector file written by keepRerankVectors is permuted in place, one mapped read-only is copied
+        if (rerank_vectors_) {
+            size_t size = rerank_vectors_->elementSize();
+            std::vector<char> vectors(rerank_vectors_->get(0), rerank_vectors_->get(0) + cur_element_count * size);
+            if (!rerank_vectors_->writable())
+                rerank_vectors_.reset(new VectorStore(max_elements_, size));
+            for (size_t i = 0; i < cur_element_count; i++) {
+                rerank_vectors_->set(i, vectors.data() + order[i] * size);
+            }
+        }
+    }
+
+    /*
+    * Moves the upper level links into one block in id order, e.g. after elements were added by many
+    * threads, whose lists interleave. Not thread safe; a mapped index is left as it is.
+    */
+    void compactLinks() {
+        if (!ownsMemory())
+            return;
+        LinkArena arena;
+        if (!arena.reserve(upperLinksSize(cur_element_count)))
+            throw std::runtime_error("Not enough memory: compactLinks failed to allocate linklists");
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (element_levels_[i] == 0)
+                continue;
+            size_t size = size_links_per_element_ * element_levels_[i];
+            char *links = arena.allocate(size);
+            memcpy(links, linkLists_[i], size);
+            linkLists_[i] = links;
+        }
+        link_arena_.swap(arena);
+    }
+
+    // Zeroed upper level links for an element of level level > 0, nullptr if there is not enough memory
+    char *allocateLinkLists(int level) {
+        return link_arena_.allocate(size_links_per_element_ * level);
+    }
+
+    /*
+    * Sets how level 0 is allocated from now on and moves the current one there: MEMORY_DEFAULT or
+    * MEMORY_HUGE_PAGES, MEMORY_HUGETLB and MEMORY_NUMA_INTERLEAVE combined. Huge pages save the TLB
+    * misses of searches over a large level 0, interleaving spreads it over the memory of all sockets.
+    * Call it before loadIndex, or on a new index, whose level 0 is not touched yet.
+    */
+    void setMemoryPolicy(int policy) {
+        memory_policy_ = policy;
+        if (data_level0_memory_ != nullptr && ownsMemory() && !resizeLevel0(max_elements_, level0_layout_.type))
+            throw std::runtime_error("Not enough memory: setMemoryPolicy failed to allocate level0");
+    }
+
+    int getMemoryPolicy() const {
+        return memory_policy_;
+    }
+
+    /*
+    * Sets the layout of level 0 and moves the elements into it. LAYOUT_INTERLEAVED keeps the links,
+    * the vector and the label of an element in one record, as the index file does. LAYOUT_SPLIT keeps
+    * three arrays: the links, the vectors aligned to 64 bytes (see splitDataStride) and the labels, so
+    * the cache lines a search reads hold no labels, which matters most for short quantized vectors.
+    * Files are written in records whatever the layout; loads, including before loadIndex, use the
+    * layout set. A mapped or borrowed level 0 stays in records until the index copies it.
+    */
+    void setLayout(int layout) {
+        if (layout != LAYOUT_INTERLEAVED && layout != LAYOUT_SPLIT)
+            throw std::runtime_error("Unknown level 0 layout");
+        checkNoReplicas();
+        layout_ = layout;
+        if (data_level0_memory_ != nullptr && ownsMemory())
+            applyLayout();
+    }
+
+    int getLayout() const {
+        return layout_;
+    }
+
+    /*
+    * Compresses the level 0 links of a read-only index: the ids of every list are sorted and coded
+    * apart from level 0, which keeps the list headers in the split layout. LINKS0_STREAMVBYTE codes
+    * the differences of the ids in a byte or two each for most lists, LINKS0_LOCAL16 the ids in two
+    * bytes for an index of at most LINKS0_LOCAL16_MAX_ELEMENTS elements, e.g. a shard. Searches
+    * decode the lists they expand, with SSE4.1 where the CPU has it. Deletions still work; adding,
+    * updating, resizing, reordering, merging and repairing throw until decompressLevel0. Files are
+    * written with plain links.
+    */
+    void compressLevel0(int codec = LINKS0_STREAMVBYTE) {
+        if (codec != LINKS0_STREAMVBYTE && codec != LINKS0_LOCAL16)
+            throw std::runtime_error("Unknown level 0 links codec");
+        if (codec == LINKS0_LOCAL16 && cur_element_count > LINKS0_LOCAL16_MAX_ELEMENTS)
+            throw std::runtime_error("LINKS0_LOCAL16 needs an index of at most 65536 elements");
+        checkNoReplicas();
+        decompressLevel0();
+        copyMappedIndex();
+        SelectLinkCodecKernels();
+
+        std::vector<uint64_t> offsets(cur_element_count + 1);
+        std::vector<uint8_t> codes;
+        std::vector<uint32_t> sorted;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            linklistsizeint *ll = get_linklist0(i);
+            sorted.assign(ll + 1, ll + 1 + getListCount(ll));
+            std::sort(sorted.begin(), sorted.end());
+            offsets[i] = codes.size();
+            if (codec == LINKS0_STREAMVBYTE)
+                EncodeStreamVByte(sorted.data(), sorted.size(), codes);
+            else
+                EncodeLocal16(sorted.data(), sorted.size(), codes);
+        }
+        offsets[cur_element_count] = codes.size();
+        codes.resize(codes.size() + LINKS0_CODE_PADDING, 0);
+        codes.shrink_to_fit();
+
+        if (!resizeLevel0(max_elements_, LAYOUT_COMPRESSED))
+            throw std::runtime_error("Not enough memory: compressLevel0 failed to allocate level0");
+        links0_codes_.swap(codes);
+        links0_offsets_.swap(offsets);
+        links0_codec_ = codec;
+    }
+
+    // Decodes the level 0 links into the layout of setLayout, nothing if they are not compressed
+    void decompressLevel0() {
+        if (links0_codec_ == LINKS0_PLAIN)
+            return;
+        checkNoReplicas();
+        if (!resizeLevel0(max_elements_, layout_))
+            throw std::runtime_error("Not enough memory: decompressLevel0 failed to allocate level0");
+#pragma omp parallel for schedule(static)
+        for (long long i = 0; i < (long long) cur_element_count; i++) {
+            linklistsizeint *ll = get_linklist0(i);
+            size_t count = getListCount(ll);
+            decodeLinks0(i, count, ll + 1);
+            memset(ll + 1 + count, 0, (maxM0_ - count) * sizeof(tableint));
+        }
+        dropCompressedLinks();
+    }
+
+    int getLinks0Codec() const {
+        return links0_codec_;
+    }
+
+    // Bytes of the compressed level 0 links, level 0 itself is get_data_level0_memory_size
+    size_t compressedLinksSize() const {
+        return links0_codes_.size() + links0_offsets_.size() * sizeof(uint64_t);
+    }
+
+    /*
+    * Copies level 0 into the memory of every NUMA node, searched by the threads bindSearchThread binds
+    * to a node. The copies are a snapshot for a read-only index: deletions are seen, updates are not,
+    * and adding elements or changing the layout throws until dropReplicas.
+    */
+    void replicateLevel0() {
+        dropReplicas();
+        if (cur_element_count == 0)
+            return;
+        std::vector<int> nodes = numaNodes();
+        level0_replicas_.assign(*std::max_element(nodes.begin(), nodes.end()) + 1, std::make_pair((char *) nullptr, (size_t) 0));
+        // the split layouts spread the elements over the whole block
+        size_t size = level0_layout_.type == LAYOUT_INTERLEAVED ? cur_element_count * size_data_per_element_ : level0Size(level0_layout_.type, max_elements_);
+        for (int node : nodes) {
+            size_t mapped_size;
+            char *replica = allocateMemory(size, memory_policy_ & ~MEMORY_NUMA_INTERLEAVE, mapped_size, node);
+            if (replica == nullptr) {
+                dropReplicas();
+                throw std::runtime_error("Not enough memory: replicateLevel0 failed to allocate a replica");
+            }
+            memcpy(replica, data_level0_memory_, size);
+            level0_replicas_[node] = std::make_pair(replica, mapped_size);
+        }
+        replicas_generation_ = ++replicaGeneration();
+    }
+
+    // Frees the replicas of level 0, not thread safe with searches
+    void dropReplicas() {
+        for (auto &replica : level0_replicas_) {
+            if (replica.first != nullptr)
+                freeMemory(replica.first, replica.second);
+        }
+        level0_replicas_.clear();
+        replicas_generation_ = 0;
+    }
+
+    /*
+    * Pins the calling thread to the CPUs of a NUMA node, by default the one it runs on, and makes its
+    * searches read the replica of level 0 on that node. Returns the node.
+    */
+    int bindSearchThread(int node = -1) {
+        if (level0_replicas_.empty())
+            throw std::runtime_error("No level 0 replicas, call replicateLevel0 first");
+        if (node < 0)
+            node = currentNumaNode();
+        if ((size_t) node >= level0_replicas_.size() || level0_replicas_[node].first == nullptr)
+            throw std::runtime_error("No level 0 replica on this NUMA node");
+        pinThreadToNode(node);
+        SearchBinding &binding = searchBinding();
+        binding.generation = replicas_generation_;
+        binding.level0 = level0_replicas_[node].first;
+        return node;
+    }
+
+ private:
+#if !defined(_WIN32)
+    static const uint64_t LOOKUP_MAGIC = 0x3150554b4f4f4c48ULL;  // "HLOOKUP1"
+
+    // Header of the lookup file of a mapped index, the index file it was built from is identified by its stat
+    struct LookupHeader {
+        uint64_t magic;
+        uint64_t index_size;
+        uint64_t index_inode;
+        uint64_t index_mtime;
+        uint64_t index_mtime_nsec;
+        uint64_t num_elements;
+        uint64_t num_deleted;
+    };
+
+    static bool mapFile(const std::string &location, char *&data, size_t &size, struct stat &file_stat, bool writable) {
+        int fd = open(location.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        size = file_stat.st_size;
+        // a private writable mapping copies the pages written to, the file stays as it is
+        void *ptr = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+            return false;
+        data = (char *) ptr;
+        return true;
+    }
+
+    static uint64_t mtimeNsec(const struct stat &file_stat) {
+#if defined(__APPLE__)
+        return file_stat.st_mtimespec.tv_nsec;
+#else
+        return file_stat.st_mtim.tv_nsec;
+#endif
+    }
+
+    static size_t lookupAlign(size_t size) {
+        return (size + 7) & ~(size_t) 7;
+    }
+
+    // Levels, deleted ids and label index from the lookup file if it was built from the index file
+    bool mapLookup(const std::string &location, const struct stat &index_stat, std::vector<tableint> &deleted) {
+        struct stat lookup_stat;
+        char *data = nullptr;
+        size_t size = 0;
+        if (!mapFile(location, data, size, lookup_stat, false))
+            return false;
+        LookupHeader header;
+        size_t levels_size = lookupAlign(cur_element_count * sizeof(int));
+        bool valid = size >= sizeof(header);
+        if (valid) {
+            memcpy(&header, data, sizeof(header));
+            valid = header.magic == LOOKUP_MAGIC && header.index_size == (uint64_t) index_stat.st_size &&
+                    header.index_inode == (uint64_t) index_stat.st_ino &&
+                    header.index_mtime == (uint64_t) index_stat.st_mtime && header.index_mtime_nsec == mtimeNsec(index_stat) &&
+                    header.num_elements == cur_element_count &&
+                    size == sizeof(header) + levels_size + lookupAlign(header.num_deleted * sizeof(tableint)) +
+                            cur_element_count * sizeof(LabelIndexEntry);
+        }
+        if (!valid) {
+            munmap(data, size);
+            return false;
+        }
+        const char *levels = data + sizeof(header);
+        const char *deleted_ids = levels + levels_size;
+        memcpy(element_levels_.data(), levels, cur_element_count * sizeof(int));
+        deleted.assign((const tableint *) deleted_ids, (const tableint *) deleted_ids + header.num_deleted);
+        label_index_storage_.clear();
+        label_index_storage_.shrink_to_fit();
+        label_index_ = (const LabelIndexEntry *) (deleted_ids + lookupAlign(header.num_deleted * sizeof(tableint)));
+        label_index_size_ = cur_element_count;
+        mapped_lookup_ = data;
+        mapped_lookup_size_ = size;
+        return true;
+    }
+
+    // Levels, deleted ids and label index read from the mapped index, the label index in memory
+    void buildLookup(size_t upper_offset, std::vector<tableint> &deleted) {
+        size_t offset = upper_offset;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            unsigned int link_list_size;
+            if (offset + sizeof(link_list_size) > mapped_index_size_) {
+                clear();
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            }
+            memcpy(&link_list_size, mapped_index_ + offset, sizeof(link_list_size));
+            if (link_list_size % size_links_per_element_ != 0) {
+                clear();
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            }
+            element_levels_[i] = link_list_size / size_links_per_element_;
+            offset += sizeof(link_list_size) + link_list_size;
+        }
+
+        deleted.clear();
+        label_index_storage_.resize(cur_element_count);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            label_index_storage_[i].label = getExternalLabel(i);
+            label_index_storage_[i].internal_id = i;
+            if (isMarkedDeleted(i))
+                deleted.push_back(i);
+        }
+        std::sort(label_index_storage_.begin(), label_index_storage_.end());
+        label_index_ = label_index_storage_.data();
+        label_index_size_ = label_index_storage_.size();
+    }
+
+    // Writes the lookup file, if the directory is writable; renamed in place so other processes never see a partial file
+    void writeLookup(const std::string &location, const struct stat &index_stat, const std::vector<tableint> &deleted) const {
+        LookupHeader header = {LOOKUP_MAGIC, (uint64_t) index_stat.st_size, (uint64_t) index_stat.st_ino,
+                               (uint64_t) index_stat.st_mtime, mtimeNsec(index_stat), cur_element_count, deleted.size()};
+        std::string temp_location = location + "." + std::to_string(getpid());
+        std::ofstream output(temp_location, std::ios::binary);
+        if (!output.is_open())
+            return;
+        const char padding[8] = {0};
+        output.write((const char *) &header, sizeof(header));
+        output.write((const char *) element_levels_.data(), cur_element_count * sizeof(int));
+        output.write(padding, lookupAlign(cur_element_count * sizeof(int)) - cur_element_count * sizeof(int));
+        output.write((const char *) deleted.data(), deleted.size() * sizeof(tableint));
+        output.write(padding, lookupAlign(deleted.size() * sizeof(tableint)) - deleted.size() * sizeof(tableint));
+        output.write((const char *) label_index_, label_index_size_ * sizeof(LabelIndexEntry));
+        output.close();
+        if (!output || rename(temp_location.c_str(), location.c_str()) != 0)
+            remove(temp_location.c_str());
+    }
+
+    // Maps a version 2 file, level 0, the links and the labels are used in place and not checked against their checksums
+    void mapIndexSections(const std::string &location, const std::vector<IndexFileSection> &sections, SpaceInterface<dist_t> *s) {
+        if (findIndexSection(sections, INDEX_SECTION_LINKS_PACKED) != nullptr)
+            throw std::runtime_error("An index file with packed links can not be mapped, load it with loadIndex");
+        struct stat index_stat;
+        if (!mapFile(location, mapped_index_, mapped_index_size_, index_stat, true))
+            throw std::runtime_error("Cannot map the index file");
+        try {
+            checkIndexSections(sections, mapped_index_size_);
+            auto section_data = [&](const IndexFileSection &section, bool check) {
+                if (check)
+                    checkIndexSectionData(section, mapped_index_ + section.offset);
+                return (const char *) mapped_index_ + section.offset;
+            };
+            const IndexFileSection &params = requireIndexSection(sections, INDEX_SECTION_PARAMS);
+            readIndexParams(section_data(params, true), params.size, s);
+            max_elements_ = cur_element_count;
+            const IndexFileSection &level0 = requireIndexSection(sections, INDEX_SECTION_LEVEL0);
+            const IndexFileSection &levels = requireIndexSection(sections, INDEX_SECTION_LEVELS);
+            const IndexFileSection &links = requireIndexSection(sections, INDEX_SECTION_LINKS);
+            const IndexFileSection &labels = requireIndexSection(sections, INDEX_SECTION_LABELS);
+            const IndexFileSection &deleted = requireIndexSection(sections, INDEX_SECTION_DELETED);
+            if (level0.size != cur_element_count * size_data_per_element_ || levels.size != cur_element_count * sizeof(int))
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            data_level0_memory_ = mapped_index_ + level0.offset;
+
+            std::vector<std::mutex>(max_elements_).swap(link_list_locks_);
+            std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+            visited_list_pool_.reset(new VisitedListPool(1, max_elements_, thread_local_visited_lists_));
+            revSize_ = 1.0 / mult_;
+            ef_ = 10;
+
+            element_levels_ = std::vector<int>(max_elements_);
+            memcpy(element_levels_.data(), section_data(levels, true), levels.size);
+            linkLists_ = (char **) malloc(sizeof(void *) * std::max(max_elements_, (size_t) 1));
+            if (linkLists_ == nullptr)
+                throw std::runtime_error("Not enough memory: loadIndexMapped failed to allocate linklists");
+            size_t offset = 0;
+            for (size_t i = 0; i < cur_element_count; i++) {
+                if (element_levels_[i] < 0 || element_levels_[i] > maxlevel_)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                linkLists_[i] = element_levels_[i] > 0 ? mapped_index_ + links.offset + offset : nullptr;
+                offset += size_links_per_element_ * element_levels_[i];
+            }
+            if (offset != links.size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+            label_index_ = (const LabelIndexEntry *) section_data(labels, false);
+            label_index_size_ = checkLabelSection((const char *) label_index_, labels.size);
+            useDeletedSection(section_data(deleted, true), deleted.size);
+
+            const IndexFileSection *space = findIndexSection(sections, INDEX_SECTION_SPACE);
+            const IndexFileSection *residuals = findIndexSection(sections, INDEX_SECTION_RESIDUALS);
+            useAuxiliarySections(space ? section_data(*space, true) : nullptr, space ? space->size : 0,
+                                 residuals ? section_data(*residuals, true) : nullptr, residuals ? residuals->size : 0);
+        } catch (...) {
+            clear();
+            deleted_elements.clear();
+            num_deleted_ = 0;
+            throw;
+        }
+    }
+#endif
+
+    static uint32_t spaceKind(SpaceInterface<dist_t> *s) {
+        if (dynamic_cast<PqSpace *>(s) != nullptr)
+            return INDEX_SPACE_PQ;
+        if (dynamic_cast<SqSpace *>(s) != nullptr)
+            return INDEX_SPACE_SQ;
+        if (dynamic_cast<L2SpaceInt8 *>(s) != nullptr)
+            return INDEX_SPACE_L2_INT8;
+        if (dynamic_cast<SpaceInt8 *>(s) != nullptr)
+            return INDEX_SPACE_IP_INT8;
+        if (dynamic_cast<L2Space *>(s) != nullptr)
+            return INDEX_SPACE_L2;
+        if (dynamic_cast<InnerProductSpace *>(s) != nullptr)
+            return INDEX_SPACE_IP;
+        return INDEX_SPACE_OTHER;
+    }
+
+    // The header of a version 1 file
+    void writeIndexHeader(std::ostream &output) const {
+        writeBinaryPOD(output, offsetLevel0_);
+        writeBinaryPOD(output, max_elements_);
+        writeBinaryPOD(output, cur_element_count);
+        writeBinaryPOD(output, size_data_per_element_);
+        writeBinaryPOD(output, label_offset_);
+        writeBinaryPOD(output, offsetData_);
+        writeBinaryPOD(output, maxlevel_);
+        writeBinaryPOD(output, enterpoint_node_);
+        writeBinaryPOD(output, maxM_);
+        writeBinaryPOD(output, maxM0_);
+        writeBinaryPOD(output, M_);
+        writeBinaryPOD(output, mult_);
+        writeBinaryPOD(output, ef_construction_);
+    }
+
+    void writeIndexParams(std::ostream &output) const {
+        writeIndexHeader(output);
+        writeBinaryPOD(output, data_size_);
+        writeBinaryPOD(output, scale_);
+        writeBinaryPOD(output, scale2_);
+        uint32_t space_kind = spaceKind(space_);
+        writeBinaryPOD(output, space_kind);  // last, see readIndexSpaceKind
+    }
+
+    // Parameters section of a version 2 file, s must be of the kind and the data size the index was saved with
+    void readIndexParams(const char *data, size_t size, SpaceInterface<dist_t> *s) {
+        std::istringstream input(std::string(data, size));
+        readIndexHeader(input);
+        size_t data_size;
+        uint32_t space_kind;
+        readBinaryPOD(input, data_size);
+        readBinaryPOD(input, scale_);
+        readBinaryPOD(input, scale2_);
+        readBinaryPOD(input, space_kind);
+        if (!input) {
+            cur_element_count = 0;
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        if (data_size != s->get_data_size() || (space_kind != INDEX_SPACE_OTHER && space_kind != spaceKind(s))) {
+            cur_element_count = 0;
+            throw std::runtime_error("The index file was saved with another space");
+        }
+        space_ = s;
+        data_size_ = data_size;
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        code_fstdistfunc_ = s->get_code_dist_func();
+        code_dist_func_param_ = s->get_code_dist_func_param();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+    }
+
+    std::vector<char> readIndexSection(std::istream &input, const IndexFileSection &section) const {
+        std::vector<char> data(section.size);
+        readIndexSection(input, section, data.data());
+        return data;
+    }
+
+    void readIndexSection(std::istream &input, const IndexFileSection &section, char *data) const {
+        input.seekg(section.offset, input.beg);
+        input.read(data, section.size);
+        if (!input)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        checkIndexSectionData(section, data);
+    }
+
+    // The links section, read into the lists of the elements with the checksum over all of them
+    void readLinks(std::istream &input, const IndexFileSection &links) {
+        IndexChecksum checksum;
+        size_t links_size = 0;
+        if (!link_arena_.reserve(upperLinksSize(cur_element_count)))
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
+        input.seekg(links.offset, input.beg);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (element_levels_[i] == 0)
+                continue;
+            size_t size = size_links_per_element_ * element_levels_[i];
+            links_size += size;
+            if (links_size > links.size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            linkLists_[i] = link_arena_.allocate(size);
+            if (linkLists_[i] == nullptr)
+                throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+            input.read(linkLists_[i], size);
+            checksum.update(linkLists_[i], size);
+        }
+        if (!input || links_size != links.size || checksum.digest() != links.checksum)
+            throw std::runtime_error("Index seems to be corrupted: wrong checksum of section " + std::to_string(links.id));
+    }
+
+    // The records without the neighbour ids, read in chunks and spread to level 0 with the slots of the ids cleared
+    void readLevel0Data(std::istream &input, const IndexFileSection &level0) {
+        size_t id_slots_size = maxM0_ * sizeof(tableint);
+        size_t stride = size_data_per_element_ - id_slots_size;
+        size_t chunk_elements = std::max(INDEX_CHECKSUM_BLOCK / stride, (size_t) 1);
+        std::vector<char> buffer(chunk_elements * stride);
+        IndexChecksum checksum;
+        input.seekg(level0.offset, input.beg);
+        for (size_t start = 0; start < cur_element_count; start += chunk_elements) {
+            size_t n = std::min(chunk_elements, cur_element_count - start);
+            input.read(buffer.data(), n * stride);
+            if (!input)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            checksum.update(buffer.data(), n * stride);
+            for (size_t i = 0; i < n; i++) {
+                char *record = data_level0_memory_ + (start + i) * size_data_per_element_ + offsetLevel0_;
+                const char *stored = buffer.data() + i * stride;
+                memcpy(record, stored, sizeof(linklistsizeint));
+                memset(record + sizeof(linklistsizeint), 0, id_slots_size);
+                memcpy(record + sizeof(linklistsizeint) + id_slots_size, stored + sizeof(linklistsizeint), stride - sizeof(linklistsizeint));
+            }
+        }
+        if (checksum.digest() != level0.checksum)
+            throw std::runtime_error("Index seems to be corrupted: wrong checksum of section " + std::to_string(level0.id));
+    }
+
+    // Unpacks the neighbour ids of all levels, the chunks on all threads
+    void readPackedLinks(std::istream &input, const IndexFileSection &packed) {
+        std::vector<char> data = readIndexSection(input, packed);
+        size_t num_chunks = (cur_element_count + INDEX_PACKED_CHUNK - 1) / INDEX_PACKED_CHUNK;
+        size_t directory_size = (num_chunks + 1) * sizeof(uint64_t);
+        if (data.size() < directory_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        std::vector<uint64_t> directory(num_chunks + 1);
+        memcpy(directory.data(), data.data(), directory_size);
+        if (directory[0] != num_chunks)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        const uint8_t *chunks = (const uint8_t *) data.data() + directory_size;
+        size_t chunks_size = data.size() - directory_size;
+        // in id order, not in the order the threads get to them
+        if (!allocateUpperLinks(cur_element_count))
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
+
+        std::atomic<bool> corrupted(false);
+#pragma omp parallel for schedule(dynamic)
+        for (long long c = 0; c < (long long) num_chunks; c++) {
+            uint64_t begin = c == 0 ? 0 : directory[c];
+            uint64_t end = directory[c + 1];
+            if (begin > end || end > chunks_size) {
+                corrupted = true;
+                continue;
+            }
+            const uint8_t *p = chunks + begin;
+            const uint8_t *chunk_end = chunks + end;
+            size_t last = std::min(cur_element_count.load(), (size_t) (c + 1) * INDEX_PACKED_CHUNK);
+            for (size_t i = c * INDEX_PACKED_CHUNK; i < last && !corrupted; i++) {
+                linklistsizeint *ll = get_linklist0(i);
+                size_t count = getListCount(ll);
+                if (count > maxM0_ || !unpackIndexLinks(p, chunk_end, count, cur_element_count, (uint32_t *) (ll + 1))) {
+                    corrupted = true;
+                    break;
+                }
+                for (int level = 1; level <= element_levels_[i]; level++) {
+                    ll = get_linklist(i, level);
+                    uint32_t count;
+                    if (!readVarint(p, chunk_end, count) || count > maxM_ ||
+                        !unpackIndexLinks(p, chunk_end, count, cur_element_count, (uint32_t *) (ll + 1))) {
+                        corrupted = true;
+                        break;
+                    }
+                    setListCount(ll, count);
+                }
+            }
+            if (p != chunk_end)
+                corrupted = true;
+        }
+        if (corrupted)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+    // Number of entries of the labels section, whose ids must be elements of the index
+    size_t checkLabelSection(const char *data, size_t size) const {
+        if (size % sizeof(LabelIndexEntry) != 0 || size / sizeof(LabelIndexEntry) > cur_element_count)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        size_t num_labels = size / sizeof(LabelIndexEntry);
+        const LabelIndexEntry *entries = (const LabelIndexEntry *) data;
+        for (size_t i = 0; i < num_labels; i++) {
+            if (entries[i].internal_id >= cur_element_count)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        return num_labels;
+    }
+
+    void useDeletedSection(const char *data, size_t size) {
+        if (size % sizeof(tableint) != 0)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        const tableint *deleted = (const tableint *) data;
+        num_deleted_ = size / sizeof(tableint);
+        for (size_t i = 0; i < num_deleted_; i++) {
+            if (deleted[i] >= cur_element_count || !isMarkedDeleted(deleted[i]))
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            if (allow_replace_deleted_)
+                deleted_elements.insert(deleted[i]);
+        }
+    }
+
+    // Restores the state of the space and the PQ residuals
+    void useAuxiliarySections(const char *space_state, size_t space_state_size, const char *residuals, size_t residuals_size) {
+        if (space_state_size > 0) {
+            std::istringstream input(std::string(space_state, space_state_size));
+            if (PqSpace *pq_space = dynamic_cast<PqSpace *>(space_))
+                pq_space->loadCodebooks(input);
+            else if (SqSpace *sq_space = dynamic_cast<SqSpace *>(space_))
+                sq_space->loadRanges(input);
+            else if (Int8SpaceBase *int8_space = dynamic_cast<Int8SpaceBase *>(space_))
+                int8_space->loadScale(input);
+        }
+        if (residuals_size % sizeof(float) != 0)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        pq_residuals_.assign((const float *) residuals, (const float *) residuals + residuals_size / sizeof(float));
+        useInt8Scale();
+    }
+
+    // PQ codebooks, SQ ranges or int8 scale of the space, nothing for other spaces or untrained ones
+    void saveSpaceState(std::ostream &output) const {
+        if (PqSpace *pq_space = dynamic_cast<PqSpace *>(space_)) {
+            if (pq_space->hasCodebooks())
+                pq_space->saveCodebooks(output);
+        } else if (SqSpace *sq_space = dynamic_cast<SqSpace *>(space_)) {
+            if (sq_space->isTrained())
+                sq_space->saveRanges(output);
+        } else if (Int8SpaceBase *int8_space = dynamic_cast<Int8SpaceBase *>(space_)) {
+            int8_space->saveScale(output);
+        }
+    }
+
+    // Bytes of the upper level links of elements 0 .. count - 1
+    size_t upperLinksSize(size_t count) const {
+        size_t size = 0;
+        for (size_t i = 0; i < count; i++) size += size_links_per_element_ * element_levels_[i];
+        return size;
+    }
+
+    // Zeroed upper level links for elements 0 .. count - 1 of element_levels_, in one block in id order
+    bool allocateUpperLinks(size_t count) {
+        char *links = link_arena_.allocate(upperLinksSize(count));
+        if (links == nullptr)
+            return false;
+        for (size_t i = 0; i < count; i++) {
+            linkLists_[i] = element_levels_[i] > 0 ? links : nullptr;
+            links += size_links_per_element_ * element_levels_[i];
+        }
+        return true;
+    }
+
+    // Level 0 of capacity elements in a layout, the records of the index file for LAYOUT_INTERLEAVED
+    Level0Layout level0Layout(int type, size_t capacity) const {
+        Level0Layout layout;
+        layout.type = type;
+        if (type == LAYOUT_INTERLEAVED) {
+            layout.links0_region = offsetLevel0_;
+            layout.data_region = offsetData_;
+            layout.labels_region = label_offset_;
+            layout.links0_stride = layout.data_stride = layout.labels_stride = size_data_per_element_;
+        } else {
+            layout.links0_stride = type == LAYOUT_COMPRESSED ? sizeof(linklistsizeint) : size_links_level0_;
+            layout.data_region = alignLevel0(capacity * layout.links0_stride);
+            layout.data_stride = splitDataStride(data_size_);
+            layout.labels_region = alignLevel0(layout.data_region + capacity * layout.data_stride);
+            layout.labels_stride = sizeof(labeltype);
+        }
+        return layout;
+    }
+
+    size_t level0Size(int type, size_t capacity) const {
+        if (type == LAYOUT_INTERLEAVED)
+            return capacity * size_data_per_element_;
+        return level0Layout(type, capacity).labels_region + capacity * sizeof(labeltype);
+    }
+
+    void copyElement(char *to, const Level0Layout &to_layout, tableint to_id,
+                     const char *from, const Level0Layout &from_layout, tableint from_id) const {
+        // the compressed layout keeps the list header alone
+        bool header = to_layout.type == LAYOUT_COMPRESSED || from_layout.type == LAYOUT_COMPRESSED;
+        memcpy(to + to_layout.links0_region + to_id * to_layout.links0_stride,
+               from + from_layout.links0_region + from_id * from_layout.links0_stride,
+               header ? sizeof(linklistsizeint) : size_links_level0_);
+        memcpy(to + to_layout.data_region + to_id * to_layout.data_stride,
+               from + from_layout.data_region + from_id * from_layout.data_stride, data_size_);
+        memcpy(to + to_layout.labels_region + to_id * to_layout.labels_stride,
+               from + from_layout.labels_region + from_id * from_layout.labels_stride, sizeof(labeltype));
+    }
+
+    // Bytes pos .. pos + n - 1 of the record of element i in the index file
+    void copyRecordBytes(tableint i, size_t pos, size_t n, char *out) const {
+        if (level0_layout_.type == LAYOUT_INTERLEAVED) {
+            memcpy(out, data_level0_memory_ + i * size_data_per_element_ + pos, n);
+            return;
+        }
+        std::vector<linklistsizeint> links;
+        const char *fields[3] = {(const char *) level0List(i, links), getDataByInternalId(i), (const char *) getExternalLabeLp(i)};
+        size_t starts[4] = {offsetLevel0_, offsetData_, label_offset_, size_data_per_element_};
+        for (int f = 0; f < 3 && n > 0; f++) {
+            if (pos >= starts[f + 1])
+                continue;
+            size_t m = std::min(n, starts[f + 1] - pos);
+            memcpy(out, fields[f] + pos - starts[f], m);
+            out += m;
+            pos += m;
+            n -= m;
+        }
+    }
+
+    // Bytes offset .. offset + size - 1 of the records of all elements, for the writers of saveIndex
+    void fillLevel0Records(size_t offset, size_t size, char *out) const {
+        if (level0_layout_.type == LAYOUT_INTERLEAVED) {
+            memcpy(out, data_level0_memory_ + offset, size);
+            return;
+        }
+        while (size > 0) {
+            size_t pos = offset % size_data_per_element_;
+            size_t n = std::min(size, size_data_per_element_ - pos);
+            copyRecordBytes(offset / size_data_per_element_, pos, n, out);
+            offset += n;
+            out += n;
+            size -= n;
+        }
+    }
+
+    /*
+    * Reallocates level 0 for capacity elements in a layout as the memory policy says, keeping the
+    * elements; false without enough memory.
+    */
+    bool resizeLevel0(size_t capacity, int type) {
+        size_t size = level0Size(type, capacity);
+        bool records = type == LAYOUT_INTERLEAVED && level0_layout_.type == LAYOUT_INTERLEAVED;
+        if (records && level0_mapped_size_ == 0 && memory_policy_ == MEMORY_DEFAULT) {
+            char *data_level0_memory = (char *) realloc(data_level0_memory_, size);
+            if (data_level0_memory == nullptr)
+                return false;
+            data_level0_memory_ = data_level0_memory;
+        } else {
+            size_t mapped_size;
+            char *data_level0_memory = allocateMemory(size, memory_policy_, mapped_size, -1, LEVEL0_ALIGNMENT);
+            if (data_level0_memory == nullptr)
+                return false;
+            if (records) {
+                memcpy(data_level0_memory, data_level0_memory_, std::min(size, cur_element_count * size_data_per_element_));
+            } else {
+                Level0Layout layout = level0Layout(type, capacity);
+#pragma omp parallel for schedule(static)
+                for (long long i = 0; i < (long long) cur_element_count; i++) {
+                    copyElement(data_level0_memory, layout, i, data_level0_memory_, level0_layout_, i);
+                }
+            }
+            freeMemory(data_level0_memory_, level0_mapped_size_);
+            data_level0_memory_ = data_level0_memory;
+            level0_mapped_size_ = mapped_size;
+        }
+        level0_layout_ = level0Layout(type, capacity);
+        data_level0_memory_size_ = size;
+        return true;
+    }
+
+    // Moves level 0 into the layout of setLayout, e.g. after it was loaded in records
+    void applyLayout() {
+        if (links0_codec_ != LINKS0_PLAIN)
+            return;
+        if (level0_layout_.type != layout_ && !resizeLevel0(max_elements_, layout_))
+            throw std::runtime_error("Not enough memory: failed to allocate level0 in its layout");
+    }
+
+    void checkNoReplicas() const {
+        if (!level0_replicas_.empty())
+            throw std::runtime_error("The index has level 0 replicas, call dropReplicas first");
+    }
+
+    void checkLinksNotCompressed() const {
+        if (links0_codec_ != LINKS0_PLAIN)
+            throw std::runtime_error("The level 0 links are compressed, call decompressLevel0 first");
+    }
+
+    void dropCompressedLinks() {
+        links0_codec_ = LINKS0_PLAIN;
+        std::vector<uint8_t>().swap(links0_codes_);
+        std::vector<uint64_t>().swap(links0_offsets_);
+    }
+
+    // The ids of the level 0 list of a compressed index, getListCount of its header many
+    void decodeLinks0(tableint id, size_t count, tableint *ids) const {
+        const uint8_t *codes = links0_codes_.data() + links0_offsets_[id];
+        if (links0_codec_ == LINKS0_STREAMVBYTE)
+            DecodeStreamVByteExt(codes, count, ids);
+        else
+            DecodeLocal16Ext(codes, count, ids);
+    }
+
+    /*
+    * The level 0 list of a compressed index as get_linklist0 gives it, header first, decoded into
+    * buffer of maxM0_ + 2 entries. The entry after the last id is 0, the searches prefetch it.
+    */
+    linklistsizeint *decodeLinkList0(tableint id, const char *level0, linklistsizeint *buffer) const {
+        linklistsizeint header = *get_linklist0(id, (char *) level0);
+        size_t count = getListCount(&header);
+        buffer[0] = header;
+        decodeLinks0(id, count, buffer + 1);
+        buffer[count + 1] = 0;
+        return buffer;
+    }
+
+    // The level 0 list of element id, decoded into buffer with all maxM0_ slots if the links are compressed
+    linklistsizeint *level0List(tableint id, std::vector<linklistsizeint> &buffer) const {
+        if (links0_codec_ == LINKS0_PLAIN)
+            return get_linklist0(id);
+        buffer.assign(maxM0_ + 2, 0);
+        return decodeLinkList0(id, data_level0_memory_, buffer.data());
+    }
+
+    // Replicas a thread searches, valid while generation is the replicas_generation_ of the index
+    struct SearchBinding {
+        uint64_t generation;
+        char *level0;
+    };
+
+    static SearchBinding &searchBinding() {
+        static thread_local SearchBinding binding = {0, nullptr};
+        return binding;
+    }
+
+    // Unique over all indexes, so a binding never matches a later index at the same address
+    static std::atomic<uint64_t> &replicaGeneration() {
+        static std::atomic<uint64_t> generation{0};
+        return generation;
+    }
+
+    // Level 0 searched by the calling thread: the replica of its node after bindSearchThread, else level 0 itself
+    char *searchLevel0() const {
+        const SearchBinding &binding = searchBinding();
+        return binding.generation != 0 && binding.generation == replicas_generation_ ? binding.level0 : data_level0_memory_;
+    }
+
+    void renameLinks(linklistsizeint *ll, const std::vector<tableint> &new_id) {
+        tableint *links = (tableint *) (ll + 1);
+        size_t size = getListCount(ll);
+        for (size_t j = 0; j < size; j++) {
+            links[j] = new_id[links[j]];
+        }
+    }
+
+    void unmapIndex() {
+#if !defined(_WIN32)
+        if (mapped_index_ != nullptr)
+            munmap(mapped_index_, mapped_index_size_);
+        if (mapped_lookup_ != nullptr)
+            munmap(mapped_lookup_, mapped_lookup_size_);
+#endif
+        mapped_index_ = nullptr;
+        mapped_index_size_ = 0;
+        mapped_lookup_ = nullptr;
+        mapped_lookup_size_ = 0;
+        borrowed_memory_.reset();
+        label_index_ = nullptr;
+        label_index_size_ = 0;
+        std::vector<LabelIndexEntry>().swap(label_index_storage_);
+    }
+
+ public:
+
+    int getElementLevel(tableint internal_id) {
+        return element_levels_[internal_id];
+    }
+
+    void getExternalNeighbours(tableint internal_id, std::vector<labeltype>& external_neighbours) const {
+        std::vector<linklistsizeint> links0;
+        linklistsizeint *ll_cur = level0List(internal_id, links0);
+        tableint *data = (tableint *) (ll_cur + 1);
+
+        for (int i = 0; i < *ll_cur; i++) {
+            tableint internal_id_neighbour = *(data+i);
+
+            labeltype external_id = getExternalLabel(internal_id_neighbour);
+            external_neighbours.push_back(external_id);
+        }
+    }
+
+    void countOutDegrees(std::vector<std::vector<linklistsizeint>>& out_degrees) {
+        checkLinksNotCompressed();
+        out_degrees.resize(cur_element_count);
+        long long num_elements = cur_element_count;
+#pragma omp parallel for schedule(dynamic, 1024)
+        for (long long i = 0; i < num_elements; i++) {
+            out_degrees[i].resize(element_levels_[i]+1);
+            for (int level = 0; level <= element_levels_[i]; level++) {
+                out_degrees[i][level] = getListCount(get_linklist_at_level(i, level));
+            }
+        }
+    }
+
+    void countInDegrees(std::vector<std::vector<linklistsizeint>>& in_degrees) {
+        checkLinksNotCompressed();
+        in_degrees.resize(cur_element_count);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            in_degrees[i].assign(element_levels_[i]+1, 0);
+        }
+
+        long long num_elements = cur_element_count;
+#pragma omp parallel for schedule(dynamic, 1024)
+        for (long long i = 0; i < num_elements; i++) {
+            for (int level = 0; level <= element_levels_[i]; level++) {
+                linklistsizeint *ll_cur = get_linklist_at_level(i, level);
+                size_t size = getListCount(ll_cur);
+                tableint *data = (tableint *) (ll_cur + 1);
+                for (size_t j = 0; j < size; j++) {
+#pragma omp atomic
+                    in_degrees[data[j]][level]++;
+                }
+            }
+        }
+    }
+
+    // In-degrees at a single level, 0 for the elements below it
+    void countInDegrees(std::vector<linklistsizeint>& in_degrees, int level) {
+        checkLinksNotCompressed();
+        in_degrees.assign(cur_element_count, 0);
+        long long num_elements = cur_element_count;
+#pragma omp parallel for schedule(dynamic, 1024)
+        for (long long i = 0; i < num_elements; i++) {
+            if (element_levels_[i] < level) continue;
+            linklistsizeint *ll_cur = get_linklist_at_level(i, level);
+            size_t size = getListCount(ll_cur);
+            tableint *data = (tableint *) (ll_cur + 1);
+            for (size_t j = 0; j < size; j++) {
+#pragma omp atomic
+                in_degrees[data[j]]++;
+            }
+        }
+    }
+
+    /*
+    * Links the elements a search cannot reach, e.g. after mergeIndex. At every level a BFS from the
+    * entry point finds them, and each one is linked from the closest reachable element that can
+    * take it: one with a free slot, or else one that drops its farthest link to an element with
+    * other inbound links. Dropped links can cut off elements in turn, so the passes are repeated
+    * until everything is reachable or max_passes is used up. Returns the number of links added.
+    */
+    size_t repairConnectivity(size_t max_passes = 8) {
+        checkLinksNotCompressed();
+        size_t repaired = 0;
+        if (cur_element_count == 0) return repaired;
+
+        std::vector<linklistsizeint> in_degrees;
+        std::vector<bool> reachable;
+        std::vector<tableint> queue;
+        for (int level = maxlevel_; level >= 0; level--) {
+            countInDegrees(in_degrees, level);
+            for (size_t pass = 0; pass < max_passes; pass++) {
+                reachable.assign(cur_element_count, false);
+                markReachable(enterpoint_node_, level, reachable, queue);
+                size_t unreachable = 0;
+                size_t linked = 0;
+                for (tableint id = 0; id < cur_element_count; id++) {
+                    if (element_levels_[id] < level || reachable[id]) continue;
+                    unreachable++;
+                    if (linkUnreachable(id, level, reachable, in_degrees)) {
+                        linked++;
+                        markReachable(id, level, reachable, queue);
+                    }
+                }
+                repaired += linked;
+                if (unreachable == 0 || linked == 0) break;
+            }
+        }
+        return repaired;
+    }
+
+    // Marks the elements reachable from start at level by a BFS over the links
+    void markReachable(tableint start, int level, std::vector<bool> &reachable, std::vector<tableint> &queue) const {
+        queue.clear();
+        queue.push_back(start);
+        reachable[start] = true;
+        for (size_t head = 0; head < queue.size(); head++) {
+            linklistsizeint *ll_cur = get_linklist_at_level(queue[head], level);
+            size_t size = getListCount(ll_cur);
+            tableint *data = (tableint *) (ll_cur + 1);
+            for (size_t j = 0; j < size; j++) {
+                if (reachable[data[j]]) continue;
+                reachable[data[j]] = true;
+                queue.push_back(data[j]);
+            }
+        }
+    }
+
+    // Adds a link to id at level from a reachable element, see repairConnectivity
+    bool linkUnreachable(tableint id, int level, const std::vector<bool> &reachable, std::vector<linklistsizeint> &in_degrees) {
+        const char *data_point = getDataByInternalId(id);
+        // its own reachable links first, the reachable elements closest to it otherwise
+        std::vector<std::pair<dist_t, tableint>> candidates;
+        for (tableint link : getConnectionsWithLock(id, level)) {
+            if (reachable[link])
+                candidates.emplace_back(code_fstdistfunc_(data_point, getDataByInternalId(link), code_dist_func_param_, scale2_), link);
+        }
+        if (candidates.empty()) {
+            tableint currObj = enterpoint_node_;
+            for (int l = maxlevel_; l >= level; l--) {
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates =
+                        searchBaseLayer(currObj, data_point, l, l > level ? 1 : 0);
+                while (!top_candidates.empty()) {
+                    std::pair<dist_t, tableint> candidate = top_candidates.top();
+                    top_candidates.pop();
+                    if (l == level && candidate.second != id && reachable[candidate.second])
+                        candidates.push_back(candidate);
+                    if (top_candidates.empty()) currObj = candidate.second;
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        size_t Mcurmax = level ? maxM_ : maxM0_;
+        // a link farther than id is dropped if possible, any link otherwise
+        for (int pass = 0; pass < 2; pass++) {
+            for (const std::pair<dist_t, tableint> &candidate : candidates) {
+                linklistsizeint *ll_cur = get_linklist_at_level(candidate.second, level);
+                size_t size = getListCount(ll_cur);
+                tableint *data = (tableint *) (ll_cur + 1);
+                if (size < Mcurmax) {
+                    data[size] = id;
+                    setListCount(ll_cur, size + 1);
+                    in_degrees[id]++;
+                    return true;
+                }
+                int replaced = -1;
+                dist_t farthest = pass == 0 ? candidate.first : std::numeric_limits<dist_t>::lowest();
+                for (size_t j = 0; j < size; j++) {
+                    if (in_degrees[data[j]] <= 1) continue;
+                    dist_t dist = code_fstdistfunc_(getDataByInternalId(candidate.second), getDataByInternalId(data[j]),
+                                                    code_dist_func_param_, scale2_);
+                    if (dist > farthest) {
+                        farthest = dist;
+                        replaced = j;
+                    }
+                }
+                if (replaced >= 0) {
+                    in_degrees[data[replaced]]--;
+                    data[replaced] = id;
+                    in_degrees[id]++;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /*
+    * Merges shard indexes built with the same space into this empty index. Elements are numbered
+    * shard by shard; an element whose label is in several shards gets the union of its copies'
+    * links, cut down by mergeSelectNeighbors. Apart from the index itself the merge only keeps a
+    * flat id map per shard and the source copy of every element; vectors and links are written per
+    * node range in parallel straight from the shard memory.
+    *
+    * With prune_by_distance the union is cut down by the construction heuristic instead of at
+    * random. Links only join elements of the same shard, so with refine_ef > 0 every element is
+    * then searched for in the merged graph with that ef and linked to the closer elements found
+    * in other shards, see refineMergedLinks. repairConnectivity afterwards links the elements
+    * that are still unreachable.
+    */
+    void mergeIndex(const std::vector<HierarchicalNSW*>& shard_indexes, bool prune_by_distance = false,
+                    size_t refine_ef = 0) {
+        if (shard_indexes.size() <= 1) {
+            return;
+        }
+        if (cur_element_count != 0)
+            throw std::runtime_error("mergeIndex needs an empty index");
+        checkLinksNotCompressed();
+
+        size_t total_elements = 0;
+        for (const HierarchicalNSW *shard : shard_indexes) {
+            if (shard->data_size_ != data_size_)
+                throw std::runtime_error("The shards and the merged index have different data sizes");
+            shard->checkLinksNotCompressed();
+            total_elements += shard->cur_element_count;
+        }
 
-        // 拿到所有点每层的边关系，构造自定义图
-        std::cout << "get all edges from shards" << std::endl;
-        std::vector<struct node> graph;
-        for (int shard_id = 0; shard_id < shard_indexes.size(); shard_id++) {
-            auto& index = shard_indexes[shard_id];
-            size_t shard_max_elements = index->max_elements_;
-
-            for (int shard_internal_label = 0; shard_internal_label < shard_max_elements; shard_internal_label++) {
-                int cur_level = index->getElementLevel(shard_internal_label);
-
-                struct node node;
-                node.max_level_ = cur_level;
-                node.external_label_ = index->getExternalLabel(shard_internal_label);
-                node.internal_label_ = shard_internal_label;
-                node.shard_id_ = shard_id;
-
-                for (int level = 0; level <= cur_level; level++) {
-                    std::vector<labeltype> neighbours;
-                    if (level == 0) {
-                        index->getExternalNeighbours(shard_internal_label, neighbours);
-                    } else {
-                        linklistsizeint* ll_cur = index->get_linklist(shard_internal_label, level);
-                        tableint* data = (tableint*)(ll_cur+1);
-
-                        // 遍历当前层的邻居
-                        for (int i = 0; i < *ll_cur; i++) {
-                            tableint internal_id_neighbour = *(data+i);
-                            labeltype external_id = index->getExternalLabel(internal_id_neighbour);
-                            neighbours.push_back(external_id);
-                        }
+        // internal id in this index of every shard element
+        std::vector<std::vector<tableint>> remap(shard_indexes.size());
+        // (shard, internal id) of the copy the vector of an element comes from
+        std::vector<std::pair<uint32_t, tableint>> source;
+        source.reserve(std::min(total_elements, max_elements_));
+        // (element, (shard, internal id)) of the other copies of labels found in several shards
+        std::vector<std::pair<tableint, std::pair<uint32_t, tableint>>> copies;
+        label_lookup_.reserve(std::min(total_elements, max_elements_));
+        for (uint32_t s = 0; s < shard_indexes.size(); s++) {
+            const HierarchicalNSW *shard = shard_indexes[s];
+            remap[s].resize(shard->cur_element_count);
+            for (tableint i = 0; i < shard->cur_element_count; i++) {
+                labeltype label = shard->getExternalLabel(i);
+                auto search = label_lookup_.find(label);
+                if (search == label_lookup_.end()) {
+                    if (source.size() >= max_elements_) {
+                        label_lookup_.clear();
+                        throw std::runtime_error("The number of elements exceeds the specified limit");
                     }
-                    node.external_neighbours_.push_back(neighbours);
+                    tableint id = source.size();
+                    label_lookup_[label] = id;
+                    source.emplace_back(s, i);
+                    element_levels_[id] = shard->element_levels_[i];
+                    remap[s][i] = id;
+                } else {
+                    tableint id = search->second;
+                    std::pair<uint32_t, tableint> copy(s, i);
+                    // take the vector from a live copy if there is one
+                    if (shard_indexes[source[id].first]->isMarkedDeleted(source[id].second) && !shard->isMarkedDeleted(i))
+                        std::swap(source[id], copy);
+                    copies.emplace_back(id, copy);
+                    element_levels_[id] = std::max(element_levels_[id], shard->element_levels_[i]);
+                    remap[s][i] = id;
                 }
-
-                graph.push_back(node);
             }
         }
+        std::sort(copies.begin(), copies.end());
 
-        // 遍历所有的 external_label，将数据复制到当前索引中
-        // 主要存储向量和外部标签，实际的邻居数量以及实际的邻居需要合并后再填充
-        if (graph.empty()) {
-            throw std::runtime_error("No edges to merge");
+        long long num_elements = source.size();
+        if (!allocateUpperLinks(num_elements)) {
+            label_lookup_.clear();
+            throw std::runtime_error("Not enough memory: mergeIndex failed to allocate linklists");
+        }
+        // the vectors are all in place before the links are selected by distance
+#pragma omp parallel for schedule(dynamic, 1024)
+        for (long long i = 0; i < num_elements; i++) {
+            tableint id = i;
+            const HierarchicalNSW *shard = shard_indexes[source[id].first];
+            tableint src = source[id].second;
+            labeltype label = shard->getExternalLabel(src);
+            memcpy(getDataByInternalId(id), shard->getDataByInternalId(src), data_size_);
+            memcpy(getExternalLabeLp(id), &label, sizeof(labeltype));
         }
 
-        // 重排，将一样的 external_label 的边放在一起 
-        std::cout << "resort graph nodes" << std::endl;
-        std::sort(graph.begin(), graph.end(), [](const auto &left, const auto &right) {
-            return left.external_label_ < right.external_label_ || 
-                    (left.external_label_ == right.external_label_ && left.shard_id_ < right.shard_id_);
-        });
-
-        std::cout << "cal unique_labels size" << std::endl;
-        size_t total_unique_elements = 0;
-        std::unordered_set<labeltype> unique_labels;
-        for (const auto& node : graph) {
-            unique_labels.insert(node.external_label_);
-        }
-        total_unique_elements = unique_labels.size();
-        std::cout << "unique_labels size: " << unique_labels.size() << std::endl;
-        std::cout << "graph nodes size: " << graph.size() << std::endl;
-
-        cur_element_count = total_unique_elements;
-
-        // 合并边，存储到自定义图中
-        std::cout << "merge edges" << std::endl;
-        std::vector<struct node> merge_graph(total_unique_elements);  // 存储合并后的图
-        std::unordered_map<labeltype, tableint> external_label_to_internal_id;  // 记录填充后的外部数据在当前索引中的位置
-        labeltype current_external_label = graph[0].external_label_;
-        tableint current_internal_label = 0;
-        int shard_id = graph[0].shard_id_;
-        auto& shard_index = shard_indexes[shard_id];
-        int cur_max_level = graph[0].max_level_;
-
-        // 合并 0 号点的边
-        // std::vector<std::vector<std::vector<labeltype>>> graph_merge_neighbours(max_elements_);
-        std::vector<std::vector<labeltype>> merge_neighbours(cur_max_level+1);
-        // 不用临时变量，直接将 merge_graph 里的external_label_大小更改，直接向 merge_graph 里添加数据
-        std::cout << "resize merge_neighbours size: " << std::endl;
-        cur_max_level = graph[0].max_level_;
-        for (int i = 1; i < graph.size(); i++) {
-            if (graph[i].external_label_ == current_external_label) {
-                if (graph[i].max_level_ > cur_max_level) {
-                    cur_max_level = graph[i].max_level_;
-                }
-            } else {
-                merge_graph[current_internal_label].external_neighbours_.resize(cur_max_level+1);
-                merge_graph[current_internal_label].internal_neighbours_.resize(cur_max_level+1);
-                merge_graph[current_internal_label].max_level_ = cur_max_level;
-                merge_graph[current_internal_label].internal_label_ = current_internal_label;
-                merge_graph[current_internal_label].external_label_ = current_external_label;
-                current_internal_label++;
-
-                cur_max_level = graph[i].max_level_;
-                current_external_label = graph[i].external_label_;
-            }
-
-            // 更新 maxlevel_
-            if (cur_max_level > maxlevel_) {
-                maxlevel_ = cur_max_level;
-            }
-        }
-        std::cout << "max level: " << maxlevel_ << std::endl;
-        merge_graph[current_internal_label].external_neighbours_.resize(cur_max_level+1);
-        merge_graph[current_internal_label].internal_neighbours_.resize(cur_max_level+1);
-        merge_graph[current_internal_label].max_level_ = cur_max_level;
-        merge_graph[current_internal_label].internal_label_ = current_internal_label;
-        merge_graph[current_internal_label].external_label_ = current_external_label;
-
-        current_internal_label = 0;
-        current_external_label = graph[0].external_label_;
-
-        for (int level = 0; level <= graph[0].max_level_; level++) {
-            auto& merge_graph_neighbours_level  = merge_graph[current_internal_label].external_neighbours_[level];
-            auto& graph_external_neighbours_level = graph[0].external_neighbours_[level];
-            merge_graph_neighbours_level.insert(merge_graph_neighbours_level.end(), graph_external_neighbours_level.begin(), graph_external_neighbours_level.end());
-        }
-
-        std::cout << "merge all edges" << std::endl;
-        std::cout << "graph size: " << graph.size() << std::endl;
-
-        memcpy(getDataByInternalId(current_internal_label), 
-               shard_index->getDataByLabelFloat(current_external_label).data(), data_size_);  // 复制向量
-        memcpy(getExternalLabeLp(current_internal_label),
-               &current_external_label, sizeof(labeltype));                     // 复制外部id
-        external_label_to_internal_id[current_external_label] = current_internal_label;    // 记录外部id在当前索引中的位置 
-
-        // 遍历所有的边，合并各个 level 的邻居
-        for (int i = 1; i < graph.size(); i++) {
-            if (graph[i].external_label_ != current_external_label) {
-                current_internal_label++;
-                current_external_label = graph[i].external_label_;
-
-                // 将数据 copy 到 level0
-                uint32_t shard_id = graph[i].shard_id_;
-                auto& shard_index = shard_indexes[shard_id];
-                memcpy(getDataByInternalId(current_internal_label), 
-                    // shard_index->template getDataByLabel<float>(current_external_label).data(), data_size_);  // 复制向量
-                    shard_index->getDataByLabelFloat(current_external_label).data(), data_size_);  // 复制向量
-                memcpy(getExternalLabeLp(current_internal_label),
-                    &current_external_label, sizeof(labeltype)); // 复制外部id
-                external_label_to_internal_id[current_external_label] = current_internal_label;  // 记录外部id在当前索引中的位置 
-                                                                                                 //
-            }
-
-            for (int level = 0; level <= graph[i].max_level_; level++) {
-                auto& merge_graph_neighbours_level  = merge_graph[current_internal_label].external_neighbours_[level];
-                auto& graph_external_neighbours_level = graph[i].external_neighbours_[level];
-                merge_graph_neighbours_level.insert(merge_graph_neighbours_level.end(), graph_external_neighbours_level.begin(), graph_external_neighbours_level.end());
-            }
-        }
-
-        // 邻居去重
-        std::cout << "unique" << std::endl;
-        for (auto& node: merge_graph) {
-            auto& external_neighbours = node.external_neighbours_;
-            for (int level = 0; level <= node.max_level_; level++) {
-                auto& merge_neighbours_level = external_neighbours[level];
-                std::sort(merge_neighbours_level.begin(), merge_neighbours_level.end());
-                auto it = std::unique(merge_neighbours_level.begin(), merge_neighbours_level.end());
-                merge_neighbours_level.erase(it, merge_neighbours_level.end());
-            }
-        }
-
-        // 检查 max_level跟实际的邻居数量是否一致 
-        std::cout << "merge graph size: " << merge_graph.size() << std::endl;
-        for (int i = 0; i < merge_graph.size(); i++) {
-            if (merge_graph[i].max_level_ != merge_graph[i].external_neighbours_.size() - 1) {
-                std::cout << "The edges are not consistent: max_level: " << merge_graph[i].max_level_ << " neighbours size: " << merge_graph[i].external_neighbours_.size() << std::endl;
-                throw std::runtime_error("The edges are not consistent");
-            }
-        }
-
-        // 添加反向边
-        // std::cout << "reconnect" << std::endl;
-        // for (int i = 0; i < merge_graph.size(); i++) {
-        //     auto external_label = merge_graph[i].external_label_;
-        //     auto& external_neighbours = merge_graph[i].external_neighbours_;
-        //     for (int level = 0; level <= merge_graph[i].max_level_; level++) {
-        //         auto& external_neighbours_level = external_neighbours[level];
-        //         for (int j = 0; j < external_neighbours_level.size(); j++) {
-        //             auto neighbour_external_id = external_neighbours_level[j];
-        //             auto neighbour_internal_id = external_label_to_internal_id.find(neighbour_external_id);
-        //
-        //             auto& neighbour_node = merge_graph[neighbour_internal_id->second];
-        //             auto& neighbour_node_external_neighbours_level = neighbour_node.external_neighbours_[level];
-        //             bool update = true;
-        //             for (int k = 0; k < neighbour_node_external_neighbours_level.size(); k++) {
-        //                 if (neighbour_node_external_neighbours_level[k] == external_label) {
-        //                     update = false;
-        //                     break;
-        //                 }
-        //             }
-        //
-        //             if (update) {
-        //                 neighbour_node_external_neighbours_level.push_back(external_label);
-        //             }
-        //         }
-        //     }
-        // }
-
-
-        // 映射内部 id
-        std::cout << "map internal id" << std::endl;
-        for (auto& node: merge_graph) {
-            auto& external_neighbours = node.external_neighbours_;
-            auto& internal_neighbours = node.internal_neighbours_;
-
-            for (int level = 0; level <= node.max_level_; level++) {
-                internal_neighbours[level].resize(external_neighbours[level].size());
-            }
-
-            for (int level = 0; level <= node.max_level_; level++) {
-                for (int i = 0; i < external_neighbours[level].size(); i++) {
-                    auto it = external_label_to_internal_id.find(external_neighbours[level][i]);
-                    if (it == external_label_to_internal_id.end()) {
-                        std::cout << "error: external id not found" << std::endl;
-                        throw std::runtime_error("external id not found");
-                    } else {
-                        internal_neighbours[level][i] = (it->second);
+#pragma omp parallel
+        {
+            std::vector<tableint> links;
+#pragma omp for schedule(dynamic, 1024)
+            for (long long i = 0; i < num_elements; i++) {
+                tableint id = i;
+                uint32_t s = source[id].first;
+                tableint src = source[id].second;
+                const HierarchicalNSW *shard = shard_indexes[s];
+                int level = element_levels_[id];
+
+                auto first_copy = std::lower_bound(copies.begin(), copies.end(),
+                    std::make_pair(id, std::pair<uint32_t, tableint>(0, 0)));
+                for (int l = 0; l <= level; l++) {
+                    links.clear();
+                    appendMergedLinks(shard, src, l, remap[s], links);
+                    for (auto copy = first_copy; copy != copies.end() && copy->first == id; copy++) {
+                        appendMergedLinks(shard_indexes[copy->second.first], copy->second.second, l,
+                                          remap[copy->second.first], links);
                     }
+                    links.erase(std::remove(links.begin(), links.end(), id), links.end());
+                    mergeSelectNeighbors(id, links, l, prune_by_distance);
+
+                    linklistsizeint *ll_cur = get_linklist_by_level(id, l);
+                    *ll_cur = 0;
+                    setListCount(ll_cur, links.size());
+                    memcpy(ll_cur + 1, links.data(), links.size() * sizeof(tableint));
                 }
+                if (shard->isMarkedDeleted(src))
+                    *((unsigned char *) get_linklist0(id) + 2) |= DELETE_MARK;
             }
         }
-
-        // 获取去重后所有点在level0的入度
-        std::cout << "call indegree level0" << std::endl;
-        std::vector<linklistsizeint> in_degrees(max_elements_);
-        // for (int i = 0; i < merge_graph.size(); i++) {
-        //     auto& internal_neighbours = merge_graph[i].internal_neighbours_;
-        //     for (auto& internal_neighbours_id: internal_neighbours[0]) {
-        //         in_degrees[internal_neighbours_id]++;
-        //     }
-        // }
-
-        std::cout << "fill edges" << std::endl;
-        // 填充邻居
-        // std::random_device rng;
-        // std::mt19937 urng(rng());
-        // size_links_per_element_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);  // 高层的 level 也变成 2*M 实时看
-        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
-
-        std::cout << "enter point node: " << enterpoint_node_ << std::endl;
-        size_t enterpoint_max_level = 0;
-        for (int i = 0; i < merge_graph.size(); i++) {
-            auto internal_label = merge_graph[i].internal_label_;
-            auto cur_max_level = merge_graph[i].max_level_;
-            element_levels_[i] = cur_max_level;
-            if (cur_max_level > enterpoint_max_level) {
-                enterpoint_max_level = cur_max_level;
-                enterpoint_node_ = internal_label;
+        cur_element_count = num_elements;
+        for (tableint id = 0; id < cur_element_count; id++) {
+            if (element_levels_[id] > maxlevel_) {
+                maxlevel_ = element_levels_[id];
+                enterpoint_node_ = id;
             }
-
-            if (cur_max_level > 0) {
-                linkLists_[internal_label] = (char*)malloc(size_links_per_element_*cur_max_level+1);
-                memset(linkLists_[internal_label], 0, size_links_per_element_*cur_max_level+1);
+            if (isMarkedDeleted(id)) {
+                num_deleted_ += 1;
+                if (allow_replace_deleted_) deleted_elements.insert(id);
             }
+        }
 
-            auto& internal_neighbours = merge_graph[i].internal_neighbours_;
-            for (int level = 0; level <= cur_max_level; level++) {
-                auto& internal_neighbours_level = internal_neighbours[level];
-                mergeSelectNeighbors(i, internal_neighbours_level, level, in_degrees);
-                // std::shuffle(internal_neighbours_level.begin(), internal_neighbours_level.end(), urng);
+        if (refine_ef > 0) {
+            std::vector<uint32_t> element_shard(num_elements);
+            for (tableint id = 0; id < cur_element_count; id++) {
+                element_shard[id] = source[id].first;
+            }
+            std::vector<std::pair<uint32_t, tableint>>().swap(source);
+            std::vector<std::vector<tableint>>().swap(remap);
+            refineMergedLinks(element_shard, refine_ef);
+        }
+    }
 
-                if (level == 0) {
-                    size_t num_neighbours = internal_neighbours_level.size() > maxM0_ ? maxM0_ : internal_neighbours_level.size();
+    /*
+    * Cross-shard pass of mergeIndex. Every element is searched for with ef refine_ef; at each of
+    * its levels the elements of other shards found closer than its farthest link are added to the
+    * candidates, which are pruned by the construction heuristic and linked back like in an insertion.
+    * The cost is one search per element, elements without closer foreign candidates keep their links.
+    */
+    void refineMergedLinks(const std::vector<uint32_t> &element_shard, size_t refine_ef) {
+        long long num_elements = cur_element_count;
+#pragma omp parallel for schedule(dynamic, 256)
+        for (long long i = 0; i < num_elements; i++) {
+            tableint id = i;
+            const char *data_point = getDataByInternalId(id);
+            int element_level = element_levels_[id];
+            tableint currObj = enterpoint_node_;
+            for (int level = maxlevel_; level >= 0; level--) {
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates =
+                        searchBaseLayer(currObj, data_point, level, level > element_level ? 1 : refine_ef);
+                std::vector<std::pair<dist_t, tableint>> found;
+                while (!top_candidates.empty()) {
+                    found.push_back(top_candidates.top());
+                    top_candidates.pop();
+                }
+                if (!found.empty()) currObj = found.back().second;
+                if (level > element_level) continue;
 
-                    linklistsizeint* ll_cur = get_linklist0(internal_label);
-                    setListCount(ll_cur, num_neighbours);
-                    tableint* data = (tableint*)(ll_cur+1);
-                    for (int i = 0; i < num_neighbours; i++) {
-                        data[i] = internal_neighbours_level[i];
+                // read, pruned and written under the lock, reverse links added meanwhile are not lost
+                size_t Mcurmax = level ? maxM_ : maxM0_;
+                std::vector<tableint> links;
+                std::vector<tableint> selected;
+                {
+                    std::unique_lock <std::mutex> lock(link_list_locks_[id]);
+                    linklistsizeint *ll_cur = get_linklist_at_level(id, level);
+                    tableint *data = (tableint *) (ll_cur + 1);
+                    links.assign(data, data + getListCount(ll_cur));
+                    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+                    dist_t farthest = std::numeric_limits<dist_t>::lowest();
+                    for (tableint link : links) {
+                        dist_t dist = code_fstdistfunc_(data_point, getDataByInternalId(link), code_dist_func_param_, scale2_);
+                        candidates.emplace(dist, link);
+                        farthest = std::max(farthest, dist);
                     }
-                } else {
-                    size_t num_neighbours = internal_neighbours_level.size() > maxM_ ? maxM_ : internal_neighbours_level.size();
+                    bool improved = false;
+                    for (const std::pair<dist_t, tableint> &candidate : found) {
+                        if (candidate.second == id || element_shard[candidate.second] == element_shard[id]) continue;
+                        if (links.size() >= Mcurmax && candidate.first >= farthest) continue;
+                        if (std::find(links.begin(), links.end(), candidate.second) != links.end()) continue;
+                        candidates.push(candidate);
+                        improved = true;
+                    }
+                    if (!improved) continue;
 
-                    linklistsizeint* ll_cur = get_linklist(internal_label, level);
-                    setListCount(ll_cur, num_neighbours);
-                    tableint* data = (tableint*)(ll_cur+1);
-                    for (int i = 0; i < num_neighbours; i++) {
-                        data[i] = internal_neighbours_level[i];
+                    getNeighborsByHeuristic2(candidates, Mcurmax);
+                    while (!candidates.empty()) {
+                        selected.push_back(candidates.top().second);
+                        candidates.pop();
                     }
+                    setListCount(ll_cur, selected.size());
+                    memcpy(data, selected.data(), selected.size() * sizeof(tableint));
+                }
+                for (tableint neighbour : selected) {
+                    if (std::find(links.begin(), links.end(), neighbour) == links.end())
+                        addReverseLink(id, neighbour, level, true);
                 }
             }
         }
-        std::cout << "enter point node: " << enterpoint_node_ << std::endl;
-
-        // // 增加反向连边，
-        // // 方案 1. 在构图结束后，从 id=0 开始进行反向连接
-        // // 方案 2. 在构图结束后，根据入度进行排列，入度小的首先进行选择
-        // // 方案 3. 在构图前根据入度进行排序，然后选择 
-        // std::cout << "add reverse edges" << std::endl;
-        // for (int i = 0; i < merge_graph.size(); i++) {
-        //     auto max_level = element_levels_[i];
-        //     for (int level = 0; level <= max_level; level++) {
-        //         linklistsizeint* ll_cur = get_linklist_by_level(i, level);
-        //         tableint* data_neighbours = (tableint*)(ll_cur+1);
-        //         for (linklistsizeint j = 0; j < *ll_cur; j++) {
-        //             tableint internal_id_neighbour = data_neighbours[j];
-        //             linklistsizeint* ll_cur_nei = get_linklist_by_level(internal_id_neighbour, level);
-        //             tableint* data_nei = (tableint*)(ll_cur_nei+1);
-        //
-        //             auto m = level == 0 ? maxM0_ : maxM_;
-        //             if (*ll_cur_nei < m) {
-        //                 bool found = false;
-        //                 for (linklistsizeint k = 0; k < *ll_cur_nei; k++) {
-        //                     if (data_nei[k] == i) {
-        //                         found = true;
-        //                         break;
-        //                     }
-        //                 }
-        //
-        //                 if (!found) {
-        //                     data_nei[*ll_cur_nei] = i;
-        //                     *ll_cur_nei = *ll_cur_nei + 1;
-        //                 }
-        //             }
-        //         }
-        //     }
-        // }
-
-        // std::cout << "cal in degree" << std::endl;
-        // std::vector<int> indices(max_elements_);
-        // std::vector<int> in_degree(max_elements_, 0);
-        // // 计算level0入度，并排序，从入度最小的开始选择
-        // for (tableint i = 0; i < max_elements_; i++) {
-        //     indices[i] = i;
-        //     linklistsizeint* ll_cur = get_linklist0(i);
-        //
-        //     tableint num_neighbours = *ll_cur;
-        //     tableint* data_neighbours = (tableint*)(ll_cur+1);
-        //     for (tableint j = 0; j < num_neighbours; j++) {
-        //         tableint internal_id_neighbour = data_neighbours[j];
-        //         in_degree[internal_id_neighbour]++;
-        //     }
-        // }
-        //
-        // std::cout << "sort in degree" << std::endl;
-        // std::sort(indices.begin(), indices.end(),
-        //       [&in_degree](int i1, int i2) { return in_degree[i1] < in_degree[i2]; });
-        //
-        // std::cout << "reconnect" << std::endl;
-        // for (tableint i = 0; i < max_elements_; i++) {
-        //     for (int level = 0; level <= element_levels_[indices[i]]; level++) {
-        //         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-        //         linklistsizeint* ll_cur = get_linklist_by_level(indices[i], level);
-        //
-        //         tableint num_neighbours = *ll_cur;
-        //         tableint* data_neighbours = (tableint*)(ll_cur+1);
-        //         for (tableint j = 0; j < num_neighbours; j++) {
-        //             tableint internal_id_neighbour = data_neighbours[j];
-        //             top_candidates.push(std::make_pair(0.0, internal_id_neighbour));
-        //         }
-        //
-        //         mutuallyConnectNewElement(nullptr, indices[i], top_candidates, level, false, false);
-        //     }
-        // }
+    }
+
+    // Appends the links of a shard element at level, in the ids of the merged index, if it has the level
+    static void appendMergedLinks(const HierarchicalNSW *shard, tableint internal_id, int level,
+                                  const std::vector<tableint> &remap, std::vector<tableint> &links) {
+        if (shard->element_levels_[internal_id] < level) return;
+        linklistsizeint *ll_cur = shard->get_linklist_by_level(internal_id, level);
+        size_t size = shard->getListCount(ll_cur);
+        tableint *data = (tableint *) (ll_cur + 1);
+        for (size_t j = 0; j < size; j++) {
+            links.push_back(remap[data[j]]);
+        }
     }
 
     linklistsizeint *get_linklist_by_level(tableint internal_id, int level) const {
@@ -1313,136 +2881,118 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
-    void mergeSelectNeighbors(tableint home, std::vector<tableint>& internal_neighbours, int level, std::vector<linklistsizeint>& in_degree) {
+    // Deduplicates the merged neighbours and cuts them down to the level's maximum
+    void mergeSelectNeighbors(tableint home, std::vector<tableint>& internal_neighbours, int level, bool prune_by_distance) {
+        size_t current_m = level == 0 ? maxM0_ : maxM_;
+        std::sort(internal_neighbours.begin(), internal_neighbours.end());
+        auto it = std::unique(internal_neighbours.begin(), internal_neighbours.end());
+        internal_neighbours.erase(it, internal_neighbours.end());
+        if (internal_neighbours.size() <= current_m) {
+            return;
+        }
 
+        // rescored by the distance to home, keeps what the construction heuristic would keep
+        if (prune_by_distance) {
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+            for (tableint neighbour : internal_neighbours) {
+                candidates.emplace(code_fstdistfunc_(getDataByInternalId(home), getDataByInternalId(neighbour),
+                                                     code_dist_func_param_, scale2_), neighbour);
+            }
+            getNeighborsByHeuristic2(candidates, current_m);
+            internal_neighbours.clear();
+            while (!candidates.empty()) {
+                internal_neighbours.push_back(candidates.top().second);
+                candidates.pop();
+            }
+            return;
+        }
+        // seeded by the element so the merge does not depend on the number of threads
+        std::mt19937 urng(home);
+        std::shuffle(internal_neighbours.begin(), internal_neighbours.end(), urng);
+        internal_neighbours.resize(current_m);
+    }
 
-        // 方案 1：去重后随机选择
-        // 提前去重
-        {
-            int current_m = level == 0 ? maxM0_ : maxM_;
-            std::sort(internal_neighbours.begin(), internal_neighbours.end());
-            auto it = std::unique(internal_neighbours.begin(), internal_neighbours.end());
-            internal_neighbours.erase(it, internal_neighbours.end());
-            if (internal_neighbours.size() <= current_m) {
-                return;
-            }
-            std::random_device rng;
-            std::mt19937 urng(rng());
-            std::shuffle(internal_neighbours.begin(), internal_neighbours.end(), urng);
-            internal_neighbours.resize(current_m);
-        }
-
-        // // 方案 2：按照 id 排序，重复多的放到最前面
-        // int current_m = level == 0 ? maxM0_ : maxM_;
-        // if ((level == 0 && internal_neighbours.size() < maxM0_) ||
-        //     (level > 0 && internal_neighbours.size() < maxM_)) {
-        //     // 数量少直接去重
-        //     std::sort(internal_neighbours.begin(), internal_neighbours.end());
-        //     auto it = std::unique(internal_neighbours.begin(), internal_neighbours.end());
-        //     internal_neighbours.erase(it, internal_neighbours.end());
-        //     return;
-        // }
-        //
-        // // 统计重复数量
-        // std::unordered_map<tableint, int> count_map;
-        // for (auto& internal_id : internal_neighbours) {
-        //     count_map[internal_id]++;
-        // }
-        // // 根据数量排序
-        // std::vector<std::pair<tableint, int>> count_neighbours(count_map.begin(), count_map.end());
-        // std::sort(count_neighbours.begin(), count_neighbours.end(), [](const auto &left, const auto &right) {
-        //     return left.second > right.second;
-        // });
-        //
-        // std::vector<tableint>().swap(internal_neighbours);  // 清空并释放内存
-        // internal_neighbours.push_back(count_neighbours[0].first);  // 重复最多的放到最前面
-        // for (int i = 1; i < count_neighbours.size() && internal_neighbours.size() < current_m; i++) {
-        //     if (count_neighbours[i].first != count_neighbours[i-1].first) {
-        //         internal_neighbours.push_back(count_neighbours[i].first);
-        //     }
-        // }
-
-        // // 方案 3，按照邻居的入度来删减, 邻居入度少的优先留下
-        // // 需要整个图提前去重
-        // {
-        //     int current_m = level == 0 ? maxM0_ : maxM_;
-        //     if ((level == 0 && internal_neighbours.size() <= maxM0_) ||
-        //         (level > 0 && internal_neighbours.size() <= maxM_)) {
-        //         // 数量少直接返回
-        //         return;
-        //     }
-        //
-        //     // 上层的采用随机选择的方案
-        //     if (level > 0) {
-        //         std::random_device rng;
-        //         std::mt19937 urng(rng());
-        //         std::shuffle(internal_neighbours.begin(), internal_neighbours.end(), urng);
-        //         internal_neighbours.resize(maxM_);
-        //         return ;
-        //     }
-        //
-        //     // level0 根据入度排序进行选择
-        //     std::vector<std::pair<tableint, int>> neighbour_with_indegree(internal_neighbours.size());
-        //     for (int i = 0; i < internal_neighbours.size(); i++) {
-        //         neighbour_with_indegree[i] = std::make_pair(internal_neighbours[i], in_degree[internal_neighbours[i]]);
-        //     }
-        //     std::sort(neighbour_with_indegree.begin(), neighbour_with_indegree.end(), [](const auto &left, const auto &right) {
-        //             return left.second > right.second;
-        //     });
-        //     internal_neighbours.resize(maxM0_);
-        //     // std::copy(neighbour_with_indegree.begin(), neighbour_with_indegree.begin() + maxM0_, internal_neighbours.begin());
-        //     // std::vector<tableint>().swap(internal_neighbours);  // 清空并释放内存
-        //     for (int i = 0; i < neighbour_with_indegree.size(); i++) {
-        //         if (i < maxM0_) {
-        //             internal_neighbours[i] = neighbour_with_indegree[i].first;
-        //         } else {
-        //             in_degree[neighbour_with_indegree[i].first]--;
-        //         }
-        //     }
-        // }
-
-//         // 方案 3：启发式选择
-//         if (internal_neighbours.size() >= 32 ) {
-//             return;
-//         }
-//         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-// // #pragma omp parallel for
-//         for (int i = 0; i < internal_neighbours.size(); i++) {
-//             tableint neighbour_internal_id = internal_neighbours[i];
-//             dist_t distance = fstdistfunc_(
-//                     getDataByInternalId(home), 
-//                     getDataByInternalId(neighbour_internal_id), dist_func_param_, scale2_);
-//             top_candidates.push(std::make_pair(distance, neighbour_internal_id));
-//         }
-//
-//         getNeighborsByHeuristic2(top_candidates, level == 0 ? maxM0_ : maxM_);
-//         std::vector<tableint>().swap(internal_neighbours);
-//         while (!top_candidates.empty()) {
-//             internal_neighbours.push_back(top_candidates.top().second);
-//             top_candidates.pop();
-//         }
-
-        // 方案 4
-        // 增加反向连边
-    }
-
-    // // 计算合并前所有层点的入度
-    // void calInDegrees0(std::vector<linklistsizeint>& in_degree) {
-    //     for (int i = 0; i < max_elements_; i++) {
-    //         linklistsizeint* ll_cur = get_linklist0(i);
-    //
-    //         linklistsizeint num_neighbours = *ll_cur;
-    //         tableint* data_neighbours = (tableint*)(ll_cur+1);
-    //         for (tableint j = 0; j < num_neighbours; j++) {
-    //             tableint internal_id_neighbour = data_neighbours[j];
-    //             in_degree[internal_id_neighbour]++;
-    //         }
-    //     }
-    // }
+    /*
+    * Folds a delta index, e.g. a small index of fresh vectors built with the same space, into this
+    * index, which grows in place with resizeIndex if needed. Elements deleted in the delta are skipped
+    * and labels already in this index are updated as by addPoint.
+    *
+    * The delta elements are inserted in parallel in delta id order, each with its delta level, so most
+    * of their delta neighbours, which were in the delta before them, are already inserted. The search
+    * of every level starts from those neighbours instead of descending from the entry point. It starts
+    * next to the element, so ef (ef_construction_ if 0) can be set much lower than for addPoint.
+    * Returns the number of elements added.
+    */
+    size_t mergeDelta(const HierarchicalNSW &delta, size_t ef = 0) {
+        if (delta.data_size_ != data_size_)
+            throw std::runtime_error("The delta index has a different data size");
+        checkLinksNotCompressed();
+        delta.checkLinksNotCompressed();
+        // the re-ranking vectors of the delta elements, else the elements must be exact vectors themselves;
+        // checked here rather than part way through the merge
+        const VectorStore *delta_vectors = nullptr;
+        if (rerank_vectors_ && delta.rerank_vectors_ && delta.rerank_vectors_->elementSize() == rerank_vectors_->elementSize())
+            delta_vectors = delta.rerank_vectors_.get();
+        rerankVector(nullptr, delta_vectors ? delta_vectors->get(0) : nullptr);
+
+        size_t delta_count = delta.cur_element_count;
+        size_t num_new = 0;
+        for (tableint u = 0; u < delta_count; u++) {
+            tableint id;
+            if (!delta.isMarkedDeleted(u) && !lookupInternalId(delta.getExternalLabel(u), id))
+                num_new++;
+        }
+        if (cur_element_count + num_new > max_elements_)
+            resizeIndex(cur_element_count + num_new);
+
+        // internal id here of every inserted delta element, delta_count while not inserted
+        std::unique_ptr<std::atomic<tableint>[]> mapped(new std::atomic<tableint>[delta_count]);
+        for (size_t u = 0; u < delta_count; u++) mapped[u].store(delta_count, std::memory_order_relaxed);
+
+        size_t count_before = cur_element_count;
+        std::exception_ptr error;
+        std::mutex error_lock;
+#pragma omp parallel for schedule(dynamic, 16)
+        for (long long i = 0; i < (long long) delta_count; i++) {
+            tableint u = i;
+            if (delta.isMarkedDeleted(u)) continue;
+            try {
+                int level = delta.element_levels_[u];
+                std::vector<tableint> seeds;
+                for (int l = 0; l <= level; l++) {
+                    linklistsizeint *ll = delta.get_linklist_at_level(u, l);
+                    size_t size = delta.getListCount(ll);
+                    tableint *links = (tableint *) (ll + 1);
+                    for (size_t j = 0; j < size; j++) {
+                        tableint id = mapped[links[j]].load(std::memory_order_acquire);
+                        if (id != delta_count) seeds.push_back(id);
+                    }
+                }
+
+                labeltype label = delta.getExternalLabel(u);
+                std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
+                tableint id = addPoint(delta.getDataByInternalId(u), label, level, &seeds, ef,
+                                       delta_vectors ? delta_vectors->get(u) : nullptr);
+                mapped[u].store(id, std::memory_order_release);
+            } catch (...) {
+                std::unique_lock <std::mutex> lock(error_lock);
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+        return cur_element_count - count_before;
+    }
+
+    // The space of a PQ index, the codebooks live there
+    PqSpace *getPqSpace() const {
+        PqSpace *pq_space = dynamic_cast<PqSpace *>(space_);
+        if (pq_space == nullptr)
+            throw std::runtime_error("The index space is not a PqSpace");
+        return pq_space;
+    }
 
     void loadCodeBooks(const std::vector<std::vector<float>>& code_books) {
-        pq_centroids_ = code_books;
-        hnswlib::codebooks = code_books;
+        getPqSpace()->setCodebooks(code_books);
     }
 
     void loadResiduals(const std::vector<float>& residuals) {
@@ -1460,70 +3010,129 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
     }
 
-    float L2(const float* d1, const float *d2, int dim) {
-        float r = 0.0;
-        for (int i = 0; i < dim; i++) {
-            float r1 = *(d1+i)-*(d2+i);
-            r += r1*r1;
-        }
-
-        return r;
+    void calDistLookUpTable() {
+        getPqSpace()->computeSdcTable();
     }
 
-    void calDistLookUpTable(int M, int Ks, int dsub) {
-      hnswlib::dist_lookup.resize(M);
-      for (int i = 0; i < hnswlib::dist_lookup.size(); i++) {
-          hnswlib::dist_lookup[i].resize(Ks * (Ks + 1) / 2);
-      }
-
-      for (int i = 0; i < M; i++) {
-        const float *data = pq_centroids_[i].data();
 
-        for (int j = 0; j < Ks; j++) {
-          for (int k = 0; k < Ks; k++) {
-            if (j < k)
-              break;
-
-            float d = L2(data + j * dsub, data + k * dsub, dsub);
-            size_t idx = j * (j + 1) / 2 + k;
-            dist_lookup[i][idx] = d;
-          }
+    /*
+    * Trains pq_space on sample_size random stored vectors (with opq also its rotation), replaces the
+    * float vector of every element by its PQ code in place, shrinking the level 0 records, and
+    * switches the index to pq_space. The index must hold pq_space->getDim() floats per element.
+    * Elements added afterwards are codes of pq_space->encode(), linked by the distances between codes.
+    * Returns the mean squared quantization error per element.
+    */
+    float trainPq(PqSpace *pq_space, size_t sample_size = 65536, size_t niter = 25, bool opq = false, unsigned int seed = 1234) {
+        size_t dim = pq_space->getDim();
+        size_t M = pq_space->getM();
+        if (data_size_ != dim * sizeof(float))
+            throw std::runtime_error("trainPq needs an index of float vectors of the PQ dimension");
+        size_t n = cur_element_count;
+        if (n == 0)
+            throw std::runtime_error("trainPq needs a non-empty index");
+
+        // training sample, a random subset of the elements
+        sample_size = std::min(sample_size, n);
+        std::vector<tableint> ids(n);
+        for (size_t i = 0; i < n; i++) ids[i] = i;
+        std::mt19937 rng(seed);
+        for (size_t i = 0; i < sample_size; i++) {
+            std::uniform_int_distribution<size_t> distrib(i, n - 1);
+            std::swap(ids[i], ids[distrib(rng)]);
+        }
+        std::vector<float> sample(sample_size * dim);
+        for (size_t i = 0; i < sample_size; i++) {
+            memcpy(sample.data() + i * dim, getDataByInternalId(ids[i]), data_size_);
         }
-      }
+        pq_space->train(sample.data(), sample_size, niter, opq, 8, seed);
+        std::vector<float>().swap(sample);
+
+        std::vector<uint8_t> codes(n * M);
+        double err = 0;
+#pragma omp parallel for reduction(+:err)
+        for (long long i = 0; i < (long long) n; i++) {
+            err += pq_space->encode((const float *) getDataByInternalId(i), codes.data() + i * M);
+        }
+
+        replaceDataByCodes(codes, M, pq_space);
+        return (float) (err / n);
     }
 
-    float calMax() {
-        float max_ = 0.0;
-        float per = 0.9;
-        int64_t top_n = (1.0-per)*max_elements_;
 
-        std::priority_queue<float, std::vector<float>, std::greater<float>> top_candidates;
-        size_t dim = *((size_t *) dist_func_param_);
-        for (size_t i = 0; i < max_elements_; i++) {
-            char* data_ptrv = getDataByInternalId(i);
-            float* data_ptr = (float*) data_ptrv;
-            for (size_t i = 0; i < dim; i++) {
-                float abs_val = data_ptr[i] > 0 ? data_ptr[i] : -data_ptr[i];
-                if (top_candidates.size() < top_n) {
-                    top_candidates.push(abs_val);
-                } 
-                if (top_candidates.size() == top_n) {
-                    float min_val = top_candidates.top();
-                    if (abs_val > min_val) {
-                        top_candidates.pop();
-                        top_candidates.push(abs_val);
-                    }
-                }
-            }
+    /*
+    * Trains sq_space on the stored float vectors in place, replaces every vector by its code and
+    * switches the index to sq_space, as trainPq does. clip is the fraction of the values of a range
+    * clipped at each end, per_dimension false gives all dimensions one range.
+    * Elements added afterwards are codes of sq_space->encode(), linked by the distances between codes.
+    * Returns the mean squared quantization error per element.
+    */
+    float trainSq(SqSpace *sq_space, float clip = 0.0f, bool per_dimension = true) {
+        size_t dim = sq_space->getDim();
+        if (data_size_ != dim * sizeof(float))
+            throw std::runtime_error("trainSq needs an index of float vectors of the SQ dimension");
+        size_t n = cur_element_count;
+        if (n == 0)
+            throw std::runtime_error("trainSq needs a non-empty index");
+
+        sq_space->train(data_level0_memory_ + level0_layout_.data_region, n, level0_layout_.data_stride, clip, per_dimension);
+
+        size_t code_size = sq_space->get_data_size();
+        std::vector<uint8_t> codes(n * code_size);
+        double err = 0;
+#pragma omp parallel for reduction(+:err)
+        for (long long i = 0; i < (long long) n; i++) {
+            err += sq_space->encode((const float *) getDataByInternalId(i), codes.data() + i * code_size);
         }
 
-        float max_val = top_candidates.top();
+        replaceDataByCodes(codes, code_size, sq_space);
+        return (float) (err / n);
+    }
+
 
-        while (max_val <= 0 && !top_candidates.empty()) {
-            max_val = top_candidates.top();
-            top_candidates.pop();
+    // Puts codes of code_size bytes in place of the stored vectors, shrinking the level 0 records, and switches to space
+    void replaceDataByCodes(const std::vector<uint8_t> &codes, size_t code_size, SpaceInterface<dist_t> *space) {
+        if (code_size > data_size_)
+            throw std::runtime_error("Codes must not be larger than the stored vectors");
+        checkNoReplicas();
+        checkLinksNotCompressed();
+        copyMappedIndex();
+        if (level0_layout_.type != LAYOUT_INTERLEAVED && !resizeLevel0(max_elements_, LAYOUT_INTERLEAVED))
+            throw std::runtime_error("Not enough memory: replaceDataByCodes failed to allocate level0");
+        // records only shrink, so moving them forward in id order never overwrites one not moved yet
+        size_t new_size_data_per_element = size_links_level0_ + code_size + sizeof(labeltype);
+        for (size_t i = 0; i < cur_element_count; i++) {
+            char *src = data_level0_memory_ + i * size_data_per_element_;
+            char *dst = data_level0_memory_ + i * new_size_data_per_element;
+            labeltype label;
+            memcpy(&label, src + label_offset_, sizeof(labeltype));
+            memmove(dst + offsetLevel0_, src + offsetLevel0_, size_links_level0_);
+            memcpy(dst + offsetData_, codes.data() + i * code_size, code_size);
+            memcpy(dst + offsetData_ + code_size, &label, sizeof(labeltype));
         }
+        size_data_per_element_ = new_size_data_per_element;
+        label_offset_ = offsetData_ + code_size;
+        data_size_ = code_size;
+        level0_layout_ = level0Layout(LAYOUT_INTERLEAVED, max_elements_);
+        space_ = space;
+        fstdistfunc_ = space->get_dist_func();
+        dist_func_param_ = space->get_dist_func_param();
+        code_fstdistfunc_ = space->get_code_dist_func();
+        code_dist_func_param_ = space->get_code_dist_func_param();
+
+        // the index holds the codes already, a failed shrink leaves them in the larger buffer
+        if (!resizeLevel0(max_elements_, LAYOUT_INTERLEAVED))
+            throw std::runtime_error("Not enough memory: replaceDataByCodes failed to shrink level0");
+        applyLayout();
+    }
 
+    // The 1 - 0.1 / dim quantile of |x| over all stored values, from a parallel histogram sketch
+    float calMax() {
+        size_t dim = *((size_t *) dist_func_param_);
+        QuantileSketch sketch(dim);
+        sketch.build(data_level0_memory_ + level0_layout_.data_region, cur_element_count, level0_layout_.data_stride, true, true);
+        float max_val = sketch.globalQuantile(1.0 - 0.1 / dim);
+        if (max_val <= 0)
+            max_val = sketch.globalQuantile(1.0);
         return max_val;
     }
 
@@ -1561,24 +3170,58 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
     }
 
+    /*
+    * Quantizes the stored float vectors to int8 with the scale of sq8(), shrinks the records to dim bytes
+    * and switches the index to int8_space with that scale, so searches take float queries and quantize
+    * them. Elements added afterwards are int8 vectors quantized with int8_space->quantize().
+    */
+    void sq8(Int8SpaceBase *int8_space) {
+        size_t dim = int8_space->getDim();
+        if (data_size_ != dim * sizeof(float))
+            throw std::runtime_error("sq8 needs an index of float vectors of the int8 space dimension");
+        float max_val = calMax();
+        if (max_val <= 0)
+            throw std::runtime_error("sq8 needs non-zero vectors");
+        int8_space->setScale(127 / max_val);
+
+        size_t n = cur_element_count;
+        std::vector<uint8_t> codes(n * dim);
+#pragma omp parallel for
+        for (long long i = 0; i < (long long) n; i++) {
+            int8_space->quantize((const float *) getDataByInternalId(i), (int8_t *) codes.data() + i * dim);
+        }
+        replaceDataByCodes(codes, dim, int8_space);
+        useInt8Scale();
+    }
+
+
+    // Distances of an int8 space with a scale are divided by scale^2, e.g. after loading an sq8 index
+    void useInt8Scale() {
+        Int8SpaceBase *int8_space = dynamic_cast<Int8SpaceBase *>(space_);
+        if (int8_space != nullptr && int8_space->getScale() > 0) {
+            scale_ = int8_space->getScale();
+            scale2_ = scale_ * scale_;
+        }
+    }
+
     template<typename data_t>
     std::vector<data_t> getDataByLabel(labeltype label) const {
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
         
         std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end() || isMarkedDeleted(search->second)) {
+        tableint internalId;
+        if (!lookupInternalId(label, internalId) || isMarkedDeleted(internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
         lock_table.unlock();
 
         char* data_ptrv = getDataByInternalId(internalId);
-        size_t dim = *((size_t *) dist_func_param_);
+        // the stored bytes, which are fewer than the dimension for packed codes
+        size_t count = data_size_ / sizeof(data_t);
         std::vector<data_t> data;
         data_t* data_ptr = (data_t*) data_ptrv;
-        for (size_t i = 0; i < dim; i++) {
+        for (size_t i = 0; i < count; i++) {
             data.push_back(*data_ptr);
             data_ptr += 1;
         }
@@ -1586,15 +3229,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     std::vector<float> getDataByLabelFloat(labeltype label) const {
+        uint32_t kind = spaceKind(space_);
+        if (kind == INDEX_SPACE_PQ || kind == INDEX_SPACE_SQ || kind == INDEX_SPACE_L2_INT8 || kind == INDEX_SPACE_IP_INT8)
+            throw std::runtime_error("The index stores codes, not float vectors");
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
         
         std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end() || isMarkedDeleted(search->second)) {
+        tableint internalId;
+        if (!lookupInternalId(label, internalId) || isMarkedDeleted(internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
         lock_table.unlock();
 
         char* data_ptrv = getDataByInternalId(internalId);
@@ -1617,11 +3262,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
         std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!lookupInternalId(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
         lock_table.unlock();
 
         markDeletedInternal(internalId);
@@ -1659,11 +3303,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
         std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!lookupInternalId(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
         lock_table.unlock();
 
         unmarkDeletedInternal(internalId);
@@ -1714,14 +3357,20 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     * If replacement of deleted elements is enabled: replaces previously deleted point if any, updating it with new point
     */
     void addPoint(const void *data_point, labeltype label, bool replace_deleted = false) {
+        addPoint(data_point, label, nullptr, replace_deleted);
+    }
+
+    // As addPoint, with the full precision vector the index keeps for searchKnnRerank, see keepRerankVectors
+    void addPoint(const void *data_point, labeltype label, const void *exact_vector, bool replace_deleted = false) {
         if ((allow_replace_deleted_ == false) && (replace_deleted == true)) {
             throw std::runtime_error("Replacement of deleted elements is disabled in constructor");
         }
+        exact_vector = rerankVector(data_point, exact_vector);
 
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
         if (!replace_deleted) {
-            addPoint(data_point, label, -1);
+            addPoint(data_point, label, -1, nullptr, 0, exact_vector);
             return;
         }
         // check if there is vacant place
@@ -1737,7 +3386,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         // if there is no vacant place then add or update point
         // else add point to vacant place
         if (!is_vacant_place) {
-            addPoint(data_point, label, -1);
+            addPoint(data_point, label, -1, nullptr, 0, exact_vector);
         } else {
             // we assume that there are no concurrent operations on deleted element
             labeltype label_replaced = getExternalLabel(internal_id_replaced);
@@ -1749,14 +3398,20 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             lock_table.unlock();
 
             unmarkDeletedInternal(internal_id_replaced);
-            updatePoint(data_point, internal_id_replaced, 1.0);
+            updatePoint(data_point, internal_id_replaced, 1.0, exact_vector);
         }
     }
 
 
-    void updatePoint(const void *dataPoint, tableint internalId, float updateNeighborProbability) {
+    void updatePoint(const void *dataPoint, tableint internalId, float updateNeighborProbability,
+                     const void *exact_vector = nullptr) {
+        checkNoReplicas();
+        checkLinksNotCompressed();
+        exact_vector = rerankVector(dataPoint, exact_vector);
         // update the feature vector associated with existing point with new vector
         memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+        if (exact_vector)
+            rerank_vectors_->set(internalId, exact_vector);
 
         int maxLevelCopy = maxlevel_;
         tableint entryPointCopy = enterpoint_node_;
@@ -1800,7 +3455,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (cand == neigh)
                         continue;
 
-                    dist_t distance = fstdistfunc_(getDataByInternalId(neigh), getDataByInternalId(cand), dist_func_param_, scale2_);
+                    dist_t distance = code_fstdistfunc_(getDataByInternalId(neigh), getDataByInternalId(cand), code_dist_func_param_, scale2_);
                     if (candidates.size() < elementsToKeep) {
                         candidates.emplace(distance, cand);
                     } else {
@@ -1841,7 +3496,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         int maxLevel) {
         tableint currObj = entryPointInternalId;
         if (dataPointLevel < maxLevel) {
-            dist_t curdist = fstdistfunc_(dataPoint, getDataByInternalId(currObj), dist_func_param_, scale2_);
+            dist_t curdist = code_fstdistfunc_(dataPoint, getDataByInternalId(currObj), code_dist_func_param_, scale2_);
             for (int level = maxLevel; level > dataPointLevel; level--) {
                 bool changed = true;
                 while (changed) {
@@ -1859,7 +3514,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                         _mm_prefetch(getDataByInternalId(*(datal + i + 1)), _MM_HINT_T0);
 #endif
                         tableint cand = datal[i];
-                        dist_t d = fstdistfunc_(dataPoint, getDataByInternalId(cand), dist_func_param_, scale2_);
+                        dist_t d = code_fstdistfunc_(dataPoint, getDataByInternalId(cand), code_dist_func_param_, scale2_);
                         if (d < curdist) {
                             curdist = d;
                             currObj = cand;
@@ -1890,7 +3545,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             if (filteredTopCandidates.size() > 0) {
                 bool epDeleted = isMarkedDeleted(entryPointInternalId);
                 if (epDeleted) {
-                    filteredTopCandidates.emplace(fstdistfunc_(dataPoint, getDataByInternalId(entryPointInternalId), dist_func_param_, scale2_), entryPointInternalId);
+                    filteredTopCandidates.emplace(code_fstdistfunc_(dataPoint, getDataByInternalId(entryPointInternalId), code_dist_func_param_, scale2_), entryPointInternalId);
                     if (filteredTopCandidates.size() > ef_construction_)
                         filteredTopCandidates.pop();
                 }
@@ -1903,7 +3558,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     std::vector<tableint> getConnectionsWithLock(tableint internalId, int level) {
         std::unique_lock <std::mutex> lock(link_list_locks_[internalId]);
-        unsigned int *data = get_linklist_at_level(internalId, level);
+        std::vector<linklistsizeint> links0;
+        unsigned int *data = level == 0 ? level0List(internalId, links0) : get_linklist(internalId, level);
         int size = getListCount(data);
         std::vector<tableint> result(size);
         tableint *ll = (tableint *) (data + 1);
@@ -1912,15 +3568,24 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
-    tableint addPoint(const void *data_point, labeltype label, int level) {
+    /*
+    * Adds the element with the given level, a random level if level < 0. With seeds the search of every
+    * level starts from the seeds on the level (and the closest element of the level above) with ef,
+    * see mergeDelta, instead of the descent from the entry point. exact_vector is kept for re-ranking.
+    */
+    tableint addPoint(const void *data_point, labeltype label, int level,
+                      const std::vector<tableint> *seeds = nullptr, size_t ef = 0,
+                      const void *exact_vector = nullptr) {
+        checkNoReplicas();
+        checkLinksNotCompressed();
+        exact_vector = rerankVector(data_point, exact_vector);
         tableint cur_c = 0;
         {
             // Checking if the element with the same label already exists
             // if so, updating it *instead* of creating a new element.
             std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            auto search = label_lookup_.find(label);
-            if (search != label_lookup_.end()) {
-                tableint existingInternalId = search->second;
+            tableint existingInternalId;
+            if (lookupInternalId(label, existingInternalId)) {
                 if (allow_replace_deleted_) {
                     if (isMarkedDeleted(existingInternalId)) {
                         throw std::runtime_error("Can't use addPoint to update deleted elements if replacement of deleted elements is enabled.");
@@ -1931,7 +3596,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 if (isMarkedDeleted(existingInternalId)) {
                     unmarkDeletedInternal(existingInternalId);
                 }
-                updatePoint(data_point, existingInternalId, 1.0);
+                updatePoint(data_point, existingInternalId, 1.0, exact_vector);
 
                 return existingInternalId;
             }
@@ -1948,7 +3613,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
         int curlevel = getRandomLevel(mult_);
         // int curlevel = getRandomLevel(revSize_);
-        if (level > 0)
+        if (level >= 0)
             curlevel = level;
 
         element_levels_[cur_c] = curlevel;  // 设置当前点所属的 level，最高 level
@@ -1960,22 +3625,27 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         tableint currObj = enterpoint_node_;
         tableint enterpoint_copy = enterpoint_node_;  // 获取进入点
 
-        memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+        memset(get_linklist0(cur_c), 0, size_links_level0_);
 
         // Initialisation of the data and label
         memcpy(getExternalLabeLp(cur_c), &label, sizeof(labeltype)); // level0 写入外部 id
         memcpy(getDataByInternalId(cur_c), data_point, data_size_);  // level0 写入数据
+        if (exact_vector)
+            rerank_vectors_->set(cur_c, exact_vector);
 
         if (curlevel) {  // 如果当前点不是在第 0 层
-            linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1); // 为这个点分配curlevel个层，每个层都有 M 个邻居
+            linkLists_[cur_c] = link_arena_.allocate(size_links_per_element_ * curlevel); // 为这个点分配curlevel个层，每个层都有 M 个邻居
             if (linkLists_[cur_c] == nullptr)
                 throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
-            memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
         }
 
         if ((signed)currObj != -1) {
-            if (curlevel < maxlevelcopy) { // 寻找到当前层的进入点
-                dist_t curdist = fstdistfunc_(data_point, getDataByInternalId(currObj), dist_func_param_, scale2_);
+            int toplevel = std::min(curlevel, maxlevelcopy);
+            std::vector<tableint> entry_points;
+            if (seeds)
+                selectSeeds(*seeds, toplevel, entry_points);
+            if (curlevel < maxlevelcopy && entry_points.empty()) { // 寻找到当前层的进入点
+                dist_t curdist = code_fstdistfunc_(data_point, getDataByInternalId(currObj), code_dist_func_param_, scale2_);
                 for (int level = maxlevelcopy; level > curlevel; level--) {
                     bool changed = true;
                     while (changed) {
@@ -1990,7 +3660,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                             tableint cand = datal[i];
                             if (cand < 0 || cand > max_elements_)
                                 throw std::runtime_error("cand error");
-                            dist_t d = fstdistfunc_(data_point, getDataByInternalId(cand), dist_func_param_, scale2_);
+                            dist_t d = code_fstdistfunc_(data_point, getDataByInternalId(cand), code_dist_func_param_, scale2_);
                             if (d < curdist) {
                                 curdist = d;
                                 currObj = cand;
@@ -2007,11 +3677,19 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     throw std::runtime_error("Level error");
 
                 // 从当前层的进入点开始寻找最近的邻居
-                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates = searchBaseLayer(
-                        currObj, data_point, level);
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+                if (seeds) {
+                    if (level < toplevel)
+                        selectSeeds(*seeds, level, entry_points);
+                    if (level < toplevel || entry_points.empty())
+                        entry_points.push_back(currObj);
+                    top_candidates = searchBaseLayer(entry_points.data(), entry_points.size(), data_point, level, ef);
+                } else {
+                    top_candidates = searchBaseLayer(currObj, data_point, level);
+                }
                 if (epDeleted) {
-                    top_candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(enterpoint_copy), dist_func_param_, scale2_), enterpoint_copy);
-                    if (top_candidates.size() > ef_construction_)
+                    top_candidates.emplace(code_fstdistfunc_(data_point, getDataByInternalId(enterpoint_copy), code_dist_func_param_, scale2_), enterpoint_copy);
+                    if (top_candidates.size() > (ef ? ef : ef_construction_))
                         top_candidates.pop();
                 }
                 // 在当前层构图，同时获得下一层的进入点 
@@ -2032,11 +3710,142 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    // The seeds that have the level, in entry_points
+    void selectSeeds(const std::vector<tableint> &seeds, int level, std::vector<tableint> &entry_points) const {
+        entry_points.clear();
+        for (tableint seed : seeds) {
+            if (element_levels_[seed] >= level)
+                entry_points.push_back(seed);
+        }
+    }
+
+
     std::priority_queue<std::pair<dist_t, labeltype >>
     searchKnn(const void *query_data, size_t k, float q_residual, BaseFilterFunctor* isIdAllowed = nullptr) const {
         std::priority_queue<std::pair<dist_t, labeltype >> result;
         if (cur_element_count == 0) return result;
 
+        static thread_local std::vector<char> prepared_query;
+        size_t query_stride;
+        query_data = prepareQueries(query_data, 1, prepared_query, query_stride);
+
+        tableint currObj = searchUpperLayers(query_data);
+
+        if (use_flat_candidate_pool_) {
+            static thread_local FlatSearchQueues queues;
+            queues.reset(std::max(ef_, k));
+            searchKnnBaseLayer(queues, currObj, query_data, k, q_residual, isIdAllowed, result);
+        } else {
+            HeapSearchQueues queues;
+            searchKnnBaseLayer(queues, currObj, query_data, k, q_residual, isIdAllowed, result);
+        }
+        return result;
+    }
+
+
+    /*
+    * Keeps a full precision copy of the stored vectors for searchKnnRerank. Call it before sq8(), trainSq() or
+    * trainPq() replace the vectors by codes; exact_space computes the exact distances (e.g. the space
+    * the index was built with). With a location the copy is a memory-mapped file that
+    * loadRerankVectors can map again later, otherwise it is kept in memory; saveIndex does not write it.
+    * The copy grows with resizeIndex. Elements added after the vectors were replaced by codes pass
+    * their full precision vector to addPoint(data_point, label, exact_vector).
+    */
+    void keepRerankVectors(SpaceInterface<dist_t> *exact_space, const std::string &location = "") {
+        if (exact_space->get_data_size() != data_size_)
+            throw std::runtime_error("The exact space does not match the stored vectors");
+        if (location.empty()) {
+            rerank_vectors_.reset(new VectorStore(max_elements_, data_size_));
+        } else {
+            rerank_vectors_.reset(new VectorStore(location, max_elements_, data_size_, true));
+        }
+        for (size_t i = 0; i < cur_element_count; i++) {
+            rerank_vectors_->set(i, getDataByInternalId(i));
+        }
+        rerank_fstdistfunc_ = exact_space->get_dist_func();
+        rerank_dist_func_param_ = exact_space->get_dist_func_param();
+    }
+
+
+    /*
+    * The vector kept for re-ranking an element added as data_point: exact_vector, or data_point itself
+    * while the index still holds the exact vectors. nullptr without re-ranking vectors.
+    */
+    const void *rerankVector(const void *data_point, const void *exact_vector) const {
+        if (!rerank_vectors_)
+            return nullptr;
+        if (!rerank_vectors_->writable())
+            throw std::runtime_error("The re-ranking vectors are mapped read-only, resizeIndex copies them into memory");
+        if (exact_vector != nullptr)
+            return exact_vector;
+        if (data_size_ != rerank_vectors_->elementSize())
+            throw std::runtime_error("The index keeps re-ranking vectors, pass the exact vector of the element");
+        return data_point;
+    }
+
+
+    // Maps the vectors written by keepRerankVectors(exact_space, location) read-only, e.g. after loadIndex
+    void loadRerankVectors(SpaceInterface<dist_t> *exact_space, const std::string &location) {
+        std::unique_ptr<VectorStore> vectors(new VectorStore(location, 0, exact_space->get_data_size(), false));
+        if (vectors->capacity() < cur_element_count)
+            throw std::runtime_error("The vector file holds less vectors than the index");
+        rerank_vectors_.swap(vectors);
+        rerank_fstdistfunc_ = exact_space->get_dist_func();
+        rerank_dist_func_param_ = exact_space->get_dist_func_param();
+    }
+
+
+    /*
+    * Two stage search: the graph is traversed with the compact codes, then the best k * rerank_factor
+    * candidates are scored again with the full precision vectors kept by keepRerankVectors.
+    * exact_query is the query for the exact space, by default query_data itself (e.g. the float query of a PQ index).
+    */
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnnRerank(
+        const void *query_data,
+        size_t k,
+        size_t rerank_factor = 4,
+        BaseFilterFunctor* isIdAllowed = nullptr,
+        const void *exact_query = nullptr) const {
+        if (!rerank_vectors_)
+            throw std::runtime_error("No re-ranking vectors, call keepRerankVectors first");
+        std::priority_queue<std::pair<dist_t, labeltype >> result;
+        if (cur_element_count == 0) return result;
+        if (exact_query == nullptr) exact_query = query_data;
+
+        static thread_local std::vector<char> prepared_query;
+        size_t query_stride;
+        query_data = prepareQueries(query_data, 1, prepared_query, query_stride);
+
+        tableint currObj = searchUpperLayers(query_data);
+
+        size_t num_candidates = k * std::max(rerank_factor, (size_t) 1);
+        size_t ef = std::max(ef_, num_candidates);
+        HeapSearchQueues queues;
+        if (!num_deleted_ && !isIdAllowed) {
+            searchBaseLayerST<true, true>(queues, currObj, query_data, ef, 0, isIdAllowed);
+        } else {
+            searchBaseLayerST<false>(queues, currObj, query_data, ef, 0, isIdAllowed);
+        }
+
+        auto &top_candidates = queues.top_candidates;
+        while (top_candidates.size() > num_candidates) {
+            top_candidates.pop();
+        }
+        while (!top_candidates.empty()) {
+            tableint id = top_candidates.top().second;
+            top_candidates.pop();
+            dist_t dist = rerank_fstdistfunc_(exact_query, rerank_vectors_->get(id), rerank_dist_func_param_, 1.0f);
+            result.emplace(dist, getExternalLabel(id));
+            if (result.size() > k)
+                result.pop();
+        }
+        return result;
+    }
+
+
+    // Greedy search from the entry point down to level 1, returns the entry point for level 0
+    tableint searchUpperLayers(const void *query_data) const {
         tableint currObj = enterpoint_node_;
         dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_, scale2_);
         // add residuals
@@ -2072,17 +3881,29 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 }
             }
         }
+        return currObj;
+    }
 
-        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+
+    template <typename search_queues_t>
+    void searchKnnBaseLayer(
+        search_queues_t &queues,
+        tableint currObj,
+        const void *query_data,
+        size_t k,
+        float q_residual,
+        BaseFilterFunctor* isIdAllowed,
+        std::priority_queue<std::pair<dist_t, labeltype >> &result) const {
         bool bare_bone_search = !num_deleted_ && !isIdAllowed;
         if (bare_bone_search) {
-            top_candidates = searchBaseLayerST<true, true>( // collect_metrics
-                    currObj, query_data, std::max(ef_, k), q_residual, isIdAllowed);
+            searchBaseLayerST<true, true>( // collect_metrics
+                    queues, currObj, query_data, std::max(ef_, k), q_residual, isIdAllowed);
         } else {
-            top_candidates = searchBaseLayerST<false>(
-                    currObj, query_data, std::max(ef_, k), q_residual, isIdAllowed);
+            searchBaseLayerST<false>(
+                    queues, currObj, query_data, std::max(ef_, k), q_residual, isIdAllowed);
         }
 
+        auto &top_candidates = queues.top_candidates;
         while (top_candidates.size() > k) {
             top_candidates.pop();
         }
@@ -2091,7 +3912,306 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             result.push(std::pair<dist_t, labeltype>(rez.first, getExternalLabel(rez.second)));
             top_candidates.pop();
         }
-        return result;
+    }
+
+
+    // Level-0 search state of one query inside searchKnnBatch
+    template <typename search_queues_t>
+    struct BatchQueryState : search_queues_t {
+        const void *query;
+        VisitedList *vl;
+        dist_t lowerBound;
+        std::vector<linklistsizeint> links0;  // the list expanded last if the links are compressed
+    };
+
+
+    /*
+    * Searches a block of queries together. Queries are stored contiguously, data_size_ bytes each.
+    * Queries that sit on the same upper-layer node share the loads of its neighbours, and the
+    * level-0 expansions of all queries are interleaved so that the link list fetch of one query
+    * overlaps with the distance computations of the others.
+    * Results are written closer first to distances[nq * k] and labels[nq * k]; slots that can not
+    * be filled get the max distance and label -1. Returns false if any query got less than k results.
+    */
+    bool searchKnnBatch(
+        const void *queries,
+        size_t nq,
+        size_t k,
+        dist_t *distances,
+        labeltype *labels,
+        BaseFilterFunctor* isIdAllowed = nullptr) const {
+        if (nq == 0 || k == 0) return true;
+        if (cur_element_count == 0) {
+            std::fill(distances, distances + nq * k, std::numeric_limits<dist_t>::max());
+            std::fill(labels, labels + nq * k, (labeltype) -1);
+            return false;
+        }
+
+        static thread_local std::vector<char> prepared_queries;
+        size_t query_stride;
+        queries = prepareQueries(queries, nq, prepared_queries, query_stride);
+
+        std::vector<tableint> curr_obj(nq, enterpoint_node_);
+        std::vector<dist_t> curr_dist(nq);
+        const char *ep_data = getDataByInternalId(enterpoint_node_);
+        for (size_t q = 0; q < nq; q++) {
+            curr_dist[q] = fstdistfunc_(batchQuery(queries, query_stride, q), ep_data, dist_func_param_, scale2_);
+        }
+
+        // Greedy descent, queries resting on the same node scan its neighbours together
+        long hops = 0, distance_computations = 0;
+        std::vector<size_t> active, next_active;
+        std::vector<char> changed(nq);
+        for (int level = maxlevel_; level > 0; level--) {
+            active.resize(nq);
+            for (size_t q = 0; q < nq; q++) active[q] = q;
+
+            while (!active.empty()) {
+                std::sort(active.begin(), active.end(), [&curr_obj](size_t a, size_t b) {
+                    return curr_obj[a] < curr_obj[b];
+                });
+                next_active.clear();
+
+                size_t group_begin = 0;
+                while (group_begin < active.size()) {
+                    tableint node = curr_obj[active[group_begin]];
+                    size_t group_end = group_begin + 1;
+                    while (group_end < active.size() && curr_obj[active[group_end]] == node) group_end++;
+
+                    unsigned int *data = (unsigned int *) get_linklist(node, level);
+                    int size = getListCount(data);
+                    hops += group_end - group_begin;
+                    distance_computations += size * (group_end - group_begin);
+
+                    for (size_t g = group_begin; g < group_end; g++) changed[active[g]] = false;
+
+                    tableint *datal = (tableint *) (data + 1);
+                    for (int i = 0; i < size; i++) {
+                        tableint cand = datal[i];
+                        if (cand < 0 || cand > max_elements_)
+                            throw std::runtime_error("cand error");
+#ifdef USE_SSE
+                        if (i + 1 < size)
+                            _mm_prefetch(getDataByInternalId(datal[i + 1]), _MM_HINT_T0);
+#endif
+                        const char *cand_data = getDataByInternalId(cand);
+                        for (size_t g = group_begin; g < group_end; g++) {
+                            size_t q = active[g];
+                            dist_t d = fstdistfunc_(batchQuery(queries, query_stride, q), cand_data, dist_func_param_, scale2_);
+                            if (d < curr_dist[q]) {
+                                curr_dist[q] = d;
+                                curr_obj[q] = cand;
+                                changed[q] = true;
+                            }
+                        }
+                    }
+
+                    for (size_t g = group_begin; g < group_end; g++) {
+                        if (changed[active[g]]) next_active.push_back(active[g]);
+                    }
+                    group_begin = group_end;
+                }
+                active.swap(next_active);
+            }
+        }
+        metric_hops += hops;
+        metric_distance_computations += distance_computations;
+
+        size_t ef = std::max(ef_, k);
+        if (use_flat_candidate_pool_) {
+            static thread_local std::vector<BatchQueryState<FlatSearchQueues>> states;
+            if (states.size() < nq) states.resize(nq);
+            for (size_t q = 0; q < nq; q++) states[q].reset(ef);
+            return searchKnnBatchBaseLayer(states.data(), queries, query_stride, nq, k, ef, curr_obj, curr_dist,
+                                           distances, labels, isIdAllowed);
+        }
+        std::vector<BatchQueryState<HeapSearchQueues>> states(nq);
+        return searchKnnBatchBaseLayer(states.data(), queries, query_stride, nq, k, ef, curr_obj, curr_dist,
+                                       distances, labels, isIdAllowed);
+    }
+
+
+    template <typename batch_state_t>
+    bool searchKnnBatchBaseLayer(
+        batch_state_t *states,
+        const void *queries,
+        size_t query_stride,
+        size_t nq,
+        size_t k,
+        size_t ef,
+        const std::vector<tableint> &curr_obj,
+        const std::vector<dist_t> &curr_dist,
+        dist_t *distances,
+        labeltype *labels,
+        BaseFilterFunctor* isIdAllowed) const {
+        // gives the visited lists back to the pool, also when the filter or the search throws
+        struct VisitedListsGuard {
+            VisitedListPool *pool;
+            batch_state_t *states;
+            size_t count;
+            ~VisitedListsGuard() {
+                for (size_t q = 0; q < count; q++) pool->releaseVisitedList(states[q].vl);
+            }
+        } visited_lists{visited_list_pool_.get(), states, 0};
+
+        bool bare_bone_search = !num_deleted_ && !isIdAllowed;
+        for (size_t q = 0; q < nq; q++) {
+            batch_state_t &state = states[q];
+            state.query = batchQuery(queries, query_stride, q);
+            state.vl = visited_list_pool_->getFreeVisitedList();
+            visited_lists.count++;
+            tableint ep_id = curr_obj[q];
+            if (bare_bone_search ||
+                (!isMarkedDeleted(ep_id) && ((!isIdAllowed) || (*isIdAllowed)(getExternalLabel(ep_id))))) {
+                state.lowerBound = curr_dist[q];
+                state.top_candidates.emplace(curr_dist[q], ep_id);
+                state.candidate_set.emplace(-curr_dist[q], ep_id);
+            } else {
+                state.lowerBound = std::numeric_limits<dist_t>::max();
+                state.candidate_set.emplace(-state.lowerBound, ep_id);
+            }
+            state.vl->mass[ep_id] = state.vl->curV;
+        }
+
+        // Round-robin over the live queries: first pick and prefetch the next node of every query,
+        // then expand them, so the fetches are in flight while the other queries compute distances
+        std::vector<size_t> live(nq);
+        std::vector<tableint> next_node(nq);
+        for (size_t q = 0; q < nq; q++) live[q] = q;
+        while (!live.empty()) {
+            size_t num_live = 0;
+            for (size_t i = 0; i < live.size(); i++) {
+                size_t q = live[i];
+                batch_state_t &state = states[q];
+                if (state.candidate_set.empty()) continue;
+                std::pair<dist_t, tableint> current_node_pair = state.candidate_set.top();
+                if (-current_node_pair.first > state.lowerBound &&
+                    (bare_bone_search || state.top_candidates.size() == ef)) {
+                    continue;
+                }
+                state.candidate_set.pop();
+                next_node[q] = current_node_pair.second;
+#ifdef USE_SSE
+                _mm_prefetch((char *) get_linklist0(next_node[q]), _MM_HINT_T0);
+#endif
+                live[num_live++] = q;
+            }
+            live.resize(num_live);
+
+            for (size_t i = 0; i < live.size(); i++) {
+                size_t q = live[i];
+                if (bare_bone_search) {
+                    expandBatchCandidate<true>(states[q], next_node[q], ef, isIdAllowed);
+                } else {
+                    expandBatchCandidate<false>(states[q], next_node[q], ef, isIdAllowed);
+                }
+            }
+        }
+
+        bool all_found = true;
+        for (size_t q = 0; q < nq; q++) {
+            batch_state_t &state = states[q];
+            while (state.top_candidates.size() > k) {
+                state.top_candidates.pop();
+            }
+            size_t found = state.top_candidates.size();
+            if (found < k) all_found = false;
+            for (size_t i = found; i < k; i++) {
+                distances[q * k + i] = std::numeric_limits<dist_t>::max();
+                labels[q * k + i] = (labeltype) -1;
+            }
+            while (!state.top_candidates.empty()) {
+                found--;
+                distances[q * k + found] = state.top_candidates.top().first;
+                labels[q * k + found] = getExternalLabel(state.top_candidates.top().second);
+                state.top_candidates.pop();
+            }
+        }
+        return all_found;
+    }
+
+
+    inline const void *batchQuery(const void *queries, size_t query_stride, size_t q) const {
+        return (const char *) queries + q * query_stride;
+    }
+
+
+    /*
+    * Runs the space's prepare_query on nq contiguous queries (e.g. builds the PQ distance tables).
+    * Returns the queries to pass to the distance function and their stride, the input itself
+    * if the space takes queries as they are.
+    */
+    const void *prepareQueries(const void *queries, size_t nq, std::vector<char> &buffer, size_t &query_stride) const {
+        size_t query_data_size = space_ ? space_->get_query_data_size() : 0;
+        if (query_data_size == 0) {
+            query_stride = data_size_;
+            return queries;
+        }
+        size_t input_size = space_->get_query_input_size();
+        buffer.resize(nq * query_data_size);
+        for (size_t q = 0; q < nq; q++) {
+            space_->prepare_query((const char *) queries + q * input_size, buffer.data() + q * query_data_size);
+        }
+        query_stride = query_data_size;
+        return buffer.data();
+    }
+
+
+    // One level-0 expansion step of searchKnnBatch, same logic as searchBaseLayerST without a stop condition
+    template <bool bare_bone_search, typename batch_state_t>
+    void expandBatchCandidate(batch_state_t &state, tableint current_node_id, size_t ef, BaseFilterFunctor* isIdAllowed) const {
+        vl_type *visited_array = state.vl->mass;
+        vl_type visited_array_tag = state.vl->curV;
+        char *level0 = searchLevel0();
+
+        int *data;
+        if (links0_codec_ == LINKS0_PLAIN) {
+            data = (int *) get_linklist0(current_node_id, level0);
+        } else {
+            state.links0.resize(maxM0_ + 2);
+            data = (int *) decodeLinkList0(current_node_id, level0, state.links0.data());
+        }
+        size_t size = getListCount((linklistsizeint*)data);
+        if (bare_bone_search) {
+            metric_hops++;
+            metric_distance_computations+=size;
+        }
+
+#ifdef USE_SSE
+        _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
+        _mm_prefetch(getDataByInternalId(*(data + 1), level0), _MM_HINT_T0);
+#endif
+
+        for (size_t j = 1; j <= size; j++) {
+            int candidate_id = *(data + j);
+#ifdef USE_SSE
+            _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*(data + j + 1), level0),
+                            _MM_HINT_T0);
+#endif
+            if (visited_array[candidate_id] == visited_array_tag) continue;
+            visited_array[candidate_id] = visited_array_tag;
+
+            char *currObj1 = getDataByInternalId(candidate_id, level0);
+            dist_t dist = fstdistfunc_(state.query, currObj1, dist_func_param_, scale2_);
+            if (state.top_candidates.size() < ef || state.lowerBound > dist) {
+                state.candidate_set.emplace(-dist, candidate_id);
+
+                if (bare_bone_search ||
+                    (!isMarkedDeleted(candidate_id) && ((!isIdAllowed) || (*isIdAllowed)(getExternalLabel(candidate_id))))) {
+                    state.top_candidates.emplace(dist, candidate_id);
+                }
+
+                while (state.top_candidates.size() > ef) {
+                    state.top_candidates.pop();
+                }
+
+                if (!state.top_candidates.empty())
+                    state.lowerBound = state.top_candidates.top().first;
+                if (state.top_candidates.size() >= ef)
+                    dropFartherCandidates(state.candidate_set, state.lowerBound);
+            }
+        }
     }
 
 
@@ -2103,6 +4223,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::vector<std::pair<dist_t, labeltype >> result;
         if (cur_element_count == 0) return result;
 
+        static thread_local std::vector<char> prepared_query;
+        size_t query_stride;
+        query_data = prepareQueries(query_data, 1, prepared_query, query_stride);
+
         tableint currObj = enterpoint_node_;
         dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_, scale2_);
 
@@ -2134,12 +4258,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-        top_candidates = searchBaseLayerST<false>(currObj, query_data, 0, isIdAllowed, &stop_condition);
+        top_candidates = searchBaseLayerST<false>(currObj, query_data, 0, 0, isIdAllowed, &stop_condition);
 
         size_t sz = top_candidates.size();
         result.resize(sz);
         while (!top_candidates.empty()) {
-            result[--sz] = top_candidates.top();
+            std::pair<dist_t, tableint> rez = top_candidates.top();
+            result[--sz] = std::pair<dist_t, labeltype>(rez.first, getExternalLabel(rez.second));
             top_candidates.pop();
         }
 
@@ -2150,6 +4275,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     void checkIntegrity() {
+        checkLinksNotCompressed();
         int connections_checked = 0;
         std::vector <int > inbound_connections_num(cur_element_count, 0);
         for (int i = 0; i < cur_element_count; i++) {
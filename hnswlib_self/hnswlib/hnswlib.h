@@ -20,6 +20,17 @@
 #endif
 #endif
 
+// Kernels compiled for their own instruction set with SIMD_TARGET and picked at runtime,
+// so a binary built for a generic target still uses e.g. AVX-512 where the CPU has it
+#if defined(USE_SSE) && (defined(__GNUC__) || defined(_MSC_VER))
+#define USE_SIMD_DISPATCH
+#if defined(__GNUC__)
+#define SIMD_TARGET(arch) __attribute__((target(arch)))
+#else
+#define SIMD_TARGET(arch)
+#endif
+#endif
+
 #if defined(USE_AVX) || defined(USE_SSE)
 #ifdef _MSC_VER
 #include <intrin.h>
@@ -114,6 +125,46 @@ static bool AVX512Capable() {
     }
     return HW_AVX512F && avx512Supported;
 }
+
+static bool SSE41Capable() {
+    int cpuInfo[4];
+
+    cpuid(cpuInfo, 0, 0);
+    int nIds = cpuInfo[0];
+    if (nIds < 0x00000001) return false;
+
+    cpuid(cpuInfo, 0x00000001, 0);
+    return (cpuInfo[2] & ((int)1 << 19)) != 0;
+}
+
+static bool AVX2Capable() {
+    if (!AVXCapable()) return false;
+
+    int cpuInfo[4];
+
+    cpuid(cpuInfo, 0, 0);
+    int nIds = cpuInfo[0];
+    if (nIds < 0x00000007) return false;
+
+    cpuid(cpuInfo, 0x00000007, 0);
+    return (cpuInfo[1] & ((int)1 << 5)) != 0;
+}
+
+static bool AVX512BWCapable() {
+    if (!AVX512Capable()) return false;
+
+    int cpuInfo[4];
+    cpuid(cpuInfo, 0x00000007, 0);
+    return (cpuInfo[1] & ((int)1 << 30)) != 0;
+}
+
+static bool AVX512VNNICapable() {
+    if (!AVX512BWCapable()) return false;
+
+    int cpuInfo[4];
+    cpuid(cpuInfo, 0x00000007, 0);
+    return (cpuInfo[2] & ((int)1 << 11)) != 0;
+}
 #endif
 
 #include <queue>
@@ -180,6 +231,21 @@ class SpaceInterface {
 
     virtual void *get_dist_func_param() = 0;
 
+    // Size of a query as passed to the search, by default a query is a stored element
+    virtual size_t get_query_input_size() { return get_data_size(); }
+
+    // Size of a prepared query, 0 if the distance function takes the query as it is
+    virtual size_t get_query_data_size() { return 0; }
+
+    // Converts a query once per search into the form the distance function expects as its first argument
+    virtual void prepare_query(const void *query_data, void *prepared_query) {}
+
+    // Distance between two stored elements, which the graph is built with; the same as the search
+    // distance unless queries are prepared into another form than the elements
+    virtual DISTFUNC<MTYPE> get_code_dist_func() { return get_dist_func(); }
+
+    virtual void *get_code_dist_func_param() { return get_dist_func_param(); }
+
     virtual ~SpaceInterface() {}
 };
 
@@ -226,5 +292,7 @@ AlgorithmInterface<dist_t>::searchKnnCloserFirst(const void* query_data, size_t
 #include "stop_condition.h"
 #include "bruteforce.h"
 #include "hnswalg.h"
+#include "sharded_hnsw.h"
+#include "merge_files.h"
 #include "space_pq.h"
 #include "space_int8.h"
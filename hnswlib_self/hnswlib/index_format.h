@@ -0,0 +1,503 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace hnswlib {
+
+/*
+* Layout of the version 2 index file written by HierarchicalNSW::saveIndex(location, 2):
+*
+*   IndexFileHeader2                  magic, version and number of sections
+*   IndexFileSection[num_sections]    id, offset, size and checksum of every section
+*   sections                          each at a multiple of INDEX_SECTION_ALIGNMENT
+*
+* Sections of unknown ids are skipped, so sections can be added without a new version.
+* Arrays are stored as the index holds them in memory, so a mapped file is used in place.
+*/
+static const uint64_t INDEX_FILE_MAGIC = 0x3258444957534e48ULL;  // "HNSWIDX2"
+static const uint32_t INDEX_FILE_VERSION = 2;
+static const size_t INDEX_SECTION_ALIGNMENT = 64;
+
+// Parameters of the graph, the same values in the same order as the header of a version 1 file,
+// then the data size, scale_, scale2_ and the space kind
+static const uint32_t INDEX_SECTION_PARAMS = 1;
+// Level 0 records of the elements
+static const uint32_t INDEX_SECTION_LEVEL0 = 2;
+// int per element, its top level
+static const uint32_t INDEX_SECTION_LEVELS = 3;
+// Upper level links of the elements with a level above 0 in id order, without sizes
+static const uint32_t INDEX_SECTION_LINKS = 4;
+// LabelIndexEntry per label, sorted by label
+static const uint32_t INDEX_SECTION_LABELS = 5;
+// tableint per deleted element, sorted
+static const uint32_t INDEX_SECTION_DELETED = 6;
+// State of the space: PQ codebooks, SQ ranges or the int8 scale
+static const uint32_t INDEX_SECTION_SPACE = 7;
+// PQ residuals, float per element
+static const uint32_t INDEX_SECTION_RESIDUALS = 8;
+// Written instead of LEVEL0 and LINKS when the links are packed: the level 0 records without the
+// neighbour ids, so the list header (count and deletion mark), the data and the label of each element
+static const uint32_t INDEX_SECTION_LEVEL0_DATA = 9;
+// Neighbour ids of all levels in chunks of INDEX_PACKED_CHUNK elements: the number of chunks, the end
+// offsets of the chunks after this directory, then per element its level 0 ids and for every upper
+// level the count and the ids, see packIndexLinks
+static const uint32_t INDEX_SECTION_LINKS_PACKED = 10;
+static const size_t INDEX_PACKED_CHUNK = 4096;
+
+// Kind of the space an index was saved with, a file of a known kind loads only with that kind
+static const uint32_t INDEX_SPACE_OTHER = 0;
+static const uint32_t INDEX_SPACE_L2 = 1;
+static const uint32_t INDEX_SPACE_IP = 2;
+static const uint32_t INDEX_SPACE_L2_INT8 = 3;
+static const uint32_t INDEX_SPACE_IP_INT8 = 4;
+static const uint32_t INDEX_SPACE_PQ = 5;
+static const uint32_t INDEX_SPACE_SQ = 6;
+
+struct IndexFileHeader2 {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_sections;
+};
+
+struct IndexFileSection {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+static inline size_t indexSectionAlign(size_t offset) {
+    return (offset + INDEX_SECTION_ALIGNMENT - 1) & ~(INDEX_SECTION_ALIGNMENT - 1);
+}
+
+/*
+* 64-bit hash fed in pieces of any size. Eight bytes at a time with a multiply and a rotation,
+* so it keeps up with reading the file; it detects corruption, it is not a secure hash.
+*/
+class IndexHash {
+    uint64_t hash_{0x9e3779b97f4a7c15ULL};
+    uint64_t length_{0};
+    unsigned char tail_[8];
+    size_t tail_size_{0};
+
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    void mix(uint64_t word) {
+        hash_ ^= rotl(word * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+        hash_ = rotl(hash_, 27) * 5 + 0x52dce729;
+    }
+
+ public:
+    void update(const void *data, size_t size) {
+        if (size == 0)
+            return;
+        const unsigned char *bytes = (const unsigned char *) data;
+        length_ += size;
+        if (tail_size_ > 0) {
+            size_t n = std::min(size, 8 - tail_size_);
+            memcpy(tail_ + tail_size_, bytes, n);
+            tail_size_ += n;
+            bytes += n;
+            size -= n;
+            if (tail_size_ < 8)
+                return;
+            uint64_t word;
+            memcpy(&word, tail_, 8);
+            mix(word);
+            tail_size_ = 0;
+        }
+        for (; size >= 8; bytes += 8, size -= 8) {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            mix(word);
+        }
+        memcpy(tail_, bytes, size);
+        tail_size_ = size;
+    }
+
+    uint64_t digest() const {
+        IndexHash last = *this;
+        uint64_t word = 0;
+        memcpy(&word, tail_, tail_size_);
+        last.mix(word ^ length_);
+        uint64_t h = last.hash_;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+};
+
+/*
+* Checksum of a section: the hash of the hashes of its blocks of INDEX_CHECKSUM_BLOCK bytes, the last
+* one may be shorter, so the blocks of a section are hashed on all threads when it is written or read.
+*/
+static const size_t INDEX_CHECKSUM_BLOCK = (size_t) 1 << 22;
+
+class IndexChecksum {
+    IndexHash block_;
+    size_t block_size_{0};
+    IndexHash blocks_;
+
+ public:
+    void update(const void *data, size_t size) {
+        const char *bytes = (const char *) data;
+        while (size > 0) {
+            size_t n = std::min(size, INDEX_CHECKSUM_BLOCK - block_size_);
+            block_.update(bytes, n);
+            block_size_ += n;
+            bytes += n;
+            size -= n;
+            if (block_size_ == INDEX_CHECKSUM_BLOCK) {
+                uint64_t block_checksum = block_.digest();
+                blocks_.update(&block_checksum, sizeof(block_checksum));
+                block_ = IndexHash();
+                block_size_ = 0;
+            }
+        }
+    }
+
+    uint64_t digest() const {
+        IndexHash blocks = blocks_;
+        if (block_size_ > 0) {
+            uint64_t block_checksum = block_.digest();
+            blocks.update(&block_checksum, sizeof(block_checksum));
+        }
+        return blocks.digest();
+    }
+
+    static uint64_t ofBlock(const void *data, size_t size) {
+        IndexHash block;
+        block.update(data, size);
+        return block.digest();
+    }
+
+    static uint64_t combine(const std::vector<uint64_t> &block_checksums) {
+        IndexHash blocks;
+        blocks.update(block_checksums.data(), block_checksums.size() * sizeof(uint64_t));
+        return blocks.digest();
+    }
+
+    static uint64_t of(const void *data, size_t size) {
+        const char *bytes = (const char *) data;
+        std::vector<uint64_t> block_checksums((size + INDEX_CHECKSUM_BLOCK - 1) / INDEX_CHECKSUM_BLOCK);
+#pragma omp parallel for schedule(dynamic)
+        for (long long b = 0; b < (long long) block_checksums.size(); b++) {
+            size_t offset = b * INDEX_CHECKSUM_BLOCK;
+            block_checksums[b] = ofBlock(bytes + offset, std::min(INDEX_CHECKSUM_BLOCK, size - offset));
+        }
+        return combine(block_checksums);
+    }
+};
+
+static inline void writeVarint(std::vector<uint8_t> &out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t) value);
+}
+
+// false if the varint runs past end
+static inline bool readVarint(const uint8_t *&p, const uint8_t *end, uint32_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p == end)
+            return false;
+        uint8_t byte = *p++;
+        value |= (uint32_t) (byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+/*
+* Neighbour ids sorted and coded as the varints of their differences, so a list takes about a byte per
+* neighbour less than its slots; ids close to each other, as after a reordering, take a byte or two.
+* The order of the neighbours of a list is not kept, the search does not depend on it.
+*/
+static inline void packIndexLinks(const uint32_t *ids, size_t count, std::vector<uint32_t> &sorted, std::vector<uint8_t> &out) {
+    sorted.assign(ids, ids + count);
+    std::sort(sorted.begin(), sorted.end());
+    uint32_t previous = 0;
+    for (uint32_t id : sorted) {
+        writeVarint(out, id - previous);
+        previous = id;
+    }
+}
+
+// false if the ids run past end or are not below num_elements
+static inline bool unpackIndexLinks(const uint8_t *&p, const uint8_t *end, size_t count, size_t num_elements, uint32_t *ids) {
+    uint64_t id = 0;
+    for (size_t j = 0; j < count; j++) {
+        uint32_t delta;
+        if (!readVarint(p, end, delta))
+            return false;
+        id += delta;
+        if (id >= num_elements)
+            return false;
+        ids[j] = (uint32_t) id;
+    }
+    return true;
+}
+
+
+/*
+* Copies the bytes [offset, offset + size) of a concatenation of pieces to out. Piece i starts at
+* starts[i], starts has one more entry for the end, and copy(i, pos, n, out) copies its bytes [pos, pos + n).
+*/
+template<typename Copy>
+static void fillIndexPieces(const std::vector<size_t> &starts, Copy copy, size_t offset, size_t size, char *out) {
+    size_t i = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+    while (size > 0) {
+        size_t n = std::min(size, starts[i + 1] - offset);
+        if (n > 0) {
+            copy(i, offset - starts[i], n, out);
+            offset += n;
+            out += n;
+            size -= n;
+        }
+        i++;
+    }
+}
+
+
+/*
+* Writes a file in blocks of INDEX_CHECKSUM_BLOCK bytes on all threads. A part is a range of the file
+* whose bytes a function copies into the block buffer of a thread; the blocks are hashed for the checksum
+* of their part and written with pwrite, so no part is copied whole and no small writes are made.
+*/
+class ParallelFileWriter {
+ public:
+    // Copies the bytes [offset, offset + size) of the part to out
+    typedef std::function<void(size_t offset, size_t size, char *out)> Fill;
+
+ private:
+    struct Part {
+        size_t file_offset;
+        size_t size;
+        Fill fill;
+        std::vector<uint64_t> block_checksums;
+    };
+    std::string location_;
+    std::vector<Part> parts_;
+
+ public:
+    explicit ParallelFileWriter(const std::string &location) : location_(location) {}
+
+    size_t addPart(size_t file_offset, size_t size, Fill fill) {
+        parts_.push_back({file_offset, size, fill, std::vector<uint64_t>()});
+        return parts_.size() - 1;
+    }
+
+    size_t addBuffer(size_t file_offset, const void *data, size_t size) {
+        const char *bytes = (const char *) data;
+        return addPart(file_offset, size, [bytes](size_t offset, size_t n, char *out) {
+            memcpy(out, bytes + offset, n);
+        });
+    }
+
+    uint64_t checksum(size_t part) const {
+        return IndexChecksum::combine(parts_[part].block_checksums);
+    }
+
+    // Writes the parts to a file of file_size bytes, zeros between them
+    void write(size_t file_size) {
+        std::vector<std::pair<size_t, size_t>> blocks;  // part, block
+        for (size_t p = 0; p < parts_.size(); p++) {
+            size_t num_blocks = (parts_[p].size + INDEX_CHECKSUM_BLOCK - 1) / INDEX_CHECKSUM_BLOCK;
+            parts_[p].block_checksums.assign(num_blocks, 0);
+            for (size_t b = 0; b < num_blocks; b++) blocks.emplace_back(p, b);
+        }
+#if defined(_WIN32)
+        std::ofstream output(location_, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+#else
+        int fd = open(location_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        if (ftruncate(fd, file_size) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to write the index file");
+        }
+#endif
+        std::atomic<bool> failed(false);
+        // an exception must not leave the omp region, the first one is rethrown after it
+        std::exception_ptr error;
+#pragma omp parallel
+        {
+            std::vector<char> buffer(INDEX_CHECKSUM_BLOCK);
+#pragma omp for schedule(dynamic)
+            for (long long i = 0; i < (long long) blocks.size(); i++) {
+                if (failed)
+                    continue;
+                Part &part = parts_[blocks[i].first];
+                size_t offset = blocks[i].second * INDEX_CHECKSUM_BLOCK;
+                size_t size = std::min(INDEX_CHECKSUM_BLOCK, part.size - offset);
+                try {
+                    part.fill(offset, size, buffer.data());
+                } catch (...) {
+#pragma omp critical
+                    {
+                        if (!error) error = std::current_exception();
+                    }
+                    failed = true;
+                    continue;
+                }
+                part.block_checksums[blocks[i].second] = IndexChecksum::ofBlock(buffer.data(), size);
+#if defined(_WIN32)
+#pragma omp critical
+                {
+                    output.seekp(part.file_offset + offset);
+                    output.write(buffer.data(), size);
+                }
+#else
+                if (!pwriteAll(fd, buffer.data(), size, part.file_offset + offset))
+                    failed = true;
+#endif
+            }
+        }
+#if defined(_WIN32)
+        output.close();
+        bool write_failed = failed || !output;
+#else
+        bool write_failed = close(fd) != 0 || failed;
+#endif
+        if (error)
+            std::rethrow_exception(error);
+        if (write_failed)
+            throw std::runtime_error("Failed to write the index file");
+    }
+
+    // Overwrites bytes of the written file, e.g. a header holding the checksums of the parts
+    void writeAt(size_t file_offset, const void *data, size_t size) {
+#if defined(_WIN32)
+        std::fstream output(location_, std::ios::binary | std::ios::in | std::ios::out);
+        output.seekp(file_offset);
+        output.write((const char *) data, size);
+        output.close();
+        if (!output)
+            throw std::runtime_error("Failed to write the index file");
+#else
+        int fd = open(location_.c_str(), O_WRONLY);
+        bool written = fd >= 0 && pwriteAll(fd, (const char *) data, size, file_offset);
+        if (fd >= 0 && close(fd) != 0)
+            written = false;
+        if (!written)
+            throw std::runtime_error("Failed to write the index file");
+#endif
+    }
+
+ private:
+#if !defined(_WIN32)
+    static bool pwriteAll(int fd, const char *data, size_t size, size_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+#endif
+};
+
+
+// Reads the header and the section table of a version 2 file, false if the stream holds another file
+static inline bool readIndexSections(std::istream &input, std::vector<IndexFileSection> &sections) {
+    IndexFileHeader2 header;
+    input.read((char *) &header, sizeof(header));
+    if (!input || header.magic != INDEX_FILE_MAGIC)
+        return false;
+    if (header.version != INDEX_FILE_VERSION)
+        throw std::runtime_error("Unsupported index file version " + std::to_string(header.version));
+    if (header.num_sections > 4096)
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+    sections.resize(header.num_sections);
+    input.read((char *) sections.data(), header.num_sections * sizeof(IndexFileSection));
+    if (!input)
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+    return true;
+}
+
+static inline const IndexFileSection *findIndexSection(const std::vector<IndexFileSection> &sections, uint32_t id) {
+    for (const IndexFileSection &section : sections) {
+        if (section.id == id)
+            return &section;
+    }
+    return nullptr;
+}
+
+static inline const IndexFileSection &requireIndexSection(const std::vector<IndexFileSection> &sections, uint32_t id) {
+    const IndexFileSection *section = findIndexSection(sections, id);
+    if (section == nullptr)
+        throw std::runtime_error("Index file has no section " + std::to_string(id));
+    return *section;
+}
+
+// Throws unless every section lies within a file of file_size bytes
+static inline void checkIndexSections(const std::vector<IndexFileSection> &sections, size_t file_size) {
+    for (const IndexFileSection &section : sections) {
+        if (section.offset > file_size || section.size > file_size - section.offset)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+}
+
+static inline void checkIndexSectionData(const IndexFileSection &section, const void *data) {
+    if (IndexChecksum::of(data, section.size) != section.checksum)
+        throw std::runtime_error("Index seems to be corrupted: wrong checksum of section " + std::to_string(section.id));
+}
+
+// Kind of the space a version 2 file was saved with, the last field of its parameters section, and
+// INDEX_SPACE_OTHER for a version 1 file, which does not record it
+static inline uint32_t readIndexSpaceKind(const std::string &location) {
+    std::ifstream input(location, std::ios::binary);
+    if (!input.is_open())
+        throw std::runtime_error("Cannot open file");
+    std::vector<IndexFileSection> sections;
+    if (!readIndexSections(input, sections))
+        return INDEX_SPACE_OTHER;
+    const IndexFileSection &params = requireIndexSection(sections, INDEX_SECTION_PARAMS);
+    if (params.size < sizeof(uint32_t) || params.size > ((size_t) 1 << 20))
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+    std::vector<char> data(params.size);
+    input.seekg(params.offset, input.beg);
+    input.read(data.data(), data.size());
+    if (!input)
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+    checkIndexSectionData(params, data.data());
+    uint32_t space_kind;
+    memcpy(&space_kind, data.data() + data.size() - sizeof(space_kind), sizeof(space_kind));
+    return space_kind;
+}
+
+}  // namespace hnswlib
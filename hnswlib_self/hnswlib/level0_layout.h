@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace hnswlib {
+
+// Layouts of level 0, see HierarchicalNSW::setLayout
+static const int LAYOUT_INTERLEAVED = 0;  // one record of links, vector and label per element, as in the index file
+static const int LAYOUT_SPLIT = 1;  // an array of the links, one of the vectors and one of the labels
+static const int LAYOUT_COMPRESSED = 2;  // LAYOUT_SPLIT keeping only the header of each list, see compressLevel0
+
+// Alignment of the level 0 block and of its vector array in the split layout, a cache line and an AVX-512 load
+static const size_t LEVEL0_ALIGNMENT = 64;
+
+/*
+* Where the fields of the elements are in level 0: element i has its level 0 links at
+* links0_region + i * links0_stride, its vector at data_region + i * data_stride and its label at
+* labels_region + i * labels_stride, all from the start of level 0.
+*/
+struct Level0Layout {
+    int type{LAYOUT_INTERLEAVED};
+    size_t links0_region{0};
+    size_t links0_stride{0};
+    size_t data_region{0};
+    size_t data_stride{0};
+    size_t labels_region{0};
+    size_t labels_stride{0};
+};
+
+static inline size_t alignLevel0(size_t size) {
+    return (size + LEVEL0_ALIGNMENT - 1) / LEVEL0_ALIGNMENT * LEVEL0_ALIGNMENT;
+}
+
+/*
+* Bytes between two vectors in the split layout: vectors of a cache line or more start on one,
+* smaller ones, e.g. quantization codes, take a power of two and never straddle two lines.
+*/
+static inline size_t splitDataStride(size_t data_size) {
+    if (data_size >= LEVEL0_ALIGNMENT)
+        return alignLevel0(data_size);
+    size_t stride = 1;
+    while (stride < data_size) stride <<= 1;
+    return stride;
+}
+
+}  // namespace hnswlib
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace hnswlib {
+
+// Bounds of the size of a new LinkArena chunk, which grows with the arena
+static const size_t LINK_ARENA_MIN_CHUNK = (size_t) 1 << 16;
+static const size_t LINK_ARENA_MAX_CHUNK = (size_t) 1 << 24;
+
+/*
+* Memory of the upper level link lists: carved out of large chunks instead of one malloc per
+* element, so a million lists are a few allocations, are freed at once and lie next to each other
+* in the order they were allocated. Lists never move and live until clear. Allocation is thread safe.
+*/
+class LinkArena {
+    std::vector<char *> chunks_;
+    size_t chunk_used_{0};  // bytes used of the last chunk
+    size_t chunk_size_{0};  // of the last chunk
+    size_t allocated_{0};  // bytes of all chunks
+    std::mutex lock_;
+
+    bool addChunk(size_t size) {
+        char *chunk = (char *) malloc(size);
+        if (chunk == nullptr)
+            return false;
+        chunks_.push_back(chunk);
+        chunk_used_ = 0;
+        chunk_size_ = size;
+        allocated_ += size;
+        return true;
+    }
+
+ public:
+    LinkArena() = default;
+    LinkArena(const LinkArena &) = delete;
+    LinkArena &operator=(const LinkArena &) = delete;
+
+    ~LinkArena() {
+        clear();
+    }
+
+    // size zeroed bytes, nullptr if there is not enough memory
+    char *allocate(size_t size) {
+        char *list;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            if (chunks_.empty() || chunk_size_ - chunk_used_ < size) {
+                size_t chunk_size = std::min(std::max(allocated_, LINK_ARENA_MIN_CHUNK), LINK_ARENA_MAX_CHUNK);
+                if (!addChunk(std::max(chunk_size, size)))
+                    return nullptr;
+            }
+            list = chunks_.back() + chunk_used_;
+            chunk_used_ += size;
+        }
+        memset(list, 0, size);
+        return list;
+    }
+
+    // Makes the next size bytes of allocations come from one chunk, e.g. before loading all lists
+    bool reserve(size_t size) {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!chunks_.empty() && chunk_size_ - chunk_used_ >= size)
+            return true;
+        return addChunk(std::max(size, (size_t) 1));
+    }
+
+    void clear() {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (char *chunk : chunks_) free(chunk);
+        chunks_.clear();
+        chunk_used_ = 0;
+        chunk_size_ = 0;
+        allocated_ = 0;
+    }
+
+    void swap(LinkArena &other) {
+        std::unique_lock<std::mutex> lock(lock_);
+        std::unique_lock<std::mutex> other_lock(other.lock_);
+        chunks_.swap(other.chunks_);
+        std::swap(chunk_used_, other.chunk_used_);
+        std::swap(chunk_size_, other.chunk_size_);
+        std::swap(allocated_, other.allocated_);
+    }
+
+    size_t chunkCount() const {
+        return chunks_.size();
+    }
+
+    // Bytes of all chunks
+    size_t allocatedBytes() const {
+        return allocated_;
+    }
+};
+
+}  // namespace hnswlib
@@ -0,0 +1,152 @@
+#pragma once
+#include "hnswlib.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace hnswlib {
+
+// Codecs of the level 0 links, see HierarchicalNSW::compressLevel0
+static const int LINKS0_PLAIN = 0;
+static const int LINKS0_STREAMVBYTE = 1;  // differences of the sorted ids in 1 to 4 bytes each
+static const int LINKS0_LOCAL16 = 2;  // sorted ids in 2 bytes each, for at most LINKS0_LOCAL16_MAX_ELEMENTS elements
+
+static const size_t LINKS0_LOCAL16_MAX_ELEMENTS = (size_t) 1 << 16;
+// Bytes the decoders may read past the codes of the last list, the codes are padded with as many
+static const size_t LINKS0_CODE_PADDING = 16;
+
+/*
+* Stream VByte (Lemire, Kurz, Rupp 2017) of count sorted ids appended to out: a control byte per
+* four ids with the byte length of each difference in two bits, then the bytes of all differences.
+* Lengths and bytes kept apart let a decoder take four differences with one shuffle.
+*/
+static void
+EncodeStreamVByte(const uint32_t* sorted, size_t count, std::vector<uint8_t>& out) {
+    size_t control = out.size();
+    out.resize(control + (count + 3) / 4, 0);
+    uint32_t previous = 0;
+    for (size_t j = 0; j < count; j++) {
+        uint32_t delta = sorted[j] - previous;
+        previous = sorted[j];
+        int bytes = delta < (1u << 8) ? 1 : delta < (1u << 16) ? 2 : delta < (1u << 24) ? 3 : 4;
+        out[control + j / 4] |= (uint8_t) ((bytes - 1) << (2 * (j % 4)));
+        for (int b = 0; b < bytes; b++) out.push_back((uint8_t) (delta >> (8 * b)));
+    }
+}
+
+static void
+DecodeStreamVByte(const uint8_t* in, size_t count, uint32_t* ids) {
+    const uint8_t* data = in + (count + 3) / 4;
+    uint32_t previous = 0;
+    for (size_t j = 0; j < count; j++) {
+        int bytes = ((in[j / 4] >> (2 * (j % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        for (int b = 0; b < bytes; b++) delta |= (uint32_t) data[b] << (8 * b);
+        data += bytes;
+        previous += delta;
+        ids[j] = previous;
+    }
+}
+
+// count ids below 65536 in two bytes each, little endian
+static void
+EncodeLocal16(const uint32_t* ids, size_t count, std::vector<uint8_t>& out) {
+    for (size_t j = 0; j < count; j++) {
+        out.push_back((uint8_t) ids[j]);
+        out.push_back((uint8_t) (ids[j] >> 8));
+    }
+}
+
+static void
+DecodeLocal16(const uint8_t* in, size_t count, uint32_t* ids) {
+    for (size_t j = 0; j < count; j++) {
+        ids[j] = (uint32_t) in[2 * j] | ((uint32_t) in[2 * j + 1] << 8);
+    }
+}
+
+#if defined(USE_SIMD_DISPATCH)
+
+// Per control byte: the shuffle spreading the bytes of four differences to 32 bit lanes, and their length
+struct StreamVByteTables {
+    uint8_t shuffle[256][16];
+    uint8_t length[256];
+
+    StreamVByteTables() {
+        for (int control = 0; control < 256; control++) {
+            int pos = 0;
+            for (int k = 0; k < 4; k++) {
+                int bytes = ((control >> (2 * k)) & 3) + 1;
+                for (int b = 0; b < 4; b++) shuffle[control][4 * k + b] = b < bytes ? (uint8_t) (pos + b) : 0xff;
+                pos += bytes;
+            }
+            length[control] = (uint8_t) pos;
+        }
+    }
+};
+
+static const StreamVByteTables&
+streamVByteTables() {
+    static const StreamVByteTables tables;
+    return tables;
+}
+
+// Four ids per shuffle and prefix sum, reads up to 15 bytes past the differences
+SIMD_TARGET("sse4.1")
+static void
+DecodeStreamVByteSSE41(const uint8_t* in, size_t count, uint32_t* ids) {
+    const StreamVByteTables& tables = streamVByteTables();
+    const uint8_t* data = in + (count + 3) / 4;
+    __m128i previous = _mm_setzero_si128();
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        uint8_t control = in[j / 4];
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) data),
+                                     _mm_loadu_si128((const __m128i*) tables.shuffle[control]));
+        data += tables.length[control];
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        previous = _mm_add_epi32(v, _mm_shuffle_epi32(previous, _MM_SHUFFLE(3, 3, 3, 3)));
+        _mm_storeu_si128((__m128i*) (ids + j), previous);
+    }
+    uint32_t last = (uint32_t) _mm_extract_epi32(previous, 3);
+    for (; j < count; j++) {
+        int bytes = ((in[j / 4] >> (2 * (j % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        for (int b = 0; b < bytes; b++) delta |= (uint32_t) data[b] << (8 * b);
+        data += bytes;
+        last += delta;
+        ids[j] = last;
+    }
+}
+
+SIMD_TARGET("sse4.1")
+static void
+DecodeLocal16SSE41(const uint8_t* in, size_t count, uint32_t* ids) {
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m128i v = _mm_loadl_epi64((const __m128i*) (in + 2 * j));
+        _mm_storeu_si128((__m128i*) (ids + j), _mm_cvtepu16_epi32(v));
+    }
+    for (; j < count; j++) {
+        ids[j] = (uint32_t) in[2 * j] | ((uint32_t) in[2 * j + 1] << 8);
+    }
+}
+
+#endif
+
+static void (*DecodeStreamVByteExt)(const uint8_t*, size_t, uint32_t*) = DecodeStreamVByte;
+static void (*DecodeLocal16Ext)(const uint8_t*, size_t, uint32_t*) = DecodeLocal16;
+
+// Picks the SSE4.1 decoders where the CPU supports them
+static void
+SelectLinkCodecKernels() {
+#if defined(USE_SIMD_DISPATCH)
+    if (SSE41Capable()) {
+        streamVByteTables();
+        DecodeStreamVByteExt = DecodeStreamVByteSSE41;
+        DecodeLocal16Ext = DecodeLocal16SSE41;
+    }
+#endif
+}
+
+}  // namespace hnswlib
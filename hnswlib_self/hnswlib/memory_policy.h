@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace hnswlib {
+
+// Flags of HierarchicalNSW::setMemoryPolicy, how level 0 is allocated
+static const int MEMORY_DEFAULT = 0;  // malloc
+static const int MEMORY_HUGE_PAGES = 1;  // transparent huge pages, madvise(MADV_HUGEPAGE)
+static const int MEMORY_HUGETLB = 2;  // reserved huge pages (MAP_HUGETLB), transparent ones if none are left
+static const int MEMORY_NUMA_INTERLEAVE = 4;  // pages spread round robin over the NUMA nodes
+
+static const size_t HUGE_PAGE_SIZE = (size_t) 1 << 21;
+
+/*
+* NUMA nodes of the machine from /sys/devices/system/node/online ("0-1,3"), node 0 alone where
+* that is not available.
+*/
+static std::vector<int> numaNodes() {
+    std::vector<int> nodes;
+    std::ifstream input("/sys/devices/system/node/online");
+    std::string list;
+    if (input >> list) {
+        const char *p = list.c_str();
+        while (*p) {
+            char *end;
+            int first = (int) strtol(p, &end, 10);
+            if (end == p) break;
+            int last = first;
+            if (*end == '-')
+                last = (int) strtol(end + 1, &end, 10);
+            for (int node = first; node <= last; node++) nodes.push_back(node);
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    if (nodes.empty())
+        nodes.push_back(0);
+    return nodes;
+}
+
+// NUMA node of the CPU the calling thread runs on, 0 where that is not known
+static int currentNumaNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+        return (int) node;
+#endif
+    return 0;
+}
+
+// Restricts the calling thread to the CPUs of a NUMA node, false if that failed
+static bool pinThreadToNode(int node) {
+#if defined(__linux__)
+    std::ifstream input("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!(input >> list))
+        return false;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &cpus);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+/*
+* Sets the NUMA policy of pages not touched yet: interleaved over all nodes, or bound to node.
+* Best effort, the memory works the same where the kernel has no NUMA support.
+*/
+static void bindMemory(void *data, size_t size, int node) {
+#if defined(SYS_mbind)
+    const int MPOL_BIND_MODE = 2;
+    const int MPOL_INTERLEAVE_MODE = 3;
+    unsigned long mask[16] = {0};
+    size_t max_node = sizeof(mask) * 8;
+    if (node >= 0) {
+        if ((size_t) node >= max_node) return;
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    } else {
+        for (int n : numaNodes()) {
+            if ((size_t) n < max_node)
+                mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+        }
+    }
+    syscall(SYS_mbind, data, size, node >= 0 ? MPOL_BIND_MODE : MPOL_INTERLEAVE_MODE, mask, max_node, 0);
+#endif
+}
+#endif
+
+// malloc, or posix_memalign for an alignment beyond that of malloc
+static char *allocateAligned(size_t size, size_t alignment) {
+#if !defined(_WIN32)
+    if (alignment > sizeof(void *) * 2) {
+        void *data = nullptr;
+        if (posix_memalign(&data, alignment, std::max(size, (size_t) 1)) != 0)
+            return nullptr;
+        return (char *) data;
+    }
+#endif
+    return (char *) malloc(size);
+}
+
+/*
+* Allocates size bytes as policy says, or on NUMA node node if it is not negative. mapped_size is
+* set to the size mapped, 0 for memory from malloc, and is what freeMemory needs. Memory from malloc
+* is aligned to alignment if it is given, mapped memory always to a page. Returns nullptr if there
+* is not enough memory.
+*/
+static char *allocateMemory(size_t size, int policy, size_t &mapped_size, int node = -1, size_t alignment = 0) {
+    mapped_size = 0;
+#if defined(__linux__)
+    if (policy == MEMORY_DEFAULT && node < 0)
+        return allocateAligned(size, alignment);
+    size = std::max(size, (size_t) 1);
+    void *data = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (policy & MEMORY_HUGETLB) {
+        size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        data = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+            size = huge_size;
+    }
+#endif
+    if (data == MAP_FAILED && (policy & (MEMORY_HUGE_PAGES | MEMORY_HUGETLB))) {
+        // transparent huge pages need 2 MB aligned ranges, the mapping is trimmed to one
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        char *raw = (char *) mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == (char *) MAP_FAILED)
+            return nullptr;
+        char *aligned = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+        if (aligned != raw)
+            munmap(raw, aligned - raw);
+        if (aligned + size != raw + size + HUGE_PAGE_SIZE)
+            munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+        data = aligned;
+#if defined(MADV_HUGEPAGE)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    }
+    if (data == MAP_FAILED) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return nullptr;
+    }
+    if (node >= 0 || (policy & MEMORY_NUMA_INTERLEAVE))
+        bindMemory(data, size, node);
+    mapped_size = size;
+    return (char *) data;
+#else
+    return allocateAligned(size, alignment);
+#endif
+}
+
+static void freeMemory(char *data, size_t mapped_size) {
+#if defined(__linux__)
+    if (mapped_size != 0) {
+        munmap(data, mapped_size);
+        return;
+    }
+#endif
+    free(data);
+}
+
+}  // namespace hnswlib
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace hnswlib {
+
+// Header of a version 1 index file written by HierarchicalNSW::saveIndex
+struct IndexFileHeader {
+    size_t offsetLevel0{0};
+    size_t max_elements{0};
+    size_t cur_element_count{0};
+    size_t size_data_per_element{0};
+    size_t label_offset{0};
+    size_t offsetData{0};
+    int maxlevel{0};
+    tableint enterpoint_node{0};
+    size_t maxM{0};
+    size_t maxM0{0};
+    size_t M{0};
+    double mult{0.0};
+    size_t ef_construction{0};
+
+    void read(std::istream &input) {
+        readBinaryPOD(input, offsetLevel0);
+        readBinaryPOD(input, max_elements);
+        readBinaryPOD(input, cur_element_count);
+        readBinaryPOD(input, size_data_per_element);
+        readBinaryPOD(input, label_offset);
+        readBinaryPOD(input, offsetData);
+        readBinaryPOD(input, maxlevel);
+        readBinaryPOD(input, enterpoint_node);
+        readBinaryPOD(input, maxM);
+        readBinaryPOD(input, maxM0);
+        readBinaryPOD(input, M);
+        readBinaryPOD(input, mult);
+        readBinaryPOD(input, ef_construction);
+        if (offsetLevel0 == INDEX_FILE_MAGIC)
+            throw std::runtime_error("Only index files of version 1 can be merged");
+        if (!input)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+    void write(std::ostream &output) const {
+        writeBinaryPOD(output, offsetLevel0);
+        writeBinaryPOD(output, max_elements);
+        writeBinaryPOD(output, cur_element_count);
+        writeBinaryPOD(output, size_data_per_element);
+        writeBinaryPOD(output, label_offset);
+        writeBinaryPOD(output, offsetData);
+        writeBinaryPOD(output, maxlevel);
+        writeBinaryPOD(output, enterpoint_node);
+        writeBinaryPOD(output, maxM);
+        writeBinaryPOD(output, maxM0);
+        writeBinaryPOD(output, M);
+        writeBinaryPOD(output, mult);
+        writeBinaryPOD(output, ef_construction);
+    }
+
+    // Bytes of the links of one upper level
+    size_t sizeLinksPerElement() const {
+        return maxM * sizeof(tableint) + sizeof(linklistsizeint);
+    }
+
+    bool sameLayout(const IndexFileHeader &other) const {
+        return offsetLevel0 == other.offsetLevel0 && size_data_per_element == other.size_data_per_element &&
+               label_offset == other.label_offset && offsetData == other.offsetData &&
+               maxM == other.maxM && maxM0 == other.maxM0 && M == other.M;
+    }
+};
+
+
+/*
+* Sorts the file input of records T into the file output with bounded memory: runs of run_bytes
+* are sorted in memory and written next to output, then merged in one k-way pass.
+*/
+template<typename T, typename Compare>
+void externalSort(const std::string &input, const std::string &output, size_t run_bytes, Compare comp) {
+    size_t run_records = std::max(run_bytes / sizeof(T), (size_t) 1);
+    std::ifstream in(input, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("Cannot open file");
+    std::vector<std::string> runs;
+    std::vector<T> buffer;
+    while (true) {
+        buffer.resize(run_records);
+        in.read((char *) buffer.data(), run_records * sizeof(T));
+        size_t n = in.gcount() / sizeof(T);
+        if (n == 0) break;
+        buffer.resize(n);
+        std::sort(buffer.begin(), buffer.end(), comp);
+        runs.push_back(output + ".run" + std::to_string(runs.size()));
+        std::ofstream run(runs.back(), std::ios::binary);
+        run.write((const char *) buffer.data(), n * sizeof(T));
+        if (!run)
+            throw std::runtime_error("Cannot write the sort runs");
+        if (n < run_records) break;
+    }
+    in.close();
+    std::vector<T>().swap(buffer);
+
+    std::ofstream out(output, std::ios::binary);
+    std::vector<std::unique_ptr<std::ifstream>> readers;
+    auto greater = [&comp](const std::pair<T, size_t> &a, const std::pair<T, size_t> &b) {
+        return comp(b.first, a.first);
+    };
+    std::priority_queue<std::pair<T, size_t>, std::vector<std::pair<T, size_t>>, decltype(greater)> heap(greater);
+    T record;
+    for (size_t r = 0; r < runs.size(); r++) {
+        readers.emplace_back(new std::ifstream(runs[r], std::ios::binary));
+        if (readers[r]->read((char *) &record, sizeof(T)))
+            heap.emplace(record, r);
+    }
+    while (!heap.empty()) {
+        std::pair<T, size_t> top = heap.top();
+        heap.pop();
+        out.write((const char *) &top.first, sizeof(T));
+        if (readers[top.second]->read((char *) &record, sizeof(T)))
+            heap.emplace(record, top.second);
+    }
+    if (!out)
+        throw std::runtime_error("Cannot write the sorted file");
+    readers.clear();
+    for (const std::string &run : runs) remove(run.c_str());
+}
+
+
+/*
+* Merges index files written by saveIndex into the index file location, like mergeIndex without
+* prune_by_distance does in memory, without loading the shards. Elements are numbered shard by
+* shard; the copies of a label found in several shards become one element with the vector of its
+* first live copy and the union of the links of all copies, cut down at random.
+*
+* The shards are read sequentially in chunks of chunk_elements level 0 records, which with the sort
+* runs of the same size bound the memory. Duplicate labels are found by an external sort of
+* (label, position) records and the id map lives in a memory-mapped file; the temporary files are
+* written next to location. Links are rewritten per chunk in parallel. Returns the number of elements.
+*/
+inline size_t mergeIndexFiles(const std::vector<std::string> &shard_locations, const std::string &location,
+                              size_t chunk_elements = 65536) {
+    // (label, position) of every shard element, position numbers the elements of all shards in order
+    struct LabelRecord {
+        labeltype label;
+        uint64_t position;
+        uint64_t deleted;
+    };
+    // A copy of a label that is not the first one, the element is numbered by the first copy
+    struct CopyRecord {
+        uint64_t first;
+        uint64_t position;
+        uint64_t upper_offset;  // file offset of the upper level links of the copy
+        uint32_t level;
+        uint32_t is_source;  // the vector, label and deletion mark of the element come from this copy
+    };
+    // remap value of the copies, whose links go to the element of the first copy
+    const tableint COPY_FLAG = (tableint) 1 << (sizeof(tableint) * 8 - 1);
+    const unsigned char DELETE_MARK = 0x01;  // as in HierarchicalNSW
+
+    // removes the temporary files however the merge ends
+    struct TempFiles {
+        std::vector<std::string> paths;
+        std::string add(const std::string &path) {
+            paths.push_back(path);
+            return path;
+        }
+        ~TempFiles() {
+            for (const std::string &path : paths) remove(path.c_str());
+        }
+    } temp;
+
+    size_t num_shards = shard_locations.size();
+    if (num_shards == 0)
+        throw std::runtime_error("mergeIndexFiles needs at least one shard");
+    chunk_elements = std::max(chunk_elements, (size_t) 1);
+
+    std::vector<IndexFileHeader> headers(num_shards);
+    std::vector<uint64_t> first_position(num_shards + 1, 0);
+    std::vector<std::unique_ptr<std::ifstream>> shards;  // random reads of the copies
+    std::streamoff header_size = 0;
+    for (size_t s = 0; s < num_shards; s++) {
+        shards.emplace_back(new std::ifstream(shard_locations[s], std::ios::binary));
+        if (!shards[s]->is_open())
+            throw std::runtime_error("Cannot open file");
+        headers[s].read(*shards[s]);
+        header_size = shards[s]->tellg();
+        if (!headers[s].sameLayout(headers[0]))
+            throw std::runtime_error("The shards have different data sizes or parameters");
+        first_position[s + 1] = first_position[s] + headers[s].cur_element_count;
+    }
+    const IndexFileHeader &layout = headers[0];
+    size_t record_size = layout.size_data_per_element;
+    size_t links_size = layout.sizeLinksPerElement();
+    size_t run_bytes = chunk_elements * record_size;
+    uint64_t num_positions = first_position[num_shards];
+    auto shard_of = [&first_position](uint64_t position) {
+        return (size_t) (std::upper_bound(first_position.begin(), first_position.end(), position) - first_position.begin() - 1);
+    };
+    auto read_at = [&shards](size_t s, std::streamoff offset, char *buffer, size_t size) {
+        shards[s]->seekg(offset, std::ios::beg);
+        if (!shards[s]->read(buffer, size))
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    };
+    std::vector<char> chunk(chunk_elements * record_size);
+
+    // labels of all elements, sorted to find the labels in several shards
+    std::string labels_file = temp.add(location + ".labels");
+    {
+        std::ofstream labels(labels_file, std::ios::binary);
+        for (size_t s = 0; s < num_shards; s++) {
+            std::ifstream input(shard_locations[s], std::ios::binary);
+            input.seekg(header_size, std::ios::beg);
+            for (size_t begin = 0; begin < headers[s].cur_element_count; begin += chunk_elements) {
+                size_t n = std::min(chunk_elements, headers[s].cur_element_count - begin);
+                if (!input.read(chunk.data(), n * record_size))
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                for (size_t i = 0; i < n; i++) {
+                    const char *record = chunk.data() + i * record_size;
+                    LabelRecord rec;
+                    memcpy(&rec.label, record + layout.label_offset, sizeof(labeltype));
+                    rec.position = first_position[s] + begin + i;
+                    rec.deleted = (record[layout.offsetLevel0 + 2] & DELETE_MARK) != 0;
+                    labels.write((const char *) &rec, sizeof(rec));
+                }
+            }
+        }
+    }
+    std::string sorted_labels_file = temp.add(location + ".labels.sorted");
+    externalSort<LabelRecord>(labels_file, sorted_labels_file, run_bytes, [](const LabelRecord &a, const LabelRecord &b) {
+        return a.label < b.label || (a.label == b.label && a.position < b.position);
+    });
+    remove(labels_file.c_str());
+
+    // id of every position in the merged index, the copies are flagged
+    std::string remap_file = temp.add(location + ".remap");
+    VectorStore remap_store(remap_file, num_positions, sizeof(tableint), true);
+    tableint *remap = (tableint *) remap_store.get(0);
+    std::string copies_file = temp.add(location + ".copies");
+    {
+        std::ifstream sorted_labels(sorted_labels_file, std::ios::binary);
+        std::ofstream copies(copies_file, std::ios::binary);
+        std::vector<LabelRecord> group;
+        LabelRecord rec;
+        bool more = (bool) sorted_labels.read((char *) &rec, sizeof(rec));
+        while (more) {
+            group.clear();
+            group.push_back(rec);
+            while ((more = (bool) sorted_labels.read((char *) &rec, sizeof(rec))) && rec.label == group[0].label) {
+                group.push_back(rec);
+            }
+            if (group.size() == 1) continue;
+            // the vector is taken from a live copy if there is one
+            size_t source = 0;
+            while (source < group.size() && group[source].deleted) source++;
+            if (source == group.size()) source = 0;
+            for (size_t i = 1; i < group.size(); i++) {
+                remap[group[i].position] = COPY_FLAG;
+                CopyRecord copy = {group[0].position, group[i].position, 0, 0, (uint32_t) (i == source)};
+                copies.write((const char *) &copy, sizeof(copy));
+            }
+        }
+    }
+    remove(sorted_labels_file.c_str());
+
+    size_t num_elements = 0;
+    for (uint64_t position = 0; position < num_positions; position++) {
+        if (remap[position] != COPY_FLAG) {
+            if (num_elements >= COPY_FLAG)
+                throw std::runtime_error("The number of elements exceeds the specified limit");
+            remap[position] = num_elements++;
+        }
+    }
+
+    // the copies in position order get their links to the first copy and the offset of their upper levels
+    std::string copies_by_position_file = temp.add(location + ".copies.position");
+    externalSort<CopyRecord>(copies_file, copies_by_position_file, run_bytes, [](const CopyRecord &a, const CopyRecord &b) {
+        return a.position < b.position;
+    });
+    {
+        std::ifstream copies_by_position(copies_by_position_file, std::ios::binary);
+        std::ofstream copies(copies_file, std::ios::binary | std::ios::trunc);
+        CopyRecord copy;
+        bool more = (bool) copies_by_position.read((char *) &copy, sizeof(copy));
+        for (size_t s = 0; s < num_shards; s++) {
+            std::ifstream input(shard_locations[s], std::ios::binary);
+            input.seekg(0, std::ios::end);
+            std::streamoff file_size = input.tellg();
+            input.seekg(header_size + (std::streamoff) (headers[s].cur_element_count * record_size), std::ios::beg);
+            for (uint64_t position = first_position[s]; position < first_position[s + 1]; position++) {
+                unsigned int link_list_size;
+                readBinaryPOD(input, link_list_size);
+                if (!input || link_list_size % links_size != 0)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                if (more && copy.position == position) {
+                    remap[position] = remap[copy.first] | COPY_FLAG;
+                    copy.upper_offset = input.tellg();
+                    copy.level = link_list_size / links_size;
+                    copies.write((const char *) &copy, sizeof(copy));
+                    more = (bool) copies_by_position.read((char *) &copy, sizeof(copy));
+                }
+                input.seekg(link_list_size, std::ios::cur);
+            }
+            if (input.tellg() != file_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+    }
+    remove(copies_by_position_file.c_str());
+    std::string copies_by_first_file = temp.add(location + ".copies.first");
+    externalSort<CopyRecord>(copies_file, copies_by_first_file, run_bytes, [](const CopyRecord &a, const CopyRecord &b) {
+        return a.first < b.first || (a.first == b.first && a.position < b.position);
+    });
+    remove(copies_file.c_str());
+
+    // false if a link is out of the shard
+    auto append_links = [&](size_t s, const linklistsizeint *ll, std::vector<tableint> &links) {
+        size_t size = *((const unsigned short int *) ll);
+        const tableint *data = (const tableint *) (ll + 1);
+        for (size_t j = 0; j < size; j++) {
+            if (data[j] >= headers[s].cur_element_count)
+                return false;
+            links.push_back(remap[first_position[s] + data[j]] & ~COPY_FLAG);
+        }
+        return true;
+    };
+    // same selection as mergeSelectNeighbors without prune_by_distance
+    auto select_links = [](tableint home, std::vector<tableint> &links, size_t max_links) {
+        links.erase(std::remove(links.begin(), links.end(), home), links.end());
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+        if (links.size() <= max_links) return;
+        std::mt19937 urng(home);
+        std::shuffle(links.begin(), links.end(), urng);
+        links.resize(max_links);
+    };
+    auto write_links = [](linklistsizeint *ll, const std::vector<tableint> &links, bool deleted) {
+        *ll = 0;
+        *((unsigned short int *) ll) = (unsigned short int) links.size();
+        if (deleted) *((unsigned char *) ll + 2) |= DELETE_MARK;
+        memcpy(ll + 1, links.data(), links.size() * sizeof(tableint));
+    };
+
+    std::ofstream output(location, std::ios::binary);
+    if (!output.is_open())
+        throw std::runtime_error("Cannot open file");
+    IndexFileHeader merged = layout;
+    merged.max_elements = num_elements;
+    merged.cur_element_count = num_elements;
+    merged.maxlevel = -1;
+    merged.enterpoint_node = -1;
+    merged.write(output);
+
+    // level 0: the records of the elements with the links of all their copies
+    {
+        std::ifstream copies(copies_by_first_file, std::ios::binary);
+        CopyRecord copy;
+        bool more = (bool) copies.read((char *) &copy, sizeof(copy));
+        std::vector<char> out_chunk;
+        std::vector<uint64_t> elements;  // positions of the elements of the chunk
+        std::vector<size_t> copies_begin;  // their copies in copy_records
+        std::vector<char> copy_records;
+        std::vector<size_t> copy_shards;
+        std::vector<char> copy_is_source;
+        std::atomic<bool> corrupted(false);
+        for (size_t s = 0; s < num_shards; s++) {
+            std::ifstream input(shard_locations[s], std::ios::binary);
+            input.seekg(header_size, std::ios::beg);
+            for (size_t begin = 0; begin < headers[s].cur_element_count; begin += chunk_elements) {
+                size_t n = std::min(chunk_elements, headers[s].cur_element_count - begin);
+                if (!input.read(chunk.data(), n * record_size))
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                elements.clear();
+                copies_begin.clear();
+                copy_records.clear();
+                copy_shards.clear();
+                copy_is_source.clear();
+                for (size_t i = 0; i < n; i++) {
+                    uint64_t position = first_position[s] + begin + i;
+                    if (remap[position] & COPY_FLAG) continue;
+                    elements.push_back(position);
+                    copies_begin.push_back(copy_shards.size());
+                    for (; more && copy.first == position; more = (bool) copies.read((char *) &copy, sizeof(copy))) {
+                        size_t copy_shard = shard_of(copy.position);
+                        copy_shards.push_back(copy_shard);
+                        copy_is_source.push_back(copy.is_source);
+                        copy_records.resize(copy_shards.size() * record_size);
+                        read_at(copy_shard, header_size + (std::streamoff) ((copy.position - first_position[copy_shard]) * record_size),
+                                copy_records.data() + (copy_shards.size() - 1) * record_size, record_size);
+                    }
+                }
+                copies_begin.push_back(copy_shards.size());
+
+                out_chunk.resize(elements.size() * record_size);
+#pragma omp parallel
+                {
+                    std::vector<tableint> links;
+#pragma omp for schedule(dynamic, 1024)
+                    for (long long e = 0; e < (long long) elements.size(); e++) {
+                        size_t i = elements[e] - first_position[s] - begin;
+                        tableint id = remap[elements[e]];
+                        const char *record = chunk.data() + i * record_size;
+                        const char *source = record;
+                        links.clear();
+                        bool valid = append_links(s, (const linklistsizeint *) (record + layout.offsetLevel0), links);
+                        for (size_t c = copies_begin[e]; c < copies_begin[e + 1]; c++) {
+                            const char *copy_record = copy_records.data() + c * record_size;
+                            if (copy_is_source[c]) source = copy_record;
+                            valid &= append_links(copy_shards[c], (const linklistsizeint *) (copy_record + layout.offsetLevel0), links);
+                        }
+                        if (!valid) corrupted = true;
+                        select_links(id, links, layout.maxM0);
+
+                        char *out_record = out_chunk.data() + e * record_size;
+                        memcpy(out_record, source, record_size);
+                        memset(out_record + layout.offsetLevel0, 0, layout.maxM0 * sizeof(tableint) + sizeof(linklistsizeint));
+                        bool deleted = (source[layout.offsetLevel0 + 2] & DELETE_MARK) != 0;
+                        write_links((linklistsizeint *) (out_record + layout.offsetLevel0), links, deleted);
+                    }
+                }
+                if (corrupted)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                output.write(out_chunk.data(), out_chunk.size());
+            }
+        }
+    }
+
+    // upper levels, the level of an element is the highest of its copies
+    {
+        std::ifstream copies(copies_by_first_file, std::ios::binary);
+        CopyRecord copy;
+        bool more = (bool) copies.read((char *) &copy, sizeof(copy));
+        std::vector<char> own, out_lists;
+        std::vector<std::pair<size_t, std::vector<char>>> copy_lists;
+        std::vector<tableint> links;
+        for (size_t s = 0; s < num_shards; s++) {
+            std::ifstream input(shard_locations[s], std::ios::binary);
+            input.seekg(header_size + (std::streamoff) (headers[s].cur_element_count * record_size), std::ios::beg);
+            for (uint64_t position = first_position[s]; position < first_position[s + 1]; position++) {
+                unsigned int link_list_size;
+                readBinaryPOD(input, link_list_size);
+                own.resize(link_list_size);
+                if (link_list_size && !input.read(own.data(), link_list_size))
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                if (remap[position] & COPY_FLAG) continue;
+
+                tableint id = remap[position];
+                int level = link_list_size / links_size;
+                copy_lists.clear();
+                for (; more && copy.first == position; more = (bool) copies.read((char *) &copy, sizeof(copy))) {
+                    size_t copy_shard = shard_of(copy.position);
+                    copy_lists.emplace_back(copy_shard, std::vector<char>(copy.level * links_size));
+                    if (copy.level)
+                        read_at(copy_shard, copy.upper_offset, copy_lists.back().second.data(), copy.level * links_size);
+                    level = std::max(level, (int) copy.level);
+                }
+
+                unsigned int out_size = level * links_size;
+                out_lists.assign(out_size, 0);
+                for (int l = 1; l <= level; l++) {
+                    links.clear();
+                    bool valid = true;
+                    if ((size_t) l * links_size <= own.size())
+                        valid &= append_links(s, (const linklistsizeint *) (own.data() + (l - 1) * links_size), links);
+                    for (auto &copy_list : copy_lists) {
+                        if ((size_t) l * links_size <= copy_list.second.size())
+                            valid &= append_links(copy_list.first, (const linklistsizeint *) (copy_list.second.data() + (l - 1) * links_size), links);
+                    }
+                    if (!valid)
+                        throw std::runtime_error("Index seems to be corrupted or unsupported");
+                    select_links(id, links, layout.maxM);
+                    write_links((linklistsizeint *) (out_lists.data() + (l - 1) * links_size), links, false);
+                }
+                writeBinaryPOD(output, out_size);
+                output.write(out_lists.data(), out_size);
+                if (level > merged.maxlevel) {
+                    merged.maxlevel = level;
+                    merged.enterpoint_node = id;
+                }
+            }
+        }
+    }
+
+    output.seekp(0, std::ios::beg);
+    merged.write(output);
+    output.close();
+    if (!output)
+        throw std::runtime_error("Cannot write the merged index");
+    return num_elements;
+}
+
+}  // namespace hnswlib
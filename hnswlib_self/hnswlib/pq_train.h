@@ -0,0 +1,222 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace hnswlib {
+
+static float
+L2SqrRow(const float *a, const float *b, size_t d) {
+    float res = 0;
+    for (size_t i = 0; i < d; i++) {
+        float t = a[i] - b[i];
+        res += t * t;
+    }
+    return res;
+}
+
+// Index of the closest of the k centroids to x, its distance goes to dist
+static size_t
+NearestCentroid(const float *x, const float *centroids, size_t k, size_t d, float &dist) {
+    size_t best = 0;
+    float best_dist = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; c++) {
+        float t = L2SqrRow(x, centroids + c * d, d);
+        if (t < best_dist) {
+            best_dist = t;
+            best = c;
+        }
+    }
+    dist = best_dist;
+    return best;
+}
+
+/*
+* Lloyd's k-means of n vectors of dimension d into k centroids, the assignment step runs in parallel.
+* Starts from k distinct random vectors, an empty cluster takes over half of the largest one.
+* Returns the mean squared distance of the vectors to their centroids.
+*/
+static float
+KMeans(const float *x, size_t n, size_t d, size_t k, size_t niter, unsigned int seed, float *centroids) {
+    if (n < k)
+        throw std::runtime_error("Not enough training vectors for k-means");
+
+    std::mt19937 rng(seed);
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; i++) perm[i] = i;
+    for (size_t i = 0; i < k; i++) {
+        std::uniform_int_distribution<size_t> distrib(i, n - 1);
+        std::swap(perm[i], perm[distrib(rng)]);
+        memcpy(centroids + i * d, x + perm[i] * d, d * sizeof(float));
+    }
+
+    std::vector<int> assign(n);
+    std::vector<double> sums(k * d);
+    std::vector<size_t> counts(k);
+    double err = 0;
+    for (size_t iter = 0; iter <= niter; iter++) {
+        err = 0;
+#pragma omp parallel for reduction(+:err)
+        for (long long i = 0; i < (long long) n; i++) {
+            float dist;
+            assign[i] = (int) NearestCentroid(x + i * d, centroids, k, d, dist);
+            err += dist;
+        }
+        if (iter == niter) break;
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            double *sum = sums.data() + assign[i] * d;
+            const float *v = x + i * d;
+            for (size_t j = 0; j < d; j++) sum[j] += v[j];
+            counts[assign[i]]++;
+        }
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] == 0) continue;
+            for (size_t j = 0; j < d; j++)
+                centroids[c * d + j] = (float) (sums[c * d + j] / counts[c]);
+        }
+
+        // split the largest cluster for every empty one
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] != 0) continue;
+            size_t largest = std::max_element(counts.begin(), counts.end()) - counts.begin();
+            const float eps = 1.0f / 1024;
+            for (size_t j = 0; j < d; j++) {
+                float v = centroids[largest * d + j];
+                centroids[c * d + j] = v * (1 + eps) + (j % 2 ? eps : -eps);
+                centroids[largest * d + j] = v * (1 - eps) - (j % 2 ? eps : -eps);
+            }
+            counts[c] = counts[largest] / 2;
+            counts[largest] -= counts[c];
+        }
+    }
+    return (float) (err / n);
+}
+
+/*
+* Singular value decomposition a = u * diag(s) * v^T of a square d x d row-major matrix
+* by one-sided Jacobi rotations. Columns of u that belong to a zero singular value are
+* completed to an orthonormal basis.
+*/
+static void
+JacobiSVD(const std::vector<double> &a, size_t d, std::vector<double> &u, std::vector<double> &s, std::vector<double> &v) {
+    u = a;
+    v.assign(d * d, 0.0);
+    for (size_t i = 0; i < d; i++) v[i * d + i] = 1.0;
+
+    for (int sweep = 0; sweep < 60; sweep++) {
+        bool rotated = false;
+        for (size_t p = 0; p + 1 < d; p++) {
+            for (size_t q = p + 1; q < d; q++) {
+                double alpha = 0, beta = 0, gamma = 0;
+                for (size_t i = 0; i < d; i++) {
+                    double up = u[i * d + p], uq = u[i * d + q];
+                    alpha += up * up;
+                    beta += uq * uq;
+                    gamma += up * uq;
+                }
+                if (fabs(gamma) <= 1e-15 * sqrt(alpha * beta) || gamma == 0) continue;
+                rotated = true;
+
+                double zeta = (beta - alpha) / (2 * gamma);
+                double t = (zeta >= 0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1 + zeta * zeta));
+                double c = 1 / sqrt(1 + t * t);
+                double sn = c * t;
+                for (size_t i = 0; i < d; i++) {
+                    double up = u[i * d + p], uq = u[i * d + q];
+                    u[i * d + p] = c * up - sn * uq;
+                    u[i * d + q] = sn * up + c * uq;
+                    double vp = v[i * d + p], vq = v[i * d + q];
+                    v[i * d + p] = c * vp - sn * vq;
+                    v[i * d + q] = sn * vp + c * vq;
+                }
+            }
+        }
+        if (!rotated) break;
+    }
+
+    s.assign(d, 0.0);
+    double max_s = 0;
+    for (size_t j = 0; j < d; j++) {
+        double norm = 0;
+        for (size_t i = 0; i < d; i++) norm += u[i * d + j] * u[i * d + j];
+        s[j] = sqrt(norm);
+        max_s = std::max(max_s, s[j]);
+    }
+    std::vector<bool> valid(d);
+    for (size_t j = 0; j < d; j++) {
+        valid[j] = s[j] > 1e-12 * max_s && s[j] > 0;
+        if (valid[j]) {
+            for (size_t i = 0; i < d; i++) u[i * d + j] /= s[j];
+        }
+    }
+    for (size_t j = 0; j < d; j++) {
+        if (valid[j]) continue;
+        // Gram-Schmidt of a unit vector against the columns done so far
+        for (size_t e = 0; e < d && !valid[j]; e++) {
+            std::vector<double> col(d, 0.0);
+            col[e] = 1.0;
+            for (size_t k = 0; k < d; k++) {
+                if (!valid[k]) continue;
+                double dot = 0;
+                for (size_t i = 0; i < d; i++) dot += col[i] * u[i * d + k];
+                for (size_t i = 0; i < d; i++) col[i] -= dot * u[i * d + k];
+            }
+            double norm = 0;
+            for (size_t i = 0; i < d; i++) norm += col[i] * col[i];
+            if (norm > 1e-6) {
+                norm = sqrt(norm);
+                for (size_t i = 0; i < d; i++) u[i * d + j] = col[i] / norm;
+                valid[j] = true;
+            }
+        }
+    }
+}
+
+/*
+* Orthogonal r minimizing ||x * r - y|| for n row vectors of dimension d (orthogonal Procrustes):
+* r = u * v^T for the SVD x^T * y = u * s * v^T. r is d x d row-major.
+*/
+static void
+ProcrustesRotation(const float *x, const float *y, size_t n, size_t d, std::vector<float> &r) {
+    std::vector<double> xty(d * d, 0.0);
+#pragma omp parallel for
+    for (long long a = 0; a < (long long) d; a++) {
+        for (size_t i = 0; i < n; i++) {
+            double xa = x[i * d + a];
+            const float *yi = y + i * d;
+            for (size_t b = 0; b < d; b++) xty[a * d + b] += xa * yi[b];
+        }
+    }
+
+    std::vector<double> u, s, v;
+    JacobiSVD(xty, d, u, s, v);
+    r.assign(d * d, 0.0f);
+    for (size_t a = 0; a < d; a++) {
+        for (size_t b = 0; b < d; b++) {
+            double sum = 0;
+            for (size_t k = 0; k < d; k++) sum += u[a * d + k] * v[b * d + k];
+            r[a * d + b] = (float) sum;
+        }
+    }
+}
+
+// y = x * r for a row vector x and a d x d row-major matrix r
+static void
+RotateRow(const float *x, const float *r, size_t d, float *y) {
+    for (size_t j = 0; j < d; j++) y[j] = 0;
+    for (size_t i = 0; i < d; i++) {
+        float xi = x[i];
+        const float *row = r + i * d;
+        for (size_t j = 0; j < d; j++) y[j] += xi * row[j];
+    }
+}
+
+}  // namespace hnswlib
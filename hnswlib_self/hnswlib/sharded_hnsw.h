@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace hnswlib {
+
+/*
+* Stop condition of one shard in ShardedHNSW::searchKnn with early termination: the search with ef
+* of the shard, which also stops once it has k results and the closest candidate left is farther
+* than the ef-th result of the shards searched so far. That is the bound a single index applies to
+* its own ef results, taken over all shards. The ef results are kept for the merge.
+*/
+template<typename dist_t>
+class ShardBoundStopCondition : public BaseSearchStopCondition<dist_t> {
+    size_t k_;
+    size_t ef_;
+    size_t num_results_{0};
+    const std::atomic<dist_t> &global_bound_;
+
+ public:
+    ShardBoundStopCondition(size_t k, size_t ef, const std::atomic<dist_t> &global_bound)
+        : k_(k), ef_(std::max(ef, k)), global_bound_(global_bound) {}
+
+    void add_point_to_result(labeltype label, const void *datapoint, dist_t dist) override {
+        num_results_ += 1;
+    }
+
+    void remove_point_from_result(labeltype label, const void *datapoint, dist_t dist) override {
+        num_results_ -= 1;
+    }
+
+    bool should_stop_search(dist_t candidate_dist, dist_t lowerBound) override {
+        if (candidate_dist > lowerBound && num_results_ >= ef_) {
+            return true;
+        }
+        return num_results_ >= k_ && candidate_dist > global_bound_.load(std::memory_order_relaxed);
+    }
+
+    bool should_consider_candidate(dist_t candidate_dist, dist_t lowerBound) override {
+        return num_results_ < ef_ || lowerBound > candidate_dist;
+    }
+
+    bool should_remove_extra() override {
+        return num_results_ > ef_;
+    }
+
+    void filter_results(std::vector<std::pair<dist_t, labeltype >> &candidates) override {
+    }
+
+    ~ShardBoundStopCondition() {}
+};
+
+
+/*
+* N HierarchicalNSW shards served as one index. A label always goes to the same shard, given by
+* shard_function or by a hash of the label. searchKnn searches the shards in parallel on the
+* OpenMP threads and merges their results into the global top k.
+*/
+template<typename dist_t>
+class ShardedHNSW : public AlgorithmInterface<dist_t> {
+ public:
+    typedef std::function<size_t(labeltype)> ShardFunction;
+
+ private:
+    std::vector<std::unique_ptr<HierarchicalNSW<dist_t>>> shards_;
+    ShardFunction shard_function_;
+    bool early_termination_ = false;  // shards stop searching once they cannot improve the result
+
+ public:
+    ShardedHNSW(
+        SpaceInterface<dist_t> *s,
+        size_t num_shards,
+        size_t max_elements_per_shard,
+        size_t M = 16,
+        size_t ef_construction = 200,
+        size_t random_seed = 100,
+        bool allow_replace_deleted = false,
+        ShardFunction shard_function = ShardFunction())
+        : shard_function_(shard_function) {
+        if (num_shards == 0)
+            throw std::runtime_error("ShardedHNSW needs at least one shard");
+        for (size_t i = 0; i < num_shards; i++) {
+            shards_.emplace_back(new HierarchicalNSW<dist_t>(s, max_elements_per_shard, M, ef_construction,
+                                                            random_seed + i, allow_replace_deleted));
+        }
+    }
+
+    // Takes over existing shards, e.g. loaded one by one; their labels must follow the routing
+    ShardedHNSW(const std::vector<HierarchicalNSW<dist_t> *> &shards, ShardFunction shard_function = ShardFunction())
+        : shard_function_(shard_function) {
+        if (shards.empty())
+            throw std::runtime_error("ShardedHNSW needs at least one shard");
+        for (HierarchicalNSW<dist_t> *shard : shards) {
+            shards_.emplace_back(shard);
+        }
+    }
+
+    // Loads the shards written by saveIndex(location)
+    ShardedHNSW(
+        SpaceInterface<dist_t> *s,
+        const std::string &location,
+        size_t max_elements_per_shard = 0,
+        bool allow_replace_deleted = false,
+        ShardFunction shard_function = ShardFunction())
+        : shard_function_(shard_function) {
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        size_t num_shards = 0;
+        readBinaryPOD(input, num_shards);
+        input.close();
+        if (num_shards == 0)
+            throw std::runtime_error("ShardedHNSW needs at least one shard");
+        for (size_t i = 0; i < num_shards; i++) {
+            shards_.emplace_back(new HierarchicalNSW<dist_t>(s, shardLocation(location, i), false,
+                                                            max_elements_per_shard, allow_replace_deleted));
+        }
+    }
+
+    static std::string shardLocation(const std::string &location, size_t shard) {
+        return location + ".shard" + std::to_string(shard);
+    }
+
+    size_t numShards() const {
+        return shards_.size();
+    }
+
+    HierarchicalNSW<dist_t> &getShard(size_t shard) const {
+        return *shards_[shard];
+    }
+
+    size_t getShardOf(labeltype label) const {
+        if (shard_function_) {
+            size_t shard = shard_function_(label);
+            if (shard >= shards_.size())
+                throw std::runtime_error("The shard function returned a shard out of range");
+            return shard;
+        }
+        // splitmix64 finalizer, consecutive labels spread evenly over the shards
+        uint64_t x = (uint64_t) label + 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x = x ^ (x >> 31);
+        return x % shards_.size();
+    }
+
+    void setEf(size_t ef) {
+        for (auto &shard : shards_) shard->setEf(ef);
+    }
+
+    void setEarlyTermination(bool early_termination) {
+        early_termination_ = early_termination;
+    }
+
+    size_t getCurrentElementCount() const {
+        size_t count = 0;
+        for (auto &shard : shards_) count += shard->cur_element_count;
+        return count;
+    }
+
+    size_t getMaxElements() const {
+        size_t count = 0;
+        for (auto &shard : shards_) count += shard->max_elements_;
+        return count;
+    }
+
+    size_t getDeletedCount() const {
+        size_t count = 0;
+        for (auto &shard : shards_) count += shard->num_deleted_;
+        return count;
+    }
+
+    void addPoint(const void *data_point, labeltype label, bool replace_deleted = false) override {
+        shards_[getShardOf(label)]->addPoint(data_point, label, replace_deleted);
+    }
+
+    void markDelete(labeltype label) {
+        shards_[getShardOf(label)]->markDelete(label);
+    }
+
+    void unmarkDelete(labeltype label) {
+        shards_[getShardOf(label)]->unmarkDelete(label);
+    }
+
+    template<typename data_t>
+    std::vector<data_t> getDataByLabel(labeltype label) const {
+        return shards_[getShardOf(label)]->template getDataByLabel<data_t>(label);
+    }
+
+    /*
+    * Searches every shard with k and its own ef, one shard per OpenMP thread, and keeps the k closest
+    * results over all shards. With early termination a shard stops searching once its closest
+    * candidate left is farther than the ef-th result of the shards already done, see ShardBoundStopCondition.
+    */
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnn(const void *query_data, size_t k, float q_residual, BaseFilterFunctor* isIdAllowed = nullptr) const override {
+        std::priority_queue<std::pair<dist_t, labeltype >> result;
+        if (k == 0) return result;
+
+        // the k results, or with early termination the ef results the bound is taken from
+        size_t num_kept = k;
+        if (early_termination_) {
+            for (auto &shard : shards_) num_kept = std::max(num_kept, shard->ef_);
+        }
+        std::mutex result_lock;
+        std::atomic<dist_t> bound(std::numeric_limits<dist_t>::max());
+        std::exception_ptr error;
+        long long num_shards = shards_.size();
+#pragma omp parallel for schedule(dynamic, 1)
+        for (long long s = 0; s < num_shards; s++) {
+            try {
+                const HierarchicalNSW<dist_t> &shard = *shards_[s];
+                std::vector<std::pair<dist_t, labeltype >> found;
+                if (early_termination_) {
+                    ShardBoundStopCondition<dist_t> stop_condition(k, shard.ef_, bound);
+                    found = shard.searchStopConditionClosest(query_data, stop_condition, isIdAllowed);
+                } else {
+                    std::priority_queue<std::pair<dist_t, labeltype >> top = shard.searchKnn(query_data, k, q_residual, isIdAllowed);
+                    found.reserve(top.size());
+                    while (!top.empty()) {
+                        found.push_back(top.top());
+                        top.pop();
+                    }
+                }
+
+                std::unique_lock <std::mutex> lock(result_lock);
+                for (const std::pair<dist_t, labeltype> &rez : found) {
+                    if (result.size() < num_kept || rez.first < result.top().first) {
+                        result.push(rez);
+                        if (result.size() > num_kept) result.pop();
+                    }
+                }
+                if (result.size() == num_kept) bound.store(result.top().first, std::memory_order_relaxed);
+            } catch (...) {
+                std::unique_lock <std::mutex> lock(result_lock);
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+        while (result.size() > k) result.pop();
+        return result;
+    }
+
+    // Writes the number of shards to location and every shard next to it, see shardLocation
+    void saveIndex(const std::string &location) override {
+        std::ofstream output(location, std::ios::binary);
+        size_t num_shards = shards_.size();
+        writeBinaryPOD(output, num_shards);
+        output.close();
+        for (size_t i = 0; i < shards_.size(); i++) {
+            shards_[i]->saveIndex(shardLocation(location, i));
+        }
+    }
+};
+
+}  // namespace hnswlib
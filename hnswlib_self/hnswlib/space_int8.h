@@ -1,6 +1,10 @@
 #pragma once
 #include "hnswlib.h"
 
+#if defined(USE_SIMD_DISPATCH) && (!defined(__GNUC__) || defined(__clang__) || __GNUC__ >= 8)
+#define USE_INT8_VNNI
+#endif
+
 namespace hnswlib {
 
 template <typename Tdist, typename Tcorr>
@@ -13,29 +17,317 @@ InnerProductRef(const Tcorr* a, const Tcorr* b, size_t d) {
     return sum;
 }
 
+template <typename Tdist, typename Tcorr>
+static Tdist
+L2SqrRef(const Tcorr* a, const Tcorr* b, size_t d) {
+    Tdist sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        Tdist t = Tdist(a[i]) - Tdist(b[i]);
+        sum += t * t;
+    }
+    return sum;
+}
 
-int fvec_inner_product_int8_avx(const int8_t* x, const int8_t* y, size_t d) {
-    __m256i msum256 = _mm256_setzero_si256();
+static int
+InnerProductInt8(const int8_t* x, const int8_t* y, size_t d) {
+    return InnerProductRef<int, int8_t>(x, y, d);
+}
+
+static int
+L2SqrInt8(const int8_t* x, const int8_t* y, size_t d) {
+    return L2SqrRef<int, int8_t>(x, y, d);
+}
+
+// x * scale rounded to the nearest integer and saturated to [-128, 127]
+static void
+QuantizeInt8(const float* x, int8_t* y, size_t d, float scale) {
+    for (size_t i = 0; i < d; i++) {
+        float v = std::min(std::max(x[i] * scale, -128.0f), 127.0f);
+        y[i] = (int8_t) lrintf(v);
+    }
+}
+
+#if defined(USE_SIMD_DISPATCH)
+
+SIMD_TARGET("sse4.1")
+static int
+ReduceAddSSE(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+SIMD_TARGET("sse4.1")
+static int
+InnerProductInt8SSE41(const int8_t* x, const int8_t* y, size_t d) {
+    __m128i msum = _mm_setzero_si128();
     while (d >= 16) {
-        __m256i ma = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i_u*)x));
+        __m128i va = _mm_loadu_si128((const __m128i*)x);
+        __m128i vb = _mm_loadu_si128((const __m128i*)y);
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(_mm_cvtepi8_epi16(va), _mm_cvtepi8_epi16(vb)));
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(_mm_cvtepi8_epi16(_mm_srli_si128(va, 8)),
+                                                  _mm_cvtepi8_epi16(_mm_srli_si128(vb, 8))));
         x += 16;
-        __m256i mb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i_u*)y));
         y += 16;
-        msum256 = _mm256_add_epi32(msum256, _mm256_madd_epi16(ma, mb));
         d -= 16;
     }
-    __m128i msum128 = _mm256_extracti128_si256(msum256, 1);
-    msum128 = _mm_add_epi32(msum128, _mm256_extracti128_si256(msum256, 0));
+    int sum = ReduceAddSSE(msum);
+    return d ? sum + InnerProductRef<int, int8_t>(x, y, d) : sum;
+}
+
+SIMD_TARGET("sse4.1")
+static int
+L2SqrInt8SSE41(const int8_t* x, const int8_t* y, size_t d) {
+    __m128i msum = _mm_setzero_si128();
+    while (d >= 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)x);
+        __m128i vb = _mm_loadu_si128((const __m128i*)y);
+        __m128i diff = _mm_sub_epi16(_mm_cvtepi8_epi16(va), _mm_cvtepi8_epi16(vb));
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(diff, diff));
+        diff = _mm_sub_epi16(_mm_cvtepi8_epi16(_mm_srli_si128(va, 8)), _mm_cvtepi8_epi16(_mm_srli_si128(vb, 8)));
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(diff, diff));
+        x += 16;
+        y += 16;
+        d -= 16;
+    }
+    int sum = ReduceAddSSE(msum);
+    return d ? sum + L2SqrRef<int, int8_t>(x, y, d) : sum;
+}
+
+SIMD_TARGET("avx2")
+static int
+ReduceAddAVX2(__m256i v) {
+    __m128i msum128 = _mm_add_epi32(_mm256_extracti128_si256(v, 1), _mm256_castsi256_si128(v));
     msum128 = _mm_hadd_epi32(msum128, msum128);
     msum128 = _mm_hadd_epi32(msum128, msum128);
-    int sum = _mm_cvtsi128_si32(msum128);
+    return _mm_cvtsi128_si32(msum128);
+}
+
+SIMD_TARGET("avx2")
+static int
+InnerProductInt8AVX2(const int8_t* x, const int8_t* y, size_t d) {
+    __m256i msum256 = _mm256_setzero_si256();
+    while (d >= 16) {
+        __m256i ma = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)x));
+        x += 16;
+        __m256i mb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)y));
+        y += 16;
+        msum256 = _mm256_add_epi32(msum256, _mm256_madd_epi16(ma, mb));
+        d -= 16;
+    }
+    int sum = ReduceAddAVX2(msum256);
     return d ? sum + InnerProductRef<int, int8_t>(x, y, d) : sum;
 }
 
+SIMD_TARGET("avx2")
+static int
+L2SqrInt8AVX2(const int8_t* x, const int8_t* y, size_t d) {
+    __m256i msum256 = _mm256_setzero_si256();
+    while (d >= 16) {
+        __m256i ma = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)x));
+        x += 16;
+        __m256i mb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)y));
+        y += 16;
+        __m256i diff = _mm256_sub_epi16(ma, mb);
+        msum256 = _mm256_add_epi32(msum256, _mm256_madd_epi16(diff, diff));
+        d -= 16;
+    }
+    int sum = ReduceAddAVX2(msum256);
+    return d ? sum + L2SqrRef<int, int8_t>(x, y, d) : sum;
+}
+
+// The AVX-512 kernels load the tail with a mask, the masked lanes read as zero
+SIMD_TARGET("avx512f,avx512bw")
+static int
+InnerProductInt8AVX512(const int8_t* x, const int8_t* y, size_t d) {
+    __m512i msum = _mm512_setzero_si512();
+    while (d >= 32) {
+        __m512i ma = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)x));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)y));
+        msum = _mm512_add_epi32(msum, _mm512_madd_epi16(ma, mb));
+        x += 32;
+        y += 32;
+        d -= 32;
+    }
+    if (d) {
+        __mmask64 mask = ((__mmask64)1 << d) - 1;
+        __m512i ma = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, x)));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, y)));
+        msum = _mm512_add_epi32(msum, _mm512_madd_epi16(ma, mb));
+    }
+    return _mm512_reduce_add_epi32(msum);
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static int
+L2SqrInt8AVX512(const int8_t* x, const int8_t* y, size_t d) {
+    __m512i msum = _mm512_setzero_si512();
+    while (d >= 32) {
+        __m512i ma = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)x));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)y));
+        __m512i diff = _mm512_sub_epi16(ma, mb);
+        msum = _mm512_add_epi32(msum, _mm512_madd_epi16(diff, diff));
+        x += 32;
+        y += 32;
+        d -= 32;
+    }
+    if (d) {
+        __mmask64 mask = ((__mmask64)1 << d) - 1;
+        __m512i ma = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, x)));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, y)));
+        __m512i diff = _mm512_sub_epi16(ma, mb);
+        msum = _mm512_add_epi32(msum, _mm512_madd_epi16(diff, diff));
+    }
+    return _mm512_reduce_add_epi32(msum);
+}
+
+#if defined(USE_INT8_VNNI)
+// vpdpbusd multiplies unsigned by signed bytes: x * y = (x + 128) * y - 128 * y,
+// where x + 128 is x with the sign bit flipped
+SIMD_TARGET("avx512f,avx512bw,avx512vnni")
+static int
+InnerProductInt8AVX512VNNI(const int8_t* x, const int8_t* y, size_t d) {
+    const __m512i offset = _mm512_set1_epi8((char)0x80);
+    __m512i mdot = _mm512_setzero_si512();
+    __m512i mcorr = _mm512_setzero_si512();
+    while (d >= 64) {
+        __m512i ma = _mm512_loadu_si512((const void*)x);
+        __m512i mb = _mm512_loadu_si512((const void*)y);
+        mdot = _mm512_dpbusd_epi32(mdot, _mm512_xor_si512(ma, offset), mb);
+        mcorr = _mm512_dpbusd_epi32(mcorr, offset, mb);
+        x += 64;
+        y += 64;
+        d -= 64;
+    }
+    if (d) {
+        __mmask64 mask = ((__mmask64)1 << d) - 1;
+        __m512i ma = _mm512_maskz_loadu_epi8(mask, x);
+        __m512i mb = _mm512_maskz_loadu_epi8(mask, y);
+        mdot = _mm512_dpbusd_epi32(mdot, _mm512_xor_si512(ma, offset), mb);
+        mcorr = _mm512_dpbusd_epi32(mcorr, offset, mb);
+    }
+    return _mm512_reduce_add_epi32(_mm512_sub_epi32(mdot, mcorr));
+}
+
+SIMD_TARGET("avx512f,avx512bw,avx512vnni")
+static int
+L2SqrInt8AVX512VNNI(const int8_t* x, const int8_t* y, size_t d) {
+    __m512i msum = _mm512_setzero_si512();
+    while (d >= 32) {
+        __m512i ma = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)x));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)y));
+        __m512i diff = _mm512_sub_epi16(ma, mb);
+        msum = _mm512_dpwssd_epi32(msum, diff, diff);
+        x += 32;
+        y += 32;
+        d -= 32;
+    }
+    if (d) {
+        __mmask64 mask = ((__mmask64)1 << d) - 1;
+        __m512i ma = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, x)));
+        __m512i mb = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(mask, y)));
+        __m512i diff = _mm512_sub_epi16(ma, mb);
+        msum = _mm512_dpwssd_epi32(msum, diff, diff);
+    }
+    return _mm512_reduce_add_epi32(msum);
+}
+#endif
+
+SIMD_TARGET("sse4.1")
+static void
+QuantizeInt8SSE41(const float* x, int8_t* y, size_t d, float scale) {
+    __m128 mscale = _mm_set1_ps(scale);
+    __m128 mmin = _mm_set1_ps(-128.0f);
+    __m128 mmax = _mm_set1_ps(127.0f);
+    while (d >= 8) {
+        __m128 lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(x), mscale), mmin), mmax);
+        __m128 hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(x + 4), mscale), mmin), mmax);
+        __m128i v16 = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+        _mm_storel_epi64((__m128i*)y, _mm_packs_epi16(v16, v16));
+        x += 8;
+        y += 8;
+        d -= 8;
+    }
+    QuantizeInt8(x, y, d, scale);
+}
+
+SIMD_TARGET("avx2")
+static void
+QuantizeInt8AVX2(const float* x, int8_t* y, size_t d, float scale) {
+    __m256 mscale = _mm256_set1_ps(scale);
+    __m256 mmin = _mm256_set1_ps(-128.0f);
+    __m256 mmax = _mm256_set1_ps(127.0f);
+    while (d >= 16) {
+        __m256 lo = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x), mscale), mmin), mmax);
+        __m256 hi = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x + 8), mscale), mmin), mmax);
+        // packs works per 128 bit lane, the permute puts the 16 values back in order
+        __m256i v16 = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        v16 = _mm256_permute4x64_epi64(v16, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i v8 = _mm_packs_epi16(_mm256_castsi256_si128(v16), _mm256_extracti128_si256(v16, 1));
+        _mm_storeu_si128((__m128i*)y, v8);
+        x += 16;
+        y += 16;
+        d -= 16;
+    }
+    QuantizeInt8(x, y, d, scale);
+}
+
+SIMD_TARGET("avx512f")
+static void
+QuantizeInt8AVX512(const float* x, int8_t* y, size_t d, float scale) {
+    __m512 mscale = _mm512_set1_ps(scale);
+    __m512 mmin = _mm512_set1_ps(-128.0f);
+    __m512 mmax = _mm512_set1_ps(127.0f);
+    while (d >= 16) {
+        __m512 v = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(_mm512_loadu_ps(x), mscale), mmin), mmax);
+        _mm_storeu_si128((__m128i*)y, _mm512_cvtsepi32_epi8(_mm512_cvtps_epi32(v)));
+        x += 16;
+        y += 16;
+        d -= 16;
+    }
+    QuantizeInt8(x, y, d, scale);
+}
+
+#endif
+
+static int (*InnerProductInt8Ext)(const int8_t*, const int8_t*, size_t) = InnerProductInt8;
+static int (*L2SqrInt8Ext)(const int8_t*, const int8_t*, size_t) = L2SqrInt8;
+static void (*QuantizeInt8Ext)(const float*, int8_t*, size_t, float) = QuantizeInt8;
+
+// Picks the widest int8 kernels the CPU supports
+static void
+SelectInt8Kernels() {
+#if defined(USE_SIMD_DISPATCH)
+    if (AVX512Capable())
+        QuantizeInt8Ext = QuantizeInt8AVX512;
+    else if (AVX2Capable())
+        QuantizeInt8Ext = QuantizeInt8AVX2;
+    else if (SSE41Capable())
+        QuantizeInt8Ext = QuantizeInt8SSE41;
+#if defined(USE_INT8_VNNI)
+    if (AVX512VNNICapable()) {
+        InnerProductInt8Ext = InnerProductInt8AVX512VNNI;
+        L2SqrInt8Ext = L2SqrInt8AVX512VNNI;
+        return;
+    }
+#endif
+    if (AVX512BWCapable()) {
+        InnerProductInt8Ext = InnerProductInt8AVX512;
+        L2SqrInt8Ext = L2SqrInt8AVX512;
+    } else if (AVX2Capable()) {
+        InnerProductInt8Ext = InnerProductInt8AVX2;
+        L2SqrInt8Ext = L2SqrInt8AVX2;
+    } else if (SSE41Capable()) {
+        InnerProductInt8Ext = InnerProductInt8SSE41;
+        L2SqrInt8Ext = L2SqrInt8SSE41;
+    }
+#endif
+}
+
 static float
 InnerProductDistFuncIP(const void* a, const void* b, const void* d, float scale2) {
     size_t dim = *((size_t*)d);
-    return (float)(fvec_inner_product_int8_avx((const int8_t*)a, (const int8_t*)b, dim)) / scale2;
+    return (float)(InnerProductInt8Ext((const int8_t*)a, (const int8_t*)b, dim)) / scale2;
 }
 
 
@@ -44,16 +336,30 @@ InnerProductDistFunc(const void* a, const void* b, const void* d, float scale2)
     return  1.0 - InnerProductDistFuncIP(a, b, d, scale2);
 }
 
-class SpaceInt8 : public SpaceInterface<float> {
+
+static float
+L2SqrInt8DistFunc(const void* a, const void* b, const void* d, float scale2) {
+    size_t dim = *((size_t*)d);
+    return (float)(L2SqrInt8Ext((const int8_t*)a, (const int8_t*)b, dim)) / scale2;
+}
+
+/*
+* Spaces of int8 vectors. Once a scale is set (sq8 sets it), queries are floats that
+* prepare_query quantizes with that scale, so callers do not quantize them themselves.
+*/
+class Int8SpaceBase : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
     size_t data_size_;
     size_t dim_;
+    float scale_;
 
  public:
-    SpaceInt8(size_t dim) {
-        fstdistfunc_ = InnerProductDistFunc;
+    Int8SpaceBase(size_t dim, DISTFUNC<float> dist_func) {
+        fstdistfunc_ = dist_func;
+        SelectInt8Kernels();
         dim_ = dim;
         data_size_ = dim * sizeof(int8_t);
+        scale_ = 0;
     }
 
     size_t get_data_size() {
@@ -68,7 +374,65 @@ class SpaceInt8 : public SpaceInterface<float> {
         return &dim_;
     }
 
+    size_t get_query_input_size() {
+        return scale_ > 0 ? dim_ * sizeof(float) : data_size_;
+    }
+
+    size_t get_query_data_size() {
+        return scale_ > 0 ? data_size_ : 0;
+    }
+
+    void prepare_query(const void *query_data, void *prepared_query) {
+        quantize((const float *) query_data, (int8_t *) prepared_query);
+    }
+
+    size_t getDim() const {
+        return dim_;
+    }
+
+    // 0 when queries are int8 vectors quantized by the caller
+    float getScale() const {
+        return scale_;
+    }
+
+    void setScale(float scale) {
+        scale_ = scale;
+    }
+
+    void quantize(const float *x, int8_t *y) const {
+        QuantizeInt8Ext(x, y, dim_, scale_);
+    }
+
+    void saveScale(std::ostream &output) const {
+        writeBinaryPOD(output, dim_);
+        writeBinaryPOD(output, scale_);
+    }
+
+    void loadScale(std::istream &input) {
+        size_t dim;
+        float scale;
+        readBinaryPOD(input, dim);
+        readBinaryPOD(input, scale);
+        if (!input || dim != dim_)
+            throw std::runtime_error("The int8 scale does not match the space");
+        scale_ = scale;
+    }
+
+    virtual ~Int8SpaceBase() {}
+};
+
+class SpaceInt8 : public Int8SpaceBase {
+ public:
+    SpaceInt8(size_t dim) : Int8SpaceBase(dim, InnerProductDistFunc) {}
+
     ~SpaceInt8() {}
 };
 
+class L2SpaceInt8 : public Int8SpaceBase {
+ public:
+    L2SpaceInt8(size_t dim) : Int8SpaceBase(dim, L2SqrInt8DistFunc) {}
+
+    ~L2SpaceInt8() {}
+};
+
 }  // namespace hnswlib
@@ -1,67 +1,156 @@
 #pragma once
 #include "./hnswlib.h"
+#include <fstream>
+#include "pq_train.h"
 
 namespace hnswlib {
 
-std::vector<std::vector<float>> codebooks;
-std::vector<std::vector<float>> dist_lookup;
+// Parameters of the PQ distance functions, a code is M bytes
+struct PqDistParam {
+    size_t M;
+    size_t dim;
+    size_t ksub;
+    const float *sdc;  // M lower triangular ksub x ksub tables of centroid distances, see PqSpace::computeSdcTable
+};
 
+// Symmetric distance between two codes
 static float
 sdc_pq_distance(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
   uint8_t *pv1 = (uint8_t *)pVect1v;
   uint8_t *pv2 = (uint8_t *)pVect2v;
+  const PqDistParam *param = (const PqDistParam *)qty_ptr;
 
-  size_t qty = *((size_t *)qty_ptr);
+  size_t qty = param->M;
+  size_t table_size = param->ksub * (param->ksub + 1) / 2;
   float res = 0;
 
   for (size_t i = 0; i < qty; ++i) {
-    uint8_t idx1 = pv1[i];
-    uint8_t idx2 = pv2[i];
+    size_t idx1 = pv1[i];
+    size_t idx2 = pv2[i];
+    const float *dist_lookup = param->sdc + i * table_size;
     if (idx1 < idx2) {
         size_t idx = idx2 * (idx2 + 1) / 2 + idx1;
-        res += dist_lookup[i][idx];
+        res += dist_lookup[idx];
     } else {
         size_t idx = idx1 * (idx1 + 1) / 2 + idx2;
-        res += dist_lookup[i][idx];
+        res += dist_lookup[idx];
     }
   }
   return res;
 }
 
+/*
+* Asymmetric distance: pVect1v is the query distance table made by PqSpace::prepare_query,
+* M rows of ksub floats holding the distance from the query sub-vector to every centroid,
+* so a code costs M table lookups instead of dim float operations.
+*/
 static float adc_pq_distance(const void *pVect1v, const void *pVect2v,
                              const void *qty_ptr, float t) {
-  float *pVect1 = (float *)pVect1v;
-  uint8_t *pVect2 = (uint8_t *)pVect2v;
-  size_t M = *((size_t *)qty_ptr);
-
-  int dim = 128;
-  int dsub = dim / M;
+  const float *table = (const float *)pVect1v;
+  const uint8_t *codes = (const uint8_t *)pVect2v;
+  const PqDistParam *param = (const PqDistParam *)qty_ptr;
 
   float res = 0;
-  for (size_t i = 0; i < M; i++) {
-    uint8_t code_books_idx = pVect2[i];
-    float* centroids = codebooks[i].data()+code_books_idx*dsub;
+  for (size_t i = 0; i < param->M; i++) {
+    res += table[i * param->ksub + codes[i]];
+  }
+  return res;
+}
 
-    for (size_t j = 0; j < dsub; j++) {
-        float d1 = pVect1[i * dsub + j];
-        float d2 = centroids[j];
-        res += (d1 - d2) * (d1 - d2);
-    }
+#if defined(USE_SIMD_DISPATCH)
+SIMD_TARGET("avx2")
+static float adc_pq_distance_avx2(const void *pVect1v, const void *pVect2v,
+                                  const void *qty_ptr, float t) {
+  const float *table = (const float *)pVect1v;
+  const uint8_t *codes = (const uint8_t *)pVect2v;
+  const PqDistParam *param = (const PqDistParam *)qty_ptr;
+  size_t M = param->M;
+  int ksub = (int) param->ksub;
+
+  // row offsets of 8 consecutive sub-quantizers
+  __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(ksub));
+  __m256i step = _mm256_set1_epi32(8 * ksub);
+  __m256 sum = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= M; i += 8) {
+    __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(codes + i)));
+    sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table, _mm256_add_epi32(idx, offsets), 4));
+    offsets = _mm256_add_epi32(offsets, step);
+  }
+
+  __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  sum128 = _mm_hadd_ps(sum128, sum128);
+  sum128 = _mm_hadd_ps(sum128, sum128);
+  float res = _mm_cvtss_f32(sum128);
+  for (; i < M; i++) {
+    res += table[i * ksub + codes[i]];
+  }
+  return res;
+}
+
+SIMD_TARGET("avx512f")
+static float adc_pq_distance_avx512(const void *pVect1v, const void *pVect2v,
+                                    const void *qty_ptr, float t) {
+  const float *table = (const float *)pVect1v;
+  const uint8_t *codes = (const uint8_t *)pVect2v;
+  const PqDistParam *param = (const PqDistParam *)qty_ptr;
+  size_t M = param->M;
+  int ksub = (int) param->ksub;
+
+  __m512i offsets = _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(ksub));
+  __m512i step = _mm512_set1_epi32(16 * ksub);
+  __m512 sum = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= M; i += 16) {
+    __m512i idx = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(codes + i)));
+    sum = _mm512_add_ps(sum, _mm512_i32gather_ps(_mm512_add_epi32(idx, offsets), table, 4));
+    offsets = _mm512_add_epi32(offsets, step);
   }
 
+  float res = _mm512_reduce_add_ps(sum);
+  for (; i < M; i++) {
+    res += table[i * ksub + codes[i]];
+  }
   return res;
 }
+#endif
 
+/*
+* Product quantization space, each index owns its space with the trained codebooks.
+* Stored elements are M one byte codes; queries are dim floats that prepare_query
+* turns into distance tables. Two codes are compared by the symmetric distance.
+*/
 class PqSpace : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
     size_t data_size_;
-    size_t dim_;
+    size_t nbits_;
+    PqDistParam param_;
+    std::vector<float> codebooks_;  // M x ksub x dsub centroids
+    std::vector<float> sdc_;
+    std::vector<float> rotation_;  // OPQ rotation, dim x dim, empty for plain PQ
 
  public:
-    PqSpace(size_t dim) {
+    // M sub-quantizers of 2^nbits centroids over dim dimensions, one byte per code
+    PqSpace(size_t M, size_t dim = 128, size_t nbits = 8) {
+        if (M == 0 || dim % M != 0)
+            throw std::runtime_error("PQ dimension must be a multiple of M");
+        if (nbits == 0 || nbits > 8)
+            throw std::runtime_error("PQ supports 1 to 8 bits per code");
+        nbits_ = nbits;
+        param_.M = M;
+        param_.dim = dim;
+        param_.ksub = (size_t) 1 << nbits;
+        param_.sdc = nullptr;
+        data_size_ = M * sizeof(uint8_t);
+
         fstdistfunc_ = adc_pq_distance;
-        dim_ = dim;
-        data_size_ = dim * sizeof(uint8_t);
+#if defined(USE_SIMD_DISPATCH)
+        if (AVX512Capable())
+            fstdistfunc_ = adc_pq_distance_avx512;
+        else if (AVX2Capable())
+            fstdistfunc_ = adc_pq_distance_avx2;
+#endif
     }
 
     size_t get_data_size() {
@@ -73,10 +162,279 @@ class PqSpace : public SpaceInterface<float> {
     }
 
     void *get_dist_func_param() {
-        return &dim_;
+        return &param_;
+    }
+
+    // Code to code distance, valid after computeSdcTable
+    DISTFUNC<float> get_sdc_dist_func() {
+        return sdc_pq_distance;
+    }
+
+    // Elements are compared with each other by their codes, e.g. while adding codes to the graph
+    DISTFUNC<float> get_code_dist_func() {
+        return get_sdc_dist_func();
+    }
+
+    void *get_code_dist_func_param() {
+        return &param_;
+    }
+
+    size_t get_query_input_size() {
+        return param_.dim * sizeof(float);
+    }
+
+    size_t get_query_data_size() {
+        return param_.M * param_.ksub * sizeof(float);
+    }
+
+    size_t getM() const {
+        return param_.M;
+    }
+
+    size_t getDim() const {
+        return param_.dim;
+    }
+
+    size_t getNbits() const {
+        return nbits_;
+    }
+
+    size_t getKsub() const {
+        return param_.ksub;
+    }
+
+    size_t getDsub() const {
+        return param_.dim / param_.M;
+    }
+
+    bool hasCodebooks() const {
+        return !codebooks_.empty();
+    }
+
+    // Centroids of sub-quantizer m, ksub x dsub floats
+    const float *getCentroids(size_t m) const {
+        return codebooks_.data() + m * param_.ksub * getDsub();
+    }
+
+    // One vector of ksub x dsub centroids per sub-quantizer
+    void setCodebooks(const std::vector<std::vector<float>> &code_books) {
+        if (code_books.size() != param_.M)
+            throw std::runtime_error("Number of PQ codebooks does not match M");
+        size_t codebook_size = param_.ksub * getDsub();
+        std::vector<float> flat(param_.M * codebook_size);
+        for (size_t i = 0; i < param_.M; i++) {
+            if (code_books[i].size() != codebook_size)
+                throw std::runtime_error("PQ codebook size does not match ksub * dsub");
+            memcpy(flat.data() + i * codebook_size, code_books[i].data(), codebook_size * sizeof(float));
+        }
+        codebooks_.swap(flat);
+        sdc_.clear();
+        param_.sdc = nullptr;
+    }
+
+    // Fills the tables of sdc_pq_distance, to be called after the codebooks are set
+    void computeSdcTable() {
+        if (!hasCodebooks())
+            throw std::runtime_error("PQ codebooks are not loaded");
+        size_t ksub = param_.ksub;
+        size_t dsub = getDsub();
+        size_t table_size = ksub * (ksub + 1) / 2;
+        sdc_.resize(param_.M * table_size);
+        for (size_t i = 0; i < param_.M; i++) {
+            const float *data = getCentroids(i);
+            float *dist_lookup = sdc_.data() + i * table_size;
+            for (size_t j = 0; j < ksub; j++) {
+                for (size_t k = 0; k <= j; k++) {
+                    float res = 0;
+                    for (size_t l = 0; l < dsub; l++) {
+                        float t = data[j * dsub + l] - data[k * dsub + l];
+                        res += t * t;
+                    }
+                    dist_lookup[j * (j + 1) / 2 + k] = res;
+                }
+            }
+        }
+        param_.sdc = sdc_.data();
+    }
+
+    bool hasRotation() const {
+        return !rotation_.empty();
+    }
+
+    /*
+    * Trains the codebooks by k-means in every sub-space on n vectors. With opq the vectors are
+    * first rotated by an orthogonal matrix that is refined opq_iter times, alternating between
+    * k-means and the rotation that best maps the vectors onto their reconstructions.
+    * Returns the mean squared quantization error on the training vectors.
+    */
+    float train(const float *x, size_t n, size_t niter = 25, bool opq = false, size_t opq_iter = 8, unsigned int seed = 1234) {
+        size_t dim = param_.dim;
+        rotation_.clear();
+
+        std::vector<float> xr;
+        const float *train_x = x;
+        if (opq) {
+            rotation_.assign(dim * dim, 0.0f);
+            for (size_t i = 0; i < dim; i++) rotation_[i * dim + i] = 1.0f;
+            xr.resize(n * dim);
+            std::vector<float> decoded(n * dim);
+            std::vector<uint8_t> codes(n * param_.M);
+            for (size_t it = 0; it < opq_iter; it++) {
+                rotateAll(x, n, xr.data());
+                trainCodebooks(xr.data(), n, std::min(niter, (size_t) 4), seed + it);
+#pragma omp parallel for
+                for (long long i = 0; i < (long long) n; i++) {
+                    encodeRotated(xr.data() + i * dim, codes.data() + i * param_.M);
+                    decode(codes.data() + i * param_.M, decoded.data() + i * dim);
+                }
+                ProcrustesRotation(x, decoded.data(), n, dim, rotation_);
+            }
+            rotateAll(x, n, xr.data());
+            train_x = xr.data();
+        }
+        trainCodebooks(train_x, n, niter, seed);
+        computeSdcTable();
+
+        std::vector<uint8_t> codes(n * param_.M);
+        double err = 0;
+#pragma omp parallel for reduction(+:err)
+        for (long long i = 0; i < (long long) n; i++) {
+            err += encodeRotated(train_x + i * dim, codes.data() + i * param_.M);
+        }
+        return (float) (err / n);
+    }
+
+    /*
+    * Writes the M byte code of a dim float vector, returns the squared distance
+    * between the vector and its reconstruction
+    */
+    float encode(const float *x, uint8_t *code) const {
+        if (!hasRotation())
+            return encodeRotated(x, code);
+        std::vector<float> xr(param_.dim);
+        RotateRow(x, rotation_.data(), param_.dim, xr.data());
+        return encodeRotated(xr.data(), code);
+    }
+
+    // Reconstruction of a code, in the rotated space for OPQ
+    void decode(const uint8_t *code, float *x) const {
+        size_t dsub = getDsub();
+        for (size_t i = 0; i < param_.M; i++) {
+            memcpy(x + i * dsub, getCentroids(i) + code[i] * dsub, dsub * sizeof(float));
+        }
+    }
+
+    // Squared L2 distance from every query sub-vector to every centroid of its codebook
+    void prepare_query(const void *query_data, void *prepared_query) {
+        if (!hasCodebooks())
+            throw std::runtime_error("PQ codebooks are not loaded");
+        const float *query = (const float *) query_data;
+        std::vector<float> rotated_query;
+        if (hasRotation()) {
+            rotated_query.resize(param_.dim);
+            RotateRow(query, rotation_.data(), param_.dim, rotated_query.data());
+            query = rotated_query.data();
+        }
+        float *table = (float *) prepared_query;
+        size_t dsub = getDsub();
+        for (size_t i = 0; i < param_.M; i++) {
+            const float *q = query + i * dsub;
+            const float *centroids = getCentroids(i);
+            float *row = table + i * param_.ksub;
+            for (size_t c = 0; c < param_.ksub; c++) {
+                float res = 0;
+                for (size_t j = 0; j < dsub; j++) {
+                    float t = q[j] - centroids[c * dsub + j];
+                    res += t * t;
+                }
+                row[c] = res;
+            }
+        }
+    }
+
+    void saveCodebooks(std::ostream &output) const {
+        if (!hasCodebooks())
+            throw std::runtime_error("PQ codebooks are not loaded");
+        writeBinaryPOD(output, param_.M);
+        writeBinaryPOD(output, param_.dim);
+        writeBinaryPOD(output, nbits_);
+        output.write((const char *) codebooks_.data(), codebooks_.size() * sizeof(float));
+        size_t rotation_size = rotation_.size();
+        writeBinaryPOD(output, rotation_size);
+        output.write((const char *) rotation_.data(), rotation_size * sizeof(float));
+    }
+
+    void loadCodebooks(std::istream &input) {
+        size_t M, dim, nbits;
+        readBinaryPOD(input, M);
+        readBinaryPOD(input, dim);
+        readBinaryPOD(input, nbits);
+        if (M != param_.M || dim != param_.dim || nbits != nbits_)
+            throw std::runtime_error("PQ codebooks do not match the space parameters");
+        std::vector<float> flat(param_.M * param_.ksub * getDsub());
+        input.read((char *) flat.data(), flat.size() * sizeof(float));
+        size_t rotation_size = 0;
+        readBinaryPOD(input, rotation_size);
+        if (rotation_size != 0 && rotation_size != param_.dim * param_.dim)
+            throw std::runtime_error("PQ rotation does not match the space parameters");
+        std::vector<float> rotation(rotation_size);
+        input.read((char *) rotation.data(), rotation_size * sizeof(float));
+        if (!input)
+            throw std::runtime_error("Failed to read the PQ codebooks");
+        codebooks_.swap(flat);
+        rotation_.swap(rotation);
+        computeSdcTable();
+    }
+
+    // The codebooks go to their own file next to the index, e.g. index.bin.pq
+    void saveCodebooks(const std::string &location) const {
+        std::ofstream output(location, std::ios::binary);
+        saveCodebooks(output);
+        output.close();
+    }
+
+    void loadCodebooks(const std::string &location) {
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        loadCodebooks(input);
+        input.close();
     }
 
     ~PqSpace() {}
+
+ private:
+    void rotateAll(const float *x, size_t n, float *xr) const {
+#pragma omp parallel for
+        for (long long i = 0; i < (long long) n; i++) {
+            RotateRow(x + i * param_.dim, rotation_.data(), param_.dim, xr + i * param_.dim);
+        }
+    }
+
+    // k-means per sub-space on the (rotated) vectors
+    void trainCodebooks(const float *x, size_t n, size_t niter, unsigned int seed) {
+        size_t dsub = getDsub();
+        size_t ksub = param_.ksub;
+        codebooks_.resize(param_.M * ksub * dsub);
+        std::vector<float> sub(n * dsub);
+        for (size_t m = 0; m < param_.M; m++) {
+            for (size_t i = 0; i < n; i++) {
+                memcpy(sub.data() + i * dsub, x + i * param_.dim + m * dsub, dsub * sizeof(float));
+            }
+            KMeans(sub.data(), n, dsub, ksub, niter, seed + (unsigned int) m, codebooks_.data() + m * ksub * dsub);
+        }
+    }
+
+    float encodeRotated(const float *x, uint8_t *code) const {
+        size_t dsub = getDsub();
+        float err = 0;
+        for (size_t m = 0; m < param_.M; m++) {
+            float dist;
+            code[m] = (uint8_t) NearestCentroid(x + m * dsub, getCentroids(m), param_.ksub, dsub, dist);
+            err += dist;
+        }
+        return err;
+    }
 };
 
 }
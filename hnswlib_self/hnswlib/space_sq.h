@@ -0,0 +1,500 @@
+#pragma once
+#include "./hnswlib.h"
+#include <fstream>
+#include "sq_train.h"
+
+namespace hnswlib {
+
+// Parameters of the SQ distance functions. A code of dim values takes code_size bytes, fewer than dim below 8 bits.
+struct SqDistParam {
+    size_t dim;
+    size_t nbits;
+    size_t code_size;
+    const float *step;  // per dimension quantization step, value = vmin + step * code
+    const float *vmin;
+};
+
+// Code of dimension j in a code of NBITS bit values packed little endian
+template<int NBITS>
+static inline unsigned SqCode(const uint8_t *code, size_t j) {
+    if (NBITS == 8) return code[j];
+    if (NBITS == 4) return (code[j >> 1] >> ((j & 1) * 4)) & 0x0f;
+    size_t bit = j * NBITS;
+    unsigned shift = bit & 7;
+    unsigned v = code[bit >> 3];
+    if (shift + NBITS > 8) v |= (unsigned) code[(bit >> 3) + 1] << 8;
+    return (v >> shift) & ((1u << NBITS) - 1);
+}
+
+// Writes a code value into a zero initialized code
+template<int NBITS>
+static inline void SqSetCode(uint8_t *code, size_t j, unsigned c) {
+    size_t bit = j * NBITS;
+    unsigned shift = bit & 7;
+    unsigned v = c << shift;
+    code[bit >> 3] |= (uint8_t) v;
+    if (shift + NBITS > 8) code[(bit >> 3) + 1] |= (uint8_t) (v >> 8);
+}
+
+/*
+* Asymmetric distances: pVect1v is the query made by SqSpace::prepare_query and pVect2v a code.
+* For L2 the query holds q - vmin, for the inner product q * step followed by the dot product of
+* q and vmin, so neither kernel touches vmin.
+*/
+template<int NBITS>
+static float SqL2Sqr(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+
+    float res = 0;
+    for (size_t j = 0; j < param->dim; j++) {
+        float diff = query[j] - param->step[j] * SqCode<NBITS>(code, j);
+        res += diff * diff;
+    }
+    return res;
+}
+
+template<int NBITS>
+static float SqInnerProduct(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+
+    float res = 0;
+    for (size_t j = 0; j < param->dim; j++) {
+        res += query[j] * SqCode<NBITS>(code, j);
+    }
+    return 1.0f - query[param->dim] - res;
+}
+
+// Symmetric distances between two codes, for comparing stored elements
+template<int NBITS>
+static float SqCodeL2Sqr(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const uint8_t *code1 = (const uint8_t *) pVect1v;
+    const uint8_t *code2 = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+
+    float res = 0;
+    for (size_t j = 0; j < param->dim; j++) {
+        float diff = param->step[j] * ((float) SqCode<NBITS>(code1, j) - (float) SqCode<NBITS>(code2, j));
+        res += diff * diff;
+    }
+    return res;
+}
+
+template<int NBITS>
+static float SqCodeInnerProduct(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const uint8_t *code1 = (const uint8_t *) pVect1v;
+    const uint8_t *code2 = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+
+    float res = 0;
+    for (size_t j = 0; j < param->dim; j++) {
+        float x1 = param->vmin[j] + param->step[j] * SqCode<NBITS>(code1, j);
+        float x2 = param->vmin[j] + param->step[j] * SqCode<NBITS>(code2, j);
+        res += x1 * x2;
+    }
+    return 1.0f - res;
+}
+
+#if defined(USE_SIMD_DISPATCH)
+/*
+* Codes i to i + 7 as floats, i a multiple of 8 so the block starts on a byte. Reads NBITS bytes,
+* 8 for 6 bit codes whose 4 code groups of 3 bytes are spread over the 32 bit lanes by a shuffle.
+*/
+template<int NBITS>
+SIMD_TARGET("avx2")
+static inline __m256 SqUnpack8(const uint8_t *code, size_t i) {
+    const uint8_t *p = code + i * NBITS / 8;
+    __m128i bytes;
+    if (NBITS == 8) {
+        bytes = _mm_loadl_epi64((const __m128i *) p);
+    } else if (NBITS == 4) {
+        int32_t packed;
+        memcpy(&packed, p, sizeof(packed));
+        __m128i v = _mm_cvtsi32_si128(packed);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        bytes = _mm_unpacklo_epi8(_mm_and_si128(v, mask), _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    } else {
+        __m256i v = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *) p));
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi32(
+            (int) 0x80020100, (int) 0x80020100, (int) 0x80020100, (int) 0x80020100,
+            (int) 0x80050403, (int) 0x80050403, (int) 0x80050403, (int) 0x80050403));
+        v = _mm256_srlv_epi32(v, _mm256_setr_epi32(0, 6, 12, 18, 0, 6, 12, 18));
+        return _mm256_cvtepi32_ps(_mm256_and_si256(v, _mm256_set1_epi32(0x3f)));
+    }
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+SIMD_TARGET("avx2")
+static inline float SqReduceAVX2(__m256 sum) {
+    __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    sum128 = _mm_hadd_ps(sum128, sum128);
+    sum128 = _mm_hadd_ps(sum128, sum128);
+    return _mm_cvtss_f32(sum128);
+}
+
+template<int NBITS>
+SIMD_TARGET("avx2")
+static float SqL2SqrAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+    const size_t load = NBITS == 6 ? 8 : NBITS;  // bytes read for a block of 8 codes
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t j = 0;
+    for (; j + 8 <= param->dim && j * NBITS / 8 + load <= param->code_size; j += 8) {
+        __m256 decoded = _mm256_mul_ps(_mm256_loadu_ps(param->step + j), SqUnpack8<NBITS>(code, j));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(query + j), decoded);
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    float res = SqReduceAVX2(sum);
+    for (; j < param->dim; j++) {
+        float diff = query[j] - param->step[j] * SqCode<NBITS>(code, j);
+        res += diff * diff;
+    }
+    return res;
+}
+
+template<int NBITS>
+SIMD_TARGET("avx2")
+static float SqInnerProductAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+    const size_t load = NBITS == 6 ? 8 : NBITS;
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t j = 0;
+    for (; j + 8 <= param->dim && j * NBITS / 8 + load <= param->code_size; j += 8) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(query + j), SqUnpack8<NBITS>(code, j)));
+    }
+    float res = SqReduceAVX2(sum);
+    for (; j < param->dim; j++) {
+        res += query[j] * SqCode<NBITS>(code, j);
+    }
+    return 1.0f - query[param->dim] - res;
+}
+
+// Codes i to i + 15 as floats, i a multiple of 16. Reads 2 * NBITS bytes, 16 for 6 bit codes.
+template<int NBITS>
+SIMD_TARGET("avx512f,avx512bw")
+static inline __m512 SqUnpack16(const uint8_t *code, size_t i) {
+    const uint8_t *p = code + i * NBITS / 8;
+    __m128i bytes;
+    if (NBITS == 8) {
+        bytes = _mm_loadu_si128((const __m128i *) p);
+    } else if (NBITS == 4) {
+        __m128i v = _mm_loadl_epi64((const __m128i *) p);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        bytes = _mm_unpacklo_epi8(_mm_and_si128(v, mask), _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    } else {
+        __m512i v = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) p));
+        v = _mm512_shuffle_epi8(v, _mm512_setr_epi32(
+            (int) 0x80020100, (int) 0x80020100, (int) 0x80020100, (int) 0x80020100,
+            (int) 0x80050403, (int) 0x80050403, (int) 0x80050403, (int) 0x80050403,
+            (int) 0x80080706, (int) 0x80080706, (int) 0x80080706, (int) 0x80080706,
+            (int) 0x800b0a09, (int) 0x800b0a09, (int) 0x800b0a09, (int) 0x800b0a09));
+        v = _mm512_srlv_epi32(v, _mm512_setr_epi32(0, 6, 12, 18, 0, 6, 12, 18, 0, 6, 12, 18, 0, 6, 12, 18));
+        return _mm512_cvtepi32_ps(_mm512_and_si512(v, _mm512_set1_epi32(0x3f)));
+    }
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+}
+
+template<int NBITS>
+SIMD_TARGET("avx512f,avx512bw")
+static float SqL2SqrAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+    const size_t load = NBITS == 6 ? 16 : 2 * NBITS;  // bytes read for a block of 16 codes
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t j = 0;
+    for (; j + 16 <= param->dim && j * NBITS / 8 + load <= param->code_size; j += 16) {
+        __m512 decoded = _mm512_mul_ps(_mm512_loadu_ps(param->step + j), SqUnpack16<NBITS>(code, j));
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(query + j), decoded);
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    float res = _mm512_reduce_add_ps(sum);
+    for (; j < param->dim; j++) {
+        float diff = query[j] - param->step[j] * SqCode<NBITS>(code, j);
+        res += diff * diff;
+    }
+    return res;
+}
+
+template<int NBITS>
+SIMD_TARGET("avx512f,avx512bw")
+static float SqInnerProductAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr, float t) {
+    const float *query = (const float *) pVect1v;
+    const uint8_t *code = (const uint8_t *) pVect2v;
+    const SqDistParam *param = (const SqDistParam *) qty_ptr;
+    const size_t load = NBITS == 6 ? 16 : 2 * NBITS;
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t j = 0;
+    for (; j + 16 <= param->dim && j * NBITS / 8 + load <= param->code_size; j += 16) {
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(query + j), SqUnpack16<NBITS>(code, j), sum);
+    }
+    float res = _mm512_reduce_add_ps(sum);
+    for (; j < param->dim; j++) {
+        res += query[j] * SqCode<NBITS>(code, j);
+    }
+    return 1.0f - query[param->dim] - res;
+}
+#endif
+
+/*
+* Trained scalar quantization space, each index owns its space with the trained ranges.
+* Every dimension j has its own range [vmin_j, vmin_j + step_j * (2^nbits - 1)] (non-uniform),
+* or all dimensions share one range (uniform). Elements are dim codes of 4, 6 or 8 bits packed
+* into bytes; queries are dim floats, for the inner product distance 1 - <q, x> as InnerProductSpace.
+*/
+class SqSpace : public SpaceInterface<float> {
+    DISTFUNC<float> fstdistfunc_;
+    DISTFUNC<float> code_fstdistfunc_;
+    bool inner_product_;
+    SqDistParam param_;
+    std::vector<float> vmin_;
+    std::vector<float> step_;
+
+    template<int NBITS>
+    void selectKernels() {
+        if (inner_product_) {
+            fstdistfunc_ = SqInnerProduct<NBITS>;
+            code_fstdistfunc_ = SqCodeInnerProduct<NBITS>;
+        } else {
+            fstdistfunc_ = SqL2Sqr<NBITS>;
+            code_fstdistfunc_ = SqCodeL2Sqr<NBITS>;
+        }
+#if defined(USE_SIMD_DISPATCH)
+        if (AVX512BWCapable()) {
+            if (inner_product_)
+                fstdistfunc_ = SqInnerProductAVX512<NBITS>;
+            else
+                fstdistfunc_ = SqL2SqrAVX512<NBITS>;
+        } else if (AVX2Capable()) {
+            if (inner_product_)
+                fstdistfunc_ = SqInnerProductAVX2<NBITS>;
+            else
+                fstdistfunc_ = SqL2SqrAVX2<NBITS>;
+        }
+#endif
+    }
+
+ public:
+    SqSpace(size_t dim, size_t nbits = 8, bool inner_product = false) : inner_product_(inner_product) {
+        if (dim == 0)
+            throw std::runtime_error("SQ dimension must be positive");
+        param_.dim = dim;
+        param_.nbits = nbits;
+        param_.code_size = (dim * nbits + 7) / 8;
+        param_.step = nullptr;
+        param_.vmin = nullptr;
+        if (nbits == 8)
+            selectKernels<8>();
+        else if (nbits == 6)
+            selectKernels<6>();
+        else if (nbits == 4)
+            selectKernels<4>();
+        else
+            throw std::runtime_error("SQ supports 4, 6 or 8 bits per dimension");
+    }
+
+    size_t get_data_size() {
+        return param_.code_size;
+    }
+
+    DISTFUNC<float> get_dist_func() {
+        return fstdistfunc_;
+    }
+
+    void *get_dist_func_param() {
+        return &param_;
+    }
+
+    // Elements are compared with each other by their codes, e.g. while adding codes to the graph
+    DISTFUNC<float> get_code_dist_func() {
+        return code_fstdistfunc_;
+    }
+
+    void *get_code_dist_func_param() {
+        return &param_;
+    }
+
+    size_t get_query_input_size() {
+        return param_.dim * sizeof(float);
+    }
+
+    size_t get_query_data_size() {
+        return (param_.dim + 1) * sizeof(float);
+    }
+
+    size_t getDim() const {
+        return param_.dim;
+    }
+
+    size_t getNbits() const {
+        return param_.nbits;
+    }
+
+    bool isInnerProduct() const {
+        return inner_product_;
+    }
+
+    bool isTrained() const {
+        return !vmin_.empty();
+    }
+
+    const float *getMin() const {
+        return vmin_.data();
+    }
+
+    const float *getStep() const {
+        return step_.data();
+    }
+
+    // Range [vmin[j], vmax[j]] of every dimension
+    void setRanges(const float *vmin, const float *vmax) {
+        size_t levels = ((size_t) 1 << param_.nbits) - 1;
+        vmin_.assign(vmin, vmin + param_.dim);
+        step_.resize(param_.dim);
+        for (size_t j = 0; j < param_.dim; j++) {
+            float step = (vmax[j] - vmin[j]) / levels;
+            step_[j] = step > 0 ? step : 1.0f;
+        }
+        param_.step = step_.data();
+        param_.vmin = vmin_.data();
+    }
+
+    /*
+    * Trains the ranges on n rows of dim floats at x + i * stride with a quantile sketch. A fraction
+    * clip of the values of a range is clipped at each end, 0 keeps min and max. per_dimension false
+    * gives all dimensions the same range. Returns the mean squared quantization error of a row.
+    */
+    float train(const char *x, size_t n, size_t stride, float clip = 0.0f, bool per_dimension = true) {
+        if (n == 0)
+            throw std::runtime_error("SQ training needs at least one vector");
+        size_t dim = param_.dim;
+        QuantileSketch sketch(dim);
+        sketch.build(x, n, stride, !per_dimension);
+        std::vector<float> vmin(dim), vmax(dim);
+        for (size_t j = 0; j < dim; j++) {
+            vmin[j] = per_dimension ? sketch.quantile(j, clip) : sketch.globalQuantile(clip);
+            vmax[j] = per_dimension ? sketch.quantile(j, 1.0 - clip) : sketch.globalQuantile(1.0 - clip);
+        }
+        setRanges(vmin.data(), vmax.data());
+
+        double err = 0;
+#pragma omp parallel for reduction(+:err)
+        for (long long i = 0; i < (long long) n; i++) {
+            std::vector<uint8_t> code(param_.code_size);
+            err += encode((const float *) (x + i * stride), code.data());
+        }
+        return (float) (err / n);
+    }
+
+    float train(const float *x, size_t n, float clip = 0.0f, bool per_dimension = true) {
+        return train((const char *) x, n, param_.dim * sizeof(float), clip, per_dimension);
+    }
+
+    // Writes the code of a dim float vector, returns the squared error of its reconstruction
+    float encode(const float *x, uint8_t *code) const {
+        if (!isTrained())
+            throw std::runtime_error("SQ ranges are not trained");
+        memset(code, 0, param_.code_size);
+        unsigned levels = (1u << param_.nbits) - 1;
+        float err = 0;
+        for (size_t j = 0; j < param_.dim; j++) {
+            float v = roundf((x[j] - vmin_[j]) / step_[j]);
+            unsigned c = v <= 0 ? 0 : (v >= levels ? levels : (unsigned) v);
+            if (param_.nbits == 8)
+                SqSetCode<8>(code, j, c);
+            else if (param_.nbits == 6)
+                SqSetCode<6>(code, j, c);
+            else
+                SqSetCode<4>(code, j, c);
+            float diff = x[j] - (vmin_[j] + step_[j] * c);
+            err += diff * diff;
+        }
+        return err;
+    }
+
+    void decode(const uint8_t *code, float *x) const {
+        for (size_t j = 0; j < param_.dim; j++) {
+            unsigned c;
+            if (param_.nbits == 8)
+                c = SqCode<8>(code, j);
+            else if (param_.nbits == 6)
+                c = SqCode<6>(code, j);
+            else
+                c = SqCode<4>(code, j);
+            x[j] = vmin_[j] + step_[j] * c;
+        }
+    }
+
+    void prepare_query(const void *query_data, void *prepared_query) {
+        if (!isTrained())
+            throw std::runtime_error("SQ ranges are not trained");
+        const float *query = (const float *) query_data;
+        float *prepared = (float *) prepared_query;
+        float bias = 0;
+        for (size_t j = 0; j < param_.dim; j++) {
+            if (inner_product_) {
+                prepared[j] = query[j] * step_[j];
+                bias += query[j] * vmin_[j];
+            } else {
+                prepared[j] = query[j] - vmin_[j];
+            }
+        }
+        prepared[param_.dim] = bias;
+    }
+
+    void saveRanges(std::ostream &output) const {
+        if (!isTrained())
+            throw std::runtime_error("SQ ranges are not trained");
+        writeBinaryPOD(output, param_.dim);
+        writeBinaryPOD(output, param_.nbits);
+        output.write((const char *) vmin_.data(), param_.dim * sizeof(float));
+        output.write((const char *) step_.data(), param_.dim * sizeof(float));
+    }
+
+    void loadRanges(std::istream &input) {
+        size_t dim, nbits;
+        readBinaryPOD(input, dim);
+        readBinaryPOD(input, nbits);
+        if (dim != param_.dim || nbits != param_.nbits)
+            throw std::runtime_error("SQ ranges do not match the space parameters");
+        std::vector<float> vmin(dim), step(dim);
+        input.read((char *) vmin.data(), dim * sizeof(float));
+        input.read((char *) step.data(), dim * sizeof(float));
+        if (!input)
+            throw std::runtime_error("Failed to read the SQ ranges");
+        vmin_.swap(vmin);
+        step_.swap(step);
+        param_.step = step_.data();
+        param_.vmin = vmin_.data();
+    }
+
+    // The ranges go to their own file next to the index, e.g. index.bin.sq
+    void saveRanges(const std::string &location) const {
+        std::ofstream output(location, std::ios::binary);
+        saveRanges(output);
+        output.close();
+    }
+
+    void loadRanges(const std::string &location) {
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        loadRanges(input);
+        input.close();
+    }
+
+    ~SqSpace() {}
+};
+
+}  // namespace hnswlib
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <stdexcept>
+
+namespace hnswlib {
+
+/*
+* Quantiles of every dimension of a set of vectors from fixed width histograms. build() makes two
+* passes over the rows, one for the ranges and one for the counts, without copying or sorting values.
+* The rows are split between the threads, each reads whole rows sequentially.
+* Rows are dim floats at x + i * stride, so the level 0 records of an index are read in place.
+*/
+class QuantileSketch {
+    size_t dim_;
+    size_t bins_;
+    size_t n_{0};
+    bool shared_range_{false};
+    std::vector<float> lo_;
+    std::vector<float> hi_;
+    std::vector<size_t> counts_;  // dim x bins
+
+    static float quantileOf(const size_t *counts, size_t bins, size_t total, float lo, float hi, double q) {
+        if (total == 0) return 0;
+        if (q <= 0) return lo;
+        if (q >= 1) return hi;
+        double width = ((double) hi - lo) / bins;
+        double rank = q * total;
+        double cum = 0;
+        for (size_t b = 0; b < bins; b++) {
+            if (counts[b] != 0 && cum + counts[b] >= rank) {
+                double frac = (rank - cum) / counts[b];
+                return (float) (lo + (b + frac) * width);
+            }
+            cum += counts[b];
+        }
+        return hi;
+    }
+
+ public:
+    QuantileSketch(size_t dim, size_t bins = 1024) : dim_(dim), bins_(bins) {
+        if (dim == 0 || bins == 0)
+            throw std::runtime_error("QuantileSketch needs a non-zero dimension and number of bins");
+    }
+
+    /*
+    * With shared_range every dimension uses the overall range so globalQuantile can merge them,
+    * with absolute the sketch is of |x|.
+    */
+    void build(const char *x, size_t n, size_t stride, bool shared_range = false, bool absolute = false) {
+        n_ = n;
+        shared_range_ = shared_range;
+        lo_.assign(dim_, std::numeric_limits<float>::max());
+        hi_.assign(dim_, std::numeric_limits<float>::lowest());
+        counts_.assign(dim_ * bins_, 0);
+        if (n == 0) return;
+
+        // every thread takes a range of rows into its own ranges and counts, merged after its range
+#pragma omp parallel
+        {
+            std::vector<float> lo(dim_, std::numeric_limits<float>::max());
+            std::vector<float> hi(dim_, std::numeric_limits<float>::lowest());
+#pragma omp for schedule(static)
+            for (long long i = 0; i < (long long) n; i++) {
+                const float *row = (const float *) (x + i * stride);
+                for (size_t d = 0; d < dim_; d++) {
+                    float v = absolute ? fabsf(row[d]) : row[d];
+                    lo[d] = std::min(lo[d], v);
+                    hi[d] = std::max(hi[d], v);
+                }
+            }
+#pragma omp critical
+            {
+                for (size_t d = 0; d < dim_; d++) {
+                    lo_[d] = std::min(lo_[d], lo[d]);
+                    hi_[d] = std::max(hi_[d], hi[d]);
+                }
+            }
+        }
+        if (shared_range) {
+            float lo = *std::min_element(lo_.begin(), lo_.end());
+            float hi = *std::max_element(hi_.begin(), hi_.end());
+            std::fill(lo_.begin(), lo_.end(), lo);
+            std::fill(hi_.begin(), hi_.end(), hi);
+        }
+
+#pragma omp parallel
+        {
+            std::vector<size_t> counts(dim_ * bins_, 0);
+#pragma omp for schedule(static)
+            for (long long i = 0; i < (long long) n; i++) {
+                const float *row = (const float *) (x + i * stride);
+                for (size_t d = 0; d < dim_; d++) {
+                    float v = absolute ? fabsf(row[d]) : row[d];
+                    float range = hi_[d] - lo_[d];
+                    size_t bin = range > 0 ? (size_t) ((v - lo_[d]) / range * bins_) : 0;
+                    counts[d * bins_ + std::min(bin, bins_ - 1)]++;
+                }
+            }
+#pragma omp critical
+            {
+                for (size_t j = 0; j < counts.size(); j++) counts_[j] += counts[j];
+            }
+        }
+    }
+
+    size_t size() const {
+        return n_;
+    }
+
+    float min(size_t d) const {
+        return lo_[d];
+    }
+
+    float max(size_t d) const {
+        return hi_[d];
+    }
+
+    // Value below which a fraction q of dimension d lies, exact at q = 0 and q = 1
+    float quantile(size_t d, double q) const {
+        return quantileOf(counts_.data() + d * bins_, bins_, n_, lo_[d], hi_[d], q);
+    }
+
+    // Quantile over the values of all dimensions, needs a sketch built with shared_range
+    float globalQuantile(double q) const {
+        if (!shared_range_)
+            throw std::runtime_error("globalQuantile needs a sketch built with a shared range");
+        std::vector<size_t> merged(bins_, 0);
+        for (size_t d = 0; d < dim_; d++) {
+            for (size_t b = 0; b < bins_; b++) merged[b] += counts_[d * bins_ + b];
+        }
+        return quantileOf(merged.data(), bins_, n_ * dim_, lo_[0], hi_[0], q);
+    }
+};
+
+}  // namespace hnswlib
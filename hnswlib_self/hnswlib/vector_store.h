@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace hnswlib {
+
+/*
+* Fixed size array of vectors kept next to the graph, e.g. the float vectors used to re-rank
+* the results of a quantized index. Either in memory or a memory-mapped file, which lets the
+* OS page the vectors in on demand and keeps them between runs.
+*/
+class VectorStore {
+    char *data_{nullptr};
+    size_t element_size_{0};
+    size_t capacity_{0};
+    size_t map_size_{0};  // non zero if data_ is mapped
+    bool writable_{true};
+    std::string location_;  // file of a mapped store
+
+ public:
+    // In memory store of capacity vectors
+    VectorStore(size_t capacity, size_t element_size)
+        : element_size_(element_size), capacity_(capacity) {
+        data_ = (char *) malloc(capacity * element_size);
+        if (data_ == nullptr)
+            throw std::runtime_error("Not enough memory: VectorStore failed to allocate vectors");
+    }
+
+    /*
+    * Store mapped from the file at location. With create the file is created (or truncated) to
+    * hold capacity vectors and is writable, otherwise the existing file is mapped read-only and
+    * capacity is taken from its size.
+    */
+    VectorStore(const std::string &location, size_t capacity, size_t element_size, bool create)
+        : element_size_(element_size), capacity_(capacity), writable_(create), location_(location) {
+#if defined(_WIN32)
+        throw std::runtime_error("Memory-mapped vectors are not supported on this platform");
+#else
+        int fd = create ? open(location.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(location.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        if (create) {
+            if (ftruncate(fd, (off_t) (capacity * element_size)) != 0) {
+                close(fd);
+                throw std::runtime_error("Cannot resize the vector file");
+            }
+        } else {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || element_size == 0 || st.st_size % element_size != 0) {
+                close(fd);
+                throw std::runtime_error("Vector file size does not match the vector size");
+            }
+            capacity_ = st.st_size / element_size;
+        }
+        map_size_ = capacity_ * element_size_;
+        if (map_size_ == 0) {
+            close(fd);
+            return;
+        }
+        void *ptr = mmap(nullptr, map_size_, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            map_size_ = 0;
+            throw std::runtime_error("Cannot map the vector file");
+        }
+        data_ = (char *) ptr;
+#endif
+    }
+
+    VectorStore(const VectorStore &) = delete;
+    VectorStore &operator=(const VectorStore &) = delete;
+
+    ~VectorStore() {
+#if !defined(_WIN32)
+        if (map_size_) {
+            munmap(data_, map_size_);
+            return;
+        }
+#endif
+        free(data_);
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    size_t elementSize() const {
+        return element_size_;
+    }
+
+    // false for an existing file mapped read-only
+    bool writable() const {
+        return writable_;
+    }
+
+    /*
+    * Room for capacity vectors, keeping the first ones. A mapped store grows its file and maps it
+    * again, so pointers from get() are invalid afterwards. Not for a file mapped read-only.
+    */
+    void resize(size_t capacity) {
+        if (!writable_)
+            throw std::runtime_error("The vector file is mapped read-only");
+        if (location_.empty()) {
+            char *data = (char *) realloc(data_, capacity * element_size_);
+            if (data == nullptr && capacity > 0)
+                throw std::runtime_error("Not enough memory: VectorStore failed to allocate vectors");
+            data_ = data;
+            capacity_ = capacity;
+            return;
+        }
+#if !defined(_WIN32)
+        int fd = open(location_.c_str(), O_RDWR);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        size_t map_size = capacity * element_size_;
+        if (ftruncate(fd, (off_t) map_size) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot resize the vector file");
+        }
+        void *ptr = nullptr;
+        if (map_size > 0) {
+            ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map the vector file");
+            }
+        }
+        close(fd);
+        if (map_size_)
+            munmap(data_, map_size_);
+        data_ = (char *) ptr;
+        map_size_ = map_size;
+        capacity_ = capacity;
+#endif
+    }
+
+    inline const char *get(size_t i) const {
+        return data_ + i * element_size_;
+    }
+
+    void set(size_t i, const void *vector) {
+        memcpy(data_ + i * element_size_, vector, element_size_);
+    }
+};
+
+}  // namespace hnswlib
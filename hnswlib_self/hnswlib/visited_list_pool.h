@@ -3,9 +3,18 @@
 #include <mutex>
 #include <string.h>
 #include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
 
 namespace hnswlib {
+// With 16-bit tags every VisitedList is cleared once per 65535 uses, on large indexes
+// that is a visible latency spike. 32-bit tags double the memory but practically never clear.
+#ifdef HNSWLIB_VISITED_TAG32
+typedef unsigned int vl_type;
+#else
 typedef unsigned short int vl_type;
+#endif
 
 class VisitedList {
  public:
@@ -36,43 +45,143 @@ class VisitedList {
 /////////////////////////////////////////////////////////
 
 class VisitedListPool {
-    std::deque<VisitedList *> pool;
-    std::mutex poolguard;
+    // Lists of the pool, shared with the thread caches so a thread that exits after
+    // the pool was destroyed does not touch freed memory
+    struct Storage {
+        std::mutex poolguard;
+        std::deque<VisitedList *> pool;  // free lists
+        std::vector<VisitedList *> all;  // every list created by the pool
+
+        ~Storage() {
+            for (VisitedList *vl : all)
+                delete vl;
+        }
+    };
+
+    // Per thread cache entry, one list per pool the thread works with
+    struct ThreadSlot {
+        size_t pool_id = 0;
+        VisitedList *vl = nullptr;
+        bool busy = false;
+        std::weak_ptr<Storage> storage;
+    };
+
+    static const int THREAD_SLOTS = 8;
+
+    struct ThreadCache {
+        ThreadSlot slots[THREAD_SLOTS];
+        int next_evict = 0;
+
+        ~ThreadCache() {
+            // give the lists of the exiting thread back to the pools that are still alive
+            for (int i = 0; i < THREAD_SLOTS; i++) {
+                std::shared_ptr<Storage> storage = slots[i].storage.lock();
+                if (storage && !slots[i].busy) {
+                    std::unique_lock <std::mutex> lock(storage->poolguard);
+                    storage->pool.push_front(slots[i].vl);
+                }
+            }
+        }
+    };
+
+    std::shared_ptr<Storage> storage;
     int numelements;
+    bool thread_local_lists;
+    size_t pool_id;  // never reused, a stale thread cache entry can not match a new pool
+
+    static ThreadCache &threadCache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static size_t nextPoolId() {
+        static std::atomic<size_t> counter{0};
+        return ++counter;
+    }
+
+    VisitedList *getFromPool() {
+        std::unique_lock <std::mutex> lock(storage->poolguard);
+        if (storage->pool.size() > 0) {
+            VisitedList *rez = storage->pool.front();
+            storage->pool.pop_front();
+            return rez;
+        }
+        VisitedList *rez = new VisitedList(numelements);
+        storage->all.push_back(rez);
+        return rez;
+    }
+
+    ThreadSlot *findSlot(ThreadCache &cache) const {
+        for (int i = 0; i < THREAD_SLOTS; i++) {
+            if (cache.slots[i].pool_id == pool_id)
+                return &cache.slots[i];
+        }
+        return nullptr;
+    }
 
  public:
-    VisitedListPool(int initmaxpools, int numelements1) {
-        numelements = numelements1;
-        for (int i = 0; i < initmaxpools; i++)
-            pool.push_front(new VisitedList(numelements));
+    /*
+    * With thread_local_lists every thread keeps its own list of this pool, so getting and
+    * releasing a list takes no lock. Each search thread then holds numelements tags.
+    * The mutex is only used the first time a thread uses the pool and for nested uses.
+    */
+    VisitedListPool(int initmaxpools, int numelements1, bool thread_local_lists = false)
+        : storage(new Storage()),
+          numelements(numelements1),
+          thread_local_lists(thread_local_lists),
+          pool_id(nextPoolId()) {
+        for (int i = 0; i < initmaxpools; i++) {
+            VisitedList *vl = new VisitedList(numelements);
+            storage->all.push_back(vl);
+            storage->pool.push_front(vl);
+        }
     }
 
     VisitedList *getFreeVisitedList() {
         VisitedList *rez;
-        {
-            std::unique_lock <std::mutex> lock(poolguard);
-            if (pool.size() > 0) {
-                rez = pool.front();
-                pool.pop_front();
-            } else {
-                rez = new VisitedList(numelements);
+        if (thread_local_lists) {
+            ThreadCache &cache = threadCache();
+            ThreadSlot *slot = findSlot(cache);
+            if (!slot) {
+                // evict the entry of another pool, its list stays owned by that pool
+                for (int i = 0; i < THREAD_SLOTS && !slot; i++) {
+                    ThreadSlot &candidate = cache.slots[(cache.next_evict + i) % THREAD_SLOTS];
+                    if (!candidate.busy) slot = &candidate;
+                }
+                if (slot) {
+                    std::shared_ptr<Storage> old_storage = slot->storage.lock();
+                    if (old_storage) {
+                        std::unique_lock <std::mutex> lock(old_storage->poolguard);
+                        old_storage->pool.push_front(slot->vl);
+                    }
+                    cache.next_evict = (int) (slot - cache.slots + 1) % THREAD_SLOTS;
+                    slot->pool_id = pool_id;
+                    slot->vl = getFromPool();
+                    slot->storage = storage;
+                }
+            }
+            if (slot && !slot->busy) {
+                slot->busy = true;
+                rez = slot->vl;
+                rez->reset();
+                return rez;
             }
         }
+        rez = getFromPool();
         rez->reset();
         return rez;
     }
 
     void releaseVisitedList(VisitedList *vl) {
-        std::unique_lock <std::mutex> lock(poolguard);
-        pool.push_front(vl);
-    }
-
-    ~VisitedListPool() {
-        while (pool.size()) {
-            VisitedList *rez = pool.front();
-            pool.pop_front();
-            delete rez;
+        if (thread_local_lists) {
+            ThreadSlot *slot = findSlot(threadCache());
+            if (slot && slot->vl == vl) {
+                slot->busy = false;
+                return;
+            }
         }
+        std::unique_lock <std::mutex> lock(storage->poolguard);
+        storage->pool.push_front(vl);
     }
 };
 }  // namespace hnswlib
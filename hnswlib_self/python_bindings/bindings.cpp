@@ -151,6 +151,7 @@ class Index {
     int dim;
     size_t seed;
     size_t default_ef;
+    size_t query_block_size;  // number of queries searched together by knn_query
 
     bool index_inited;
     bool ep_added;
@@ -159,10 +160,18 @@ class Index {
     hnswlib::labeltype cur_l;
     hnswlib::HierarchicalNSW<dist_t>* appr_alg;
     hnswlib::SpaceInterface<float>* l2space;
+    hnswlib::Int8SpaceBase* int8space;  // space of the int8 and l2_int8 indexes after sq8
+    bool quantized;
+    size_t unpickled_max_elements;  // max_elements of an index still on the arrays it was unpickled from
+    mutable size_t exported_views;  // arrays of getAnnData alive that point into the index, see checkNoExportedViews
 
 
     Index(const std::string &space_name, const int dim) : space_name(space_name), dim(dim) {
         normalize = false;
+        quantized = false;
+        int8space = nullptr;
+        unpickled_max_elements = 0;
+        exported_views = 0;
         if (space_name == "l2") {
             l2space = new hnswlib::L2Space(dim);
         } else if (space_name == "ip") {
@@ -170,8 +179,14 @@ class Index {
         } else if (space_name == "cosine") {
             l2space = new hnswlib::InnerProductSpace(dim);
             normalize = true;
+        } else if (space_name == "int8") {
+            l2space = new hnswlib::InnerProductSpace(dim);
+            int8space = new hnswlib::SpaceInt8(dim);
+        } else if (space_name == "l2_int8") {
+            l2space = new hnswlib::L2Space(dim);
+            int8space = new hnswlib::L2SpaceInt8(dim);
         } else {
-            throw std::runtime_error("Space name must be one of l2, ip, or cosine.");
+            throw std::runtime_error("Space name must be one of l2, ip, cosine, int8 or l2_int8.");
         }
         appr_alg = NULL;
         ep_added = true;
@@ -179,11 +194,14 @@ class Index {
         num_threads_default = std::thread::hardware_concurrency();
 
         default_ef = 10;
+        query_block_size = 64;
     }
 
 
     ~Index() {
         delete l2space;
+        if (int8space)
+            delete int8space;
         if (appr_alg)
             delete appr_alg;
     }
@@ -218,26 +236,59 @@ class Index {
         this->num_threads_default = num_threads;
     }
 
+    /*
+    * Level 0 and the element levels are given to pickle as views of the index memory, which adding
+    * items, resizing, quantizing or loading may free; those are refused until the views are released
+    */
+    void checkNoExportedViews() const {
+        if (exported_views > 0)
+            throw std::runtime_error("The index can not be changed while arrays of its pickled state refer to its memory");
+    }
+
     size_t indexFileSize() const {
         return appr_alg->indexFileSize();
     }
 
+    // A quantized index is saved in the version 2 format, which keeps the kind and the scale of its space
     void saveIndex(const std::string &path_to_index) {
-        appr_alg->saveIndex(path_to_index);
+        if (quantized)
+            appr_alg->saveIndex(path_to_index, 2);
+        else
+            appr_alg->saveIndex(path_to_index);
     }
 
 
     void loadIndex(const std::string &path_to_index, size_t max_elements, bool allow_replace_deleted) {
+      checkNoExportedViews();
       if (appr_alg) {
           std::cerr << "Warning: Calling load_index for an already inited index. Old index is being deallocated." << std::endl;
           delete appr_alg;
       }
-      appr_alg = new hnswlib::HierarchicalNSW<dist_t>(l2space, path_to_index, false, max_elements, allow_replace_deleted);
+      // the scale is loaded with the index, from its space section
+      uint32_t space_kind = hnswlib::readIndexSpaceKind(path_to_index);
+      quantized = int8space && (space_kind == hnswlib::INDEX_SPACE_L2_INT8 || space_kind == hnswlib::INDEX_SPACE_IP_INT8);
+      hnswlib::SpaceInterface<float>* space = quantized ? int8space : l2space;
+      appr_alg = new hnswlib::HierarchicalNSW<dist_t>(space, path_to_index, false, max_elements, allow_replace_deleted);
       cur_l = appr_alg->cur_element_count;
       index_inited = true;
     }
 
 
+    /*
+    * Quantizes the float vectors of an int8 or l2_int8 index to int8 in place, the index takes 4x less memory.
+    * Queries and new items stay float vectors, they are quantized with the same scale.
+    */
+    void sq8() {
+        checkNoExportedViews();
+        if (!int8space)
+            throw std::runtime_error("sq8 needs an index with the int8 or l2_int8 space");
+        if (quantized)
+            throw std::runtime_error("The index is already quantized");
+        appr_alg->sq8(int8space);
+        quantized = true;
+    }
+
+
     void normalize_vector(float* data, float* norm_array) {
         float norm = 0.0f;
         for (int i = 0; i < dim; i++)
@@ -249,6 +300,7 @@ class Index {
 
 
     void addItems(py::object input, py::object ids_ = py::none(), int num_threads = -1, bool replace_deleted = false) {
+        checkNoExportedViews();
         py::array_t < dist_t, py::array::c_style | py::array::forcecast > items(input);
         auto buffer = items.request();
         if (num_threads <= 0)
@@ -267,23 +319,42 @@ class Index {
 
         std::vector<size_t> ids = get_input_ids_and_check_shapes(ids_, rows);
 
+        // an unpickled index leaves the arrays of the pickle before it grows
+        if (!appr_alg->ownsMemory())
+            appr_alg->resizeIndex(unpickled_max_elements);
+
         {
             int start = 0;
             if (!ep_added) {
                 size_t id = ids.size() ? ids.at(0) : (cur_l);
                 float* vector_data = (float*)items.data(0);
                 std::vector<float> norm_array(dim);
+                std::vector<int8_t> code(dim);
                 if (normalize) {
                     normalize_vector(vector_data, norm_array.data());
                     vector_data = norm_array.data();
                 }
-                appr_alg->addPoint((void*)vector_data, (size_t)id, replace_deleted);
+                if (quantized) {
+                    int8space->quantize(vector_data, code.data());
+                    appr_alg->addPoint((void*)code.data(), (size_t)id, replace_deleted);
+                } else {
+                    appr_alg->addPoint((void*)vector_data, (size_t)id, replace_deleted);
+                }
                 start = 1;
                 ep_added = true;
             }
 
             py::gil_scoped_release l;
-            if (normalize == false) {
+            if (quantized) {
+                std::vector<int8_t> code_array(num_threads * dim);
+                ParallelFor(start, rows, num_threads, [&](size_t row, size_t threadId) {
+                    int8_t* code = code_array.data() + threadId * dim;
+                    int8space->quantize((float*)items.data(row), code);
+
+                    size_t id = ids.size() ? ids.at(row) : (cur_l + row);
+                    appr_alg->addPoint((void*)code, (size_t)id, replace_deleted);
+                    });
+            } else if (normalize == false) {
                 ParallelFor(start, rows, num_threads, [&](size_t row, size_t threadId) {
                     size_t id = ids.size() ? ids.at(row) : (cur_l + row);
                     appr_alg->addPoint((void*)items.data(row), (size_t)id, replace_deleted);
@@ -327,7 +398,16 @@ class Index {
 
         std::vector<std::vector<data_t>> data;
         for (auto id : ids) {
-            data.push_back(appr_alg->template getDataByLabel<data_t>(id));
+            if (quantized) {
+                // the stored int8 vector scaled back
+                std::vector<int8_t> code = appr_alg->template getDataByLabel<int8_t>(id);
+                std::vector<data_t> vector(code.size());
+                for (size_t i = 0; i < code.size(); i++)
+                    vector[i] = code[i] / int8space->getScale();
+                data.push_back(vector);
+            } else {
+                data.push_back(appr_alg->template getDataByLabel<data_t>(id));
+            }
         }
         if (return_type == "list") {
             return py::cast(data);
@@ -348,6 +428,18 @@ class Index {
     }
 
 
+    // Base of an array viewing the index memory: holds a reference to the index and counts the view
+    py::capsule exportView() const {
+        py::object *index = new py::object(py::cast(this, py::return_value_policy::reference));
+        exported_views++;
+        return py::capsule(index, [](void *f) {
+            py::object *index = (py::object *)f;
+            index->cast<const Index *>()->exported_views--;
+            delete index;
+        });
+    }
+
+
     py::dict getAnnData() const { /* WARNING: Index::getAnnData is not thread-safe with Index::addItems */
         std::unique_lock <std::mutex> templock(appr_alg->global);
 
@@ -362,9 +454,7 @@ class Index {
                 link_npy_size += linkListSize;
         }
 
-        char* data_level0_npy = (char*)malloc(level0_npy_size);
         char* link_list_npy = (char*)malloc(link_npy_size);
-        int* element_levels_npy = (int*)malloc(appr_alg->element_levels_.size() * sizeof(int));
 
         hnswlib::labeltype* label_lookup_key_npy = (hnswlib::labeltype*)malloc(appr_alg->label_lookup_.size() * sizeof(hnswlib::labeltype));
         hnswlib::tableint* label_lookup_val_npy = (hnswlib::tableint*)malloc(appr_alg->label_lookup_.size() * sizeof(hnswlib::tableint));
@@ -379,11 +469,6 @@ class Index {
             idx++;
         }
 
-        memset(link_list_npy, 0, link_npy_size);
-
-        memcpy(data_level0_npy, appr_alg->data_level0_memory_, level0_npy_size);
-        memcpy(element_levels_npy, appr_alg->element_levels_.data(), appr_alg->element_levels_.size() * sizeof(int));
-
         for (size_t i = 0; i < appr_alg->cur_element_count; i++) {
             size_t linkListSize = appr_alg->element_levels_[i] > 0 ? appr_alg->size_links_per_element_ * appr_alg->element_levels_[i] : 0;
             if (linkListSize) {
@@ -391,28 +476,41 @@ class Index {
             }
         }
 
-        py::capsule free_when_done_l0(data_level0_npy, [](void* f) {
-            delete[] f;
-            });
-        py::capsule free_when_done_lvl(element_levels_npy, [](void* f) {
-            delete[] f;
-            });
         py::capsule free_when_done_lb(label_lookup_key_npy, [](void* f) {
-            delete[] f;
+            free(f);
             });
         py::capsule free_when_done_id(label_lookup_val_npy, [](void* f) {
-            delete[] f;
+            free(f);
             });
         py::capsule free_when_done_ll(link_list_npy, [](void* f) {
-            delete[] f;
+            free(f);
             });
 
+        /*
+         * Level 0 and the element levels, by far the largest arrays, are not copied: they are read-only views
+         * of the index, which they keep alive. pickle serializes them at once, with protocol 5 out-of-band if
+         * a buffer_callback is given. Each view is counted in exported_views until it is released, the index
+         * refuses the changes that could free its memory meanwhile
+         */
+        py::array_t<int> element_levels_npy(
+            { appr_alg->element_levels_.size() },  // shape
+            { sizeof(int) },  // C-style contiguous strides for each index
+            appr_alg->element_levels_.data(),  // the data pointer
+            exportView());
+        py::array_t<char> data_level0_npy(
+            { level0_npy_size },  // shape
+            { sizeof(char) },  // C-style contiguous strides for each index
+            appr_alg->data_level0_memory_,  // the data pointer
+            exportView());
+        element_levels_npy.attr("setflags")("write"_a = false);
+        data_level0_npy.attr("setflags")("write"_a = false);
+
         /*  TODO: serialize state of random generators appr_alg->level_generator_ and appr_alg->update_probability_generator_  */
         /*        for full reproducibility / to avoid re-initializing generators inside Index::createFromParams         */
 
         return py::dict(
             "offset_level0"_a = appr_alg->offsetLevel0_,
-            "max_elements"_a = appr_alg->max_elements_,
+            "max_elements"_a = getMaxElements(),
             "cur_element_count"_a = (size_t)appr_alg->cur_element_count,
             "size_data_per_element"_a = appr_alg->size_data_per_element_,
             "label_offset"_a = appr_alg->label_offset_,
@@ -441,18 +539,10 @@ class Index {
                 label_lookup_val_npy,  // the data pointer
                 free_when_done_id),
 
-            "element_levels"_a = py::array_t<int>(
-                { appr_alg->element_levels_.size() },  // shape
-                { sizeof(int) },  // C-style contiguous strides for each index
-                element_levels_npy,  // the data pointer
-                free_when_done_lvl),
+            "element_levels"_a = element_levels_npy,
 
             // linkLists_,element_levels_,data_level0_memory_
-            "data_level0"_a = py::array_t<char>(
-                { level0_npy_size },  // shape
-                { sizeof(char) },  // C-style contiguous strides for each index
-                data_level0_npy,  // the data pointer
-                free_when_done_l0),
+            "data_level0"_a = data_level0_npy,
 
             "link_lists"_a = py::array_t<char>(
                 { link_npy_size },  // shape
@@ -472,6 +562,8 @@ class Index {
             "normalize"_a = normalize,
             "num_threads"_a = num_threads_default,
             "seed"_a = seed);
+        if (quantized)
+            params["scale"] = int8space->getScale();
 
         if (index_inited == false)
             return py::dict(**params, "ef"_a = default_ef);
@@ -482,7 +574,7 @@ class Index {
     }
 
 
-    static Index<float>* createFromParams(const py::dict d) {
+    static Index<float>* createFromParams(const py::dict d, bool adopt_arrays = false) {
         // check serialization version
         assert_true(((int)py::int_(Index<float>::ser_version)) >= d["ser_version"].cast<int>(), "Invalid serialization version!");
 
@@ -495,10 +587,14 @@ class Index {
         /*  TODO: deserialize state of random generators into new_index->level_generator_ and new_index->update_probability_generator_  */
         /*        for full reproducibility / state of generators is serialized inside Index::getIndexParams                      */
         new_index->seed = d["seed"].cast<size_t>();
+        if (d.contains("scale")) {
+            new_index->int8space->setScale(d["scale"].cast<float>());
+            new_index->quantized = true;
+        }
 
         if (index_inited_) {
             new_index->appr_alg = new hnswlib::HierarchicalNSW<dist_t>(
-                new_index->l2space,
+                new_index->quantized ? new_index->int8space : new_index->l2space,
                 d["max_elements"].cast<size_t>(),
                 d["M"].cast<size_t>(),
                 d["ef_construction"].cast<size_t>(),
@@ -512,7 +608,7 @@ class Index {
         new_index->default_ef = d["ef"].cast<size_t>();
 
         if (index_inited_)
-            new_index->setAnnData(d);
+            new_index->setAnnData(d, adopt_arrays);
 
         return new_index;
     }
@@ -523,7 +619,11 @@ class Index {
     }
 
 
-    void setAnnData(const py::dict d) { /* WARNING: Index::setAnnData is not thread-safe with Index::addItems */
+    /*
+     * With adopt_arrays, writable level 0 and link list arrays, as pickle gives them, are used by the index
+     * instead of copied, until it grows
+     */
+    void setAnnData(const py::dict d, bool adopt_arrays = false) { /* WARNING: Index::setAnnData is not thread-safe with Index::addItems */
         std::unique_lock <std::mutex> templock(appr_alg->global);
 
         assert_true(appr_alg->offsetLevel0_ == d["offset_level0"].cast<size_t>(), "Invalid value of offsetLevel0_ ");
@@ -574,18 +674,31 @@ class Index {
                 link_npy_size += linkListSize;
         }
 
-        memcpy(appr_alg->data_level0_memory_, data_level0_npy.data(), data_level0_npy.nbytes());
+        assert_true(data_level0_npy.nbytes() == appr_alg->cur_element_count * appr_alg->size_data_per_element_, "Invalid size of data_level0 ");
+        assert_true(link_list_npy.nbytes() == link_npy_size, "Invalid size of link_lists ");
 
-        for (size_t i = 0; i < appr_alg->max_elements_; i++) {
-            size_t linkListSize = appr_alg->element_levels_[i] > 0 ? appr_alg->size_links_per_element_ * appr_alg->element_levels_[i] : 0;
-            if (linkListSize == 0) {
-                appr_alg->linkLists_[i] = nullptr;
-            } else {
-                appr_alg->linkLists_[i] = (char*)malloc(linkListSize);
-                if (appr_alg->linkLists_[i] == nullptr)
-                    throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+        if (adopt_arrays && appr_alg->cur_element_count > 0 && data_level0_npy.writeable() && link_list_npy.writeable()) {
+            // the arrays are released with the GIL held, whichever thread drops the index
+            std::shared_ptr<void> owner(new py::tuple(py::make_tuple(data_level0_npy, link_list_npy)), [](void* arrays) {
+                py::gil_scoped_acquire gil;
+                delete (py::tuple*)arrays;
+            });
+            appr_alg->useBorrowedMemory(data_level0_npy.mutable_data(), link_list_npy.mutable_data(), owner);
+            unpickled_max_elements = d["max_elements"].cast<size_t>();
+        } else {
+            memcpy(appr_alg->data_level0_memory_, data_level0_npy.data(), data_level0_npy.nbytes());
+
+            for (size_t i = 0; i < appr_alg->max_elements_; i++) {
+                size_t linkListSize = appr_alg->element_levels_[i] > 0 ? appr_alg->size_links_per_element_ * appr_alg->element_levels_[i] : 0;
+                if (linkListSize == 0) {
+                    appr_alg->linkLists_[i] = nullptr;
+                } else {
+                    appr_alg->linkLists_[i] = appr_alg->allocateLinkLists(appr_alg->element_levels_[i]);
+                    if (appr_alg->linkLists_[i] == nullptr)
+                        throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
 
-                memcpy(appr_alg->linkLists_[i], link_list_npy.data() + link_npy_offsets[i], linkListSize);
+                    memcpy(appr_alg->linkLists_[i], link_list_npy.data() + link_npy_offsets[i], linkListSize);
+                }
             }
         }
 
@@ -616,8 +729,9 @@ class Index {
         const std::function<bool(hnswlib::labeltype)>& filter = nullptr) {
         py::array_t < dist_t, py::array::c_style | py::array::forcecast > items(input);
         auto buffer = items.request();
-        hnswlib::labeltype* data_numpy_l;
-        dist_t* data_numpy_d;
+        // owned here until the arrays take them, so a failed search does not leak them
+        std::unique_ptr<hnswlib::labeltype[]> data_numpy_l;
+        std::unique_ptr<dist_t[]> data_numpy_d;
         size_t rows, features;
 
         if (num_threads <= 0)
@@ -627,59 +741,60 @@ class Index {
             py::gil_scoped_release l;
             get_input_array_shapes(buffer, &rows, &features);
 
+            // searchKnnBatch reads a block of queries as consecutive rows of dim values
+            if (features != dim)
+                throw std::runtime_error("Wrong dimensionality of the vectors");
+
             // avoid using threads when the number of searches is small:
             if (rows <= num_threads * 4) {
                 num_threads = 1;
             }
 
-            data_numpy_l = new hnswlib::labeltype[rows * k];
-            data_numpy_d = new dist_t[rows * k];
+            data_numpy_l.reset(new hnswlib::labeltype[rows * k]);
+            data_numpy_d.reset(new dist_t[rows * k]);
 
             // Warning: search with a filter works slow in python in multithreaded mode. For best performance set num_threads=1
             CustomFilterFunctor idFilter(filter);
             CustomFilterFunctor* p_idFilter = filter ? &idFilter : nullptr;
 
+            // rows are searched in blocks, each block goes through searchKnnBatch on one thread;
+            // small batches get smaller blocks so that every thread has one
+            size_t block_size = std::max<size_t>(1, std::min<size_t>(query_block_size, (rows + num_threads - 1) / num_threads));
+            size_t num_blocks = (rows + block_size - 1) / block_size;
             if (normalize == false) {
-                ParallelFor(0, rows, num_threads, [&](size_t row, size_t threadId) {
-                    std::priority_queue<std::pair<dist_t, hnswlib::labeltype >> result = appr_alg->searchKnn(
-                        (void*)items.data(row), k, p_idFilter);
-                    if (result.size() != k)
+                ParallelFor(0, num_blocks, num_threads, [&](size_t block, size_t threadId) {
+                    size_t row = block * block_size;
+                    size_t block_rows = std::min(block_size, rows - row);
+                    if (!appr_alg->searchKnnBatch(items.data(row), block_rows, k,
+                                                  data_numpy_d.get() + row * k, data_numpy_l.get() + row * k, p_idFilter))
                         throw std::runtime_error(
                             "Cannot return the results in a contiguous 2D array. Probably ef or M is too small");
-                    for (int i = k - 1; i >= 0; i--) {
-                        auto& result_tuple = result.top();
-                        data_numpy_d[row * k + i] = result_tuple.first;
-                        data_numpy_l[row * k + i] = result_tuple.second;
-                        result.pop();
-                    }
                 });
             } else {
-                std::vector<float> norm_array(num_threads * features);
-                ParallelFor(0, rows, num_threads, [&](size_t row, size_t threadId) {
-                    float* data = (float*)items.data(row);
-
-                    size_t start_idx = threadId * dim;
-                    normalize_vector((float*)items.data(row), (norm_array.data() + start_idx));
+                std::vector<float> norm_array(num_threads * block_size * dim);
+                ParallelFor(0, num_blocks, num_threads, [&](size_t block, size_t threadId) {
+                    size_t row = block * block_size;
+                    size_t block_rows = std::min(block_size, rows - row);
+
+                    float* norm_block = norm_array.data() + threadId * block_size * dim;
+                    for (size_t i = 0; i < block_rows; i++) {
+                        normalize_vector((float*)items.data(row + i), norm_block + i * dim);
+                    }
 
-                    std::priority_queue<std::pair<dist_t, hnswlib::labeltype >> result = appr_alg->searchKnn(
-                        (void*)(norm_array.data() + start_idx), k, p_idFilter);
-                    if (result.size() != k)
+                    if (!appr_alg->searchKnnBatch(norm_block, block_rows, k,
+                                                  data_numpy_d.get() + row * k, data_numpy_l.get() + row * k, p_idFilter))
                         throw std::runtime_error(
                             "Cannot return the results in a contiguous 2D array. Probably ef or M is too small");
-                    for (int i = k - 1; i >= 0; i--) {
-                        auto& result_tuple = result.top();
-                        data_numpy_d[row * k + i] = result_tuple.first;
-                        data_numpy_l[row * k + i] = result_tuple.second;
-                        result.pop();
-                    }
                 });
             }
         }
-        py::capsule free_when_done_l(data_numpy_l, [](void* f) {
-            delete[] f;
+        hnswlib::labeltype* labels = data_numpy_l.get();
+        dist_t* distances = data_numpy_d.get();
+        py::capsule free_when_done_l(data_numpy_l.release(), [](void* f) {
+            delete[] (hnswlib::labeltype*) f;
             });
-        py::capsule free_when_done_d(data_numpy_d, [](void* f) {
-            delete[] f;
+        py::capsule free_when_done_d(data_numpy_d.release(), [](void* f) {
+            delete[] (dist_t*) f;
             });
 
         return py::make_tuple(
@@ -687,12 +802,12 @@ class Index {
                 { rows, k },  // shape
                 { k * sizeof(hnswlib::labeltype),
                   sizeof(hnswlib::labeltype) },  // C-style contiguous strides for each index
-                data_numpy_l,  // the data pointer
+                labels,  // the data pointer
                 free_when_done_l),
             py::array_t<dist_t>(
                 { rows, k },  // shape
                 { k * sizeof(dist_t), sizeof(dist_t) },  // C-style contiguous strides for each index
-                data_numpy_d,  // the data pointer
+                distances,  // the data pointer
                 free_when_done_d));
     }
 
@@ -708,12 +823,13 @@ class Index {
 
 
     void resizeIndex(size_t new_size) {
+        checkNoExportedViews();
         appr_alg->resizeIndex(new_size);
     }
 
 
     size_t getMaxElements() const {
-        return appr_alg->max_elements_;
+        return appr_alg->ownsMemory() ? appr_alg->max_elements_ : unpickled_max_elements;
     }
 
 
@@ -911,7 +1027,7 @@ PYBIND11_PLUGIN(hnswlib) {
         py::module m("hnswlib");
 
         py::class_<Index<float>>(m, "Index")
-        .def(py::init(&Index<float>::createFromParams), py::arg("params"))
+        .def(py::init([](const py::dict d) { return Index<float>::createFromParams(d); }), py::arg("params"))
            /* WARNING: Index::createFromIndex is not thread-safe with Index::addItems */
         .def(py::init(&Index<float>::createFromIndex), py::arg("index"))
         .def(py::init<const std::string &, const int>(), py::arg("space"), py::arg("dim"))
@@ -948,9 +1064,11 @@ PYBIND11_PLUGIN(hnswlib) {
         .def("mark_deleted", &Index<float>::markDeleted, py::arg("label"))
         .def("unmark_deleted", &Index<float>::unmarkDeleted, py::arg("label"))
         .def("resize_index", &Index<float>::resizeIndex, py::arg("new_size"))
+        .def("sq8", &Index<float>::sq8)
         .def("get_max_elements", &Index<float>::getMaxElements)
         .def("get_current_count", &Index<float>::getCurrentCount)
         .def_readonly("space", &Index<float>::space_name)
+        .def_readonly("quantized", &Index<float>::quantized)
         .def_readonly("dim", &Index<float>::dim)
         .def_readwrite("num_threads", &Index<float>::num_threads_default)
         .def_property("ef",
@@ -963,7 +1081,7 @@ PYBIND11_PLUGIN(hnswlib) {
               index.appr_alg->ef_ = ef_;
         })
         .def_property_readonly("max_elements", [](const Index<float> & index) {
-            return index.index_inited ? index.appr_alg->max_elements_ : 0;
+            return index.index_inited ? index.getMaxElements() : 0;
         })
         .def_property_readonly("element_count", [](const Index<float> & index) {
             return index.index_inited ? (size_t)index.appr_alg->cur_element_count : 0;
@@ -982,7 +1100,7 @@ PYBIND11_PLUGIN(hnswlib) {
             [](py::tuple t) {  // __setstate__
                 if (t.size() != 1)
                     throw std::runtime_error("Invalid state!");
-                return Index<float>::createFromParams(t[0].cast<py::dict>());
+                return Index<float>::createFromParams(t[0].cast<py::dict>(), true);
             }))
 
         .def("__repr__", [](const Index<float> &a) {
@@ -0,0 +1,105 @@
+// This is a test file for testing an index on borrowed memory
+//  >>> void useBorrowedMemory(char *level0, char *links, std::shared_ptr<void> owner);
+// of class HierarchicalNSW: the index searches on the buffers it was given, keeps them alive while
+// it uses them, and copies them into its own memory when it grows
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <memory>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+void test() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n + nq);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    index.setEf(50);
+    std::string location = "borrowed_memory_index.bin";
+    index.saveIndex(location);
+
+    // level 0 and the upper level links, as a pickle holds them
+    auto buffers = std::make_shared<std::pair<std::vector<char>, std::vector<char>>>();
+    buffers->first.assign(index.data_level0_memory_, index.data_level0_memory_ + n * index.size_data_per_element_);
+    for (size_t i = 0; i < n; i++) {
+        if (index.element_levels_[i] > 0)
+            buffers->second.insert(buffers->second.end(), index.linkLists_[i], index.linkLists_[i] + index.size_links_per_element_ * index.element_levels_[i]);
+    }
+    std::vector<char> level0 = buffers->first;
+
+    Index borrowed(&space, location, false, n + nq);
+    borrowed.setEf(50);
+    borrowed.useBorrowedMemory(buffers->first.data(), buffers->second.data(), buffers);
+    assert(!borrowed.ownsMemory());
+    assert(borrowed.max_elements_ == n);
+    assert(borrowed.data_level0_memory_ == buffers->first.data());
+    std::weak_ptr<void> alive = buffers;
+    buffers.reset();
+    assert(!alive.expired());
+
+    for (size_t q = 0; q < nq; q++) {
+        auto expected = index.searchKnn(query.data() + q * d, k, 0);
+        auto result = borrowed.searchKnn(query.data() + q * d, k, 0);
+        assert(expected.size() == result.size());
+        while (!expected.empty()) {
+            assert(expected.top() == result.top());
+            expected.pop();
+            result.pop();
+        }
+    }
+
+    // deletions go to the buffers, the index grows into its own memory
+    borrowed.markDelete(7);
+    auto owner = std::static_pointer_cast<std::pair<std::vector<char>, std::vector<char>>>(alive.lock());
+    assert(owner->first != level0);
+    owner.reset();
+    bool thrown = false;
+    try {
+        borrowed.addPoint(query.data(), n);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    borrowed.resizeIndex(n + nq);
+    assert(borrowed.ownsMemory());
+    assert(alive.expired());
+    for (size_t q = 0; q < nq; q++) {
+        borrowed.addPoint(query.data() + q * d, n + q);
+    }
+    for (size_t q = 0; q < nq; q++) {
+        assert(borrowed.searchKnn(query.data() + q * d, 1, 0).top().second == n + q);
+    }
+    assert(borrowed.isMarkedDeleted(7));
+    assert(borrowed.getDeletedCount() == 1);
+
+    remove(location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
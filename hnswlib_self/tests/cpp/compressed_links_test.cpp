@@ -0,0 +1,181 @@
+// This is a test file for testing the compressed level 0 links
+//  >>> void compressLevel0(int codec);
+//  >>> void decompressLevel0();
+// of class HierarchicalNSW: a compressed index searches, saves and deletes as the same index with
+// sorted plain lists, takes less memory and refuses to change its graph until it is decompressed
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+// The compressed lists come back sorted, the slots after them zeroed
+void sort_links(Index &index) {
+    for (hnswlib::tableint i = 0; i < index.cur_element_count; i++) {
+        hnswlib::linklistsizeint *ll = index.get_linklist0(i);
+        size_t count = index.getListCount(ll);
+        std::sort(ll + 1, ll + 1 + count);
+        std::fill(ll + 1 + count, ll + 1 + index.maxM0_, 0);
+    }
+}
+
+// The SSE4.1 decoders give what the scalar ones do, for differences of every byte length
+void test_codecs() {
+    std::mt19937 rng(13);
+    std::vector<uint32_t> ids, decoded, expected;
+    std::vector<uint8_t> codes;
+    for (size_t count = 0; count <= 40; count++) {
+        for (int bytes = 1; bytes <= 4; bytes++) {
+            uint32_t max_delta = bytes == 4 ? (1u << 26) : (1u << (8 * bytes)) - 1;
+            std::uniform_int_distribution<uint32_t> delta(0, max_delta);
+            ids.resize(count);
+            uint32_t id = 0;
+            for (size_t j = 0; j < count; j++) {
+                id += delta(rng);
+                ids[j] = id;
+            }
+            codes.clear();
+            hnswlib::EncodeStreamVByte(ids.data(), count, codes);
+            codes.resize(codes.size() + hnswlib::LINKS0_CODE_PADDING);
+            decoded.assign(count, 0);
+            hnswlib::SelectLinkCodecKernels();
+            hnswlib::DecodeStreamVByteExt(codes.data(), count, decoded.data());
+            assert(decoded == ids);
+            hnswlib::DecodeStreamVByte(codes.data(), count, decoded.data());
+            assert(decoded == ids);
+
+            for (uint32_t &local : ids) local &= 0xffff;
+            codes.clear();
+            hnswlib::EncodeLocal16(ids.data(), count, codes);
+            assert(codes.size() == 2 * count);
+            hnswlib::DecodeLocal16Ext(codes.data(), count, decoded.data());
+            assert(decoded == ids);
+        }
+    }
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    std::string location = "compressed_links_index.bin";
+    std::string compressed_location = "compressed_links_compressed.bin";
+    {
+        Index index(&space, n, 16, 100);
+        for (size_t i = 0; i < n; i++) index.addPoint(data.data() + i * d, i);
+        index.markDelete(5);
+        index.saveIndex(location);
+    }
+    Index sorted(&space, location);
+    sort_links(sorted);
+    sorted.setEf(50);
+
+    for (int codec : {hnswlib::LINKS0_STREAMVBYTE, hnswlib::LINKS0_LOCAL16}) {
+        Index compressed(&space, location);
+        size_t plain_size = n * compressed.size_data_per_element_;
+        compressed.compressLevel0(codec);
+        compressed.setEf(50);
+        assert(compressed.getLinks0Codec() == codec);
+        assert(compressed.level0_layout_.type == hnswlib::LAYOUT_COMPRESSED);
+        assert(compressed.get_data_level0_memory_size() + compressed.compressedLinksSize() < plain_size);
+        assert(compressed.isMarkedDeleted(5));
+        for (hnswlib::tableint i = 0; i < n; i++) {
+            hnswlib::linklistsizeint *ll = sorted.get_linklist0(i);
+            std::vector<hnswlib::tableint> links(ll + 1, ll + 1 + sorted.getListCount(ll));
+            assert(compressed.getConnectionsWithLock(i, 0) == links);
+            assert(compressed.getExternalLabel(i) == sorted.getExternalLabel(i));
+        }
+        check_same_results(sorted, compressed, query, nq, d, k);
+        check_same_batch_results(sorted, compressed, query, nq, k);
+
+        // deletions work, the graph does not change
+        compressed.markDelete(7);
+        sorted.markDelete(7);
+        check_same_results(sorted, compressed, query, nq, d, k);
+        check_same_batch_results(sorted, compressed, query, nq, k);
+        assert(throws([&] { compressed.addPoint(data.data(), n); }));
+        assert(throws([&] { compressed.addPoint(data.data(), 0); }));
+        assert(throws([&] { compressed.resizeIndex(n + 1); }));
+        assert(throws([&] { compressed.reorderGraph(); }));
+        assert(throws([&] { compressed.repairConnectivity(); }));
+
+        // the files are those of the sorted lists
+        for (int version : {1, 2}) {
+            for (bool pack_links : {false, true}) {
+                if (version == 1 && pack_links)
+                    continue;
+                sorted.saveIndex(location + ".sorted", version, pack_links);
+                compressed.saveIndex(compressed_location, version, pack_links);
+                assert(read_file(location + ".sorted") == read_file(compressed_location));
+            }
+        }
+
+        // the replicas share the codes
+        compressed.replicateLevel0();
+        compressed.bindSearchThread();
+        check_same_results(sorted, compressed, query, nq, d, k);
+        check_same_batch_results(sorted, compressed, query, nq, k);
+        compressed.dropReplicas();
+
+        compressed.decompressLevel0();
+        assert(compressed.getLinks0Codec() == hnswlib::LINKS0_PLAIN);
+        assert(compressed.level0_layout_.type == hnswlib::LAYOUT_INTERLEAVED);
+        assert(compressed.compressedLinksSize() == 0);
+        for (hnswlib::tableint i = 0; i < n; i++) {
+            assert(memcmp(compressed.get_linklist0(i), sorted.get_linklist0(i), sorted.size_links_level0_) == 0);
+        }
+        check_same_results(sorted, compressed, query, nq, d, k);
+        check_same_batch_results(sorted, compressed, query, nq, k);
+        sorted.unmarkDelete(7);
+
+        // compressed from the split layout, and back to it
+        compressed.setLayout(hnswlib::LAYOUT_SPLIT);
+        compressed.compressLevel0(codec);
+        compressed.decompressLevel0();
+        assert(compressed.level0_layout_.type == hnswlib::LAYOUT_SPLIT);
+        compressed.resizeIndex(n + 1);
+        compressed.addPoint(data.data(), n);
+    }
+
+    // 16 bit ids only fit small indexes
+    Index large(&space, hnswlib::LINKS0_LOCAL16_MAX_ELEMENTS + 1, 4, 10);
+    for (size_t i = 0; i <= hnswlib::LINKS0_LOCAL16_MAX_ELEMENTS; i++) large.addPoint(data.data() + i % n * d, i);
+    assert(throws([&] { large.compressLevel0(hnswlib::LINKS0_LOCAL16); }));
+    assert(large.getLinks0Codec() == hnswlib::LINKS0_PLAIN);
+    large.compressLevel0(hnswlib::LINKS0_STREAMVBYTE);
+    assert(large.searchKnn(data.data(), 1, 0).size() == 1);
+
+    remove(location.c_str());
+    remove((location + ".sorted").c_str());
+    remove(compressed_location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test_codecs();
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+// This is a test file for testing the flat candidate pool of the level-0 search
+//  >>> void setFlatCandidatePool(bool use_flat_candidate_pool);
+// searchKnn and searchKnnBatch must return the same results with both candidate queues, and an
+// index built with the flat queues must have the same graph
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+class PickDivisibleIds: public hnswlib::BaseFilterFunctor {
+unsigned int divisor = 1;
+ public:
+    PickDivisibleIds(unsigned int divisor): divisor(divisor) {
+        assert(divisor != 0);
+    }
+    bool operator()(idx_t label_id) {
+        return label_id % divisor == 0;
+    }
+};
+
+void check_flat(hnswlib::HierarchicalNSW<float>& alg_hnsw, const std::vector<float>& query,
+                int d, size_t nq, size_t k, hnswlib::BaseFilterFunctor* filter) {
+    std::vector<float> heap_distances(nq * k), flat_distances(nq * k);
+    std::vector<idx_t> heap_labels(nq * k), flat_labels(nq * k);
+
+    alg_hnsw.setFlatCandidatePool(false);
+    alg_hnsw.searchKnnBatch(query.data(), nq, k, heap_distances.data(), heap_labels.data(), filter);
+    std::vector<std::priority_queue<std::pair<float, idx_t>>> heap_results;
+    for (size_t j = 0; j < nq; ++j) {
+        heap_results.push_back(alg_hnsw.searchKnn(query.data() + j * d, k, 0, filter));
+    }
+
+    alg_hnsw.setFlatCandidatePool(true);
+    alg_hnsw.searchKnnBatch(query.data(), nq, k, flat_distances.data(), flat_labels.data(), filter);
+    assert(heap_labels == flat_labels);
+    assert(heap_distances == flat_distances);
+    for (size_t j = 0; j < nq; ++j) {
+        auto flat_result = alg_hnsw.searchKnn(query.data() + j * d, k, 0, filter);
+        auto &heap_result = heap_results[j];
+        assert(flat_result.size() == heap_result.size());
+        while (!flat_result.empty()) {
+            assert(flat_result.top() == heap_result.top());
+            flat_result.pop();
+            heap_result.pop();
+        }
+    }
+}
+
+void test_queue() {
+    hnswlib::FlatMaxQueue<float, int> queue;
+    for (int i = 0; i < 100; i++) queue.emplace((float) ((i * 37) % 100), i);
+    for (int i = 0; i < 60; i++) {
+        assert(queue.bottom().first == (float) i);
+        queue.popBottom();
+    }
+    assert(queue.size() == 40);
+    assert(queue.top().first == 99.0f);
+    queue.emplace(0.5f, -1);
+    assert(queue.bottom().second == -1);
+    assert(std::is_sorted(queue.begin(), queue.end()));
+    while (!queue.empty()) queue.pop();
+    queue.emplace(1.0f, 1);
+    assert(queue.size() == 1 && queue.bottom().second == 1);
+}
+
+void test() {
+    int d = 16;
+    idx_t n = 3000;
+    idx_t nq = 200;
+    size_t k = 10;
+
+    std::vector<float> data(n * d);
+    std::vector<float> query(nq * d);
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+
+    for (idx_t i = 0; i < n * d; ++i) {
+        data[i] = distrib(rng);
+    }
+    for (idx_t i = 0; i < nq * d; ++i) {
+        query[i] = distrib(rng);
+    }
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    hnswlib::HierarchicalNSW<float> flat_hnsw(&space, n);
+    flat_hnsw.setFlatCandidatePool(true);
+    for (size_t i = 0; i < n; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+        flat_hnsw.addPoint(data.data() + d * i, i);
+    }
+    for (hnswlib::tableint i = 0; i < n; ++i) {
+        assert(memcmp(alg_hnsw.get_linklist0(i), flat_hnsw.get_linklist0(i), alg_hnsw.size_links_level0_) == 0);
+    }
+    alg_hnsw.setEf(40);
+
+    check_flat(alg_hnsw, query, d, nq, k, nullptr);
+
+    PickDivisibleIds pickIdsDivisibleByThree(3);
+    check_flat(alg_hnsw, query, d, nq, k, &pickIdsDivisibleByThree);
+
+    for (size_t i = 0; i < n; i += 5) {
+        alg_hnsw.markDelete(i);
+    }
+    check_flat(alg_hnsw, query, d, nq, k, nullptr);
+
+    // a larger ef after the pools were sized for a smaller one
+    alg_hnsw.setEf(200);
+    check_flat(alg_hnsw, query, d, nq, k, nullptr);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test_queue();
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
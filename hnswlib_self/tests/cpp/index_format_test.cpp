@@ -0,0 +1,234 @@
+// This is a test file for testing the version 2 index file
+//  >>> void saveIndex(const std::string &location, int version);
+// of class HierarchicalNSW: the graph, labels and deletions load as saved, from the file and mapped,
+// version 1 files still load, corrupted sections and other spaces are refused, and PQ, SQ and
+// int8 indexes load with an untrained space
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <fstream>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+using Index = hnswlib::HierarchicalNSW<float>;
+
+void check_same_graph(const Index &a, const Index &b) {
+    assert(a.cur_element_count == b.cur_element_count);
+    assert(a.maxlevel_ == b.maxlevel_);
+    assert(a.enterpoint_node_ == b.enterpoint_node_);
+    assert(a.num_deleted_ == b.num_deleted_);
+    for (hnswlib::tableint id = 0; id < a.cur_element_count; id++) {
+        assert(a.element_levels_[id] == b.element_levels_[id]);
+        assert(a.isMarkedDeleted(id) == b.isMarkedDeleted(id));
+        for (int level = 1; level <= a.element_levels_[id]; level++) {
+            hnswlib::linklistsizeint *ll_a = a.get_linklist(id, level);
+            hnswlib::linklistsizeint *ll_b = b.get_linklist(id, level);
+            assert(memcmp(ll_a, ll_b, a.size_links_per_element_) == 0);
+        }
+    }
+}
+
+// Flips a byte of the file at offset
+void corrupt(const std::string &location, size_t offset) {
+    std::fstream file(location, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekg(offset);
+    char c = file.get();
+    file.seekp(offset);
+    file.put(c ^ 0x5a);
+}
+
+const hnswlib::IndexFileSection &section(const std::string &location, uint32_t id) {
+    static std::vector<hnswlib::IndexFileSection> sections;
+    std::ifstream input(location, std::ios::binary);
+    bool v2 = hnswlib::readIndexSections(input, sections);
+    assert(v2);
+    return hnswlib::requireIndexSection(sections, id);
+}
+
+void test_graph() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n, 16, 200, 100, true);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, (i * 7919) % n);
+    }
+    index.markDelete(11);
+    index.markDelete(2042);
+    index.setEf(50);
+
+    std::string location = "index_v2.bin";
+    std::string v1_location = "index_v1.bin";
+    index.saveIndex(location, 2);
+    index.saveIndex(v1_location);
+
+    Index loaded(&space, n, 16, 200, 100, true);
+    loaded.loadIndex(location, &space, n + 10);
+    loaded.setEf(50);
+    assert(loaded.max_elements_ == n + 10);
+    assert(loaded.label_lookup_ == index.label_lookup_);
+    assert(loaded.deleted_elements == index.deleted_elements);
+    check_same_graph(index, loaded);
+    check_same_results(index, loaded, query, nq, d, k);
+    loaded.addPoint(query.data(), n);
+    assert(loaded.searchKnn(query.data(), 1, 0).top().second == n);
+
+    assert(hnswlib::readIndexSpaceKind(location) == hnswlib::INDEX_SPACE_L2);
+    assert(hnswlib::readIndexSpaceKind(v1_location) == hnswlib::INDEX_SPACE_OTHER);
+
+    Index loaded_v1(&space, v1_location);
+    loaded_v1.setEf(50);
+    check_same_graph(index, loaded_v1);
+    check_same_results(index, loaded_v1, query, nq, d, k);
+
+    // a mapped version 2 file needs no lookup file
+    std::string lookup_location = location + ".lookup";
+    remove(lookup_location.c_str());
+    {
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+        mapped.setEf(50);
+        assert(!exists(lookup_location));
+        assert(mapped.label_lookup_.empty());
+        check_same_graph(index, mapped);
+        check_same_results(index, mapped, query, nq, d, k);
+        assert(mapped.getDataByLabel<float>((5 * 7919) % n)[3] == data[5 * d + 3]);
+        assert(throws([&] { mapped.getDataByLabel<float>(11); }));
+        mapped.resizeIndex(n + 1);
+        assert(mapped.label_lookup_.size() == n);
+        mapped.addPoint(query.data(), n);
+        assert(mapped.searchKnn(query.data(), 1, 0).top().second == n);
+    }
+
+    // other spaces
+    hnswlib::InnerProductSpace ip_space(d);
+    hnswlib::L2Space other_space(d + 1);
+    assert(throws([&] { Index other(&ip_space, location); }));
+    assert(throws([&] { Index other(&other_space, location); }));
+    assert(throws([&] { hnswlib::mergeIndexFiles({location}, "index_merged.bin"); }));
+
+    // a corrupted level 0 is found by loadIndex, corrupted levels by both loads
+    corrupt(location, section(location, hnswlib::INDEX_SECTION_LEVEL0).offset + 100);
+    assert(throws([&] { Index other(&space, location); }));
+    index.saveIndex(location, 2);
+    corrupt(location, section(location, hnswlib::INDEX_SECTION_LEVELS).offset + 4);
+    assert(throws([&] { Index other(&space, location); }));
+    assert(throws([&] {
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+    }));
+
+    remove(location.c_str());
+    remove(v1_location.c_str());
+}
+
+void test_quantized() {
+    size_t d = 32;
+    size_t n = 2000;
+    size_t nq = 20;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d), residuals(n);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+    for (size_t i = 0; i < n; i++) residuals[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    std::string location = "index_quantized.bin";
+    auto build = [&]() {
+        Index *index = new Index(&space, n);
+        for (size_t i = 0; i < n; i++) {
+            index->addPoint(data.data() + i * d, i);
+        }
+        index->setEf(50);
+        return index;
+    };
+
+    // PQ codebooks, with an OPQ rotation, and the residuals
+    {
+        Index *index = build();
+        hnswlib::PqSpace pq_space(8, d);
+        index->trainPq(&pq_space, n, 10, true);
+        index->loadResiduals(residuals);
+        index->saveIndex(location, 2);
+        hnswlib::PqSpace loaded_space(8, d);
+        Index loaded(&loaded_space, location);
+        loaded.setEf(50);
+        assert(loaded_space.hasCodebooks() && loaded_space.hasRotation());
+        assert(loaded.pq_residuals_ == residuals);
+        check_same_results(*index, loaded, query, nq, d, k);
+        hnswlib::PqSpace other_space(16, d);
+        assert(throws([&] { Index other(&other_space, location); }));
+        delete index;
+    }
+
+    // SQ ranges
+    {
+        Index *index = build();
+        hnswlib::SqSpace sq_space(d, 4);
+        index->trainSq(&sq_space);
+        index->saveIndex(location, 2);
+        hnswlib::SqSpace loaded_space(d, 4);
+        Index loaded(&loaded_space, location);
+        loaded.setEf(50);
+        assert(loaded_space.isTrained());
+        check_same_results(*index, loaded, query, nq, d, k);
+        delete index;
+    }
+
+    // int8 scale
+    {
+        Index *index = build();
+        hnswlib::L2SpaceInt8 int8_space(d);
+        index->sq8(&int8_space);
+        index->saveIndex(location, 2);
+        assert(hnswlib::readIndexSpaceKind(location) == hnswlib::INDEX_SPACE_L2_INT8);
+        hnswlib::L2SpaceInt8 loaded_space(d);
+        Index loaded(&loaded_space, location);
+        loaded.setEf(50);
+        assert(loaded_space.getScale() == int8_space.getScale());
+        assert(loaded.getScale() == index->getScale());
+        check_same_results(*index, loaded, query, nq, d, k);
+        Index mapped(&loaded_space);
+        hnswlib::L2SpaceInt8 mapped_space(d);
+        mapped.loadIndexMapped(location, &mapped_space);
+        mapped.setEf(50);
+        assert(mapped_space.getScale() == int8_space.getScale());
+        check_same_results(*index, mapped, query, nq, d, k);
+        hnswlib::SpaceInt8 ip_space(d);
+        assert(throws([&] { Index other(&ip_space, location); }));
+        delete index;
+    }
+
+    remove(location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test_graph();
+    test_quantized();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
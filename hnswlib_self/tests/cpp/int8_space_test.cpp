@@ -0,0 +1,181 @@
+// This is a test file for testing the int8 kernels of SpaceInt8 and L2SpaceInt8,
+// every kernel the CPU supports must match the scalar one exactly, and
+//  >>> void sq8(Int8SpaceBase *int8_space);
+// of class HierarchicalNSW: the index is searched with float queries quantized by the space
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <stdio.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+typedef int (*Int8Kernel)(const int8_t*, const int8_t*, size_t);
+typedef void (*QuantizeKernel)(const float*, int8_t*, size_t, float);
+
+void check_kernels(Int8Kernel ip, Int8Kernel l2) {
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_int_distribution<> distrib(-128, 127);
+
+    for (size_t dim = 1; dim <= 300; dim++) {
+        std::vector<int8_t> a(dim), b(dim);
+        for (size_t i = 0; i < dim; i++) {
+            a[i] = (int8_t) distrib(rng);
+            b[i] = (int8_t) distrib(rng);
+        }
+        // the extreme values
+        a[0] = -128;
+        b[dim - 1] = -128;
+        assert(ip(a.data(), b.data(), dim) == hnswlib::InnerProductInt8(a.data(), b.data(), dim));
+        assert(l2(a.data(), b.data(), dim) == hnswlib::L2SqrInt8(a.data(), b.data(), dim));
+    }
+}
+
+void check_quantize(QuantizeKernel quantize) {
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<float> distrib(-1.2f, 1.2f);
+
+    for (size_t dim = 1; dim <= 100; dim++) {
+        std::vector<float> x(dim);
+        for (size_t i = 0; i < dim; i++) x[i] = distrib(rng);
+        // saturated values and ties
+        x[0] = 1e10f;
+        if (dim > 1) x[dim - 1] = -1e10f;
+        if (dim > 2) x[1] = 2.5f / 100;
+        std::vector<int8_t> expected(dim), y(dim);
+        hnswlib::QuantizeInt8(x.data(), expected.data(), dim, 100);
+        quantize(x.data(), y.data(), dim, 100);
+        assert(y == expected);
+        assert(y[0] == 127);
+        if (dim > 1) assert(y[dim - 1] == -128);
+    }
+}
+
+void test() {
+#if defined(USE_SIMD_DISPATCH)
+    if (SSE41Capable()) {
+        std::cout << "SSE4.1" << std::endl;
+        check_kernels(hnswlib::InnerProductInt8SSE41, hnswlib::L2SqrInt8SSE41);
+        check_quantize(hnswlib::QuantizeInt8SSE41);
+    }
+    if (AVX2Capable()) {
+        std::cout << "AVX2" << std::endl;
+        check_kernels(hnswlib::InnerProductInt8AVX2, hnswlib::L2SqrInt8AVX2);
+        check_quantize(hnswlib::QuantizeInt8AVX2);
+    }
+    if (AVX512Capable()) {
+        check_quantize(hnswlib::QuantizeInt8AVX512);
+    }
+    if (AVX512BWCapable()) {
+        std::cout << "AVX-512BW" << std::endl;
+        check_kernels(hnswlib::InnerProductInt8AVX512, hnswlib::L2SqrInt8AVX512);
+    }
+#if defined(USE_INT8_VNNI)
+    if (AVX512VNNICapable()) {
+        std::cout << "AVX-512 VNNI" << std::endl;
+        check_kernels(hnswlib::InnerProductInt8AVX512VNNI, hnswlib::L2SqrInt8AVX512VNNI);
+    }
+#endif
+#endif
+
+    // the spaces use the selected kernels
+    size_t dim = 100;
+    float scale2 = 4.0f;
+    std::vector<int8_t> a(dim), b(dim);
+    for (size_t i = 0; i < dim; i++) {
+        a[i] = (int8_t) (i * 7 - 100);
+        b[i] = (int8_t) (50 - i * 3);
+    }
+    hnswlib::SpaceInt8 ip_space(dim);
+    hnswlib::L2SpaceInt8 l2_space(dim);
+    float ip = ip_space.get_dist_func()(a.data(), b.data(), ip_space.get_dist_func_param(), scale2);
+    float l2 = l2_space.get_dist_func()(a.data(), b.data(), l2_space.get_dist_func_param(), scale2);
+    assert(ip == 1.0f - (float) hnswlib::InnerProductInt8(a.data(), b.data(), dim) / scale2);
+    assert(l2 == (float) hnswlib::L2SqrInt8(a.data(), b.data(), dim) / scale2);
+}
+
+void test_sq8_index() {
+    size_t d = 32;
+    size_t n = 2000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; i++) {
+        alg_hnsw.addPoint(data.data() + i * d, i);
+    }
+    alg_hnsw.setEf(100);
+
+    hnswlib::L2SpaceInt8 int8_space(d);
+    alg_hnsw.sq8(&int8_space);
+    float scale = int8_space.getScale();
+    assert(scale > 0 && alg_hnsw.getScale() == scale);
+    assert(alg_hnsw.indexFileSize() < n * (d * sizeof(float) + alg_hnsw.size_links_level0_));
+
+    std::string index_path = "sq8_index.bin";
+    // the version 2 file keeps the scale, the space it loads with needs none
+    alg_hnsw.saveIndex(index_path, 2);
+    hnswlib::L2SpaceInt8 loaded_space(d);
+    hnswlib::HierarchicalNSW<float> loaded_hnsw(&loaded_space, index_path);
+    assert(loaded_space.getScale() == scale && loaded_hnsw.getScale() == scale);
+    loaded_hnsw.setEf(100);
+    remove(index_path.c_str());
+
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, hnswlib::labeltype>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2Sqr(qv, data.data() + i * d, &d, 1.0f), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<hnswlib::labeltype> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+
+        // float queries, the distances approximate the float ones
+        auto result = alg_hnsw.searchKnn(qv, k, 0);
+        auto loaded_result = loaded_hnsw.searchKnn(qv, k, 0);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            assert(loaded_result.top() == result.top());
+            hnswlib::labeltype label = result.top().second;
+            float exact = hnswlib::L2Sqr(qv, data.data() + label * d, &d, 1.0f);
+            assert(fabs(result.top().first - exact) < 0.05f * exact + 0.05f);
+            hits += gt_labels.count(label);
+            result.pop();
+            loaded_result.pop();
+        }
+    }
+    float recall = (float) hits / (nq * k);
+    std::cout << "SQ8 recall " << recall << std::endl;
+    assert(recall > 0.9);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    test_sq8_index();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+// This is a test file for testing the memory of the upper level links
+//  >>> void compactLinks();
+// of class HierarchicalNSW: the lists come from a few LinkArena chunks, a loaded index and a
+// compacted one have all of them in one block in id order, and the graph stays the same
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+// The lists of the elements with upper levels follow each other in id order without gaps
+bool links_in_one_block(const Index &index) {
+    char *next = nullptr;
+    for (size_t i = 0; i < index.cur_element_count; i++) {
+        if (index.element_levels_[i] == 0)
+            continue;
+        if (next != nullptr && index.linkLists_[i] != next)
+            return false;
+        next = index.linkLists_[i] + index.size_links_per_element_ * index.element_levels_[i];
+    }
+    return true;
+}
+
+bool same_links(const Index &a, const Index &b) {
+    for (size_t i = 0; i < a.cur_element_count; i++) {
+        if (a.element_levels_[i] != b.element_levels_[i])
+            return false;
+        for (int level = 1; level <= a.element_levels_[i]; level++) {
+            hnswlib::linklistsizeint *ll_a = a.get_linklist(i, level);
+            hnswlib::linklistsizeint *ll_b = b.get_linklist(i, level);
+            // packed links are stored sorted
+            std::vector<hnswlib::tableint> links_a((hnswlib::tableint *) (ll_a + 1), (hnswlib::tableint *) (ll_a + 1) + a.getListCount(ll_a));
+            std::vector<hnswlib::tableint> links_b((hnswlib::tableint *) (ll_b + 1), (hnswlib::tableint *) (ll_b + 1) + b.getListCount(ll_b));
+            std::sort(links_a.begin(), links_a.end());
+            std::sort(links_b.begin(), links_b.end());
+            if (links_a != links_b)
+                return false;
+        }
+    }
+    return true;
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 20000;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n, 16, 100);
+#pragma omp parallel for
+    for (long long i = 0; i < (long long) n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    size_t upper = 0;
+    for (size_t i = 0; i < n; i++) upper += index.element_levels_[i] > 0;
+    std::cout << upper << " lists in " << index.link_arena_.chunkCount() << " chunks of "
+              << index.link_arena_.allocatedBytes() << " bytes" << std::endl;
+    assert(index.link_arena_.chunkCount() < 10);
+
+    // every file version loads the links into one block
+    std::string location = "link_arena_index.bin";
+    index.saveIndex(location);
+    Index loaded(&space, location);
+    assert(loaded.link_arena_.chunkCount() == 1);
+    assert(links_in_one_block(loaded));
+    assert(same_links(loaded, index));
+    for (bool pack_links : {false, true}) {
+        index.saveIndex(location, 2, pack_links);
+        Index loaded2(&space, location);
+        assert(loaded2.link_arena_.chunkCount() == 1);
+        assert(links_in_one_block(loaded2));
+        assert(same_links(loaded2, index));
+    }
+
+    // the lists of parallel insertions interleave, compacted they are in id order with the same links
+    index.compactLinks();
+    assert(index.link_arena_.chunkCount() == 1);
+    assert(links_in_one_block(index));
+    assert(same_links(loaded, index));
+
+    // adding to a loaded index takes new chunks, clear frees them
+    loaded.resizeIndex(n + 100);
+    for (size_t i = 0; i < 100; i++) {
+        loaded.addPoint(data.data() + i * d, n + i);
+    }
+    assert(loaded.link_arena_.chunkCount() <= 2);
+    loaded.clear();
+    assert(loaded.link_arena_.chunkCount() == 0);
+
+    remove(location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+// This is a test file for testing the allocation of level 0
+//  >>> void setMemoryPolicy(int policy);
+//  >>> void replicateLevel0();
+//  >>> int bindSearchThread(int node);
+//  >>> void dropReplicas();
+// of class HierarchicalNSW: under every policy the index builds, grows and loads with the same
+// results, and threads bound to a replica of level 0 search as the index does
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <thread>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+std::vector<std::pair<float, hnswlib::labeltype>> search_all(const Index &index, const std::vector<float> &query, size_t nq, size_t d, size_t k) {
+    std::vector<std::pair<float, hnswlib::labeltype>> results;
+    for (size_t q = 0; q < nq; q++) {
+        auto result = index.searchKnn(query.data() + q * d, k, 0);
+        while (!result.empty()) {
+            results.push_back(result.top());
+            result.pop();
+        }
+    }
+    return results;
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 4000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n, 16, 100);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    index.setEf(50);
+    std::string location = "memory_policy_index.bin";
+    index.saveIndex(location);
+
+    for (int policy : {hnswlib::MEMORY_DEFAULT, hnswlib::MEMORY_HUGE_PAGES, hnswlib::MEMORY_HUGETLB,
+                       hnswlib::MEMORY_HUGE_PAGES | hnswlib::MEMORY_NUMA_INTERLEAVE}) {
+        // built half, moved, grown and completed under the policy
+        Index built(&space, n / 2, 16, 100);
+        built.setMemoryPolicy(hnswlib::MEMORY_HUGE_PAGES);
+        for (size_t i = 0; i < n / 4; i++) {
+            built.addPoint(data.data() + i * d, i);
+        }
+        built.setMemoryPolicy(policy);
+        assert(built.getMemoryPolicy() == policy);
+        for (size_t i = n / 4; i < n / 2; i++) {
+            built.addPoint(data.data() + i * d, i);
+        }
+        built.resizeIndex(n);
+        for (size_t i = n / 2; i < n; i++) {
+            built.addPoint(data.data() + i * d, i);
+        }
+        built.setEf(50);
+        check_same_results(index, built, query, nq, d, k);
+
+        Index loaded(&space);
+        loaded.setMemoryPolicy(policy);
+        loaded.loadIndex(location, &space);
+        loaded.setEf(50);
+        check_same_results(index, loaded, query, nq, d, k);
+    }
+
+    // replicas: searches of bound threads match, the index is read-only until the replicas are dropped
+    Index replicated(&space, location);
+    replicated.setEf(50);
+    bool thrown = false;
+    try {
+        replicated.bindSearchThread();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    replicated.replicateLevel0();
+    replicated.markDelete(7);
+    index.markDelete(7);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([&]() {
+            int node = replicated.bindSearchThread();
+            assert(node >= 0);
+            check_same_results(index, replicated, query, nq, d, k);
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    thrown = false;
+    try {
+        replicated.addPoint(data.data(), n);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        replicated.resizeIndex(2 * n);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // a binding outlives neither the replicas nor the index
+    int node = replicated.bindSearchThread();
+    replicated.dropReplicas();
+    replicated.resizeIndex(2 * n);
+    replicated.addPoint(data.data(), n);
+    std::vector<std::pair<float, hnswlib::labeltype>> expected;
+    std::thread unbound([&]() {
+        expected = search_all(replicated, query, nq, d, k);
+    });
+    unbound.join();
+    assert(search_all(replicated, query, nq, d, k) == expected);
+    replicated.replicateLevel0();
+    assert(replicated.bindSearchThread(node) == node);
+    assert(search_all(replicated, query, nq, d, k) == expected);
+
+    remove(location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
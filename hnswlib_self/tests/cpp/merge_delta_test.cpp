@@ -0,0 +1,190 @@
+// This is a test file for testing the incremental merge
+//  >>> size_t mergeDelta(const HierarchicalNSW &delta, size_t ef);
+// of class HierarchicalNSW: growth of the index, updated and deleted labels, and the recall and
+// distance computations against inserting the delta with addPoint
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+// L2 space counting the distance computations
+std::atomic<size_t> num_distances(0);
+
+float CountedL2Sqr(const void *a, const void *b, const void *param, float scale) {
+    num_distances++;
+    return hnswlib::L2Sqr(a, b, param, scale);
+}
+
+class CountedL2Space : public hnswlib::L2Space {
+ public:
+    explicit CountedL2Space(size_t dim) : hnswlib::L2Space(dim) {}
+
+    hnswlib::DISTFUNC<float> get_dist_func() override {
+        return CountedL2Sqr;
+    }
+};
+
+float recall(hnswlib::HierarchicalNSW<float> &alg_hnsw, const std::vector<float> &data, const std::vector<float> &query,
+             size_t n, size_t nq, size_t d, size_t k) {
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2Sqr(qv, data.data() + i * d, &d, 1.0f), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+        auto result = alg_hnsw.searchKnn(qv, k, 0);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            hits += gt_labels.count(result.top().second);
+            result.pop();
+        }
+    }
+    return (float) hits / (nq * k);
+}
+
+void test() {
+    size_t d = 16;
+    size_t n_base = 5000;
+    size_t n_delta = 1000;
+    size_t n = n_base + n_delta;
+    size_t nq = 100;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    // the last 20 base vectors get new values in the delta
+    std::vector<float> updated(20 * d);
+    for (size_t i = 0; i < updated.size(); i++) updated[i] = distrib(rng);
+
+    CountedL2Space space(d);
+    hnswlib::HierarchicalNSW<float> base(&space, n_base);
+    hnswlib::HierarchicalNSW<float> reference(&space, n);
+    for (size_t i = 0; i < n_base; i++) {
+        base.addPoint(data.data() + i * d, i);
+        reference.addPoint(data.data() + i * d, i);
+    }
+
+    hnswlib::HierarchicalNSW<float> delta(&space, n_delta + 30);
+    for (size_t i = n_base; i < n; i++) {
+        delta.addPoint(data.data() + i * d, i);
+    }
+    for (size_t i = 0; i < 20; i++) {
+        delta.addPoint(updated.data() + i * d, n_base - 20 + i);
+    }
+    // deleted in the delta, not merged
+    for (size_t i = 0; i < 10; i++) {
+        delta.addPoint(query.data() + i * d, n + i);
+        delta.markDelete(n + i);
+    }
+
+    num_distances = 0;
+    for (size_t i = 0; i < delta.cur_element_count; i++) {
+        if (!delta.isMarkedDeleted(i))
+            reference.addPoint(delta.getDataByInternalId(i), delta.getExternalLabel(i));
+    }
+    size_t add_distances = num_distances;
+
+    num_distances = 0;
+    size_t added = base.mergeDelta(delta);
+    size_t merge_distances = num_distances;
+    assert(added == n_delta);
+    assert(base.cur_element_count == n);
+    assert(base.max_elements_ == n);
+    assert(base.label_lookup_.size() == n);
+    for (size_t i = 0; i < 10; i++) {
+        assert(base.label_lookup_.count(n + i) == 0);
+    }
+    for (size_t i = 0; i < 20; i++) {
+        std::vector<float> stored = base.getDataByLabel<float>(n_base - 20 + i);
+        assert(stored[5] == updated[i * d + 5]);
+        memcpy(data.data() + (n_base - 20 + i) * d, updated.data() + i * d, d * sizeof(float));
+    }
+    base.checkIntegrity();
+
+    base.setEf(50);
+    reference.setEf(50);
+    float merge_recall = recall(base, data, query, n, nq, d, k);
+    float add_recall = recall(reference, data, query, n, nq, d, k);
+    std::cout << "addPoint: recall " << add_recall << ", " << add_distances << " distances; "
+              << "mergeDelta: recall " << merge_recall << ", " << merge_distances << " distances" << std::endl;
+    assert(merge_recall > 0.95);
+    assert(merge_recall > add_recall - 0.02);
+
+    // the delta neighbourhoods allow a smaller ef
+    hnswlib::HierarchicalNSW<float> base2(&space, n_base);
+    for (size_t i = 0; i < n_base; i++) {
+        base2.addPoint(data.data() + i * d, i);
+    }
+    num_distances = 0;
+    base2.mergeDelta(delta, 50);
+    size_t small_ef_distances = num_distances;
+    base2.setEf(50);
+    float small_ef_recall = recall(base2, data, query, n, nq, d, k);
+    std::cout << "mergeDelta with ef 50: recall " << small_ef_recall << ", " << small_ef_distances << " distances" << std::endl;
+    assert(small_ef_recall > add_recall - 0.02);
+    assert(small_ef_distances < add_distances / 2);
+}
+
+void test_empty() {
+    size_t d = 4;
+    std::vector<float> data(d * 100);
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    for (size_t i = 0; i < data.size(); i++) data[i] = distrib(rng);
+
+    // a delta merged into an empty index
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> delta(&space, 100);
+    for (size_t i = 0; i < 100; i++) {
+        delta.addPoint(data.data() + i * d, i);
+    }
+    hnswlib::HierarchicalNSW<float> base(&space, 10);
+    assert(base.mergeDelta(delta) == 100);
+    assert(base.cur_element_count == 100);
+    for (size_t i = 0; i < 100; i++) {
+        auto result = base.searchKnn(data.data() + i * d, 1, 0);
+        assert(result.top().second == i);
+    }
+
+    hnswlib::L2Space other_space(d + 1);
+    hnswlib::HierarchicalNSW<float> other(&other_space, 10);
+    bool thrown = false;
+    try {
+        base.mergeDelta(other);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    test_empty();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+// This is a test file for testing the merge of shard index files
+//  >>> size_t mergeIndexFiles(const std::vector<std::string> &shard_locations, const std::string &location, size_t chunk_elements);
+// the merged file loads into the same index as mergeIndex builds in memory from the loaded shards,
+// with chunks and sort runs much smaller than the shards
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+void check_same(const Index &a, const Index &b) {
+    assert(a.cur_element_count == b.cur_element_count);
+    assert(a.maxlevel_ == b.maxlevel_);
+    assert(a.enterpoint_node_ == b.enterpoint_node_);
+    assert(a.num_deleted_ == b.num_deleted_);
+    for (hnswlib::tableint id = 0; id < a.cur_element_count; id++) {
+        assert(a.getExternalLabel(id) == b.getExternalLabel(id));
+        assert(memcmp(a.getDataByInternalId(id), b.getDataByInternalId(id), a.data_size_) == 0);
+        assert(a.isMarkedDeleted(id) == b.isMarkedDeleted(id));
+        assert(a.element_levels_[id] == b.element_levels_[id]);
+        for (int level = 0; level <= a.element_levels_[id]; level++) {
+            hnswlib::linklistsizeint *ll_a = a.get_linklist_by_level(id, level);
+            hnswlib::linklistsizeint *ll_b = b.get_linklist_by_level(id, level);
+            assert(a.getListCount(ll_a) == b.getListCount(ll_b));
+            assert(memcmp(ll_a + 1, ll_b + 1, a.getListCount(ll_a) * sizeof(hnswlib::tableint)) == 0);
+        }
+    }
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t shared = 100;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), other(d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < d; i++) other[i] = distrib(rng);
+
+    // three shards of 1000 labels, the second one also holds the first 100 labels of the first,
+    // label 7 with another vector there
+    hnswlib::L2Space space(d);
+    std::vector<Index *> shards;
+    std::vector<std::string> locations;
+    for (size_t s = 0; s < 3; s++) {
+        Index *shard = new Index(&space, 1000 + shared, 16, 100, s);
+        for (size_t i = s * 1000; i < (s + 1) * 1000; i++) {
+            shard->addPoint(data.data() + i * d, i);
+        }
+        if (s == 1) {
+            for (size_t i = 0; i < shared; i++) {
+                shard->addPoint(i == 7 ? other.data() : data.data() + i * d, i);
+            }
+        }
+        shards.push_back(shard);
+    }
+    // deleted in the first copy only, so the vector of the second copy is kept
+    shards[0]->markDelete(7);
+    shards[2]->markDelete(2500);
+    for (size_t s = 0; s < 3; s++) {
+        locations.push_back("merge_files_shard" + std::to_string(s) + ".bin");
+        shards[s]->saveIndex(locations[s]);
+    }
+
+    Index merged(&space, n, 16, 100);
+    merged.mergeIndex(shards);
+
+    std::string location = "merge_files_merged.bin";
+    for (size_t chunk_elements : {64, 65536}) {
+        size_t count = hnswlib::mergeIndexFiles(locations, location, chunk_elements);
+        assert(count == n);
+        Index loaded(&space, location);
+        check_same(merged, loaded);
+        hnswlib::tableint id = loaded.label_lookup_.at(7);
+        assert(!loaded.isMarkedDeleted(id));
+        assert(memcmp(loaded.getDataByInternalId(id), other.data(), d * sizeof(float)) == 0);
+        assert(loaded.isMarkedDeleted(loaded.label_lookup_.at(2500)));
+    }
+
+    // a shard built with other parameters
+    Index different(&space, 100, 8, 100);
+    for (size_t i = 0; i < 100; i++) {
+        different.addPoint(data.data() + i * d, n + i);
+    }
+    different.saveIndex("merge_files_different.bin");
+    bool thrown = false;
+    try {
+        hnswlib::mergeIndexFiles({locations[0], "merge_files_different.bin"}, location);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    remove(location.c_str());
+    remove("merge_files_different.bin");
+    for (size_t s = 0; s < 3; s++) {
+        remove(locations[s].c_str());
+        delete shards[s];
+    }
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,339 @@
+// This is a test file for testing the merge of shard indexes
+//  >>> void mergeIndex(const std::vector<HierarchicalNSW*>& shard_indexes, bool prune_by_distance, size_t refine_ef);
+// of class HierarchicalNSW: vectors, labels, levels, links and deletion marks of the shards
+// end up in the merged index, labels found in several shards are merged into one element,
+// and the cross-shard refinement brings the recall of disjoint shards close to a single index
+//  >>> size_t repairConnectivity(size_t max_passes);
+// makes every element reachable from the entry point within the degree caps
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <set>
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+using Index = hnswlib::HierarchicalNSW<float>;
+
+std::set<idx_t> links_by_label(const Index &index, hnswlib::tableint internal_id, int level) {
+    std::set<idx_t> labels;
+    hnswlib::linklistsizeint *ll = index.get_linklist_by_level(internal_id, level);
+    hnswlib::tableint *data = (hnswlib::tableint *) (ll + 1);
+    for (size_t j = 0; j < index.getListCount(ll); j++) {
+        labels.insert(index.getExternalLabel(data[j]));
+    }
+    return labels;
+}
+
+void test_merge() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t shared = 100;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+
+    // three shards of 1000 labels, the second one also holds the first 100 labels of the first
+    hnswlib::L2Space space(d);
+    std::vector<Index *> shards;
+    for (size_t s = 0; s < 3; s++) {
+        Index *shard = new Index(&space, 1000 + shared, 16, 100, s);
+        for (size_t i = s * 1000; i < (s + 1) * 1000; i++) {
+            shard->addPoint(data.data() + i * d, i);
+        }
+        if (s == 1) {
+            for (size_t i = 0; i < shared; i++) {
+                shard->addPoint(data.data() + i * d, i);
+            }
+        }
+        shards.push_back(shard);
+    }
+    // deleted in one of its copies only, and in its only copy
+    shards[0]->markDelete(5);
+    shards[2]->markDelete(2500);
+
+    Index merged(&space, n, 16, 100);
+    merged.mergeIndex(shards);
+    assert(merged.getCurrentElementCount() == n);
+    assert(merged.getDeletedCount() == 1);
+    assert(merged.label_lookup_.size() == n);
+
+    for (idx_t label = 0; label < n; label++) {
+        hnswlib::tableint id = merged.label_lookup_.at(label);
+        assert(merged.getExternalLabel(id) == label);
+        assert(memcmp(merged.getDataByInternalId(id), data.data() + label * d, d * sizeof(float)) == 0);
+        assert(merged.isMarkedDeleted(id) == (label == 2500));
+
+        std::vector<Index *> copies;
+        for (Index *shard : shards) {
+            if (shard->label_lookup_.count(label)) copies.push_back(shard);
+        }
+        assert(copies.size() == (label < shared ? 2 : 1));
+
+        int level = 0;
+        for (Index *shard : copies) level = std::max(level, shard->element_levels_[shard->label_lookup_.at(label)]);
+        assert(merged.element_levels_[id] == level);
+
+        for (int l = 0; l <= level; l++) {
+            std::set<idx_t> expected;
+            for (Index *shard : copies) {
+                hnswlib::tableint shard_id = shard->label_lookup_.at(label);
+                if (shard->element_levels_[shard_id] < l) continue;
+                std::set<idx_t> shard_links = links_by_label(*shard, shard_id, l);
+                expected.insert(shard_links.begin(), shard_links.end());
+            }
+            expected.erase(label);
+            std::set<idx_t> links = links_by_label(merged, id, l);
+            size_t max_links = l == 0 ? merged.maxM0_ : merged.maxM_;
+            assert(links.size() == std::min(expected.size(), max_links));
+            for (idx_t link : links) assert(expected.count(link));
+        }
+    }
+    assert(merged.element_levels_[merged.enterpoint_node_] == merged.maxlevel_);
+
+    // the merged index has to be empty and large enough
+    bool thrown = false;
+    try {
+        merged.mergeIndex(shards);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    Index small(&space, n - 1, 16, 100);
+    thrown = false;
+    try {
+        small.mergeIndex(shards);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    for (Index *shard : shards) delete shard;
+}
+
+float recall(Index &index, const std::vector<float> &data, const std::vector<float> &query,
+             size_t n, size_t nq, size_t d, size_t k) {
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2Sqr(qv, data.data() + i * d, &d, 1.0f), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+        auto result = index.searchKnn(qv, k, 0);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            hits += gt_labels.count(result.top().second);
+            result.pop();
+        }
+    }
+    return (float) hits / (nq * k);
+}
+
+void test_recall() {
+    size_t d = 16;
+    size_t n = 2000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    // two graphs over the same elements, merging them keeps every element reachable
+    hnswlib::L2Space space(d);
+    std::vector<Index *> shards;
+    for (size_t s = 0; s < 2; s++) {
+        Index *shard = new Index(&space, n, 8, 100, s + 1);
+        for (size_t i = 0; i < n; i++) {
+            shard->addPoint(data.data() + i * d, i);
+        }
+        shards.push_back(shard);
+    }
+    Index merged(&space, n, 8, 100);
+    merged.mergeIndex(shards);
+    merged.setEf(50);
+
+    float merged_recall = recall(merged, data, query, n, nq, d, k);
+    std::cout << "merged recall: " << merged_recall << std::endl;
+    assert(merged_recall > 0.9);
+
+    for (Index *shard : shards) delete shard;
+}
+
+void check_links(const Index &index) {
+    for (hnswlib::tableint id = 0; id < index.cur_element_count; id++) {
+        for (int l = 0; l <= index.element_levels_[id]; l++) {
+            hnswlib::linklistsizeint *ll = index.get_linklist_at_level(id, l);
+            hnswlib::tableint *data = (hnswlib::tableint *) (ll + 1);
+            size_t size = index.getListCount(ll);
+            assert(size <= (l == 0 ? index.maxM0_ : index.maxM_));
+            std::set<hnswlib::tableint> unique(data, data + size);
+            assert(unique.size() == size);
+            assert(unique.count(id) == 0);
+            for (hnswlib::tableint link : unique) assert(index.element_levels_[link] >= l);
+        }
+    }
+}
+
+void test_cross_shard() {
+    size_t d = 16;
+    size_t n = 4000;
+    size_t nq = 100;
+    size_t k = 10;
+    size_t num_shards = 4;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index single(&space, n, 16, 100);
+    std::vector<Index *> shards;
+    for (size_t s = 0; s < num_shards; s++) {
+        shards.push_back(new Index(&space, n / num_shards, 16, 100, s));
+    }
+    for (size_t i = 0; i < n; i++) {
+        single.addPoint(data.data() + i * d, i);
+        shards[i % num_shards]->addPoint(data.data() + i * d, i);
+    }
+    single.setEf(50);
+    float single_recall = recall(single, data, query, n, nq, d, k);
+
+    // disjoint shards only share the entry point's component, most elements cannot be reached
+    Index merged(&space, n, 16, 100);
+    merged.mergeIndex(shards);
+    merged.setEf(50);
+    float merged_recall = recall(merged, data, query, n, nq, d, k);
+
+    Index refined(&space, n, 16, 100);
+    refined.mergeIndex(shards, true, 100);
+    refined.setEf(50);
+    float refined_recall = recall(refined, data, query, n, nq, d, k);
+    check_links(refined);
+    std::cout << "single index recall: " << single_recall << ", merged: " << merged_recall
+              << ", refined: " << refined_recall << std::endl;
+    assert(merged_recall < 0.5);
+    assert(refined_recall > single_recall - 0.03);
+
+    for (Index *shard : shards) delete shard;
+}
+
+size_t count_unreachable(const Index &index, int level) {
+    std::vector<bool> reachable(index.cur_element_count, false);
+    std::vector<hnswlib::tableint> queue;
+    index.markReachable(index.enterpoint_node_, level, reachable, queue);
+    size_t unreachable = 0;
+    for (hnswlib::tableint id = 0; id < index.cur_element_count; id++) {
+        if (index.element_levels_[id] >= level && !reachable[id]) unreachable++;
+    }
+    return unreachable;
+}
+
+void test_repair() {
+    size_t d = 16;
+    size_t n = 4000;
+    size_t nq = 100;
+    size_t k = 10;
+    size_t num_shards = 4;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    std::vector<Index *> shards;
+    for (size_t s = 0; s < num_shards; s++) {
+        shards.push_back(new Index(&space, n / num_shards, 16, 100, s));
+    }
+    for (size_t i = 0; i < n; i++) {
+        shards[i % num_shards]->addPoint(data.data() + i * d, i);
+    }
+
+    // without the refinement three shards are cut off from the entry point, a few links join them
+    // again; that makes every element reachable but it takes the refinement to find them quickly
+    Index merged(&space, n, 16, 100);
+    merged.mergeIndex(shards, true);
+    merged.setEf(50);
+    size_t unreachable = count_unreachable(merged, 0);
+    float merged_recall = recall(merged, data, query, n, nq, d, k);
+    assert(unreachable >= n / 2);
+
+    size_t repaired = merged.repairConnectivity();
+    float repaired_recall = recall(merged, data, query, n, nq, d, k);
+    std::cout << "unreachable: " << unreachable << ", links added: " << repaired
+              << ", recall before: " << merged_recall << ", after: " << repaired_recall << std::endl;
+    assert(repaired > 0);
+    for (int level = 0; level <= merged.maxlevel_; level++) {
+        assert(count_unreachable(merged, level) == 0);
+    }
+    check_links(merged);
+    assert(merged.repairConnectivity() == 0);
+
+    // an element without inbound links is linked again and found
+    Index single(&space, n, 16, 100);
+    for (size_t i = 0; i < n; i++) {
+        single.addPoint(data.data() + i * d, i);
+    }
+    single.repairConnectivity();
+    hnswlib::tableint orphan = single.label_lookup_.at(7);
+    for (hnswlib::tableint id = 0; id < single.cur_element_count; id++) {
+        for (int l = 0; l <= single.element_levels_[id]; l++) {
+            hnswlib::linklistsizeint *ll = single.get_linklist_at_level(id, l);
+            hnswlib::tableint *links = (hnswlib::tableint *) (ll + 1);
+            size_t size = single.getListCount(ll);
+            size_t kept = 0;
+            for (size_t j = 0; j < size; j++) {
+                if (links[j] != orphan) links[kept++] = links[j];
+            }
+            single.setListCount(ll, kept);
+        }
+    }
+    if (single.enterpoint_node_ != orphan) {
+        assert(count_unreachable(single, 0) > 0);
+        assert(single.repairConnectivity() > 0);
+        assert(count_unreachable(single, 0) == 0);
+    }
+    single.setEf(50);
+    auto result = single.searchKnn(data.data() + 7 * d, 1, 0);
+    assert(result.top().second == 7);
+    check_links(single);
+
+    for (Index *shard : shards) delete shard;
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test_merge();
+    test_recall();
+    test_cross_shard();
+    test_repair();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+// This is a test file for testing the memory-mapped load
+//  >>> void loadIndexMapped(const std::string &location, SpaceInterface<dist_t> *s);
+// of class HierarchicalNSW: the mapped index searches like the loaded one, the lookup file is
+// written at the first load and used at the next ones, changes stay out of the file, and the
+// index is copied into memory when it grows
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <fstream>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+using Index = hnswlib::HierarchicalNSW<float>;
+
+void test() {
+    size_t d = 16;
+    size_t n = 5000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    std::string location = "mmap_index.bin";
+    std::string lookup_location = location + ".lookup";
+    remove(lookup_location.c_str());
+    {
+        Index index(&space, n);
+        // labels not in id order
+        for (size_t i = 0; i < n; i++) {
+            index.addPoint(data.data() + i * d, (i * 7919) % n);
+        }
+        index.markDelete(11);
+        index.markDelete(4242);
+        index.saveIndex(location);
+    }
+    std::vector<char> file = read_file(location);
+
+    Index loaded(&space, location);
+    loaded.setEf(50);
+    for (int run = 0; run < 2; run++) {
+        // the first load writes the lookup file, the second maps it
+        assert(exists(lookup_location) == (run == 1));
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+        assert(exists(lookup_location));
+        assert(mapped.label_lookup_.empty());
+        assert(mapped.getCurrentElementCount() == n);
+        assert(mapped.getDeletedCount() == 2);
+        assert(mapped.maxlevel_ == loaded.maxlevel_);
+        for (size_t i = 0; i < n; i++) {
+            assert(mapped.element_levels_[i] == loaded.element_levels_[i]);
+        }
+        mapped.setEf(50);
+        check_same_results(loaded, mapped, query, nq, d, k);
+
+        idx_t label = (5 * 7919) % n;
+        std::vector<float> vector = mapped.getDataByLabel<float>(label);
+        assert(memcmp(vector.data(), data.data() + 5 * d, d * sizeof(float)) == 0);
+        bool thrown = false;
+        try {
+            mapped.getDataByLabel<float>(11);
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // deletions and updates are private to the process
+        mapped.markDelete(label);
+        mapped.unmarkDelete(11);
+        mapped.addPoint(query.data(), 12);
+        assert(mapped.getDeletedCount() == 2);
+        auto result = mapped.searchKnn(query.data(), 1, 0);
+        assert(result.top().second == 12);
+    }
+    assert(read_file(location) == file);
+
+    // the index grows in memory, the labels of the file stay found
+    {
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+        mapped.setEf(50);
+        bool thrown = false;
+        try {
+            mapped.addPoint(query.data(), n);
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+        mapped.resizeIndex(n + nq);
+        assert(mapped.mapped_index_ == nullptr);
+        assert(mapped.label_lookup_.size() == n);
+        for (size_t q = 0; q < nq; q++) {
+            mapped.addPoint(query.data() + q * d, n + q);
+        }
+        for (size_t q = 0; q < nq; q++) {
+            auto result = mapped.searchKnn(query.data() + q * d, 1, 0);
+            assert(result.top().second == n + q);
+        }
+        mapped.markDelete(n);
+        mapped.markDelete((3 * 7919) % n);
+        assert(mapped.getDeletedCount() == 4);
+    }
+    assert(read_file(location) == file);
+
+    // a lookup file of another index file is not used
+    {
+        Index other(&space, 100);
+        for (size_t i = 0; i < 100; i++) {
+            other.addPoint(data.data() + i * d, i);
+        }
+        other.saveIndex(location);
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+        assert(mapped.getCurrentElementCount() == 100);
+        assert(mapped.getDeletedCount() == 0);
+        auto result = mapped.searchKnn(data.data() + 42 * d, 1, 0);
+        assert(result.top().second == 42);
+    }
+
+    remove(location.c_str());
+    remove(lookup_location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
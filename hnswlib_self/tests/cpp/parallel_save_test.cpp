@@ -0,0 +1,182 @@
+// This is a test file for testing the parallel writer of saveIndex
+//  >>> void saveIndex(const std::string &location);
+//  >>> void saveIndex(const std::string &location, int version, bool pack_links);
+// of class HierarchicalNSW: a version 1 file of several blocks is the file the sequential writer
+// wrote, and an index saved with packed links loads with the same graph from a smaller file;
+// an exception of a part is rethrown by the writer
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+// The version 1 file as the sequential writer wrote it
+std::vector<char> sequential_file(const Index &index) {
+    std::ostringstream output;
+    hnswlib::writeBinaryPOD(output, index.offsetLevel0_);
+    hnswlib::writeBinaryPOD(output, index.max_elements_);
+    hnswlib::writeBinaryPOD(output, index.cur_element_count);
+    hnswlib::writeBinaryPOD(output, index.size_data_per_element_);
+    hnswlib::writeBinaryPOD(output, index.label_offset_);
+    hnswlib::writeBinaryPOD(output, index.offsetData_);
+    hnswlib::writeBinaryPOD(output, index.maxlevel_);
+    hnswlib::writeBinaryPOD(output, index.enterpoint_node_);
+    hnswlib::writeBinaryPOD(output, index.maxM_);
+    hnswlib::writeBinaryPOD(output, index.maxM0_);
+    hnswlib::writeBinaryPOD(output, index.M_);
+    hnswlib::writeBinaryPOD(output, index.mult_);
+    hnswlib::writeBinaryPOD(output, index.ef_construction_);
+    output.write(index.data_level0_memory_, index.cur_element_count * index.size_data_per_element_);
+    for (size_t i = 0; i < index.cur_element_count; i++) {
+        unsigned int link_list_size = index.element_levels_[i] > 0 ? index.size_links_per_element_ * index.element_levels_[i] : 0;
+        hnswlib::writeBinaryPOD(output, link_list_size);
+        if (link_list_size)
+            output.write(index.linkLists_[i], link_list_size);
+    }
+    std::string data = output.str();
+    return std::vector<char>(data.begin(), data.end());
+}
+
+std::vector<hnswlib::tableint> sorted_links(const Index &index, hnswlib::tableint id, int level) {
+    hnswlib::linklistsizeint *ll = index.get_linklist_at_level(id, level);
+    hnswlib::tableint *links = (hnswlib::tableint *) (ll + 1);
+    std::vector<hnswlib::tableint> result(links, links + index.getListCount(ll));
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void test() {
+    size_t d = 96;
+    size_t n = 20000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n, 16, 100);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    index.markDelete(42);
+    index.setEf(50);
+    size_t level0_size = n * index.size_data_per_element_;
+    assert(level0_size > 2 * hnswlib::INDEX_CHECKSUM_BLOCK);
+
+    std::string location = "parallel_save_index.bin";
+    index.saveIndex(location);
+    assert(read_file(location) == sequential_file(index));
+
+    std::string packed_location = "parallel_save_packed.bin";
+    index.saveIndex(packed_location, 2, true);
+    index.saveIndex(location, 2);
+    size_t packed_size = read_file(packed_location).size();
+    size_t unpacked_size = read_file(location).size();
+    std::cout << "version 2 file: " << unpacked_size << " bytes, with packed links: " << packed_size << std::endl;
+    assert(packed_size < unpacked_size - n * index.size_links_level0_ / 2);
+
+    Index loaded(&space, packed_location);
+    loaded.setEf(50);
+    assert(loaded.cur_element_count == n);
+    assert(loaded.maxlevel_ == index.maxlevel_);
+    assert(loaded.enterpoint_node_ == index.enterpoint_node_);
+    assert(loaded.getDeletedCount() == 1 && loaded.isMarkedDeleted(42));
+    for (hnswlib::tableint id = 0; id < n; id++) {
+        assert(loaded.element_levels_[id] == index.element_levels_[id]);
+        assert(memcmp(loaded.getDataByInternalId(id), index.getDataByInternalId(id), index.data_size_) == 0);
+        assert(loaded.getExternalLabel(id) == index.getExternalLabel(id));
+        for (int level = 0; level <= index.element_levels_[id]; level++) {
+            assert(sorted_links(loaded, id, level) == sorted_links(index, id, level));
+        }
+    }
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        auto expected = index.searchKnn(query.data() + q * d, k, 0);
+        auto result = loaded.searchKnn(query.data() + q * d, k, 0);
+        std::vector<hnswlib::labeltype> labels;
+        while (!expected.empty()) {
+            labels.push_back(expected.top().second);
+            expected.pop();
+        }
+        while (!result.empty()) {
+            hits += std::count(labels.begin(), labels.end(), result.top().second);
+            result.pop();
+        }
+    }
+    assert(hits > nq * k * 0.98);
+
+    // packed links are not mapped, and a corrupted chunk is found
+    bool thrown = false;
+    try {
+        Index mapped(&space);
+        mapped.loadIndexMapped(packed_location, &space);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    {
+        std::vector<hnswlib::IndexFileSection> sections;
+        std::ifstream input(packed_location, std::ios::binary);
+        hnswlib::readIndexSections(input, sections);
+        const hnswlib::IndexFileSection &packed = hnswlib::requireIndexSection(sections, hnswlib::INDEX_SECTION_LINKS_PACKED);
+        std::fstream file(packed_location, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(packed.offset + packed.size / 2);
+        file.put(0x7f);
+    }
+    thrown = false;
+    try {
+        Index corrupted(&space, packed_location);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    remove(location.c_str());
+    remove(packed_location.c_str());
+}
+
+// An exception of a part thrown by one of the writing threads comes out of write
+void test_failing_part() {
+    std::string location = "parallel_save_failing.bin";
+    std::vector<char> bytes(4 * hnswlib::INDEX_CHECKSUM_BLOCK, 1);
+    hnswlib::ParallelFileWriter writer(location);
+    writer.addBuffer(0, bytes.data(), bytes.size());
+    writer.addPart(bytes.size(), 4 * hnswlib::INDEX_CHECKSUM_BLOCK, [](size_t offset, size_t, char *) {
+        if (offset == 2 * hnswlib::INDEX_CHECKSUM_BLOCK)
+            throw std::runtime_error("Cannot read the part");
+    });
+    bool thrown = false;
+    try {
+        writer.write(bytes.size() + 4 * hnswlib::INDEX_CHECKSUM_BLOCK);
+    } catch (const std::runtime_error &e) {
+        thrown = std::string(e.what()) == "Cannot read the part";
+    }
+    assert(thrown);
+    remove(location.c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    test_failing_part();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
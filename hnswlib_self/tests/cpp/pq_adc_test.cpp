@@ -0,0 +1,121 @@
+// This is a test file for testing the PQ distances of PqSpace:
+// the distance from the prepared query table to a code must match the distance
+// from the query to the reconstructed vector, the symmetric distance the one between
+// the reconstructed vectors, also with several spaces alive and after a save/load of the codebooks
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <vector>
+#include <sstream>
+#include <iostream>
+
+namespace {
+
+float reconstructed_l2(const std::vector<std::vector<float>>& codebooks, const float *x,
+                       const uint8_t *code, size_t M, size_t dsub) {
+    float res = 0;
+    for (size_t i = 0; i < M; i++) {
+        const float *centroid = codebooks[i].data() + code[i] * dsub;
+        for (size_t j = 0; j < dsub; j++) {
+            float t = x[i * dsub + j] - centroid[j];
+            res += t * t;
+        }
+    }
+    return res;
+}
+
+void test(size_t M, size_t dim) {
+    size_t dsub = dim / M;
+    size_t ksub = 256;
+    size_t n = 100;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::uniform_int_distribution<> distrib_code(0, ksub - 1);
+
+    std::vector<std::vector<float>> codebooks(M, std::vector<float>(ksub * dsub));
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < ksub * dsub; j++) {
+            codebooks[i][j] = distrib(rng);
+        }
+    }
+    std::vector<float> query(dim);
+    for (size_t i = 0; i < dim; i++) {
+        query[i] = distrib(rng);
+    }
+
+    hnswlib::PqSpace space(M, dim);
+    space.setCodebooks(codebooks);
+    space.computeSdcTable();
+
+    // another space with other codebooks must not interfere
+    hnswlib::PqSpace other_space(M, dim);
+    std::vector<std::vector<float>> other_codebooks(M, std::vector<float>(ksub * dsub, 1.0f));
+    other_space.setCodebooks(other_codebooks);
+
+    assert(space.get_data_size() == M);
+    assert(space.get_query_input_size() == dim * sizeof(float));
+    std::vector<char> table(space.get_query_data_size());
+    space.prepare_query(query.data(), table.data());
+
+    hnswlib::DISTFUNC<float> distfunc = space.get_dist_func();
+    std::vector<uint8_t> code(M), code2(M);
+    std::vector<float> decoded(dim);
+    for (size_t k = 0; k < n; k++) {
+        for (size_t i = 0; i < M; i++) {
+            code[i] = (uint8_t) distrib_code(rng);
+            code2[i] = (uint8_t) distrib_code(rng);
+        }
+        float expected = reconstructed_l2(codebooks, query.data(), code.data(), M, dsub);
+        float scalar = hnswlib::adc_pq_distance(table.data(), code.data(), space.get_dist_func_param(), 1.0f);
+        float dist = distfunc(table.data(), code.data(), space.get_dist_func_param(), 1.0f);
+        assert(fabs(scalar - expected) <= 1e-4 * expected);
+        assert(fabs(dist - expected) <= 1e-4 * expected);
+#if defined(USE_SIMD_DISPATCH)
+        if (AVX2Capable()) {
+            float avx2 = hnswlib::adc_pq_distance_avx2(table.data(), code.data(), space.get_dist_func_param(), 1.0f);
+            assert(fabs(avx2 - expected) <= 1e-4 * expected);
+        }
+        if (AVX512Capable()) {
+            float avx512 = hnswlib::adc_pq_distance_avx512(table.data(), code.data(), space.get_dist_func_param(), 1.0f);
+            assert(fabs(avx512 - expected) <= 1e-4 * expected);
+        }
+#endif
+
+        for (size_t i = 0; i < M; i++) {
+            memcpy(decoded.data() + i * dsub, codebooks[i].data() + code2[i] * dsub, dsub * sizeof(float));
+        }
+        float expected_sdc = reconstructed_l2(codebooks, decoded.data(), code.data(), M, dsub);
+        float sdc = space.get_sdc_dist_func()(code.data(), code2.data(), space.get_dist_func_param(), 1.0f);
+        assert(fabs(sdc - expected_sdc) <= 1e-4 * expected_sdc);
+        float code_dist = space.get_code_dist_func()(code.data(), code2.data(), space.get_code_dist_func_param(), 1.0f);
+        assert(code_dist == sdc);
+    }
+
+    // codebooks saved with one space and loaded into a new one give the same tables
+    std::stringstream stream;
+    space.saveCodebooks(stream);
+    hnswlib::PqSpace loaded_space(M, dim);
+    loaded_space.loadCodebooks(stream);
+    std::vector<char> loaded_table(loaded_space.get_query_data_size());
+    loaded_space.prepare_query(query.data(), loaded_table.data());
+    assert(loaded_table == table);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test(8, 128);
+    test(16, 128);
+    test(32, 128);
+    test(12, 96);
+    test(4, 8);
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+// This is a test file for testing the built-in PQ/OPQ training
+//  >>> float trainPq(PqSpace *pq_space, size_t sample_size, size_t niter, bool opq, unsigned int seed);
+// of class HierarchicalNSW: the index is encoded in place and searched with the PQ distance, codes
+// added afterwards are linked as well as the trained elements
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+// Gaussian data with very different variances per dimension, mixed by a random rotation
+std::vector<float> make_data(size_t n, size_t d, std::mt19937 &rng, const std::vector<float> &rotation) {
+    std::normal_distribution<float> distrib;
+    std::vector<float> x(d), data(n * d);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < d; j++) {
+            x[j] = distrib(rng) * (j < d / 4 ? 4.0f : 0.5f);
+        }
+        hnswlib::RotateRow(x.data(), rotation.data(), d, data.data() + i * d);
+    }
+    return data;
+}
+
+float recall(hnswlib::HierarchicalNSW<float> &alg_hnsw, const std::vector<float> &data, const std::vector<float> &query,
+             size_t n, size_t nq, size_t d, size_t k) {
+    size_t hits = 0;
+    std::vector<float> distances(nq * k);
+    std::vector<idx_t> labels(nq * k);
+    alg_hnsw.searchKnnBatch(query.data(), nq, k, distances.data(), labels.data());
+    for (size_t q = 0; q < nq; q++) {
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2SqrRow(query.data() + q * d, data.data() + i * d, d), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+
+        auto result = alg_hnsw.searchKnn(query.data() + q * d, k, 0);
+        assert(result.size() == k);
+        for (size_t i = k; i > 0; i--) {
+            assert(labels[q * k + i - 1] == result.top().second);
+            hits += gt_labels.count(result.top().second);
+            result.pop();
+        }
+    }
+    return (float) hits / (nq * k);
+}
+
+float train(const std::vector<float> &data, const std::vector<float> &query, size_t n, size_t nq, size_t d,
+            bool opq, float &rec) {
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    alg_hnsw.setEf(100);
+
+    hnswlib::PqSpace pq_space(8, d);
+    float err = alg_hnsw.trainPq(&pq_space, 3000, 15, opq);
+    assert(alg_hnsw.data_size_ == 8);
+    assert(pq_space.hasRotation() == opq);
+    rec = recall(alg_hnsw, data, query, n, nq, d, 10);
+    return err;
+}
+
+void test() {
+    size_t d = 32;
+    size_t n = 4000;
+    size_t nq = 50;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::vector<float> identity(d * d, 0.0f);
+    for (size_t i = 0; i < d; i++) identity[i * d + i] = 1.0f;
+    // a random orthogonal matrix from the SVD of a random one
+    std::vector<float> random_matrix(d * d);
+    std::normal_distribution<float> distrib;
+    for (size_t i = 0; i < d * d; i++) random_matrix[i] = distrib(rng);
+    std::vector<float> rotation;
+    hnswlib::ProcrustesRotation(random_matrix.data(), identity.data(), d, d, rotation);
+    for (size_t i = 0; i < d; i++) {
+        for (size_t j = 0; j < d; j++) {
+            float dot = 0;
+            for (size_t l = 0; l < d; l++) dot += rotation[i * d + l] * rotation[j * d + l];
+            assert(fabs(dot - (i == j ? 1.0f : 0.0f)) < 1e-4);
+        }
+    }
+
+    std::vector<float> data = make_data(n, d, rng, rotation);
+    std::vector<float> query = make_data(nq, d, rng, rotation);
+
+    float pq_recall, opq_recall;
+    float pq_err = train(data, query, n, nq, d, false, pq_recall);
+    float opq_err = train(data, query, n, nq, d, true, opq_recall);
+    std::cout << "PQ distortion " << pq_err << " recall " << pq_recall << std::endl;
+    std::cout << "OPQ distortion " << opq_err << " recall " << opq_recall << std::endl;
+
+    // total variance of the data is 8 * 16 + 24 * 0.25 = 134
+    assert(pq_err > 0 && pq_err < 134 * 0.5);
+    assert(opq_err < pq_err);
+    assert(pq_recall > 0.5);
+    assert(opq_recall > 0.5);
+
+    // half of the elements added as codes after the training, linked by the distances between codes
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n / 2; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    alg_hnsw.setEf(100);
+    hnswlib::PqSpace pq_space(8, d);
+    alg_hnsw.trainPq(&pq_space, 3000, 15, true);
+    std::vector<uint8_t> code(pq_space.getM());
+    for (size_t i = n / 2; i < n; ++i) {
+        pq_space.encode(data.data() + d * i, code.data());
+        alg_hnsw.addPoint(code.data(), i);
+    }
+    float added_recall = recall(alg_hnsw, data, query, n, nq, d, 10);
+    std::cout << "OPQ recall with added codes " << added_recall << std::endl;
+    assert(added_recall > opq_recall - 0.1);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
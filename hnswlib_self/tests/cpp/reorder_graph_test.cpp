@@ -0,0 +1,131 @@
+// This is a test file for testing the graph reordering
+//  >>> void reorderGraph(int strategy);
+//  >>> void permuteElements(const std::vector<tableint> &order);
+// of class HierarchicalNSW: every order brings linked elements closer in memory, the index
+// searches as before, and labels, deletions, levels and rerank vectors follow the elements
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+// Share of the level 0 links to elements at most 64 ids away, e.g. on the same pages
+double near_link_share(const Index &index) {
+    size_t near = 0;
+    size_t count = 0;
+    for (hnswlib::tableint id = 0; id < index.cur_element_count; id++) {
+        hnswlib::linklistsizeint *ll = index.get_linklist0(id);
+        hnswlib::tableint *links = (hnswlib::tableint *) (ll + 1);
+        for (size_t j = 0; j < index.getListCount(ll); j++) {
+            near += links[j] + 64 >= id && links[j] <= id + 64;
+            count++;
+        }
+    }
+    return (double) near / count;
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 5000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index index(&space, n + 1, 16, 200, 100, true);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, (i * 7919) % n);
+    }
+    index.markDelete(11);
+    index.markDelete(4242);
+    index.setEf(50);
+    std::string location = "reorder_graph_index.bin";
+    index.saveIndex(location);
+    double share = near_link_share(index);
+
+    for (int strategy : {hnswlib::GRAPH_ORDER_BFS, hnswlib::GRAPH_ORDER_RCM, hnswlib::GRAPH_ORDER_GORDER}) {
+        Index reordered(&space, location, false, n + 1, true);
+        reordered.setEf(50);
+        reordered.keepRerankVectors(&space);
+        reordered.reorderGraph(strategy);
+        double reordered_share = near_link_share(reordered);
+        std::cout << "strategy " << strategy << ": near links " << share << " -> " << reordered_share << std::endl;
+        assert(reordered_share > (strategy == hnswlib::GRAPH_ORDER_GORDER ? 4 : 1.5) * share);
+
+        check_same_results(index, reordered, query, nq, d, k);
+        assert(reordered.getDeletedCount() == 2);
+        assert(reordered.isMarkedDeleted(reordered.label_lookup_.at(11)));
+        assert(reordered.deleted_elements.size() == 2);
+        for (hnswlib::tableint id : reordered.deleted_elements) {
+            assert(reordered.isMarkedDeleted(id));
+        }
+        for (const auto &entry : index.label_lookup_) {
+            hnswlib::tableint id = reordered.label_lookup_.at(entry.first);
+            assert(reordered.getExternalLabel(id) == entry.first);
+            assert(reordered.element_levels_[id] == index.element_levels_[entry.second]);
+            assert(memcmp(reordered.getDataByInternalId(id), index.getDataByInternalId(entry.second), index.data_size_) == 0);
+            assert(memcmp(reordered.rerank_vectors_->get(id), index.getDataByInternalId(entry.second), index.data_size_) == 0);
+        }
+        assert(reordered.getExternalLabel(reordered.enterpoint_node_) == index.getExternalLabel(index.enterpoint_node_));
+
+        // the order is saved, and the reordered index still grows
+        std::string reordered_location = "reorder_graph_reordered.bin";
+        reordered.saveIndex(reordered_location);
+        Index loaded(&space, reordered_location, false, n + 1, true);
+        loaded.setEf(50);
+        assert(loaded.label_lookup_ == reordered.label_lookup_);
+        check_same_results(index, loaded, query, nq, d, k);
+        loaded.addPoint(query.data(), n);
+        loaded.addPoint(query.data() + d, 12, true);
+        assert(loaded.searchKnn(query.data(), 1, 0).top().second == n);
+        assert(loaded.searchKnn(query.data() + d, 1, 0).top().second == 12);
+        remove(reordered_location.c_str());
+    }
+
+    // a mapped index is copied first
+    {
+        Index mapped(&space);
+        mapped.loadIndexMapped(location, &space);
+        mapped.setEf(50);
+        mapped.reorderGraph();
+        assert(mapped.mapped_index_ == nullptr);
+        check_same_results(index, mapped, query, nq, d, k);
+    }
+
+    std::vector<hnswlib::tableint> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    order[1] = 0;
+    bool thrown = false;
+    try {
+        index.permuteElements(order);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    remove(location.c_str());
+    remove((location + ".lookup").c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+// This is a test file for testing the two stage search of a quantized index
+//  >>> void keepRerankVectors(SpaceInterface<dist_t> *exact_space, const std::string &location);
+//  >>> searchKnnRerank(const void *query_data, size_t k, size_t rerank_factor, ...) const;
+// of class HierarchicalNSW: the re-ranked results carry exact distances and beat the PQ recall, also for
+// elements added, updated or merged after the vectors were kept
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+float recall(std::priority_queue<std::pair<float, idx_t>> result, const std::unordered_set<idx_t> &gt) {
+    size_t hits = 0;
+    size_t k = gt.size();
+    while (!result.empty()) {
+        hits += gt.count(result.top().second);
+        result.pop();
+    }
+    return (float) hits / k;
+}
+
+void test() {
+    size_t d = 32;
+    size_t n = 3000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    hnswlib::DISTFUNC<float> exact_dist = space.get_dist_func();
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    alg_hnsw.setEf(100);
+
+    std::string location = "rerank_vectors.bin";
+    alg_hnsw.keepRerankVectors(&space, location);
+    hnswlib::PqSpace pq_space(8, d);
+    alg_hnsw.trainPq(&pq_space, n, 10);
+
+    float pq_recall = 0, rerank_recall = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2Sqr(qv, data.data() + i * d, &d, 1.0f), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+
+        auto result = alg_hnsw.searchKnnRerank(qv, k, 4);
+        assert(result.size() == k);
+        auto exact = result;
+        while (!exact.empty()) {
+            idx_t label = exact.top().second;
+            assert(exact.top().first == exact_dist(qv, data.data() + label * d, space.get_dist_func_param(), 1.0f));
+            exact.pop();
+        }
+        pq_recall += recall(alg_hnsw.searchKnn(qv, k, 0), gt_labels);
+        rerank_recall += recall(result, gt_labels);
+    }
+    pq_recall /= nq;
+    rerank_recall /= nq;
+    std::cout << "PQ recall " << pq_recall << " re-ranked recall " << rerank_recall << std::endl;
+    assert(rerank_recall > pq_recall);
+    assert(rerank_recall > 0.9);
+
+    // the mapped file can be opened again
+    auto before = alg_hnsw.searchKnnRerank(query.data(), k, 4);
+    alg_hnsw.loadRerankVectors(&space, location);
+    auto after = alg_hnsw.searchKnnRerank(query.data(), k, 4);
+    assert(before.size() == after.size());
+    while (!before.empty()) {
+        assert(before.top() == after.top());
+        before.pop();
+        after.pop();
+    }
+    remove(location.c_str());
+}
+
+// Every re-ranked distance is the exact one to the vector the label holds now
+void check_exact(const hnswlib::HierarchicalNSW<float> &alg_hnsw, hnswlib::L2Space &space,
+                 const std::vector<float> &vectors, const std::vector<float> &query, size_t nq, size_t d, size_t k) {
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        auto result = alg_hnsw.searchKnnRerank(qv, k, 4);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            idx_t label = result.top().second;
+            assert(result.top().first == space.get_dist_func()(qv, vectors.data() + label * d, space.get_dist_func_param(), 1.0f));
+            result.pop();
+        }
+    }
+}
+
+// Elements added after keepRerankVectors get their exact vectors, in a store that grows with the index
+void test_add_points(const std::string &location) {
+    size_t d = 32;
+    size_t n = 2000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n / 2);
+    for (size_t i = 0; i < n / 2; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    alg_hnsw.setEf(100);
+    alg_hnsw.keepRerankVectors(&space, location);
+    hnswlib::PqSpace pq_space(8, d);
+    alg_hnsw.trainPq(&pq_space, n / 2, 10);
+
+    // codes alone lack the exact vector
+    std::vector<uint8_t> code(pq_space.getM());
+    pq_space.encode(data.data() + d * (n / 2), code.data());
+    assert(throws([&] { alg_hnsw.addPoint(code.data(), n / 2); }));
+    assert(alg_hnsw.cur_element_count == n / 2);
+
+    alg_hnsw.resizeIndex(n);
+    for (size_t i = n / 2; i < n; ++i) {
+        pq_space.encode(data.data() + d * i, code.data());
+        alg_hnsw.addPoint(code.data(), i, data.data() + d * i);
+    }
+    // an update replaces the exact vector too
+    std::vector<float> vectors(data);
+    std::copy(query.begin(), query.begin() + d, vectors.begin() + 7 * d);
+    pq_space.encode(vectors.data() + 7 * d, code.data());
+    alg_hnsw.addPoint(code.data(), 7, vectors.data() + 7 * d);
+    check_exact(alg_hnsw, space, vectors, query, nq, d, k);
+    assert(alg_hnsw.searchKnnRerank(query.data(), 1, 4).top().second == 7);
+
+    if (!location.empty()) {
+        // a file mapped again is read-only until resizeIndex copies it into memory
+        alg_hnsw.loadRerankVectors(&space, location);
+        assert(throws([&] { alg_hnsw.addPoint(code.data(), 7, vectors.data() + 7 * d); }));
+        alg_hnsw.resizeIndex(n + 1);
+        pq_space.encode(data.data(), code.data());
+        alg_hnsw.addPoint(code.data(), n, data.data());
+        vectors.insert(vectors.end(), data.begin(), data.begin() + d);
+        check_exact(alg_hnsw, space, vectors, query, nq, d, k);
+        remove(location.c_str());
+    }
+}
+
+// A merged delta brings its elements, which are the exact vectors while the index is not quantized
+void test_merge_delta() {
+    size_t d = 16;
+    size_t n = 2000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> base(&space, n / 2);
+    hnswlib::HierarchicalNSW<float> delta(&space, n / 2);
+    for (size_t i = 0; i < n / 2; ++i) {
+        base.addPoint(data.data() + d * i, i);
+        delta.addPoint(data.data() + d * (n / 2 + i), n / 2 + i);
+    }
+    base.keepRerankVectors(&space);
+    assert(base.mergeDelta(delta) == n / 2);
+    check_exact(base, space, data, query, nq, d, k);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    test_add_points("");
+    test_add_points("rerank_added_vectors.bin");
+    test_merge_delta();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
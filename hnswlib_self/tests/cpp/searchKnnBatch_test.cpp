@@ -0,0 +1,125 @@
+// This is a test file for testing the batched search
+//  >>> bool searchKnnBatch(const void *queries, size_t nq, size_t k,
+//  >>>                     dist_t *distances, labeltype *labels, BaseFilterFunctor* isIdAllowed) const;
+// of class HierarchicalNSW, the results must match searchKnn query by query
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+class PickDivisibleIds: public hnswlib::BaseFilterFunctor {
+unsigned int divisor = 1;
+ public:
+    PickDivisibleIds(unsigned int divisor): divisor(divisor) {
+        assert(divisor != 0);
+    }
+    bool operator()(idx_t label_id) {
+        return label_id % divisor == 0;
+    }
+};
+
+// Throws on the calls-th call, as a filter that fails part way through a search
+class ThrowingFilter: public hnswlib::BaseFilterFunctor {
+size_t calls;
+ public:
+    ThrowingFilter(size_t calls): calls(calls) {}
+    bool operator()(idx_t label_id) {
+        if (--calls == 0) throw std::runtime_error("filter failed");
+        return true;
+    }
+};
+
+void check_batch(hnswlib::HierarchicalNSW<float>& alg_hnsw, const std::vector<float>& query,
+                 int d, size_t nq, size_t k, hnswlib::BaseFilterFunctor* filter) {
+    std::vector<float> distances(nq * k);
+    std::vector<idx_t> labels(nq * k);
+    alg_hnsw.searchKnnBatch(query.data(), nq, k, distances.data(), labels.data(), filter);
+
+    for (size_t j = 0; j < nq; ++j) {
+        auto gd = alg_hnsw.searchKnn(query.data() + j * d, k, 0, filter);
+        size_t t = gd.size();
+        for (size_t i = t; i < k; i++) {
+            assert(labels[j * k + i] == (idx_t) -1);
+        }
+        while (!gd.empty()) {
+            t--;
+            assert(gd.top().second == labels[j * k + t]);
+            assert(gd.top().first == distances[j * k + t]);
+            gd.pop();
+        }
+    }
+}
+
+void test() {
+    int d = 16;
+    idx_t n = 3000;
+    idx_t nq = 200;
+    size_t k = 10;
+
+    std::vector<float> data(n * d);
+    std::vector<float> query(nq * d);
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+
+    for (idx_t i = 0; i < n * d; ++i) {
+        data[i] = distrib(rng);
+    }
+    for (idx_t i = 0; i < nq * d; ++i) {
+        query[i] = distrib(rng);
+    }
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    alg_hnsw.setEf(40);
+
+    check_batch(alg_hnsw, query, d, nq, k, nullptr);
+
+    PickDivisibleIds pickIdsDivisibleByThree(3);
+    check_batch(alg_hnsw, query, d, nq, k, &pickIdsDivisibleByThree);
+
+    for (size_t i = 0; i < n; i += 5) {
+        alg_hnsw.markDelete(i);
+    }
+    check_batch(alg_hnsw, query, d, nq, k, nullptr);
+    check_batch(alg_hnsw, query, d, 1, k, nullptr);
+
+    // the exception of a filter reaches the caller and the visited lists go back to the pool
+    for (bool thread_local_lists : {false, true}) {
+        alg_hnsw.setThreadLocalVisitedLists(thread_local_lists);
+        for (int repeat = 0; repeat < 3; repeat++) {
+            ThrowingFilter throwing_filter(500);
+            std::vector<float> distances(nq * k);
+            std::vector<idx_t> labels(nq * k);
+            bool thrown = false;
+            try {
+                alg_hnsw.searchKnnBatch(query.data(), nq, k, distances.data(), labels.data(), &throwing_filter);
+            } catch (const std::runtime_error &) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+        check_batch(alg_hnsw, query, d, nq, k, &pickIdsDivisibleByThree);
+    }
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,213 @@
+// This is a test file for testing the sharded index
+//  >>> class ShardedHNSW<dist_t>
+// routing of the labels, the global top k over the shards with and without early termination,
+// deletions, filters and saving and loading
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+// L2 space counting the distance computations
+std::atomic<size_t> num_distances(0);
+
+float CountedL2Sqr(const void *a, const void *b, const void *param, float scale) {
+    num_distances++;
+    return hnswlib::L2Sqr(a, b, param, scale);
+}
+
+class CountedL2Space : public hnswlib::L2Space {
+ public:
+    explicit CountedL2Space(size_t dim) : hnswlib::L2Space(dim) {}
+
+    hnswlib::DISTFUNC<float> get_dist_func() override {
+        return CountedL2Sqr;
+    }
+};
+
+class PickOddLabels : public hnswlib::BaseFilterFunctor {
+ public:
+    bool operator()(idx_t label) override {
+        return label % 2 == 1;
+    }
+};
+
+float recall(const hnswlib::ShardedHNSW<float> &index, const std::vector<float> &data, const std::vector<float> &query,
+             size_t n, size_t nq, size_t d, size_t k) {
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2Sqr(qv, data.data() + i * d, &d, 1.0f), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+        auto result = index.searchKnn(qv, k, 0);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            hits += gt_labels.count(result.top().second);
+            result.pop();
+        }
+    }
+    return (float) hits / (nq * k);
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 4000;
+    size_t nq = 100;
+    size_t k = 10;
+    size_t num_shards = 4;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    // the hash spreads consecutive labels evenly
+    CountedL2Space space(d);
+    hnswlib::ShardedHNSW<float> index(&space, num_shards, n / 2);
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    assert(index.getCurrentElementCount() == n);
+    assert(index.getMaxElements() == num_shards * n / 2);
+    for (size_t s = 0; s < num_shards; s++) {
+        size_t count = index.getShard(s).cur_element_count;
+        assert(count > n / num_shards * 0.8 && count < n / num_shards * 1.2);
+        for (auto &it : index.getShard(s).label_lookup_) {
+            assert(index.getShardOf(it.first) == s);
+        }
+    }
+    assert(index.getDataByLabel<float>(17)[3] == data[17 * d + 3]);
+
+    // the result is the top k of the results of the shards
+    index.setEf(50);
+    for (size_t q = 0; q < nq; q++) {
+        const float *qv = query.data() + q * d;
+        std::priority_queue<std::pair<float, idx_t>> expected;
+        for (size_t s = 0; s < num_shards; s++) {
+            auto shard_result = index.getShard(s).searchKnn(qv, k, 0);
+            while (!shard_result.empty()) {
+                expected.push(shard_result.top());
+                if (expected.size() > k) expected.pop();
+                shard_result.pop();
+            }
+        }
+        auto result = index.searchKnn(qv, k, 0);
+        assert(result.size() == expected.size());
+        while (!result.empty()) {
+            assert(result.top() == expected.top());
+            result.pop();
+            expected.pop();
+        }
+    }
+
+    num_distances = 0;
+    float full_recall = recall(index, data, query, n, nq, d, k);
+    size_t full_distances = num_distances;
+    index.setEarlyTermination(true);
+    num_distances = 0;
+    float early_recall = recall(index, data, query, n, nq, d, k);
+    size_t early_distances = num_distances;
+    std::cout << "recall: " << full_recall << ", " << full_distances / nq << " distances per query; "
+              << "with early termination: " << early_recall << ", " << early_distances / nq << std::endl;
+    assert(full_recall > 0.95);
+    assert(early_recall > 0.95);
+    assert(early_distances < full_distances);
+
+    // filters and deletions are applied in every shard
+    PickOddLabels pick_odd;
+    for (bool early_termination : {false, true}) {
+        index.setEarlyTermination(early_termination);
+        auto result = index.searchKnn(query.data(), k, 0, &pick_odd);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            assert(result.top().second % 2 == 1);
+            result.pop();
+        }
+    }
+    index.setEarlyTermination(false);
+    index.markDelete(42);
+    assert(index.getDeletedCount() == 1);
+    auto result = index.searchKnn(data.data() + 42 * d, 1, 0);
+    assert(result.top().second != 42);
+    index.unmarkDelete(42);
+    result = index.searchKnn(data.data() + 42 * d, 1, 0);
+    assert(result.top().second == 42);
+
+    std::string location = "sharded_index.bin";
+    index.saveIndex(location);
+    hnswlib::ShardedHNSW<float> loaded(&space, location);
+    assert(loaded.numShards() == num_shards);
+    assert(loaded.getCurrentElementCount() == n);
+    loaded.setEf(50);
+    for (size_t q = 0; q < nq; q++) {
+        auto expected = index.searchKnn(query.data() + q * d, k, 0);
+        auto got = loaded.searchKnn(query.data() + q * d, k, 0);
+        assert(got.size() == expected.size());
+        while (!got.empty()) {
+            assert(got.top() == expected.top());
+            got.pop();
+            expected.pop();
+        }
+    }
+    remove(location.c_str());
+    for (size_t s = 0; s < num_shards; s++) {
+        remove(hnswlib::ShardedHNSW<float>::shardLocation(location, s).c_str());
+    }
+}
+
+void test_shard_function() {
+    size_t d = 8;
+    size_t n = 300;
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+
+    // labels in ranges of 100
+    hnswlib::L2Space space(d);
+    hnswlib::ShardedHNSW<float> index(&space, 3, 100, 16, 200, 100, false,
+                                      [](idx_t label) { return (size_t) (label / 100); });
+    for (size_t i = 0; i < n; i++) {
+        index.addPoint(data.data() + i * d, i);
+    }
+    for (size_t s = 0; s < 3; s++) {
+        assert(index.getShard(s).cur_element_count == 100);
+        assert(index.getShard(s).label_lookup_.count(s * 100 + 7));
+    }
+    bool thrown = false;
+    try {
+        index.addPoint(data.data(), 300);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    test_shard_function();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+// This is a test file for testing the layouts of level 0
+//  >>> void setLayout(int layout);
+// of class HierarchicalNSW: an index in the split layout searches, saves, loads, grows, reorders and
+// quantizes as the same index in records, its vectors aligned to 64 bytes
+
+#include "../../hnswlib/hnswlib.h"
+#include "test_utils.h"
+
+#include <assert.h>
+
+#include <fstream>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using Index = hnswlib::HierarchicalNSW<float>;
+
+bool vectors_aligned(const Index &index) {
+    for (hnswlib::tableint i = 0; i < index.cur_element_count; i++) {
+        if ((uintptr_t) index.getDataByInternalId(i) % hnswlib::LEVEL0_ALIGNMENT != 0)
+            return false;
+    }
+    return true;
+}
+
+void test() {
+    size_t d = 16;
+    size_t n = 3000;
+    size_t nq = 50;
+    size_t k = 10;
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+    std::vector<float> data(n * d), query(nq * d);
+    for (size_t i = 0; i < n * d; i++) data[i] = distrib(rng);
+    for (size_t i = 0; i < nq * d; i++) query[i] = distrib(rng);
+
+    hnswlib::L2Space space(d);
+    Index records(&space, n / 2, 16, 100);
+    Index split(&space, n / 2, 16, 100);
+    split.setLayout(hnswlib::LAYOUT_SPLIT);
+    assert(split.getLayout() == hnswlib::LAYOUT_SPLIT);
+    for (size_t i = 0; i < n; i++) {
+        if (i == n / 2) {
+            records.resizeIndex(n);
+            split.resizeIndex(n);
+        }
+        records.addPoint(data.data() + i * d, i);
+        split.addPoint(data.data() + i * d, i);
+    }
+    records.markDelete(5);
+    split.markDelete(5);
+    records.setEf(50);
+    split.setEf(50);
+    assert(vectors_aligned(split));
+    for (hnswlib::tableint i = 0; i < n; i++) {
+        assert(split.getExternalLabel(i) == records.getExternalLabel(i));
+        assert(memcmp(split.get_linklist0(i), records.get_linklist0(i), split.size_links_level0_) == 0);
+    }
+    check_same_results(records, split, query, nq, d, k);
+
+    // the files are the same, and load in either layout
+    std::string location = "split_layout_index.bin";
+    std::string split_location = "split_layout_split.bin";
+    for (int version : {1, 2}) {
+        for (bool pack_links : {false, true}) {
+            if (version == 1 && pack_links)
+                continue;
+            records.saveIndex(location, version, pack_links);
+            split.saveIndex(split_location, version, pack_links);
+            assert(read_file(location) == read_file(split_location));
+        }
+    }
+    records.saveIndex(location);
+    Index loaded(&space);
+    loaded.setLayout(hnswlib::LAYOUT_SPLIT);
+    loaded.loadIndex(split_location, &space);
+    loaded.setEf(50);
+    assert(loaded.level0_layout_.type == hnswlib::LAYOUT_SPLIT);
+    assert(vectors_aligned(loaded));
+    check_same_results(records, loaded, query, nq, d, k);
+    loaded.setLayout(hnswlib::LAYOUT_INTERLEAVED);
+    assert(loaded.level0_layout_.type == hnswlib::LAYOUT_INTERLEAVED);
+    check_same_results(records, loaded, query, nq, d, k);
+
+    // a mapped index is copied into the split layout before it changes
+    Index mapped(&space);
+    mapped.setLayout(hnswlib::LAYOUT_SPLIT);
+    mapped.loadIndexMapped(location, &space);
+    mapped.setEf(50);
+    assert(mapped.level0_layout_.type == hnswlib::LAYOUT_INTERLEAVED);
+    check_same_results(records, mapped, query, nq, d, k);
+    mapped.resizeIndex(n + 1);
+    assert(mapped.level0_layout_.type == hnswlib::LAYOUT_SPLIT);
+    check_same_results(records, mapped, query, nq, d, k);
+
+    // reordering and replicas
+    Index reordered(&space, location);
+    reordered.setLayout(hnswlib::LAYOUT_SPLIT);
+    reordered.setEf(50);
+    reordered.reorderGraph(hnswlib::GRAPH_ORDER_BFS);
+    check_same_results(records, reordered, query, nq, d, k);
+    reordered.replicateLevel0();
+    reordered.bindSearchThread();
+    check_same_results(records, reordered, query, nq, d, k);
+    reordered.dropReplicas();
+
+    // quantized: the codes of 16 bytes are 16 apart
+    hnswlib::SqSpace sq_space(d, 8);
+    hnswlib::SqSpace split_sq_space(d, 8);
+    records.trainSq(&sq_space);
+    split.trainSq(&split_sq_space);
+    assert(split.level0_layout_.type == hnswlib::LAYOUT_SPLIT);
+    assert(split.level0_layout_.data_stride == 16);
+    assert(split.getDataByInternalId(1) - split.getDataByInternalId(0) == 16);
+    check_same_results(records, split, query, nq, d, k);
+
+    remove(location.c_str());
+    remove(split_location.c_str());
+    remove((location + ".lookup").c_str());
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
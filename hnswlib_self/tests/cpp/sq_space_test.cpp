@@ -0,0 +1,210 @@
+// This is a test file for testing the trained scalar quantization
+//  >>> float trainSq(SqSpace *sq_space, float clip, bool per_dimension);
+// of class HierarchicalNSW, the stored codes, codes added afterwards, and the 4, 6 and 8 bit kernels of SqSpace
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <vector>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+// Gaussian data where the first dimensions have a much larger variance than the others
+std::vector<float> make_data(size_t n, size_t d, std::mt19937 &rng) {
+    std::normal_distribution<float> distrib;
+    std::vector<float> data(n * d);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < d; j++) {
+            data[i * d + j] = distrib(rng) * (j < 4 ? 20.0f : 1.0f) + (float) j;
+        }
+    }
+    return data;
+}
+
+void test_sketch() {
+    size_t n = 10000;
+    size_t d = 3;
+    std::vector<float> data(n * d);
+    for (size_t i = 0; i < n; i++) {
+        data[i * d] = (float) i;
+        data[i * d + 1] = -(float) i;
+        data[i * d + 2] = 7;
+    }
+    hnswlib::QuantileSketch sketch(d);
+    sketch.build((const char *) data.data(), n, d * sizeof(float));
+    assert(sketch.quantile(0, 0) == 0);
+    assert(sketch.quantile(0, 1) == n - 1);
+    assert(fabs(sketch.quantile(0, 0.5) - n / 2.0) < 20);
+    assert(fabs(sketch.quantile(1, 0.9) + n / 10.0) < 20);
+    assert(sketch.quantile(2, 0.3) == 7);
+
+    sketch.build((const char *) data.data(), n, d * sizeof(float), true, true);
+    assert(sketch.globalQuantile(1) == n - 1);
+    // two thirds of the absolute values are uniform on [0, n), the others are 7
+    assert(fabs(sketch.globalQuantile(2.0 / 3) - n / 2.0) < 20);
+}
+
+void test_kernels(size_t nbits, bool inner_product) {
+    size_t n = 200;
+    std::mt19937 rng;
+    rng.seed(47);
+    for (size_t d : {5, 16, 37, 64, 100}) {
+        std::vector<float> data = make_data(n, d, rng);
+        hnswlib::SqSpace space(d, nbits, inner_product);
+        float err = space.train(data.data(), n);
+        assert(err > 0);
+
+        hnswlib::DISTFUNC<float> dist_func = space.get_dist_func();
+        std::vector<uint8_t> code(space.get_data_size());
+        std::vector<float> decoded(d);
+        std::vector<float> prepared(space.get_query_data_size() / sizeof(float));
+        for (size_t i = 0; i < 20; i++) {
+            const float *query = data.data() + (n - 1 - i) * d;
+            space.prepare_query(query, prepared.data());
+            space.encode(data.data() + i * d, code.data());
+            space.decode(code.data(), decoded.data());
+            float expected = 0;
+            float norm = 0;
+            for (size_t j = 0; j < d; j++) {
+                float v = inner_product ? query[j] * decoded[j] : (query[j] - decoded[j]) * (query[j] - decoded[j]);
+                expected += v;
+                norm += fabs(v);
+            }
+            if (inner_product) expected = 1.0f - expected;
+            float dist = dist_func(prepared.data(), code.data(), space.get_dist_func_param(), 1.0f);
+            assert(fabs(dist - expected) <= 1e-4 * (norm + 1));
+
+            // two codes compare as their reconstructions
+            std::vector<uint8_t> code2(space.get_data_size());
+            std::vector<float> decoded2(d);
+            space.encode(query, code2.data());
+            space.decode(code2.data(), decoded2.data());
+            expected = 0;
+            norm = 0;
+            for (size_t j = 0; j < d; j++) {
+                float v = inner_product ? decoded2[j] * decoded[j] : (decoded2[j] - decoded[j]) * (decoded2[j] - decoded[j]);
+                expected += v;
+                norm += fabs(v);
+            }
+            if (inner_product) expected = 1.0f - expected;
+            dist = space.get_code_dist_func()(code2.data(), code.data(), space.get_code_dist_func_param(), 1.0f);
+            assert(fabs(dist - expected) <= 1e-4 * (norm + 1));
+        }
+    }
+}
+
+float recall(hnswlib::HierarchicalNSW<float> &alg_hnsw, const std::vector<float> &data, const std::vector<float> &query,
+             size_t n, size_t nq, size_t d, size_t k) {
+    size_t hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        std::priority_queue<std::pair<float, idx_t>> gt;
+        for (size_t i = 0; i < n; i++) {
+            gt.emplace(hnswlib::L2SqrRow(query.data() + q * d, data.data() + i * d, d), i);
+            if (gt.size() > k) gt.pop();
+        }
+        std::unordered_set<idx_t> gt_labels;
+        while (!gt.empty()) {
+            gt_labels.insert(gt.top().second);
+            gt.pop();
+        }
+
+        auto result = alg_hnsw.searchKnn(query.data() + q * d, k, 0);
+        assert(result.size() == k);
+        while (!result.empty()) {
+            hits += gt_labels.count(result.top().second);
+            result.pop();
+        }
+    }
+    return (float) hits / (nq * k);
+}
+
+float train(const std::vector<float> &data, const std::vector<float> &query, size_t n, size_t nq, size_t d,
+            size_t nbits, bool per_dimension, float &rec) {
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; i++) {
+        alg_hnsw.addPoint(data.data() + i * d, i);
+    }
+    alg_hnsw.setEf(100);
+
+    hnswlib::SqSpace sq_space(d, nbits);
+    float err = alg_hnsw.trainSq(&sq_space, 0.0f, per_dimension);
+
+    // the stored code comes back whole and nothing past it, there are no float vectors left
+    std::vector<uint8_t> code(sq_space.get_data_size());
+    sq_space.encode(data.data() + 7 * d, code.data());
+    assert(alg_hnsw.getDataByLabel<uint8_t>(7) == code);
+    bool thrown = false;
+    try {
+        alg_hnsw.getDataByLabelFloat(7);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    rec = recall(alg_hnsw, data, query, n, nq, d, 10);
+    std::cout << nbits << " bit " << (per_dimension ? "per dimension" : "uniform")
+              << ": error " << err << ", recall " << rec << std::endl;
+    return err;
+}
+
+void test_index() {
+    size_t d = 32;
+    size_t n = 3000;
+    size_t nq = 50;
+    std::mt19937 rng;
+    rng.seed(47);
+    std::vector<float> data = make_data(n, d, rng);
+    std::vector<float> query = make_data(nq, d, rng);
+
+    // one range for all dimensions wastes most levels of the low variance dimensions
+    float uniform_recall, recall4, recall6, recall8;
+    float uniform_err = train(data, query, n, nq, d, 6, false, uniform_recall);
+    float err4 = train(data, query, n, nq, d, 4, true, recall4);
+    float err6 = train(data, query, n, nq, d, 6, true, recall6);
+    float err8 = train(data, query, n, nq, d, 8, true, recall8);
+    assert(err6 < uniform_err / 4);
+    assert(recall6 >= uniform_recall);
+    assert(err8 < err6 && err6 < err4);
+    assert(recall8 >= recall4);
+    assert(recall8 > 0.9);
+
+    // half of the elements added as codes after the training, linked by the distances between codes
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n / 2; i++) {
+        alg_hnsw.addPoint(data.data() + i * d, i);
+    }
+    alg_hnsw.setEf(100);
+    hnswlib::SqSpace sq_space(d, 8);
+    alg_hnsw.trainSq(&sq_space);
+    std::vector<uint8_t> code(sq_space.get_data_size());
+    for (size_t i = n / 2; i < n; i++) {
+        sq_space.encode(data.data() + i * d, code.data());
+        alg_hnsw.addPoint(code.data(), i);
+    }
+    float added_recall = recall(alg_hnsw, data, query, n, nq, d, 10);
+    std::cout << "8 bit recall with added codes " << added_recall << std::endl;
+    assert(added_recall > 0.9);
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test_sketch();
+    for (size_t nbits : {4, 6, 8}) {
+        test_kernels(nbits, false);
+        test_kernels(nbits, true);
+    }
+    test_index();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
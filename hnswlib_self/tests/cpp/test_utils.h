@@ -0,0 +1,58 @@
+#pragma once
+// Helpers shared by the tests
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+inline bool exists(const std::string &location) {
+    std::ifstream input(location);
+    return input.good();
+}
+
+inline std::vector<char> read_file(const std::string &location) {
+    std::ifstream input(location, std::ios::binary);
+    return std::vector<char>((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+}
+
+// true if function throws a std::runtime_error
+template<typename Function>
+bool throws(Function function) {
+    try {
+        function();
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+// Both indexes find the same neighbours at the same distances for the nq queries
+inline void check_same_results(const hnswlib::HierarchicalNSW<float> &a, const hnswlib::HierarchicalNSW<float> &b,
+                               const std::vector<float> &query, size_t nq, size_t d, size_t k) {
+    for (size_t q = 0; q < nq; q++) {
+        auto result_a = a.searchKnn(query.data() + q * d, k, 0);
+        auto result_b = b.searchKnn(query.data() + q * d, k, 0);
+        assert(result_a.size() == result_b.size());
+        while (!result_a.empty()) {
+            assert(result_a.top() == result_b.top());
+            result_a.pop();
+            result_b.pop();
+        }
+    }
+}
+
+// The same with searchKnnBatch
+inline void check_same_batch_results(const hnswlib::HierarchicalNSW<float> &a, const hnswlib::HierarchicalNSW<float> &b,
+                                     const std::vector<float> &query, size_t nq, size_t k) {
+    std::vector<float> distances_a(nq * k), distances_b(nq * k);
+    std::vector<hnswlib::labeltype> labels_a(nq * k), labels_b(nq * k);
+    a.searchKnnBatch(query.data(), nq, k, distances_a.data(), labels_a.data());
+    b.searchKnnBatch(query.data(), nq, k, distances_b.data(), labels_b.data());
+    assert(distances_a == distances_b);
+    assert(labels_a == labels_b);
+}
@@ -0,0 +1,103 @@
+// This is a test file for testing the thread-local visited lists
+//  >>> void setThreadLocalVisitedLists(bool thread_local_visited_lists);
+// of class HierarchicalNSW, searches from many (short lived) threads and from several indexes
+// must return the same results as with the shared pool
+
+#include "../../hnswlib/hnswlib.h"
+
+#include <assert.h>
+
+#include <thread>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+using idx_t = hnswlib::labeltype;
+
+std::vector<idx_t> search_all(hnswlib::HierarchicalNSW<float>& alg_hnsw, const std::vector<float>& query,
+                              int d, size_t nq, size_t k, int num_threads) {
+    std::vector<idx_t> labels(nq * k, (idx_t) -1);
+    std::vector<std::thread> threads;
+    for (int thread_id = 0; thread_id < num_threads; thread_id++) {
+        threads.push_back(std::thread([&, thread_id] {
+            for (size_t j = thread_id; j < nq; j += num_threads) {
+                auto result = alg_hnsw.searchKnn(query.data() + j * d, k, 0);
+                for (size_t i = result.size(); i > 0; i--) {
+                    labels[j * k + i - 1] = result.top().second;
+                    result.pop();
+                }
+            }
+        }));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return labels;
+}
+
+void test() {
+    int d = 16;
+    idx_t n = 2000;
+    idx_t nq = 400;
+    size_t k = 10;
+
+    std::vector<float> data(n * d);
+    std::vector<float> query(nq * d);
+
+    std::mt19937 rng;
+    rng.seed(47);
+    std::uniform_real_distribution<> distrib;
+
+    for (idx_t i = 0; i < n * d; ++i) {
+        data[i] = distrib(rng);
+    }
+    for (idx_t i = 0; i < nq * d; ++i) {
+        query[i] = distrib(rng);
+    }
+
+    hnswlib::L2Space space(d);
+    hnswlib::HierarchicalNSW<float> alg_hnsw(&space, n);
+    for (size_t i = 0; i < n; ++i) {
+        alg_hnsw.addPoint(data.data() + d * i, i);
+    }
+    std::vector<idx_t> expected = search_all(alg_hnsw, query, d, nq, k, 1);
+
+    alg_hnsw.setThreadLocalVisitedLists(true);
+    for (int round = 0; round < 3; round++) {
+        assert(search_all(alg_hnsw, query, d, nq, k, 8) == expected);
+    }
+
+    // a second index used by the same threads, then destroyed while the threads live on
+    {
+        hnswlib::HierarchicalNSW<float> other_hnsw(&space, n / 2);
+        for (size_t i = 0; i < n / 2; ++i) {
+            other_hnsw.addPoint(data.data() + d * i, i);
+        }
+        other_hnsw.setThreadLocalVisitedLists(true);
+        auto other_result = other_hnsw.searchKnn(query.data(), k, 0);
+        assert(other_result.size() == k);
+    }
+    assert(search_all(alg_hnsw, query, d, nq, k, 1) == expected);
+
+    // wrap the 16-bit tags on the calling thread
+    std::vector<idx_t> first = search_all(alg_hnsw, query, d, 1, k, 1);
+    for (int i = 0; i < 70000; i++) {
+        alg_hnsw.searchKnn(query.data() + (i % nq) * d, 1, 0);
+    }
+    auto result = alg_hnsw.searchKnn(query.data(), k, 0);
+    for (size_t i = k; i > 0; i--) {
+        assert(result.top().second == first[i - 1]);
+        result.pop();
+    }
+}
+
+}  // namespace
+
+int main() {
+    std::cout << "Testing ..." << std::endl;
+    test();
+    std::cout << "Test ok" << std::endl;
+
+    return 0;
+}
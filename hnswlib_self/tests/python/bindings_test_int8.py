@@ -0,0 +1,79 @@
+import os
+import pickle
+import unittest
+
+import numpy as np
+
+import hnswlib
+
+
+class RandomSelfTestCase(unittest.TestCase):
+    def testInt8Spaces(self):
+        dim = 32
+        num_elements = 5000
+        num_queries = 50
+        k = 10
+
+        data = np.float32(np.random.random((num_elements, dim)))
+        queries = np.float32(np.random.random((num_queries, dim)))
+
+        for space, bf_space in [('l2_int8', 'l2'), ('int8', 'ip')]:
+            p = hnswlib.Index(space=space, dim=dim)
+            p.init_index(max_elements=num_elements + 100, ef_construction=200, M=16)
+            p.set_ef(100)
+            p.add_items(data)
+
+            bf_index = hnswlib.BFIndex(space=bf_space, dim=dim)
+            bf_index.init_index(max_elements=num_elements)
+            bf_index.add_items(data)
+            bf_labels, _ = bf_index.knn_query(queries, k=k)
+
+            # quantize in place, queries stay float vectors
+            self.assertFalse(p.quantized)
+            p.sq8()
+            self.assertTrue(p.quantized)
+            labels, distances = p.knn_query(queries, k=k)
+
+            correct = 0
+            for i in range(num_queries):
+                correct += len(set(labels[i]) & set(bf_labels[i]))
+            recall = float(correct) / (k * num_queries)
+            print("%s recall after sq8: %f" % (space, recall))
+            self.assertGreater(recall, 0.85)
+
+            # get_items returns the stored vectors scaled back to floats
+            items = p.get_items([0, 1])
+            self.assertLess(np.max(np.abs(items - data[:2])), 0.02)
+
+            # float items can be added to the quantized index
+            p.add_items(data[:100], np.arange(num_elements, num_elements + 100))
+            self.assertEqual(p.get_current_count(), num_elements + 100)
+            labels, distances = p.knn_query(queries, k=k)
+
+            # the scale is saved in the index file and picked up by load_index
+            index_path = 'int8_index.bin'
+            p.save_index(index_path)
+            self.assertFalse(os.path.exists(index_path + '.scale'))
+            p2 = hnswlib.Index(space=space, dim=dim)
+            p2.load_index(index_path)
+            self.assertTrue(p2.quantized)
+            p2.set_ef(100)
+            labels2, distances2 = p2.knn_query(queries, k=k)
+            np.testing.assert_array_equal(labels, labels2)
+
+            # a float index saved at the same path afterwards loads as a float index
+            p_float = hnswlib.Index(space=space, dim=dim)
+            p_float.init_index(max_elements=num_elements, ef_construction=200, M=16)
+            p_float.add_items(data[:1000])
+            p_float.save_index(index_path)
+            p4 = hnswlib.Index(space=space, dim=dim)
+            p4.load_index(index_path)
+            self.assertFalse(p4.quantized)
+            self.assertLess(np.max(np.abs(p4.get_items([0]) - data[:1])), 1e-6)
+            os.remove(index_path)
+
+            p3 = pickle.loads(pickle.dumps(p))
+            self.assertTrue(p3.quantized)
+            p3.set_ef(100)
+            labels3, _ = p3.knn_query(queries, k=k)
+            np.testing.assert_array_equal(labels, labels3)
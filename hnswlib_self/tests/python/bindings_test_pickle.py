@@ -1,4 +1,5 @@
 import pickle
+import sys
 import unittest
 
 import numpy as np
@@ -149,3 +150,87 @@ class PickleUnitTests(unittest.TestCase):
 
     def test_cosine_space(self):
         test_space_main(self, 'cosine', 32)
+
+    @unittest.skipIf(sys.version_info < (3, 8), "pickle protocol 5 needs python 3.8")
+    def test_out_of_band_buffers(self):
+        dim = 16
+        data = np.float32(np.random.random((self.num_elements, dim)))
+        more_data = np.float32(np.random.random((self.num_test_elements, dim)))
+
+        p = hnswlib.Index(space='l2', dim=dim)
+        p.init_index(max_elements=self.num_elements + self.num_test_elements, ef_construction=self.ef_construction, M=self.M)
+        p.ef = self.ef
+        p.add_items(data)
+
+        # level 0 and the element levels go out-of-band, the unpickled index uses the writable buffers
+        buffers = []
+        dumped = pickle.dumps(p, protocol=5, buffer_callback=buffers.append)
+        self.assertGreaterEqual(len(buffers), 2)
+        p1 = pickle.loads(dumped, buffers=[bytearray(b.raw()) for b in buffers])
+        self.assertEqual(p1.max_elements, p.max_elements)
+        self.assertTrue(np.allclose(p.get_items(), p1.get_items()), "items for p and p1 must be same")
+        l, d = p.knn_query(data[:self.num_test_elements], k=self.k)
+        l1, d1 = p1.knn_query(data[:self.num_test_elements], k=self.k)
+        self.assertTrue(np.array_equal(l, l1), "knn labels returned by p and p1 must match")
+
+        # changes of the unpickled index and of a copy stay out of the original
+        p1.mark_deleted(0)
+        p1.add_items(more_data, np.arange(self.num_elements, self.num_elements + self.num_test_elements))
+        p2 = hnswlib.Index(p)
+        p2.mark_deleted(1)
+        l, d = p.knn_query(data[:2], k=1)
+        self.assertTrue(np.array_equal(l[:, 0], [0, 1]), "p must still find its items")
+        l1, d1 = p1.knn_query(more_data, k=1)
+        self.assertTrue(np.array_equal(l1[:, 0], np.arange(self.num_elements, self.num_elements + self.num_test_elements)))
+
+    def test_resize_after_dumps(self):
+        dim = 16
+        data = np.float32(np.random.random((self.num_elements, dim)))
+        more_data = np.float32(np.random.random((self.num_test_elements, dim)))
+        more_labels = np.arange(self.num_elements, self.num_elements + self.num_test_elements)
+
+        protocols = [2]
+        if sys.version_info >= (3, 8):
+            protocols.append(5)
+        for protocol in protocols:
+            p = hnswlib.Index(space='l2', dim=dim)
+            p.init_index(max_elements=self.num_elements, ef_construction=self.ef_construction, M=self.M)
+            p.ef = self.ef
+            p.add_items(data)
+
+            # the pickled state does not outlive dumps, the index grows afterwards
+            dumped = pickle.dumps(p, protocol=protocol)
+            p.resize_index(self.num_elements + self.num_test_elements)
+            p.add_items(more_data, more_labels)
+            p1 = pickle.loads(dumped)
+            self.assertEqual(p1.get_current_count(), self.num_elements)
+            self.assertTrue(np.allclose(p1.get_items(), data), f"items of p1 must be those pickled (protocol {protocol})")
+            l, d = p.knn_query(more_data, k=1)
+            self.assertTrue(np.array_equal(l[:, 0], more_labels))
+            l, d = p.knn_query(data[:self.num_test_elements], k=self.k)
+            l1, d1 = p1.knn_query(data[:self.num_test_elements], k=self.k)
+            self.assertLessEqual(np.sum(((d - d1)**2.) > 1e-3), self.dists_err_thresh)
+
+    @unittest.skipIf(sys.version_info < (3, 8), "pickle protocol 5 needs python 3.8")
+    def test_resize_while_buffers_alive(self):
+        dim = 16
+        data = np.float32(np.random.random((self.num_elements, dim)))
+
+        p = hnswlib.Index(space='l2', dim=dim)
+        p.init_index(max_elements=self.num_elements, ef_construction=self.ef_construction, M=self.M)
+        p.add_items(data)
+
+        # out-of-band buffers view the index memory, it can not be freed until they are released
+        buffers = []
+        dumped = pickle.dumps(p, protocol=5, buffer_callback=buffers.append)
+        with self.assertRaises(RuntimeError):
+            p.resize_index(2 * self.num_elements)
+        with self.assertRaises(RuntimeError):
+            p.add_items(data[:1], [self.num_elements])
+        p1 = pickle.loads(dumped, buffers=buffers)
+        self.assertTrue(np.allclose(p1.get_items(), data))
+
+        del buffers
+        p.resize_index(2 * self.num_elements)
+        p.add_items(data[:1], [self.num_elements])
+        self.assertEqual(p.get_current_count(), self.num_elements + 1)